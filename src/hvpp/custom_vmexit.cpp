@@ -1,8 +1,210 @@
 #include "custom_vmexit.h"
+#include "hvpp/bulk_read.h"
+#include "hvpp/coverage.h"
+#include "hvpp/memscan.h"
+#include "hvpp/vmcall.h"
 
 #include "lib/cr3_guard.h"
 #include "lib/mp.h"
 #include "lib/log.h"
+#include "lib/module_map.h"
+
+#include <algorithm> // std::min()
+#include <cstring>
+
+//
+// VMCALLs of the optional features - see vmcall.h for their arguments.
+//
+
+static void vmcall_steal_time(vcpu_t& vp) noexcept
+{
+  vp.exit_context().rax = vp.exit_context().rdx
+    ? vp.steal_time().map(vp, vp.exit_context().rdx_as_pointer, vp.exit_context().r8)
+    : vp.steal_time().unmap(vp);
+}
+
+static void vmcall_idle_time(vcpu_t& vp) noexcept
+{
+  if (vp.exit_context().rdx)
+  {
+    vp.exit_context().rax = vp.idle_time().enable(vp, vp.steal_time());
+  }
+  else
+  {
+    vp.idle_time().disable(vp);
+    vp.exit_context().rax = !vp.idle_time().enabled();
+  }
+}
+
+static void vmcall_idle_status(vcpu_t& vp) noexcept
+{
+  auto buffer = vp.exit_context().rdx_as_pointer;
+  vp.exit_context().rax = 0;
+
+  cr3_guard _(vp.guest_cr3());
+
+  if (buffer && guest_buffer_writable(buffer, sizeof(idle_status_t)))
+  {
+    auto status = vp.idle_time().status(vp.steal_time(), ia32_asm_read_tsc());
+    memcpy(buffer, &status, sizeof(status));
+
+    vp.exit_context().rax = 1;
+  }
+}
+
+static void vmcall_memscan_start(vcpu_t& vp) noexcept
+{
+  auto buffer = vp.exit_context().rdx_as_pointer;
+  vp.exit_context().rax = 0;
+
+  cr3_guard _(vp.guest_cr3());
+
+  if (buffer && guest_buffer_present(buffer, sizeof(memscan_request_t)))
+  {
+    memscan_request_t request;
+    memcpy(&request, buffer, sizeof(request));
+
+    vp.exit_context().rax = memory_scanner_t::start(request);
+  }
+}
+
+static void vmcall_memscan_poll(vcpu_t& vp) noexcept
+{
+  auto buffer = vp.exit_context().rdx_as_pointer;
+  auto size = std::min<uint64_t>(vp.exit_context().r8,
+    sizeof(memscan_status_t) + memory_scanner_t::ring_capacity * sizeof(memscan_match_t));
+  vp.exit_context().rax = 0;
+
+  cr3_guard _(vp.guest_cr3());
+
+  if (buffer && size >= sizeof(memscan_status_t) && guest_buffer_writable(buffer, size))
+  {
+    auto status = memory_scanner_t::status();
+    status.cursor = vp.exit_context().r9;
+
+    auto count = static_cast<uint32_t>(
+      (size - sizeof(memscan_status_t)) / sizeof(memscan_match_t));
+
+    auto matches = reinterpret_cast<memscan_match_t*>(
+      reinterpret_cast<memscan_status_t*>(buffer) + 1);
+
+    vp.exit_context().rax = memory_scanner_t::read_matches(status.cursor, matches, count);
+    memcpy(buffer, &status, sizeof(status));
+  }
+}
+
+static void vmcall_profiler(vcpu_t& vp) noexcept
+{
+  vp.exit_context().rax = profiler_t::configure(static_cast<uint32_t>(
+    std::min<uint64_t>(vp.exit_context().rdx, UINT32_MAX)));
+}
+
+static void vmcall_profiler_read(vcpu_t& vp) noexcept
+{
+  auto buffer = vp.exit_context().rdx_as_pointer;
+  auto size = std::min<uint64_t>(vp.exit_context().r8,
+    sizeof(profiler_status_t) + profiler_t::ring_capacity * sizeof(uint64_t));
+  vp.exit_context().rax = 0;
+
+  cr3_guard _(vp.guest_cr3());
+
+  if (buffer && size >= sizeof(profiler_status_t) && guest_buffer_writable(buffer, size))
+  {
+    auto status = profiler_t::status();
+    status.cursor = vp.exit_context().r9;
+
+    auto count = static_cast<uint32_t>(
+      (size - sizeof(profiler_status_t)) / sizeof(uint64_t));
+
+    auto samples = reinterpret_cast<uint64_t*>(
+      reinterpret_cast<profiler_status_t*>(buffer) + 1);
+
+    vp.exit_context().rax = profiler_t::read_samples(status.cursor, samples, count);
+    memcpy(buffer, &status, sizeof(status));
+  }
+}
+
+static void vmcall_bulk_read(vcpu_t& vp) noexcept
+{
+  vp.exit_context().rax = bulk_reader_t::read(vp,
+                                              vp.exit_context().rdx_as_pointer,
+                                              vp.exit_context().r8,
+                                              vp.exit_context().r9_as_pointer);
+}
+
+static void vmcall_coverage_setup(vcpu_t& vp) noexcept
+{
+  auto buffer = vp.exit_context().rdx_as_pointer;
+  vp.exit_context().rax = 0;
+
+  cr3_guard _(vp.guest_cr3());
+
+  if (buffer && guest_buffer_present(buffer, sizeof(coverage_request_t)))
+  {
+    coverage_request_t request;
+    memcpy(&request, buffer, sizeof(request));
+
+    vp.exit_context().rax = coverage_t::setup(request);
+  }
+}
+
+static void vmcall_coverage_arm(vcpu_t& vp) noexcept
+{
+  if (vp.exit_context().rdx)
+  {
+    vp.exit_context().rax = coverage_t::arm(vp);
+  }
+  else
+  {
+    coverage_t::disarm(vp);
+    vp.exit_context().rax = 1;
+  }
+}
+
+static void vmcall_coverage_reset(vcpu_t& vp) noexcept
+{
+  vp.exit_context().rax = coverage_t::reset(vp, vp.exit_context().rdx);
+}
+
+static void vmcall_coverage_read(vcpu_t& vp) noexcept
+{
+  auto status = coverage_t::status();
+  auto buffer = vp.exit_context().rdx_as_pointer;
+  auto size = std::min<uint64_t>(vp.exit_context().r8, status.required_size);
+  vp.exit_context().rax = 0;
+
+  cr3_guard _(vp.guest_cr3());
+
+  if (buffer && size >= sizeof(coverage_status_t) && guest_buffer_writable(buffer, size))
+  {
+    memcpy(buffer, &status, sizeof(status));
+
+    if (size >= status.required_size)
+    {
+      coverage_t::read(reinterpret_cast<coverage_status_t*>(buffer) + 1);
+      vp.exit_context().rax = 1;
+    }
+  }
+}
+
+static const struct
+{
+  uint64_t id;
+  void (*handler)(vcpu_t& vp) noexcept;
+} feature_vmcalls[] = {
+  { vmcall_steal_time_id,     &vmcall_steal_time     },
+  { vmcall_idle_time_id,      &vmcall_idle_time      },
+  { vmcall_idle_status_id,    &vmcall_idle_status    },
+  { vmcall_memscan_start_id,  &vmcall_memscan_start  },
+  { vmcall_memscan_poll_id,   &vmcall_memscan_poll   },
+  { vmcall_profiler_id,       &vmcall_profiler       },
+  { vmcall_profiler_read_id,  &vmcall_profiler_read  },
+  { vmcall_bulk_read_id,      &vmcall_bulk_read      },
+  { vmcall_coverage_setup_id, &vmcall_coverage_setup },
+  { vmcall_coverage_arm_id,   &vmcall_coverage_arm   },
+  { vmcall_coverage_reset_id, &vmcall_coverage_reset },
+  { vmcall_coverage_read_id,  &vmcall_coverage_read  },
+};
 
 void custom_vmexit_handler::setup(vcpu_t& vp) noexcept
 {
@@ -104,7 +306,7 @@ void custom_vmexit_handler::handle_execute_vmcall(vcpu_t& vp) noexcept
 
   switch (vp.exit_context().rcx)
   {
-    case 0xc1:
+    case vmcall_hook_id:
       {
         cr3_guard _(vp.guest_cr3());
 
@@ -120,7 +322,7 @@ void custom_vmexit_handler::handle_execute_vmcall(vcpu_t& vp) noexcept
       vp.ept().map_4kb(data.page_exec, data.page_exec, epte_t::access_type::execute);
       break;
 
-    case 0xc2:
+    case vmcall_unhook_id:
       hvpp_trace("vmcall (unhook)");
 
       //
@@ -129,7 +331,34 @@ void custom_vmexit_handler::handle_execute_vmcall(vcpu_t& vp) noexcept
       vp.ept().map_4kb(data.page_exec, data.page_exec, epte_t::access_type::read_write_execute);
       break;
 
+    case vmcall_cr3_load_exiting_id:
+      {
+        //
+        // Turn CR3-load exiting on (RDX != 0) or off (RDX == 0). Useful for
+        // measuring the cost of MOV to CR3 emulation on context switches.
+        //
+        auto procbased_ctls = vp.processor_based_controls();
+        procbased_ctls.cr3_load_exiting = !!vp.exit_context().rdx;
+        vp.processor_based_controls(procbased_ctls);
+
+        hvpp_trace("vmcall (cr3_load_exiting) %u", static_cast<uint32_t>(procbased_ctls.cr3_load_exiting));
+      }
+
+      //
+      // No EPT change - no need to invalidate anything.
+      //
+      return;
+
     default:
+      for (auto& vmcall : feature_vmcalls)
+      {
+        if (vmcall.id == vp.exit_context().rcx)
+        {
+          vmcall.handler(vp);
+          return;
+        }
+      }
+
       vmexit_base_handler::handle_execute_vmcall(vp);
       return;
   }
@@ -140,12 +369,36 @@ void custom_vmexit_handler::handle_execute_vmcall(vcpu_t& vp) noexcept
 
 void custom_vmexit_handler::handle_ept_violation(vcpu_t& vp) noexcept
 {
+  if (coverage_t::handle_ept_violation(vp))
+  {
+    return;
+  }
+
   auto exit_qualification = vp.exit_qualification().ept_violation;
   auto guest_pa = vp.exit_guest_physical_address();
   auto guest_la = vp.exit_guest_linear_address();
 
   auto& data = data_[mp::cpu_index()];
 
+  //
+  // Resolve guest RIP to (module, offset) pair for the traces below - but
+  // only if the rate limiter lets the trace through (module_name is left
+  // nullptr otherwise). Both traces share one bucket.
+  //
+  static logger::rate_limit_t rate_limit;
+
+  const char* module_name = nullptr;
+  uint64_t module_offset = vp.guest_rip();
+
+  if (rate_limit.acquire(__FUNCTION__, __LINE__))
+  {
+    uint32_t module_id = module_map::invalid_module_id;
+    module_map::lookup(vp.guest_rip(), module_id, module_offset);
+
+    auto module = module_map::module(module_id);
+    module_name = module ? module->name : "?";
+  }
+
   if (exit_qualification.data_read || exit_qualification.data_write)
   {
     //
@@ -154,7 +407,10 @@ void custom_vmexit_handler::handle_ept_violation(vcpu_t& vp) noexcept
     // Map the page with "data.page_read" we've saved before in VMCALL handler
     // and set the access to RW.
     //
-    hvpp_trace("data_read LA: 0x%p PA: 0x%p", guest_la, guest_pa.value());
+    if (module_name)
+    {
+      hvpp_trace("data_read LA: 0x%p PA: 0x%p RIP: %s+0x%llx", guest_la, guest_pa.value(), module_name, module_offset);
+    }
 
     vp.ept().map_4kb(data.page_exec, data.page_read, epte_t::access_type::read_write);
   }
@@ -166,7 +422,10 @@ void custom_vmexit_handler::handle_ept_violation(vcpu_t& vp) noexcept
     // Map the page with "data.page_execute" we've saved before in VMCALL handler
     // and set the access to execute-only.
     //
-    hvpp_trace("data_execute LA: 0x%p PA: 0x%p", guest_la, guest_pa.value());
+    if (module_name)
+    {
+      hvpp_trace("data_execute LA: 0x%p PA: 0x%p RIP: %s+0x%llx", guest_la, guest_pa.value(), module_name, module_offset);
+    }
 
     vp.ept().map_4kb(data.page_exec, data.page_exec, epte_t::access_type::execute);
   }
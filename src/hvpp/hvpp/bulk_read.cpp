@@ -0,0 +1,248 @@
+#include "bulk_read.h"
+#include "vcpu.h"
+#include "vmexit.h"
+
+#include "lib/cr3_guard.h"
+#include "lib/log.h"
+#include "lib/mm.h"
+#include "lib/physical_window.h"
+
+#include <algorithm> // std::min()
+#include <cstring>
+
+namespace hvpp {
+
+static constexpr uint64_t pte_present  = 1ull << 0;
+static constexpr uint64_t pte_large    = 1ull << 7;
+static constexpr uint64_t pte_pfn_mask = 0x000ffffffffff000;
+
+static bool is_canonical(uint64_t va) noexcept
+{
+  return static_cast<uint64_t>(static_cast<int64_t>(va << 16) >> 16) == va;
+}
+
+bool bulk_reader_t::available_ = false;
+
+void bulk_reader_t::allocate() noexcept
+{
+  available_ = physical_window::initialize();
+
+  if (!available_)
+  {
+    hvpp_warn("Physical window is not available, bulk read is disabled");
+  }
+}
+
+void bulk_reader_t::free() noexcept
+{
+  if (available_)
+  {
+    physical_window::destroy();
+    available_ = false;
+  }
+}
+
+uint32_t bulk_reader_t::read(vcpu_t& vp, void* descriptors, uint64_t count, void* buffer) noexcept
+{
+  if (!available_ || !descriptors || !buffer ||
+      count == 0 || count > max_descriptor_count)
+  {
+    return 0;
+  }
+
+  cr3_guard _(vp.guest_cr3());
+
+  auto descriptor = static_cast<bulk_read_descriptor_t*>(descriptors);
+
+  //
+  // Status of each descriptor is written back into the array.
+  //
+  if (!guest_buffer_writable(descriptor, count * sizeof(bulk_read_descriptor_t)))
+  {
+    return 0;
+  }
+
+  uint64_t total_length = 0;
+
+  for (uint64_t i = 0; i < count; ++i)
+  {
+    total_length += descriptor[i].length;
+  }
+
+  if (total_length > max_total_length ||
+      !guest_buffer_writable(buffer, total_length))
+  {
+    return 0;
+  }
+
+  auto caller_cr3 = kernel_cr3(vp.guest_cr3());
+  auto output = static_cast<uint8_t*>(buffer);
+  uint64_t offset = 0;
+  uint32_t result = 0;
+
+  for (uint64_t i = 0; i < count; ++i)
+  {
+    //
+    // Other threads of the caller might modify the descriptors meanwhile -
+    // read each of them just once and don't trust the length computed
+    // above.
+    //
+    bulk_read_descriptor_t request;
+    memcpy(&request, &descriptor[i], sizeof(request));
+
+    auto last_va = request.va + request.length - 1;
+    auto fits = offset + request.length <= total_length;
+    uint32_t bytes_read = 0;
+    uint32_t status;
+
+    if (!fits ||
+        request.length == 0 ||
+        last_va < request.va ||
+        !is_canonical(request.va) ||
+        !is_canonical(last_va) ||
+        ((request.va ^ last_va) >> 63))
+    {
+      status = bulk_read_descriptor_t::status_invalid;
+
+      if (fits)
+      {
+        memset(output + offset, 0, request.length);
+      }
+    }
+    else
+    {
+      cr3_t cr3;
+      cr3.flags = request.cr3;
+
+      bytes_read = read_range(request.cr3 ? cr3 : caller_cr3,
+                              request.va, request.length, output + offset);
+
+      status = bytes_read == request.length ? bulk_read_descriptor_t::status_success
+             : bytes_read                   ? bulk_read_descriptor_t::status_partial
+             :                                bulk_read_descriptor_t::status_not_present;
+    }
+
+    if (fits)
+    {
+      offset += request.length;
+    }
+
+    if (status == bulk_read_descriptor_t::status_success)
+    {
+      result += 1;
+    }
+
+    descriptor[i].status = status;
+    descriptor[i].bytes_read = bytes_read;
+  }
+
+  return result;
+}
+
+//
+// Private
+//
+
+bool bulk_reader_t::is_ram(pa_t pa) noexcept
+{
+  for (auto& range : memory_manager::physical_memory_descriptor())
+  {
+    if (range.contains(pa))
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool bulk_reader_t::translate(cr3_t cr3, uint64_t va, translation_t& result) noexcept
+{
+  //
+  // See Vol3A[4.5(4-Level Paging)]. Accessed and dirty flags aren't
+  // updated - the walk is invisible to the guest.
+  //
+  auto table_pa = pa_t::from_pfn(cr3.page_frame_number);
+
+  for (auto level = page_table_level::pml4; ; --level)
+  {
+    //
+    // Paging structures outside of RAM mean a garbage CR3 (or a corrupted
+    // paging structure) - don't read them.
+    //
+    if (!is_ram(table_pa))
+    {
+      return false;
+    }
+
+    auto table = static_cast<const uint64_t*>(physical_window::map(table_pa.value()));
+    auto entry = table[pa_t(va).index(level)];
+
+    if (!(entry & pte_present))
+    {
+      return false;
+    }
+
+    if (level == page_table_level::pt ||
+        (level != page_table_level::pml4 && (entry & pte_large)))
+    {
+      //
+      // The mask also clears the PAT bit (bit 12) of large pages.
+      //
+      result.page_size = 1ull << (page_shift + static_cast<uint8_t>(level) * 9);
+      result.pa = pa_t(entry & pte_pfn_mask & ~(result.page_size - 1));
+      return true;
+    }
+
+    table_pa = pa_t(entry & pte_pfn_mask);
+  }
+}
+
+uint32_t bulk_reader_t::read_range(cr3_t cr3, uint64_t va, uint32_t length, uint8_t* buffer) noexcept
+{
+  translation_t translation{};
+  uint64_t translation_va = 0;
+  uint32_t done = 0;
+
+  while (done < length)
+  {
+    auto current_va = va + done;
+
+    //
+    // Walk the paging structures just once per (large) page.
+    //
+    if (!translation.page_size ||
+        (current_va & ~(translation.page_size - 1)) != translation_va)
+    {
+      if (!translate(cr3, current_va, translation))
+      {
+        break;
+      }
+
+      translation_va = current_va & ~(translation.page_size - 1);
+    }
+
+    auto pa = translation.pa + pa_t(current_va - translation_va);
+
+    if (!is_ram(pa))
+    {
+      break;
+    }
+
+    auto source = static_cast<const uint8_t*>(physical_window::map(pa.value()));
+    auto offset = byte_offset(current_va);
+    auto chunk = std::min<uint32_t>(page_size - offset, length - done);
+
+    memcpy(buffer + done, source + offset, chunk);
+    done += chunk;
+  }
+
+  if (done < length)
+  {
+    memset(buffer + done, 0, length - done);
+  }
+
+  return done;
+}
+
+}
@@ -0,0 +1,100 @@
+#pragma once
+#include "ia32/arch.h"
+#include "ia32/memory.h"
+
+#include <cstdint>
+
+namespace hvpp {
+
+using namespace ia32;
+
+class vcpu_t;
+
+//
+// Layout of the descriptor shared with the guest (see VMCALLs in vmcall.h).
+//
+// "cr3" is the page-table root of the address space to read from (e.g.
+// DirectoryTableBase of the process) - 0 means the address space of the
+// caller. "status" and "bytes_read" are written back by the hypervisor.
+//
+
+struct bulk_read_descriptor_t
+{
+  enum : uint32_t
+  {
+    status_success,
+
+    //
+    // Only the first "bytes_read" bytes have been read - the page which
+    // follows them isn't present (or isn't backed by RAM).
+    //
+    status_partial,
+    status_not_present,
+
+    //
+    // Zero length, non-canonical address or the range wraps around.
+    //
+    status_invalid,
+  };
+
+  uint64_t cr3;
+  uint64_t va;
+  uint32_t length;
+  uint32_t status;
+  uint32_t bytes_read;
+  uint32_t reserved;
+};
+
+static_assert(sizeof(bulk_read_descriptor_t) == 32);
+
+//
+// Reads memory of arbitrary address spaces on behalf of the guest - all
+// descriptors of the request are handled within a single VM-exit.
+//
+// Virtual addresses are translated by a software walk of the (4-level)
+// guest paging structures, both the paging structures and the data are
+// read through the physical window (see lib/physical_window.h). Therefore
+// the walk never switches to the CR3 of the target address space (which
+// could be anything) and never touches a page which isn't present - pages
+// which are paged out are reported, not faulted in.
+//
+// The data of the descriptors are packed into the output buffer one after
+// another, in the order of the descriptors. Bytes which couldn't be read
+// are zeroed.
+//
+// Note that the guest keeps running on the other CPUs - the read isn't
+// an atomic snapshot of the target address space.
+//
+
+class bulk_reader_t
+{
+  public:
+    static constexpr uint32_t max_descriptor_count = 4096;
+    static constexpr uint32_t max_total_length     = 4 * 1024 * 1024;
+
+    static void allocate() noexcept;
+    static void free() noexcept;
+
+    //
+    // Handles the request. Both the descriptors and the output buffer are
+    // virtual addresses of the caller (they must be locked in memory).
+    // Returns number of descriptors which have been read completely, or 0
+    // if the request itself is invalid.
+    //
+    static uint32_t read(vcpu_t& vp, void* descriptors, uint64_t count, void* buffer) noexcept;
+
+  private:
+    struct translation_t
+    {
+      pa_t     pa;
+      uint64_t page_size;
+    };
+
+    static bool is_ram(pa_t pa) noexcept;
+    static bool translate(cr3_t cr3, uint64_t va, translation_t& result) noexcept;
+    static uint32_t read_range(cr3_t cr3, uint64_t va, uint32_t length, uint8_t* buffer) noexcept;
+
+    static bool available_;
+};
+
+}
@@ -17,3 +17,10 @@
 // custom_vmexit_handler.
 //
 #define HVPP_WITH_STATS
+
+//
+// Uncomment this if you want to emulate VMX instructions for hypervisors
+// running in the guest (nested VMX, see nested.h). If not defined, VMX
+// instructions raise #UD.
+//
+// #define HVPP_ENABLE_NESTED_VMX
@@ -0,0 +1,334 @@
+#include "coverage.h"
+#include "vcpu.h"
+
+#include "ia32/vmx.h"
+#include "lib/mp.h"
+
+#include <algorithm> // std::sort()
+#include <cstring>
+#include <mutex>
+
+namespace hvpp {
+
+coverage_page_t*              coverage_t::page_ = nullptr;
+std::atomic<uint64_t>*        coverage_t::hit_ = nullptr;
+uint32_t                      coverage_t::page_count_ = 0;
+uint32_t                      coverage_t::skipped_count_ = 0;
+
+hash_map<uint64_t, uint32_t>* coverage_t::index_ = nullptr;
+
+spinlock                      coverage_t::lock_;
+bool*                         coverage_t::armed_ = nullptr;
+std::atomic<uint32_t>         coverage_t::armed_count_{ 0 };
+std::atomic<uint32_t>         coverage_t::hit_count_{ 0 };
+std::atomic<uint64_t>         coverage_t::generation_{ 0 };
+
+void coverage_t::allocate() noexcept
+{
+  page_ = new coverage_page_t[max_page_count];
+  hit_ = new std::atomic<uint64_t>[max_page_count / 64];
+  index_ = new hash_map<uint64_t, uint32_t>(max_page_count);
+  armed_ = new bool[mp::cpu_count()];
+
+  if (armed_)
+  {
+    memset(armed_, 0, sizeof(bool) * mp::cpu_count());
+  }
+
+  page_count_ = 0;
+  skipped_count_ = 0;
+  armed_count_ = 0;
+  hit_count_ = 0;
+  generation_ = 0;
+}
+
+void coverage_t::free() noexcept
+{
+  delete[] page_;
+  delete[] hit_;
+  delete index_;
+  delete[] armed_;
+
+  page_ = nullptr;
+  hit_ = nullptr;
+  index_ = nullptr;
+  armed_ = nullptr;
+  page_count_ = 0;
+}
+
+uint32_t coverage_t::setup(const coverage_request_t& request) noexcept
+{
+  if (!page_ || !hit_ || !index_ || !index_->capacity() || !armed_ ||
+      request.range_count > coverage_request_t::max_range_count)
+  {
+    return 0;
+  }
+
+  std::lock_guard _(lock_);
+
+  if (armed_count_)
+  {
+    return 0;
+  }
+
+  page_count_ = 0;
+  skipped_count_ = 0;
+  index_->clear();
+
+  for (uint32_t i = 0; i < request.range_count; ++i)
+  {
+    auto begin = reinterpret_cast<uint64_t>(page_align(request.range[i].va));
+    auto end = request.range[i].va + request.range[i].size;
+
+    if (end < request.range[i].va)
+    {
+      continue;
+    }
+
+    for (auto va = begin; va < end && page_count_ < max_page_count; va += page_size)
+    {
+      auto pa = pa_t::from_va(reinterpret_cast<void*>(va));
+
+      if (!pa)
+      {
+        skipped_count_ += 1;
+        continue;
+      }
+
+      //
+      // The same physical page might be mapped at more virtual addresses.
+      //
+      bool inserted;
+      if (!index_->find_or_insert(pa.pfn(), inserted) || !inserted)
+      {
+        continue;
+      }
+
+      page_[page_count_++] = coverage_page_t{ va, pa.value(), 0 };
+    }
+  }
+
+  //
+  // Keep the pages sorted by physical address - pages within the same EPT
+  // page table are then updated with a single walk (see update_ept()).
+  //
+  std::sort(page_, page_ + page_count_, [](auto& lhs, auto& rhs) {
+    return lhs.pa < rhs.pa;
+  });
+
+  for (uint32_t i = 0; i < page_count_; ++i)
+  {
+    *index_->find(pa_t(page_[i].pa).pfn()) = i;
+  }
+
+  for (uint32_t i = 0; i < max_page_count / 64; ++i)
+  {
+    hit_[i] = 0;
+  }
+
+  hit_count_ = 0;
+  return page_count_;
+}
+
+bool coverage_t::arm(vcpu_t& vp) noexcept
+{
+  std::lock_guard _(lock_);
+
+  if (!armed_ || !page_count_)
+  {
+    return false;
+  }
+
+  auto& armed = armed_[mp::cpu_index()];
+
+  if (!armed)
+  {
+    armed = true;
+    armed_count_ += 1;
+  }
+
+  update_ept(vp, true);
+  return true;
+}
+
+void coverage_t::disarm(vcpu_t& vp) noexcept
+{
+  std::lock_guard _(lock_);
+
+  if (!armed_ || !armed_[mp::cpu_index()])
+  {
+    return;
+  }
+
+  armed_[mp::cpu_index()] = false;
+  armed_count_ -= 1;
+
+  update_ept(vp, false);
+}
+
+bool coverage_t::reset(vcpu_t& vp, uint64_t generation) noexcept
+{
+  std::lock_guard _(lock_);
+
+  if (!armed_ || !page_count_)
+  {
+    return false;
+  }
+
+  auto expected = generation - 1;
+
+  if (generation_.compare_exchange_strong(expected, generation))
+  {
+    //
+    // First CPU with the new generation - clear the hits.
+    //
+    for (uint32_t i = 0; i < max_page_count / 64; ++i)
+    {
+      hit_[i].store(0, std::memory_order_relaxed);
+    }
+
+    for (uint32_t i = 0; i < page_count_; ++i)
+    {
+      page_[i].rip = 0;
+    }
+
+    hit_count_ = 0;
+  }
+  else if (expected != generation)
+  {
+    return false;
+  }
+
+  if (armed_[mp::cpu_index()])
+  {
+    update_ept(vp, true);
+  }
+
+  return true;
+}
+
+bool coverage_t::handle_ept_violation(vcpu_t& vp) noexcept
+{
+  if (!armed_ || !armed_[mp::cpu_index()])
+  {
+    return false;
+  }
+
+  auto exit_qualification = vp.exit_qualification().ept_violation;
+  auto guest_pa = vp.exit_guest_physical_address();
+
+  if (!exit_qualification.data_execute)
+  {
+    return false;
+  }
+
+  auto index = index_->find(guest_pa.pfn());
+
+  if (!index)
+  {
+    return false;
+  }
+
+  //
+  // The page isn't in the state set by arm() - the violation has been
+  // caused by other EPT policy (see update_ept()).
+  //
+  auto updated = vp.ept().update_access_4kb(1, [&](size_t) {
+    return ept_t::access_update_t{
+      pa_t(page_[*index].pa),
+      epte_t::access_type::read_write_execute,
+      epte_t::access_type::read_write
+    };
+  });
+
+  if (!updated)
+  {
+    return false;
+  }
+
+  vmx::invept_desc_t descriptor{ vp.ept().ept_pointer(), 0 };
+  vmx::invept(vmx::invept_t::single_context, &descriptor);
+
+  //
+  // Only the first CPU which executes the page records it.
+  //
+  auto mask = 1ull << (*index % 64);
+
+  if (!(hit_[*index / 64].fetch_or(mask) & mask))
+  {
+    page_[*index].rip = vp.guest_rip();
+    hit_count_ += 1;
+  }
+
+  //
+  // Execute the instruction again - this time without EPT violation.
+  //
+  vp.suppress_rip_adjust();
+  return true;
+}
+
+coverage_status_t coverage_t::status() noexcept
+{
+  coverage_status_t result{};
+  result.page_count      = page_count_;
+  result.hit_count       = hit_count_;
+  result.skipped_count   = skipped_count_;
+  result.armed_cpu_count = armed_count_;
+  result.generation      = generation_;
+  result.bitmap_size     = (page_count_ + 63) / 64 * sizeof(uint64_t);
+  result.required_size   = sizeof(coverage_status_t) +
+                           result.bitmap_size +
+                           page_count_ * sizeof(coverage_page_t);
+
+  return result;
+}
+
+void coverage_t::read(void* buffer) noexcept
+{
+  auto bitmap = static_cast<uint64_t*>(buffer);
+  auto word_count = (page_count_ + 63) / 64;
+
+  for (uint32_t i = 0; i < word_count; ++i)
+  {
+    bitmap[i] = hit_[i].load(std::memory_order_relaxed);
+  }
+
+  memcpy(bitmap + word_count, page_, page_count_ * sizeof(coverage_page_t));
+}
+
+//
+// Private
+//
+
+void coverage_t::update_ept(vcpu_t& vp, bool armed) noexcept
+{
+  //
+  // All pages in one batch - pages which have been already executed (by
+  // any CPU) stay executable.
+  //
+  // Only the execute access is toggled and only on pages with the default
+  // policy (identity RWX, or RW set by arm()) - pages with other policy
+  // (e.g. the execute-only pages of the EPT hook in custom_vmexit.cpp)
+  // aren't traced, so they're never overwritten.
+  //
+  vp.ept().update_access_4kb(page_count_, [&](size_t i) {
+    auto executed = !!(hit_[i / 64].load(std::memory_order_relaxed) & (1ull << (i % 64)));
+
+    return armed && !executed
+      ? ept_t::access_update_t{
+          pa_t(page_[i].pa),
+          epte_t::access_type::read_write,
+          epte_t::access_type::read_write_execute
+        }
+      : ept_t::access_update_t{
+          pa_t(page_[i].pa),
+          epte_t::access_type::read_write_execute,
+          epte_t::access_type::read_write
+        };
+  });
+
+  vmx::invept_desc_t descriptor{ vp.ept().ept_pointer(), 0 };
+  vmx::invept(vmx::invept_t::single_context, &descriptor);
+}
+
+}
@@ -0,0 +1,171 @@
+#pragma once
+#include "ia32/memory.h"
+
+#include "lib/hash_map.h"
+#include "lib/spinlock.h"
+
+#include <atomic>
+#include <cstdint>
+
+namespace hvpp {
+
+using namespace ia32;
+
+class vcpu_t;
+
+//
+// Layout of the structures shared with the guest (see VMCALLs in vmcall.h).
+//
+
+struct coverage_range_t
+{
+  uint64_t va;
+  uint64_t size;
+};
+
+struct coverage_request_t
+{
+  static constexpr int max_range_count = 16;
+
+  uint32_t range_count;
+  uint32_t reserved;
+
+  coverage_range_t range[max_range_count];
+};
+
+struct coverage_page_t
+{
+  uint64_t va;
+  uint64_t pa;
+
+  //
+  // Guest RIP of the first execution (0 if the page hasn't been executed
+  // yet). It's written right after the bit in the bitmap has been set.
+  //
+  uint64_t rip;
+};
+
+//
+// Buffer returned to the guest is:
+//   coverage_status_t
+//   uint64_t        bitmap[bitmap_size / 8]  - bit N set == page N executed
+//   coverage_page_t page[page_count]
+//
+
+struct coverage_status_t
+{
+  uint32_t page_count;
+  uint32_t hit_count;
+
+  //
+  // Pages of the requested ranges which weren't present (and therefore
+  // aren't tracked) - e.g. paged-out code.
+  //
+  uint32_t skipped_count;
+  uint32_t armed_cpu_count;
+
+  uint64_t generation;
+  uint64_t bitmap_size;
+
+  //
+  // Size of the whole buffer (including this structure).
+  //
+  uint64_t required_size;
+};
+
+//
+// Page-level code coverage of the guest by one-shot execute traps.
+//
+// Execute access is removed from EPT entries of the tracked pages. The
+// first instruction fetch from such page causes EPT violation - the page
+// and the RIP are recorded and the execute access is restored for good,
+// so each page costs (at most) one VM-exit per CPU. There's no
+// single-stepping and no exit on the subsequent executions.
+//
+// Only pages with the default EPT policy (mapped 1:1 with RWX access)
+// are traced - pages remapped or restricted by other features (EPT hook,
+// steal time) are left intact and never recorded.
+//
+// Each VCPU has its own EPT, so arming, disarming and resetting must be
+// done on each CPU (see arm() and reset()). All pages of one VCPU are
+// updated in a single batch (see ept_t::update_access_4kb()) followed by
+// a single INVEPT. The hits are shared - once any CPU has recorded a page,
+// the other CPUs just restore the execute access when they hit it
+// (without recording it again) and they don't trap it at all when they
+// (re)arm later.
+//
+// Reset isn't atomic across CPUs: pages executed between the reset of the
+// hits and the re-arm of the EPT of a particular CPU aren't recorded until
+// they're executed again.
+//
+
+class coverage_t
+{
+  public:
+    static constexpr uint32_t max_page_count = 32768;
+    static constexpr uint32_t bitmap_size    = max_page_count / 8;
+
+    static void allocate() noexcept;
+    static void free() noexcept;
+
+    //
+    // Translates the ranges (virtual addresses in the address space of the
+    // caller - the CR3 must be already switched) and sets the tracked
+    // pages. Fails if any CPU is armed. Returns number of tracked pages.
+    //
+    static uint32_t setup(const coverage_request_t& request) noexcept;
+
+    //
+    // Removes (restores) execute access of the tracked pages in the EPT
+    // of the current VCPU.
+    //
+    static bool arm(vcpu_t& vp) noexcept;
+    static void disarm(vcpu_t& vp) noexcept;
+
+    //
+    // Clears the hits and re-arms the current VCPU. Must be called on each
+    // CPU with the same "generation" - which must be the current generation
+    // (see coverage_status_t) + 1. The first call clears the hits, the
+    // following ones only re-arm the EPT. Returns false if the generation
+    // doesn't match.
+    //
+    static bool reset(vcpu_t& vp, uint64_t generation) noexcept;
+
+    //
+    // Handler of EPT violation. Returns false if the violation hasn't been
+    // caused by the coverage.
+    //
+    static bool handle_ept_violation(vcpu_t& vp) noexcept;
+
+    static coverage_status_t status() noexcept;
+
+    //
+    // Copies the bitmap and page records (see coverage_status_t) into the
+    // buffer which follows the status.
+    //
+    static void read(void* buffer) noexcept;
+
+  private:
+    static void update_ept(vcpu_t& vp, bool armed) noexcept;
+
+    static coverage_page_t*       page_;
+    static std::atomic<uint64_t>* hit_;
+    static uint32_t               page_count_;
+    static uint32_t               skipped_count_;
+
+    //
+    // PFN -> index of the page.
+    //
+    static hash_map<uint64_t, uint32_t>* index_;
+
+    //
+    // Serializes setup() with arm(), disarm() and reset().
+    //
+    static spinlock               lock_;
+    static bool*                  armed_;
+    static std::atomic<uint32_t>  armed_count_;
+    static std::atomic<uint32_t>  hit_count_;
+    static std::atomic<uint64_t>  generation_;
+};
+
+}
@@ -1,5 +1,6 @@
 #include "ept.h"
 
+#include "ia32/asm.h"
 #include "lib/assert.h"
 #include "lib/bitmap.h"
 #include "lib/mm.h"
@@ -164,7 +165,55 @@ epte_t* ept_t::map_1gb(pa_t guest_pa, pa_t host_pa, epte_t::access_type access /
 // Private
 //
 
-epte_t* ept_t::map_subtable(epte_t* table) noexcept
+epte_t ept_t::load(const epte_t* entry) noexcept
+{
+  //
+  // Read the entry at once - never look at the bitfields of the entry in
+  // the table directly, because they may change under our hands.
+  //
+  epte_t result;
+  result.flags = *reinterpret_cast<const volatile uint64_t*>(&entry->flags);
+  return result;
+}
+
+bool ept_t::compare_exchange(epte_t* entry, epte_t& expected, epte_t desired) noexcept
+{
+  auto previous = ia32_asm_cmpxchg64(reinterpret_cast<volatile unsigned long long*>(&entry->flags),
+                                     desired.flags,
+                                     expected.flags);
+
+  if (previous == expected.flags)
+  {
+    return true;
+  }
+
+  expected.flags = previous;
+  return false;
+}
+
+bool ept_t::update_access(epte_t* entry, const access_update_t& page) noexcept
+{
+  auto expected = load(entry);
+
+  for (;;)
+  {
+    if (expected.page_frame_number != page.guest_pa.pfn() ||
+        expected.access != page.expected_access)
+    {
+      return false;
+    }
+
+    auto desired = expected;
+    desired.update(page.access);
+
+    if (compare_exchange(entry, expected, desired))
+    {
+      return true;
+    }
+  }
+}
+
+epte_t* ept_t::map_subtable(epte_t* table, page_table_level ptl_type) noexcept
 {
   //
   // Get or create next level of EPT table hierarchy.
@@ -174,24 +223,104 @@ epte_t* ept_t::map_subtable(epte_t* table) noexcept
   //   -> PD
   //     -> PT
   //
-  if (table->is_present())
+  // Multiple VCPUs can race for the same entry. Each of them speculatively
+  // allocates (and fully initializes) the subtable and tries to install it
+  // by a single compare-and-swap - the loser frees its subtable and uses
+  // the winner's one. Because the subtable is populated before it's
+  // published, nobody (including the CPU's page walker) can observe
+  // half-initialized subtable.
+  //
+  auto expected = load(table);
+
+  if (expected.is_present() && !expected.large_page)
   {
-    return table->subtable();
+    return expected.subtable();
   }
 
   auto subtable = new epte_t[512];
   hvpp_assert(subtable != nullptr);
-  memset(subtable, 0, sizeof(epte_t) * 512);
   static_assert(sizeof(epte_t) * 512 == page_size);
 
-  table->update(pa_t::from_va(subtable));
-  return subtable;
+  for (;;)
+  {
+    if (expected.is_present() && expected.large_page)
+    {
+      //
+      // Split the large page - the subtable maps the same memory with the
+      // same access rights and memory type, just with smaller pages
+      // (1GB -> 512x 2MB, 2MB -> 512x 4KB).
+      //
+      auto pfn_stride = ptl_type == page_table_level::pdpt ? 512 : 1;
+
+      for (int i = 0; i < 512; ++i)
+      {
+        subtable[i] = expected;
+        subtable[i].page_frame_number = expected.page_frame_number + i * pfn_stride;
+        subtable[i].large_page = ptl_type == page_table_level::pdpt;
+      }
+    }
+    else
+    {
+      memset(subtable, 0, sizeof(epte_t) * 512);
+    }
+
+    epte_t desired{};
+    desired.update(pa_t::from_va(subtable));
+
+    if (compare_exchange(table, expected, desired))
+    {
+      return subtable;
+    }
+
+    //
+    // We've lost the race. If the winner has installed a subtable, use it.
+    // Otherwise (e.g. the entry has been changed to another large page)
+    // try again with the new value.
+    //
+    if (expected.is_present() && !expected.large_page)
+    {
+      delete[] subtable;
+      return expected.subtable();
+    }
+  }
+}
+
+epte_t* ept_t::map_page_table(pa_t guest_pa) noexcept
+{
+  auto pdpt = map_subtable(&epml4_[guest_pa.index(page_table_level::pml4)], page_table_level::pml4);
+  auto pd   = map_subtable(&pdpt  [guest_pa.index(page_table_level::pdpt)], page_table_level::pdpt);
+  auto pt   = map_subtable(&pd    [guest_pa.index(page_table_level::pd)],   page_table_level::pd);
+
+  return pt;
+}
+
+epte_t* ept_t::map_leaf(epte_t* entry, pa_t guest_pa, pa_t host_pa, epte_t::access_type access, bool large) noexcept
+{
+  //
+  // Build the new value of the entry aside and publish it by a single
+  // compare-and-swap, so that neither other VCPUs nor the page walker can
+  // observe partially updated entry. The loop also preserves bits which
+  // might be set concurrently (such as accessed/dirty flags).
+  //
+  auto memory_type = memory_manager::mtrr().type(guest_pa);
+  auto expected = load(entry);
+
+  for (;;)
+  {
+    auto desired = expected;
+    desired.update(host_pa, memory_type, large, access);
+
+    if (compare_exchange(entry, expected, desired))
+    {
+      return entry;
+    }
+  }
 }
 
 epte_t* ept_t::map_pml4(pa_t guest_pa, pa_t host_pa, epte_t* pml4, epte_t::access_type access, large_page large) noexcept
 {
   auto pml4e = &pml4[guest_pa.index(page_table_level::pml4)];
-  auto pdpt = map_subtable(pml4e);
+  auto pdpt = map_subtable(pml4e, page_table_level::pml4);
 
   return map_pdpt(guest_pa, host_pa, pdpt, access, large);
 }
@@ -202,11 +331,10 @@ epte_t* ept_t::map_pdpt(pa_t guest_pa, pa_t host_pa, epte_t* pdpt, epte_t::acces
 
   if (large == large_page::pdpte_1gb)
   {
-    pdpte->update(host_pa, memory_manager::mtrr().type(guest_pa), true);
-    return pdpte;
+    return map_leaf(pdpte, guest_pa, host_pa, access, true);
   }
 
-  auto pd = map_subtable(pdpte);
+  auto pd = map_subtable(pdpte, page_table_level::pdpt);
   return map_pd(guest_pa, host_pa, pd, access, large);
 }
 
@@ -216,11 +344,10 @@ epte_t* ept_t::map_pd(pa_t guest_pa, pa_t host_pa, epte_t* pd, epte_t::access_ty
 
   if (large == large_page::pde_2mb)
   {
-    pde->update(host_pa, memory_manager::mtrr().type(guest_pa), true);
-    return pde;
+    return map_leaf(pde, guest_pa, host_pa, access, true);
   }
 
-  auto pt = map_subtable(pde);
+  auto pt = map_subtable(pde, page_table_level::pd);
   return map_pt(guest_pa, host_pa, pt, access, large);
 }
 
@@ -231,8 +358,7 @@ epte_t* ept_t::map_pt(pa_t guest_pa, pa_t host_pa, epte_t* pt, epte_t::access_ty
   (void)(large);
   hvpp_assert(large == large_page::none);
   {
-    page->update(host_pa, memory_manager::mtrr().type(guest_pa), access);
-    return page;
+    return map_leaf(page, guest_pa, host_pa, access, false);
   }
 }
 
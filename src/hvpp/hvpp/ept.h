@@ -16,6 +16,13 @@ class ept_t
       pdpte_1gb,
     };
 
+    struct access_update_t
+    {
+      pa_t                guest_pa;
+      epte_t::access_type access;
+      epte_t::access_type expected_access;
+    };
+
     void initialize() noexcept;
     void destroy() noexcept;
 
@@ -28,8 +35,32 @@ class ept_t
     epte_t* map_2mb(pa_t guest_pa, pa_t host_pa, epte_t::access_type access = epte_t::access_type::read_write_execute) noexcept;
     epte_t* map_1gb(pa_t guest_pa, pa_t host_pa, epte_t::access_type access = epte_t::access_type::read_write_execute) noexcept;
 
+    //
+    // Changes access rights of "count" 4kb pages in one pass - their
+    // translation stays the same. "update(i)" returns access_update_t of
+    // the i-th page. Consecutive pages which belong to the same page table
+    // share the walk of the EPT hierarchy, therefore the pages should be
+    // sorted by guest_pa. Large pages are split as needed.
+    //
+    // Only entries which map guest_pa 1:1 with "expected_access" are
+    // changed - pages with other policy (e.g. remapped or execute-only
+    // pages) are left intact. Returns number of changed entries.
+    //
+    // EPT isn't invalidated - the caller issues one INVEPT for the whole
+    // batch.
+    //
+    template <typename FN>
+    size_t update_access_4kb(size_t count, FN update) noexcept;
+
   private:
-    epte_t* map_subtable(epte_t* table) noexcept;
+    static epte_t load(const epte_t* entry) noexcept;
+    static bool compare_exchange(epte_t* entry, epte_t& expected, epte_t desired) noexcept;
+
+    static bool update_access(epte_t* entry, const access_update_t& page) noexcept;
+
+    epte_t* map_subtable(epte_t* table, page_table_level ptl_type) noexcept;
+    epte_t* map_page_table(pa_t guest_pa) noexcept;
+    epte_t* map_leaf(epte_t* entry, pa_t guest_pa, pa_t host_pa, epte_t::access_type access, bool large) noexcept;
     epte_t* map_pml4(pa_t guest_pa, pa_t host_pa, epte_t* pml4, epte_t::access_type access, large_page large) noexcept;
     epte_t* map_pdpt(pa_t guest_pa, pa_t host_pa, epte_t* pdpt, epte_t::access_type access, large_page large) noexcept;
     epte_t* map_pd  (pa_t guest_pa, pa_t host_pa, epte_t* pd,   epte_t::access_type access, large_page large) noexcept;
@@ -41,4 +72,32 @@ class ept_t
                        epte_t*   epml4_;
 };
 
+template <typename FN>
+size_t ept_t::update_access_4kb(size_t count, FN update) noexcept
+{
+  static constexpr uint64_t pt_mask = ~(uint64_t(page_size) * 512 - 1);
+
+  epte_t*  pt = nullptr;
+  uint64_t pt_base = 0;
+  size_t   updated = 0;
+
+  for (size_t i = 0; i < count; ++i)
+  {
+    access_update_t page = update(i);
+
+    if (!pt || (page.guest_pa.value() & pt_mask) != pt_base)
+    {
+      pt = map_page_table(page.guest_pa);
+      pt_base = page.guest_pa.value() & pt_mask;
+    }
+
+    if (update_access(&pt[page.guest_pa.index(page_table_level::pt)], page))
+    {
+      updated += 1;
+    }
+  }
+
+  return updated;
+}
+
 }
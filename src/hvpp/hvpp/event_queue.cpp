@@ -0,0 +1,212 @@
+#include "event_queue.h"
+#include "vcpu.h"
+
+#include "ia32/vmx.h"
+#include "lib/assert.h"
+
+namespace hvpp {
+
+void event_queue_t::initialize() noexcept
+{
+  count_        = 0;
+  injected_     = false;
+  window_armed_ = false;
+}
+
+bool event_queue_t::post(vmx::interrupt_type type, exception_vector vector,
+                         exception_error_code_t error_code, bool error_code_valid) noexcept
+{
+  hvpp_assert(type == vmx::interrupt_type::hardware_exception ||
+              type == vmx::interrupt_type::nmi ||
+              type == vmx::interrupt_type::external);
+
+  event_t event;
+  event.info.flags            = 0;
+  event.info.vector           = static_cast<uint32_t>(vector);
+  event.info.type             = static_cast<uint32_t>(type);
+  event.info.error_code_valid = error_code_valid;
+  event.info.valid            = true;
+  event.error_code            = error_code;
+
+  return insert(event);
+}
+
+//
+// Private
+//
+
+int event_queue_t::priority(const event_t& event) noexcept
+{
+  switch (static_cast<vmx::interrupt_type>(event.info.type))
+  {
+    case vmx::interrupt_type::hardware_exception:
+      return 0x200;
+
+    case vmx::interrupt_type::nmi:
+      return 0x100;
+
+    default:
+      return static_cast<int>(event.info.vector);
+  }
+}
+
+bool event_queue_t::insert(const event_t& event) noexcept
+{
+  if (count_ == capacity)
+  {
+    return false;
+  }
+
+  //
+  // Keep the queue sorted - events with the same priority are delivered
+  // in FIFO order.
+  //
+  auto event_priority = priority(event);
+  auto index = count_;
+
+  while (index > 0 && priority(event_[index - 1]) < event_priority)
+  {
+    event_[index] = event_[index - 1];
+    index -= 1;
+  }
+
+  event_[index] = event;
+  count_ += 1;
+  return true;
+}
+
+void event_queue_t::remove(int index) noexcept
+{
+  for (int i = index + 1; i < count_; ++i)
+  {
+    event_[i - 1] = event_[i];
+  }
+
+  count_ -= 1;
+}
+
+void event_queue_t::requeue_injected() noexcept
+{
+  injected_ = false;
+
+  //
+  // The delivery of the event injected on the last VM-entry caused this
+  // VM-exit - the event is reported in the IDT-vectoring information and
+  // it must be injected again. See Vol3C[27.2.4(Information for VM Exits
+  // During Event Delivery)].
+  //
+  vmx::interrupt_info_t idt_vectoring_info;
+  vmx::vmread(vmx::vmcs_t::field::vmexit_idt_vectoring_info, idt_vectoring_info.flags);
+
+  if (idt_vectoring_info.valid &&
+      idt_vectoring_info.type == injected_event_.info.type &&
+      idt_vectoring_info.vector == injected_event_.info.vector)
+  {
+    insert(injected_event_);
+  }
+}
+
+void event_queue_t::deliver_slow(vcpu_t& vp) noexcept
+{
+  //
+  // Events belong to L1 - keep them queued while the nested guest runs.
+  //
+  if (vp.nested().in_l2())
+  {
+    return;
+  }
+
+  //
+  // If the handler has already injected an event on its own, only (re)arm
+  // the window for the queued events.
+  //
+  auto injection_pending = vp.entry_interruption_info().valid;
+
+  vmx::interruptibility_state_t interruptibility;
+  vmx::vmread(vmx::vmcs_t::field::guest_interruptibility_state, interruptibility.flags);
+
+  auto blocking_by_sti_or_mov_ss = interruptibility.blocking_by_sti ||
+                                   interruptibility.blocking_by_mov_ss;
+
+  auto interrupts_enabled = vp.guest_rflags().interrupt_enable_flag &&
+                            !blocking_by_sti_or_mov_ss;
+
+  auto nmis_enabled = !blocking_by_sti_or_mov_ss &&
+                      !interruptibility.blocking_by_nmi;
+
+  if (!injection_pending)
+  {
+    for (int i = 0; i < count_; ++i)
+    {
+      auto& event = event_[i];
+      auto type = static_cast<vmx::interrupt_type>(event.info.type);
+
+      auto deliverable =
+        type == vmx::interrupt_type::hardware_exception ||
+        (type == vmx::interrupt_type::nmi && nmis_enabled) ||
+        (type == vmx::interrupt_type::external && interrupts_enabled);
+
+      if (!deliverable)
+      {
+        continue;
+      }
+
+      auto vector = static_cast<exception_vector>(event.info.vector);
+
+      vp.inject(event.info.error_code_valid
+        ? interrupt_info_t(type, vector, event.error_code)
+        : interrupt_info_t(type, vector));
+
+      injected_event_ = event;
+      injected_ = true;
+
+      remove(i);
+      break;
+    }
+  }
+
+  //
+  // Arm the window exiting for the events which are still queued. Only one
+  // event can be injected per VM-entry - events which aren't blocked wait
+  // for the nearest window as well.
+  //
+  auto virtual_nmis = vp.pin_based_controls().virtual_nmis;
+  auto interrupt_window = false;
+  auto nmi_window = false;
+
+  for (int i = 0; i < count_; ++i)
+  {
+    if (event_[i].info.type == static_cast<uint32_t>(vmx::interrupt_type::nmi) && virtual_nmis)
+    {
+      nmi_window = true;
+    }
+    else
+    {
+      interrupt_window = true;
+    }
+  }
+
+  arm_window(vp, interrupt_window, nmi_window);
+}
+
+void event_queue_t::arm_window(vcpu_t& vp, bool interrupt_window, bool nmi_window) noexcept
+{
+  if (!window_armed_ && !interrupt_window && !nmi_window)
+  {
+    return;
+  }
+
+  auto procbased_ctls = vp.processor_based_controls();
+
+  if (procbased_ctls.interrupt_window_exiting != interrupt_window ||
+      procbased_ctls.nmi_window_exiting != nmi_window)
+  {
+    procbased_ctls.interrupt_window_exiting = interrupt_window;
+    procbased_ctls.nmi_window_exiting = nmi_window;
+    vp.processor_based_controls(procbased_ctls);
+  }
+
+  window_armed_ = interrupt_window || nmi_window;
+}
+
+}
@@ -0,0 +1,115 @@
+#pragma once
+#include "ia32/exception.h"
+#include "ia32/vmx/interrupt.h"
+
+#include <cstdint>
+
+namespace hvpp {
+
+using namespace ia32;
+
+class vcpu_t;
+
+//
+// Per-VCPU queue of events (hardware exceptions, NMIs and external
+// interrupts) waiting for injection into the guest.
+//
+// vcpu_t::inject() writes the event directly into the VM-entry
+// interruption-information field - which means only one event per VM-exit,
+// and the event must be deliverable right now. Events posted to this queue
+// are instead injected at the end of the VM-exit (see deliver()) one at a
+// time, ordered by priority:
+//   1. hardware exceptions
+//   2. NMIs
+//   3. external interrupts (higher vector first)
+//
+// When the highest-priority event can't be delivered because the guest
+// blocks it, interrupt-window (or NMI-window) exiting is armed, so that the
+// VM-exit occurs exactly when the guest becomes interruptible. The window
+// exiting is disarmed as soon as the queue is empty - there are no
+// extra VM-exits while nothing is pending.
+//
+// NMI-window exiting requires "virtual NMIs" pin-based control. Without it
+// (the default setup), blocked NMIs wait for the interrupt window instead -
+// it opens right after the IRET of the guest's NMI handler (which restores
+// RFLAGS.IF), at which point the NMI blocking is gone too.
+//
+// If the delivery of an injected event is interrupted by a VM-exit (e.g. an
+// EPT violation while pushing the interrupt frame), the event is put back
+// into the queue (see exit()).
+//
+
+class event_queue_t
+{
+  public:
+    static constexpr int capacity = 16;
+
+    struct event_t
+    {
+      vmx::interrupt_info_t  info;
+      exception_error_code_t error_code;
+    };
+
+    void initialize() noexcept;
+
+    //
+    // Adds event into the queue. Only hardware exceptions, NMIs and external
+    // interrupts can be posted - software interrupts and exceptions are tied
+    // to the instruction which caused the VM-exit and must be injected
+    // directly. Returns false if the queue is full.
+    //
+    bool post(vmx::interrupt_type type, exception_vector vector,
+              exception_error_code_t error_code, bool error_code_valid) noexcept;
+
+    bool empty() const noexcept { return count_ == 0; }
+    int  size() const noexcept { return count_; }
+
+    //
+    // Called at the beginning of each VM-exit.
+    //
+    void exit() noexcept
+    {
+      if (injected_)
+      {
+        requeue_injected();
+      }
+    }
+
+    //
+    // Called at the end of each VM-exit (right before VM-entry). Injects the
+    // highest-priority deliverable event and (dis)arms the window exiting.
+    //
+    void deliver(vcpu_t& vp) noexcept
+    {
+      if (count_ || window_armed_)
+      {
+        deliver_slow(vp);
+      }
+    }
+
+  private:
+    static int priority(const event_t& event) noexcept;
+
+    bool insert(const event_t& event) noexcept;
+    void remove(int index) noexcept;
+
+    void requeue_injected() noexcept;
+    void deliver_slow(vcpu_t& vp) noexcept;
+    void arm_window(vcpu_t& vp, bool interrupt_window, bool nmi_window) noexcept;
+
+    //
+    // Sorted by priority (the highest first).
+    //
+    event_t event_[capacity];
+    int     count_;
+
+    //
+    // Event injected on the last VM-entry (valid while injected_ is set).
+    //
+    event_t injected_event_;
+    bool    injected_;
+
+    bool    window_armed_;
+};
+
+}
@@ -1,5 +1,8 @@
 #include "hypervisor.h"
+#include "bulk_read.h"
+#include "coverage.h"
 #include "config.h"
+#include "memscan.h"
 
 #include "ia32/cpuid/cpuid_eax_01.h"
 #include "lib/assert.h"
@@ -24,6 +27,11 @@ namespace hvpp {
 void hypervisor::initialize() noexcept
 {
   vcpu_list_ = new vcpu_t[mp::cpu_count()];
+  steal_time_t::allocate();
+  memory_scanner_t::allocate();
+  profiler_t::allocate();
+  bulk_reader_t::allocate();
+  coverage_t::allocate();
   handler_ = nullptr;
   check_ = false;
 }
@@ -31,6 +39,11 @@ void hypervisor::initialize() noexcept
 void hypervisor::destroy() noexcept
 {
   delete[] vcpu_list_;
+  steal_time_t::free();
+  memory_scanner_t::free();
+  profiler_t::free();
+  bulk_reader_t::free();
+  coverage_t::free();
 }
 
 bool hypervisor::check() noexcept
@@ -0,0 +1,207 @@
+#include "idle_time.h"
+#include "steal_time.h"
+#include "vcpu.h"
+
+#include "ia32/vmx.h"
+
+namespace hvpp {
+
+void idle_time_t::initialize(uint32_t cpu_index) noexcept
+{
+  cpu_index_        = cpu_index;
+  enabled_          = false;
+  halted_           = false;
+  wake_exits_armed_ = false;
+  halt_begin_tsc_   = 0;
+  saved_pinbased_   = 0;
+  enable_tsc_       = 0;
+  halted_cycles_    = 0;
+  halt_count_       = 0;
+  base_exit_count_  = 0;
+  base_root_cycles_ = 0;
+}
+
+bool idle_time_t::enable(vcpu_t& vp, const steal_time_t& steal_time) noexcept
+{
+  //
+  // Bit 6 of IA32_VMX_MISC - the HLT activity state is supported.
+  // See Vol3D[A.6(Miscellaneous Data)].
+  //
+  auto vmx_misc = msr::read<msr::vmx_misc_t>();
+
+  //
+  // HLT exiting is set in VMCS01 - which isn't current while the nested
+  // guest runs.
+  //
+  if (!(vmx_misc.activity_states & 1) || vp.nested().in_l2())
+  {
+    return false;
+  }
+
+  auto procbased_ctls = vp.processor_based_controls();
+  procbased_ctls.hlt_exiting = true;
+  vp.processor_based_controls(procbased_ctls);
+
+  enabled_          = true;
+  halted_           = false;
+  enable_tsc_       = ia32_asm_read_tsc();
+  halted_cycles_    = 0;
+  halt_count_       = 0;
+  base_exit_count_  = steal_time.exit_count();
+  base_root_cycles_ = steal_time.root_cycles();
+
+  return true;
+}
+
+void idle_time_t::disable(vcpu_t& vp) noexcept
+{
+  if (!enabled_ || vp.nested().in_l2())
+  {
+    return;
+  }
+
+  auto procbased_ctls = vp.processor_based_controls();
+  procbased_ctls.hlt_exiting = false;
+  vp.processor_based_controls(procbased_ctls);
+
+  disarm_wake_exits(vp);
+
+  enabled_ = false;
+}
+
+idle_status_t idle_time_t::status(const steal_time_t& steal_time, uint64_t now) const noexcept
+{
+  idle_status_t result{};
+  result.cpu_index = cpu_index_;
+  result.enabled   = enabled_;
+
+  if (enabled_)
+  {
+    result.total_cycles  = now - enable_tsc_;
+    result.halted_cycles = halted_cycles_;
+    result.halt_count    = halt_count_;
+    result.exit_count    = steal_time.exit_count() - base_exit_count_;
+    result.root_cycles   = steal_time.root_cycles() - base_root_cycles_;
+  }
+
+  return result;
+}
+
+void idle_time_t::halt(vcpu_t& vp) noexcept
+{
+  //
+  // RIP is moved past the HLT instruction as usual - the CPU in the HLT
+  // activity state resumes at the next instruction on wake-up.
+  //
+  // VM-entry into the HLT state fails if there's blocking by STI or
+  // MOV SS (Vol3C[26.3.1.5(Checks on Guest Non-Register State)]). The
+  // blocking covered just the HLT instruction itself (e.g. "sti; hlt"),
+  // which is completed now, so it can be cleared.
+  //
+  vmx::interruptibility_state_t interruptibility;
+  vmx::vmread(vmx::vmcs_t::field::guest_interruptibility_state, interruptibility.flags);
+
+  if (interruptibility.blocking_by_sti || interruptibility.blocking_by_mov_ss)
+  {
+    interruptibility.blocking_by_sti = false;
+    interruptibility.blocking_by_mov_ss = false;
+    vmx::vmwrite(vmx::vmcs_t::field::guest_interruptibility_state, interruptibility.flags);
+  }
+
+  vmx::vmwrite(vmx::vmcs_t::field::guest_activity_state,
+               static_cast<uint32_t>(vmx::activity_state::hlt));
+
+  halted_ = true;
+  halt_count_ += 1;
+
+  arm_wake_exits(vp);
+}
+
+void idle_time_t::finish_halt(vcpu_t& vp, uint64_t exit_tsc) noexcept
+{
+  halted_cycles_ += exit_tsc - halt_begin_tsc_;
+
+  auto wake_exits_armed = wake_exits_armed_;
+  disarm_wake_exits(vp);
+
+  //
+  // External interrupt or NMI which caused this VM-exit is the event which
+  // wakes up the guest - the CPU doesn't leave the HLT activity state on its
+  // own when the event causes VM-exit instead. Resume the guest as active,
+  // the event is delivered right after the VM-entry.
+  //
+  if (wake_exits_armed)
+  {
+    auto exit_reason = vp.exit_reason();
+
+    if (exit_reason == vmx::exit_reason::external_interrupt ||
+        (exit_reason == vmx::exit_reason::exception_or_nmi &&
+         vp.exit_interrupt_info().type() == vmx::interrupt_type::nmi))
+    {
+      vmx::vmwrite(vmx::vmcs_t::field::guest_activity_state,
+                   static_cast<uint32_t>(vmx::activity_state::active));
+
+      halted_ = false;
+      return;
+    }
+  }
+
+  //
+  // Other VM-exits (e.g. INIT signal) might have woken up the guest as
+  // well - or it might still be halted. In the latter case the halt
+  // continues after the VM-entry (see entry()).
+  //
+  uint32_t activity_state;
+  vmx::vmread(vmx::vmcs_t::field::guest_activity_state, activity_state);
+
+  halted_ = activity_state == static_cast<uint32_t>(vmx::activity_state::hlt);
+
+  if (halted_)
+  {
+    arm_wake_exits(vp);
+  }
+}
+
+void idle_time_t::arm_wake_exits(vcpu_t& vp) noexcept
+{
+  //
+  // Pin-based controls are set in VMCS01 - which isn't current while the
+  // nested guest runs.
+  //
+  if (wake_exits_armed_ || vp.nested().in_l2())
+  {
+    return;
+  }
+
+  auto pinbased_ctls = vp.pin_based_controls();
+  saved_pinbased_ = static_cast<uint32_t>(pinbased_ctls.flags);
+
+  //
+  // External interrupt doesn't wake up the guest which halted with
+  // interrupts disabled (e.g. "cli; hlt") - the interrupt would stay
+  // pending and cause VM-exit right after each VM-entry.
+  //
+  if (vp.guest_rflags().interrupt_enable_flag)
+  {
+    pinbased_ctls.external_interrupt_exiting = true;
+  }
+
+  pinbased_ctls.nmi_exiting = true;
+  vp.pin_based_controls(pinbased_ctls);
+
+  wake_exits_armed_ = true;
+}
+
+void idle_time_t::disarm_wake_exits(vcpu_t& vp) noexcept
+{
+  if (!wake_exits_armed_)
+  {
+    return;
+  }
+
+  vp.pin_based_controls(msr::vmx_pinbased_ctls_t{ saved_pinbased_ });
+
+  wake_exits_armed_ = false;
+}
+
+}
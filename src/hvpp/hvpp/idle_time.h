@@ -0,0 +1,125 @@
+#pragma once
+#include <cstdint>
+
+namespace hvpp {
+
+class vcpu_t;
+class steal_time_t;
+
+//
+// Layout of the status returned to the guest (see VMCALLs in vmcall.h).
+//
+// All times are in TSC ticks and are counted since the accounting has
+// been enabled on the CPU:
+//   busy time = total_cycles - halted_cycles
+//   idle ratio = halted_cycles / total_cycles
+//   hypervisor overhead = root_cycles / busy time
+//
+
+struct idle_status_t
+{
+  uint32_t cpu_index;
+  uint32_t enabled;
+  uint64_t total_cycles;
+  uint64_t halted_cycles;
+  uint64_t halt_count;
+  uint64_t exit_count;
+  uint64_t root_cycles;
+};
+
+//
+// Per-VCPU accounting of the time the guest spends halted.
+//
+// When enabled, HLT causes VM-exit. The handler (see halt()) doesn't emulate
+// the halt by waiting in VMX root - it skips the instruction and re-enters
+// the guest in the HLT activity state, so the CPU halts in VMX non-root
+// operation and wakes up on the next event as if nothing happened.
+//
+// The halt starts at the VM-entry which follows the HLT VM-exit. Waking up
+// from the HLT activity state doesn't cause VM-exit on its own - therefore
+// external-interrupt exiting (only if the guest halted with interrupts
+// enabled) and NMI exiting are armed for the duration of the halt. The
+// wake-up event then causes VM-exit, which ends the halt. "Acknowledge
+// interrupt on exit" is off, so the external interrupt stays pending in the
+// local APIC and the guest takes it right after the VM-entry - the NMI is
+// re-injected by handle_exception_or_nmi(). Both controls are disarmed on
+// the first VM-exit after the halt, whatever its reason.
+//
+// Idle loops which use MWAIT instead of HLT aren't accounted.
+//
+
+class idle_time_t
+{
+  public:
+    void initialize(uint32_t cpu_index) noexcept;
+
+    //
+    // Enables (disables) HLT exiting on the current VCPU and resets the
+    // counters. Returns false if the CPU doesn't support the HLT activity
+    // state. Both do nothing while the nested guest runs.
+    //
+    bool enable(vcpu_t& vp, const steal_time_t& steal_time) noexcept;
+    void disable(vcpu_t& vp) noexcept;
+
+    bool enabled() const noexcept { return enabled_; }
+
+    idle_status_t status(const steal_time_t& steal_time, uint64_t now) const noexcept;
+
+    //
+    // Handler of HLT VM-exit.
+    //
+    void halt(vcpu_t& vp) noexcept;
+
+    //
+    // Called at the beginning of each VM-exit and at the end of each VM-exit
+    // (right before VM-entry).
+    //
+    void exit(vcpu_t& vp, uint64_t exit_tsc) noexcept
+    {
+      if (halted_)
+      {
+        finish_halt(vp, exit_tsc);
+      }
+    }
+
+    void entry(uint64_t entry_tsc) noexcept
+    {
+      if (halted_)
+      {
+        halt_begin_tsc_ = entry_tsc;
+      }
+    }
+
+  private:
+    void finish_halt(vcpu_t& vp, uint64_t exit_tsc) noexcept;
+
+    void arm_wake_exits(vcpu_t& vp) noexcept;
+    void disarm_wake_exits(vcpu_t& vp) noexcept;
+
+    uint32_t cpu_index_;
+    bool     enabled_;
+
+    //
+    // True while the guest is (or is about to be) in the HLT activity state.
+    //
+    bool     halted_;
+    bool     wake_exits_armed_;
+    uint64_t halt_begin_tsc_;
+
+    //
+    // Pin-based controls before arm_wake_exits().
+    //
+    uint32_t saved_pinbased_;
+
+    uint64_t enable_tsc_;
+    uint64_t halted_cycles_;
+    uint64_t halt_count_;
+
+    //
+    // Counters of steal_time_t at the time of enable().
+    //
+    uint64_t base_exit_count_;
+    uint64_t base_root_cycles_;
+};
+
+}
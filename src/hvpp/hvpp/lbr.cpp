@@ -0,0 +1,229 @@
+#include "lbr.h"
+#include "vcpu.h"
+
+#include "ia32/cpuid/cpuid_eax_01.h"
+
+#include <algorithm> // std::min()
+#include <iterator>  // std::size()
+
+namespace hvpp {
+
+//
+// MSR_LASTBRANCH_n_FROM_IP/MSR_LASTBRANCH_n_TO_IP.
+//
+static constexpr uint32_t msr_lastbranch_from_ip = 0x680;
+static constexpr uint32_t msr_lastbranch_to_ip   = 0x6c0;
+
+//
+// Returns number of LBR records of the CPU (0 if the CPU doesn't have
+// model-specific LBRs at MSR_LASTBRANCH_n). See Vol3B[17.4 - 17.14] and
+// Vol4[2(Model-Specific Registers)].
+//
+static int lbr_depth() noexcept
+{
+  cpuid_eax_01 cpuid_info;
+  ia32_asm_cpuid(cpuid_info.cpu_info, 1);
+
+  auto family = cpuid_info.version_information.family_id;
+  auto model  = cpuid_info.version_information.model
+              | cpuid_info.version_information.extended_model_id << 4;
+
+  if (family != 6 || !cpuid_info.feature_information_ecx.perfmon_and_debug_capability)
+  {
+    return 0;
+  }
+
+  //
+  // Architectural LBRs (CPUID.(EAX=07H,ECX=0):EDX[19]) use different MSRs.
+  //
+  int cpu_info[4];
+  ia32_asm_cpuid(cpu_info, 0);
+  if (cpu_info[0] >= 7)
+  {
+    ia32_asm_cpuid_ex(cpu_info, 7, 0);
+    if (cpu_info[3] & (1 << 19))
+    {
+      return 0;
+    }
+  }
+
+  switch (model)
+  {
+    case 0x0f: case 0x16: case 0x17: case 0x1d:
+      //
+      // Core 2.
+      //
+      return 4;
+
+    case 0x1c: case 0x26: case 0x27: case 0x35: case 0x36: case 0x37:
+    case 0x4a: case 0x4c: case 0x4d: case 0x5a: case 0x5d:
+      //
+      // Atom, Silvermont, Airmont.
+      //
+      return 8;
+
+    case 0x4e: case 0x5e: case 0x55: case 0x8e: case 0x9e: case 0x66:
+    case 0x6a: case 0x6c: case 0x7d: case 0x7e: case 0xa5: case 0xa6:
+    case 0x5c: case 0x5f: case 0x7a: case 0x86: case 0x96: case 0x9c:
+      //
+      // Skylake and later, Goldmont, Tremont.
+      //
+      return 32;
+
+    default:
+      //
+      // Nehalem - Broadwell.
+      //
+      return model >= 0x1a ? 16 : 0;
+  }
+}
+
+//
+// Strips flags (mispredict, TSX) which are stored in the upper bits of
+// MSR_LASTBRANCH_n_FROM_IP by some LBR formats.
+//
+static uint64_t canonical(uint64_t address) noexcept
+{
+  return static_cast<uint64_t>(static_cast<int64_t>(address << 16) >> 16);
+}
+
+void lbr_t::initialize() noexcept
+{
+  depth_ = std::min(lbr_depth(), max_depth);
+
+  //
+  // Call-stack mode is supported since Haswell - LBR format 4 and newer.
+  //
+  call_stack_ = depth_ && msr::read<msr::perf_capabilities_t>().lbr_format >= 4;
+
+  enabled_ = false;
+  guest_lbr_ = false;
+  guest_lbr_select_ = 0;
+
+  msr::lbr_select_t lbr_select{ 0 };
+  lbr_select.jcc = true;
+  lbr_select.near_ind_jmp = true;
+  lbr_select.near_rel_jmp = true;
+  lbr_select.far_branch = true;
+  lbr_select.en_callstack = call_stack_;
+
+  entry_load_[0].msr_id = msr::lbr_select_t::msr_id;
+  entry_load_[0].reserved = 0;
+  entry_load_[0].value = lbr_select.flags;
+}
+
+bool lbr_t::enable(vcpu_t& vp) noexcept
+{
+  //
+  // VMCS01 must be current - while the nested guest runs, the change is
+  // left for a later VM-exit.
+  //
+  if (!depth_ || enabled_ || vp.nested().in_l2())
+  {
+    return false;
+  }
+
+  auto debugctl = vp.guest_debugctl();
+  guest_lbr_ = debugctl.lbr;
+  guest_lbr_select_ = msr::read(msr::lbr_select_t::msr_id);
+
+  debugctl.lbr = true;
+  vp.guest_debugctl(debugctl);
+
+  auto entry_ctls = vp.vm_entry_controls();
+  entry_ctls.load_debug_controls = true;
+  vp.vm_entry_controls(entry_ctls);
+
+  auto exit_ctls = vp.vm_exit_controls();
+  exit_ctls.save_debug_controls = true;
+  vp.vm_exit_controls(exit_ctls);
+
+  vmx::vmwrite(vmx::vmcs_t::field::ctrl_vmentry_msr_load_address, pa_t::from_va(entry_load_));
+  vmx::vmwrite(vmx::vmcs_t::field::ctrl_vmentry_msr_load_count, uint32_t(std::size(entry_load_)));
+
+  vmx::msr_bitmap_t msr_bitmap = vp.msr_bitmap();
+  msr_bitmap.rdmsr_low[msr::debugctl_t::msr_id / 8] |= 1 << (msr::debugctl_t::msr_id % 8);
+  msr_bitmap.wrmsr_low[msr::debugctl_t::msr_id / 8] |= 1 << (msr::debugctl_t::msr_id % 8);
+  vp.msr_bitmap(msr_bitmap);
+
+  enabled_ = true;
+  return true;
+}
+
+void lbr_t::disable(vcpu_t& vp) noexcept
+{
+  if (!enabled_ || vp.nested().in_l2())
+  {
+    return;
+  }
+
+  enabled_ = false;
+
+  vmx::msr_bitmap_t msr_bitmap = vp.msr_bitmap();
+  msr_bitmap.rdmsr_low[msr::debugctl_t::msr_id / 8] &= ~(1 << (msr::debugctl_t::msr_id % 8));
+  msr_bitmap.wrmsr_low[msr::debugctl_t::msr_id / 8] &= ~(1 << (msr::debugctl_t::msr_id % 8));
+  vp.msr_bitmap(msr_bitmap);
+
+  vmx::vmwrite(vmx::vmcs_t::field::ctrl_vmentry_msr_load_count, uint32_t(0));
+  msr::write(msr::lbr_select_t::msr_id, guest_lbr_select_);
+
+  auto debugctl = vp.guest_debugctl();
+  debugctl.lbr = guest_lbr_;
+  vp.guest_debugctl(debugctl);
+}
+
+int lbr_t::snapshot(entry_t* entries, int count) const noexcept
+{
+  if (!enabled_)
+  {
+    return 0;
+  }
+
+  //
+  // LBR depth is always power of 2.
+  //
+  auto tos = static_cast<int>(msr::read<msr::lbr_tos_t>());
+  auto mask = depth_ - 1;
+  int result = 0;
+
+  for (int i = 0; i < std::min(count, depth_); ++i)
+  {
+    auto index = static_cast<uint32_t>((tos - i) & mask);
+    auto from = msr::read(msr_lastbranch_from_ip + index);
+    auto to   = msr::read(msr_lastbranch_to_ip + index);
+
+    if (!from && !to)
+    {
+      break;
+    }
+
+    entries[result].from = canonical(from);
+    entries[result].to   = canonical(to);
+    result += 1;
+  }
+
+  return result;
+}
+
+msr::debugctl_t lbr_t::to_guest(msr::debugctl_t debugctl) const noexcept
+{
+  if (enabled_)
+  {
+    debugctl.lbr = guest_lbr_;
+  }
+
+  return debugctl;
+}
+
+msr::debugctl_t lbr_t::from_guest(msr::debugctl_t debugctl) noexcept
+{
+  if (enabled_)
+  {
+    guest_lbr_ = debugctl.lbr;
+    debugctl.lbr = true;
+  }
+
+  return debugctl;
+}
+
+}
@@ -0,0 +1,86 @@
+#pragma once
+#include "ia32/msr.h"
+#include "ia32/vmx.h"
+
+#include <cstdint>
+
+namespace hvpp {
+
+using namespace ia32;
+
+class vcpu_t;
+
+//
+// Last Branch Records of the guest.
+//
+// When enabled, the LBR bit is set in the guest's IA32_DEBUGCTL (VMCS
+// field, loaded on VM-entry and saved on VM-exit with "load/save debug
+// controls"). The CPU clears IA32_DEBUGCTL on VM-exit, therefore branches
+// of the hypervisor itself are never recorded and the LBR stack holds the
+// last branches of the guest during the whole VM-exit handler.
+//
+// If the CPU supports it, LBRs are put into call-stack mode - they then
+// hold the current call chain (rather than the last calls and returns).
+// IA32_LBR_SELECT is loaded via VM-entry MSR-load list, so that the guest
+// can't accidentally change the filter for longer than until the next
+// VM-exit - without intercepting the MSR.
+//
+// Guest accesses of IA32_DEBUGCTL are intercepted and the guest sees its
+// own value of the LBR bit (see to_guest()/from_guest()).
+//
+
+class lbr_t
+{
+  public:
+    static constexpr int max_depth = 32;
+
+    struct entry_t
+    {
+      uint64_t from;
+      uint64_t to;
+    };
+
+    void initialize() noexcept;
+
+    bool supported() const noexcept { return depth_ != 0; }
+    bool enabled() const noexcept { return enabled_; }
+    int  depth() const noexcept { return depth_; }
+
+    //
+    // Must be called in VM-exit on the CPU of the VCPU. Both do nothing
+    // while the nested guest runs (see nested_vmx_t::in_l2()).
+    //
+    bool enable(vcpu_t& vp) noexcept;
+    void disable(vcpu_t& vp) noexcept;
+
+    //
+    // Fills (at most) "count" most recent records (the most recent one
+    // first). Returns number of filled entries.
+    //
+    int snapshot(entry_t* entries, int count) const noexcept;
+
+    //
+    // Translates IA32_DEBUGCTL between the value the guest sees and the
+    // value in VMCS.
+    //
+    msr::debugctl_t to_guest(msr::debugctl_t debugctl) const noexcept;
+    msr::debugctl_t from_guest(msr::debugctl_t debugctl) noexcept;
+
+  private:
+    //
+    // VM-entry MSR-load list.
+    //
+    alignas(16) vmx::msr_entry_t entry_load_[1];
+
+    int                depth_;
+    bool               call_stack_;
+    bool               enabled_;
+
+    //
+    // State of the guest before enable().
+    //
+    bool               guest_lbr_;
+    uint64_t           guest_lbr_select_;
+};
+
+}
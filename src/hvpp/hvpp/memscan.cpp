@@ -0,0 +1,555 @@
+#include "memscan.h"
+
+#include "ia32/asm.h"
+#include "lib/log.h"
+#include "lib/mm.h"
+#include "lib/mp.h"
+#include "lib/physical_window.h"
+#include "lib/tsc.h"
+
+#include <algorithm> // std::min()
+#include <cinttypes>
+#include <cstring>
+
+#include <emmintrin.h>
+
+namespace hvpp {
+
+//
+// Default time budget of the scan on each VM-exit.
+//
+static constexpr uint32_t default_budget_us = 50;
+
+//
+// The last bytes of each page are scanned together with the beginning of
+// the next page, so that matches which cross the page boundary are found
+// (and the 16-byte loads never read past the page).
+//
+static constexpr uint32_t tail_size = 64;
+
+static_assert(tail_size >= memscan_pattern_t::max_length + 16);
+
+static uint64_t pack(uint32_t begin, uint32_t end) noexcept
+{ return (static_cast<uint64_t>(end) << 32) | begin; }
+
+static uint32_t range_begin(uint64_t range) noexcept
+{ return static_cast<uint32_t>(range); }
+
+static uint32_t range_end(uint64_t range) noexcept
+{ return static_cast<uint32_t>(range >> 32); }
+
+//
+// Returns host VA of the physical page or nullptr if the page can't be
+// mapped. Translate the VA back - pa_t::va() doesn't guarantee that the
+// VA is valid and page-fault in VM-exit handler would be fatal. Pages
+// without kernel mapping are mapped through the physical window of the
+// current CPU - such VA is valid only until the next page_va().
+//
+static const uint8_t* page_va(pa_t pa) noexcept
+{
+  auto va = pa.va();
+
+  if (va && pa_t::from_va(va) == pa)
+  {
+    return reinterpret_cast<const uint8_t*>(va);
+  }
+
+  return static_cast<const uint8_t*>(physical_window::map(pa.value()));
+}
+
+std::atomic<uint32_t>     memory_scanner_t::state_{ memscan_status_t::state_idle };
+std::atomic<uint32_t>     memory_scanner_t::active_{ 0 };
+
+memscan_request_t         memory_scanner_t::request_;
+memory_scanner_t::filter_t memory_scanner_t::filter_[memscan_request_t::max_pattern_count];
+uint32_t                  memory_scanner_t::filter_count_ = 0;
+uint64_t                  memory_scanner_t::budget_cycles_ = 0;
+
+uint32_t                  memory_scanner_t::range_chunk_[physical_memory_descriptor::max_range_count + 1];
+uint32_t                  memory_scanner_t::range_count_ = 0;
+uint64_t                  memory_scanner_t::total_bytes_ = 0;
+
+memory_scanner_t::queue_t* memory_scanner_t::queue_ = nullptr;
+uint32_t                  memory_scanner_t::queue_count_ = 0;
+
+std::atomic<uint64_t>     memory_scanner_t::done_bytes_{ 0 };
+uint64_t                  memory_scanner_t::start_tsc_ = 0;
+uint64_t                  memory_scanner_t::end_tsc_ = 0;
+
+memscan_match_t*          memory_scanner_t::ring_ = nullptr;
+std::atomic<uint64_t>     memory_scanner_t::ring_index_{ 0 };
+
+void memory_scanner_t::allocate() noexcept
+{
+  queue_count_ = mp::cpu_count();
+  queue_ = new queue_t[queue_count_];
+  ring_ = new memscan_match_t[ring_capacity];
+
+  state_ = memscan_status_t::state_idle;
+  active_ = 0;
+}
+
+void memory_scanner_t::free() noexcept
+{
+  state_ = memscan_status_t::state_idle;
+
+  delete[] queue_;
+  delete[] ring_;
+
+  queue_ = nullptr;
+  queue_count_ = 0;
+  ring_ = nullptr;
+}
+
+bool memory_scanner_t::start(const memscan_request_t& request) noexcept
+{
+  if (!queue_ || !ring_ ||
+      request.pattern_count > memscan_request_t::max_pattern_count)
+  {
+    return false;
+  }
+
+  for (uint32_t i = 0; i < request.pattern_count; ++i)
+  {
+    if (request.pattern[i].length == 0 ||
+        request.pattern[i].length > memscan_pattern_t::max_length)
+    {
+      return false;
+    }
+  }
+
+  //
+  // Stop the current scan (if any) and wait until no VCPU is in the
+  // middle of its time slice - they read the patterns and the queues.
+  //
+  auto state = state_.load();
+  do
+  {
+    if (state == memscan_status_t::state_setup)
+    {
+      return false;
+    }
+  } while (!state_.compare_exchange_weak(state, memscan_status_t::state_setup));
+
+  while (active_.load())
+  {
+    ia32_asm_pause();
+  }
+
+  if (request.pattern_count == 0)
+  {
+    state_ = memscan_status_t::state_idle;
+    return true;
+  }
+
+  //
+  // Build filters.
+  //
+  request_ = request;
+  filter_count_ = 0;
+
+  for (uint32_t i = 0; i < request_.pattern_count; ++i)
+  {
+    auto& pattern = request_.pattern[i];
+    uint8_t byte[2] = { pattern.data[0], pattern.length > 1 ? pattern.data[1] : uint8_t(0) };
+
+    //
+    // Single-byte patterns have their own filters, because candidates of
+    // such filter are checked by the first byte only.
+    //
+    auto single = pattern.length == 1;
+
+    auto filter = std::find_if(filter_, filter_ + filter_count_, [&](auto& f) {
+      return f.single == single && f.byte[0] == byte[0] && f.byte[1] == byte[1];
+    });
+
+    if (filter == filter_ + filter_count_)
+    {
+      filter->byte[0] = byte[0];
+      filter->byte[1] = byte[1];
+      filter->single = single;
+      filter->pattern_mask = 0;
+      filter_count_ += 1;
+    }
+
+    filter->pattern_mask |= 1 << i;
+  }
+
+  budget_cycles_ = tsc::ticks_per_ms()
+                 * (request_.budget_us ? request_.budget_us : default_budget_us)
+                 / 1000;
+
+  //
+  // Split physical memory into chunks.
+  //
+  auto& memory_descriptor = memory_manager::physical_memory_descriptor();
+
+  range_count_ = static_cast<uint32_t>(memory_descriptor.size());
+  total_bytes_ = 0;
+
+  uint32_t chunk_count = 0;
+  for (uint32_t i = 0; i < range_count_; ++i)
+  {
+    auto size = memory_descriptor.begin()[i].size();
+
+    range_chunk_[i] = chunk_count;
+    chunk_count += static_cast<uint32_t>(bytes_to_pages(size) + chunk_pages - 1) / chunk_pages;
+    total_bytes_ += size;
+  }
+
+  range_chunk_[range_count_] = chunk_count;
+
+  //
+  // Give each VCPU an equal share of chunks.
+  //
+  for (uint32_t i = 0; i < queue_count_; ++i)
+  {
+    auto begin = static_cast<uint32_t>(uint64_t(chunk_count) * i / queue_count_);
+    auto end   = static_cast<uint32_t>(uint64_t(chunk_count) * (i + 1) / queue_count_);
+
+    queue_[i].range         = pack(begin, end);
+    queue_[i].scanned_bytes = 0;
+    queue_[i].skipped_bytes = 0;
+    queue_[i].busy_cycles   = 0;
+    queue_[i].steal_count   = 0;
+  }
+
+  memset(ring_, 0, sizeof(memscan_match_t) * ring_capacity);
+  ring_index_ = 0;
+
+  done_bytes_ = 0;
+  start_tsc_  = ia32_asm_read_tsc();
+  end_tsc_    = 0;
+
+  state_.store(total_bytes_
+                 ? memscan_status_t::state_running
+                 : memscan_status_t::state_done,
+               std::memory_order_release);
+
+  return true;
+}
+
+memscan_status_t memory_scanner_t::status() noexcept
+{
+  memscan_status_t result{};
+
+  result.state          = state_.load(std::memory_order_acquire);
+  result.pattern_count  = request_.pattern_count;
+  result.total_bytes    = total_bytes_;
+  result.elapsed_cycles = (end_tsc_ ? end_tsc_ : ia32_asm_read_tsc()) - start_tsc_;
+  result.tsc_frequency  = tsc::frequency();
+  result.match_count    = ring_index_.load();
+
+  for (uint32_t i = 0; i < queue_count_; ++i)
+  {
+    result.scanned_bytes += queue_[i].scanned_bytes;
+    result.skipped_bytes += queue_[i].skipped_bytes;
+    result.busy_cycles   += queue_[i].busy_cycles;
+    result.steal_count   += queue_[i].steal_count;
+  }
+
+  return result;
+}
+
+uint32_t memory_scanner_t::read_matches(uint64_t& cursor, memscan_match_t* buffer, uint32_t count) noexcept
+{
+  if (!ring_)
+  {
+    return 0;
+  }
+
+  auto write_index = ring_index_.load(std::memory_order_acquire);
+
+  if (write_index > ring_capacity && cursor < write_index - ring_capacity)
+  {
+    cursor = write_index - ring_capacity;
+  }
+
+  uint32_t result = 0;
+  for (; result < count && cursor + result < write_index; ++result)
+  {
+    auto  index = cursor + result;
+    auto& entry = ring_[index % ring_capacity];
+    auto  sequence = static_cast<uint32_t>(index + 1);
+
+    //
+    // Stop at the first entry which is being written (or which has been
+    // overwritten in the meantime).
+    //
+    if (reinterpret_cast<volatile uint32_t&>(entry.sequence) != sequence)
+    {
+      break;
+    }
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    memscan_match_t match = entry;
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    if (reinterpret_cast<volatile uint32_t&>(entry.sequence) != sequence)
+    {
+      break;
+    }
+
+    memcpy(&buffer[result], &match, sizeof(match));
+  }
+
+  return result;
+}
+
+void memory_scanner_t::run_slice() noexcept
+{
+  //
+  // start() waits for "active_" to drop to zero after it changes the state,
+  // therefore the state must be checked again after "active_" is raised.
+  //
+  active_.fetch_add(1);
+
+  auto cpu_index = mp::cpu_index();
+
+  if (state_.load() == memscan_status_t::state_running &&
+      cpu_index < queue_count_)
+  {
+    auto& queue = queue_[cpu_index];
+    auto  begin_tsc = ia32_asm_read_tsc();
+    auto  now_tsc = begin_tsc;
+
+    do
+    {
+      uint32_t chunk;
+
+      if (!pop(queue, chunk) && !(steal(queue) && pop(queue, chunk)))
+      {
+        break;
+      }
+
+      scan_chunk(queue, chunk);
+      now_tsc = ia32_asm_read_tsc();
+    } while (now_tsc - begin_tsc < budget_cycles_ &&
+             state_.load(std::memory_order_relaxed) == memscan_status_t::state_running);
+
+    queue.busy_cycles += now_tsc - begin_tsc;
+  }
+
+  active_.fetch_sub(1);
+}
+
+bool memory_scanner_t::pop(queue_t& queue, uint32_t& chunk) noexcept
+{
+  auto range = queue.range.load();
+
+  do
+  {
+    if (range_begin(range) >= range_end(range))
+    {
+      return false;
+    }
+  } while (!queue.range.compare_exchange_weak(range, pack(range_begin(range) + 1, range_end(range))));
+
+  chunk = range_begin(range);
+  return true;
+}
+
+bool memory_scanner_t::steal(queue_t& queue) noexcept
+{
+  //
+  // Take the upper half of the chunks of the VCPU with the most chunks
+  // left. The owner takes chunks from the bottom, so both sides compete
+  // only for the last chunk.
+  //
+  for (;;)
+  {
+    queue_t* victim = nullptr;
+    uint64_t victim_range = 0;
+    uint32_t victim_count = 0;
+
+    for (uint32_t i = 0; i < queue_count_; ++i)
+    {
+      auto range = queue_[i].range.load();
+      auto count = range_end(range) > range_begin(range)
+        ? range_end(range) - range_begin(range)
+        : 0;
+
+      if (count > victim_count)
+      {
+        victim = &queue_[i];
+        victim_range = range;
+        victim_count = count;
+      }
+    }
+
+    if (!victim)
+    {
+      return false;
+    }
+
+    auto split = range_end(victim_range) - (victim_count + 1) / 2;
+
+    if (victim->range.compare_exchange_strong(victim_range, pack(range_begin(victim_range), split)))
+    {
+      queue.range.store(pack(split, range_end(victim_range)));
+      queue.steal_count += 1;
+      return true;
+    }
+  }
+}
+
+void memory_scanner_t::scan_chunk(queue_t& queue, uint32_t chunk) noexcept
+{
+  auto& memory_descriptor = memory_manager::physical_memory_descriptor();
+
+  uint32_t range_index = 0;
+  while (chunk >= range_chunk_[range_index + 1])
+  {
+    range_index += 1;
+  }
+
+  auto& range = memory_descriptor.begin()[range_index];
+
+  auto begin_pa = *range.begin() + pa_t{ uint64_t(chunk - range_chunk_[range_index]) * chunk_pages * page_size };
+  auto end_pa   = std::min(begin_pa + pa_t{ uint64_t(chunk_pages) * page_size }, *range.end());
+  auto bytes    = end_pa.value() - begin_pa.value();
+
+  for (auto pa = begin_pa; pa < end_pa; pa += pa_t{ page_size })
+  {
+    auto next_pa = pa + pa_t{ page_size };
+
+    if (!scan_page(pa, range.contains(next_pa)))
+    {
+      queue.skipped_bytes += page_size;
+      continue;
+    }
+
+    queue.scanned_bytes += page_size;
+  }
+
+  //
+  // The VCPU which scans the last chunk finishes the scan.
+  //
+  if (done_bytes_.fetch_add(bytes) + bytes == total_bytes_)
+  {
+    end_tsc_ = ia32_asm_read_tsc();
+
+    auto expected = uint32_t(memscan_status_t::state_running);
+    if (state_.compare_exchange_strong(expected, memscan_status_t::state_done))
+    {
+      auto cycles = end_tsc_ - start_tsc_;
+
+      hvpp_info("memscan: %" PRIu64 " MB in %" PRIu64 " ms (%" PRIu64 " MB/s), %" PRIu64 " matches",
+                total_bytes_ >> 20,
+                cycles / tsc::ticks_per_ms(),
+                cycles ? (total_bytes_ >> 20) * tsc::frequency() / cycles : 0,
+                ring_index_.load());
+    }
+  }
+}
+
+bool memory_scanner_t::scan_page(pa_t pa, bool has_next) noexcept
+{
+  auto va = page_va(pa);
+
+  if (!va)
+  {
+    return false;
+  }
+
+  scan(pa, va, page_size - tail_size, page_size);
+
+  alignas(16) uint8_t buffer[tail_size * 2 + 16] = {};
+
+  //
+  // Copy the tail before the next page is mapped - both pages might be
+  // mapped through the same physical window.
+  //
+  memcpy(buffer, va + page_size - tail_size, tail_size);
+
+  auto next_va = has_next
+    ? page_va(pa + pa_t{ page_size })
+    : nullptr;
+
+  if (next_va)
+  {
+    memcpy(buffer + tail_size, next_va, tail_size);
+  }
+
+  scan(pa + pa_t{ page_size - tail_size }, buffer, tail_size, next_va ? tail_size * 2 : tail_size);
+
+  return true;
+}
+
+void memory_scanner_t::scan(pa_t pa, const uint8_t* va, uint32_t position_count, uint32_t size) noexcept
+{
+  //
+  // Finds patterns which start at positions [0, position_count) and end
+  // before "size". Note that the 16-byte loads read up to position_count
+  // + 17 bytes.
+  //
+  // SSE2 only - entry_host() saves just the legacy SSE state (fxsave).
+  //
+  __m128i needle0[memscan_request_t::max_pattern_count];
+  __m128i needle1[memscan_request_t::max_pattern_count];
+
+  for (uint32_t i = 0; i < filter_count_; ++i)
+  {
+    needle0[i] = _mm_set1_epi8(static_cast<char>(filter_[i].byte[0]));
+    needle1[i] = filter_[i].single
+      ? _mm_set1_epi8(-1)
+      : _mm_set1_epi8(static_cast<char>(filter_[i].byte[1]));
+  }
+
+  for (uint32_t offset = 0; offset < position_count; offset += 16)
+  {
+    auto block0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(va + offset));
+    auto block1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(va + offset + 1));
+
+    for (uint32_t i = 0; i < filter_count_; ++i)
+    {
+      auto& filter = filter_[i];
+
+      auto eq0 = _mm_cmpeq_epi8(block0, needle0[i]);
+      auto eq1 = filter.single
+        ? needle1[i]
+        : _mm_cmpeq_epi8(block1, needle1[i]);
+
+      auto mask = static_cast<uint32_t>(_mm_movemask_epi8(_mm_and_si128(eq0, eq1)));
+
+      while (mask)
+      {
+        auto position = offset + static_cast<uint32_t>(ia32_asm_bsf(mask));
+        mask &= mask - 1;
+
+        uint32_t pattern_mask = filter.pattern_mask;
+
+        while (pattern_mask)
+        {
+          auto pattern_index = static_cast<uint32_t>(ia32_asm_bsf(pattern_mask));
+          pattern_mask &= pattern_mask - 1;
+
+          auto& pattern = request_.pattern[pattern_index];
+
+          if (position + pattern.length <= size &&
+              !memcmp(va + position, pattern.data, pattern.length))
+          {
+            report(pa + pa_t{ position }, pattern_index);
+          }
+        }
+      }
+    }
+  }
+}
+
+void memory_scanner_t::report(pa_t pa, uint32_t pattern_index) noexcept
+{
+  auto index = ring_index_.fetch_add(1);
+  auto& entry = ring_[index % ring_capacity];
+
+  reinterpret_cast<volatile uint32_t&>(entry.sequence) = 0;
+  std::atomic_thread_fence(std::memory_order_release);
+
+  entry.pa            = pa.value();
+  entry.pattern_index = pattern_index;
+
+  std::atomic_thread_fence(std::memory_order_release);
+  reinterpret_cast<volatile uint32_t&>(entry.sequence) = static_cast<uint32_t>(index + 1);
+}
+
+}
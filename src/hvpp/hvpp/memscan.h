@@ -0,0 +1,204 @@
+#pragma once
+#include "ia32/memory.h"
+
+#include <atomic>
+#include <cstdint>
+
+namespace hvpp {
+
+using namespace ia32;
+
+//
+// Layout of the structures shared with the guest (see VMCALLs in vmcall.h).
+//
+
+struct memscan_pattern_t
+{
+  static constexpr int max_length = 48;
+
+  uint32_t length;
+  uint32_t reserved;
+  uint8_t  data[max_length];
+};
+
+struct memscan_request_t
+{
+  static constexpr int max_pattern_count = 16;
+
+  uint32_t pattern_count;
+
+  //
+  // Time budget (in microseconds) of the scan on each VM-exit.
+  // 0 means default.
+  //
+  uint32_t budget_us;
+
+  memscan_pattern_t pattern[max_pattern_count];
+};
+
+struct memscan_match_t
+{
+  uint64_t pa;
+  uint32_t pattern_index;
+
+  //
+  // Index of the match in the result ring + 1 - set after the other fields
+  // have been written.
+  //
+  uint32_t sequence;
+};
+
+struct memscan_status_t
+{
+  enum : uint32_t
+  {
+    state_idle,
+    state_setup,
+    state_running,
+    state_done,
+  };
+
+  uint32_t state;
+  uint32_t pattern_count;
+
+  uint64_t total_bytes;
+  uint64_t scanned_bytes;
+  uint64_t skipped_bytes;
+
+  //
+  // TSC ticks from the start to the end of the scan (wall time) and total
+  // TSC ticks spent scanning on all CPUs.
+  //
+  uint64_t elapsed_cycles;
+  uint64_t busy_cycles;
+  uint64_t tsc_frequency;
+
+  uint64_t match_count;
+  uint64_t steal_count;
+
+  //
+  // Ring index of the first match which follows this structure.
+  //
+  uint64_t cursor;
+};
+
+//
+// Scanner of the guest-physical memory (ranges of
+// physical_memory_descriptor) for byte patterns.
+//
+// The scan doesn't have its own thread - each VCPU scans a few chunks of
+// memory at the end of a VM-exit handler, until the time budget of that
+// VM-exit is spent. Memory is split into chunks, each VCPU starts with
+// an equal share of them and when it runs out of work, it steals half of
+// the remaining chunks of the VCPU with the most work left. Therefore
+// VCPUs which rarely exit don't delay the end of the scan.
+//
+// Because EPT of hvpp maps guest-physical memory 1:1, the scan reads
+// physical pages through the host (kernel) mapping - pa_t::va(). Pages
+// without such mapping are read through the physical window (see
+// lib/physical_window.h) - they're skipped (and counted in skipped_bytes)
+// only if the window isn't available.
+//
+// Matches are written into a ring - if the reader is slower than the scan,
+// the oldest matches are overwritten.
+//
+
+class memory_scanner_t
+{
+  public:
+    static constexpr uint32_t ring_capacity = 4096;
+    static constexpr uint32_t chunk_pages   = 16;
+
+    static void allocate() noexcept;
+    static void free() noexcept;
+
+    //
+    // Starts a new scan (aborting the current one). Scan with no patterns
+    // just aborts the current one. Returns false if the request is invalid.
+    //
+    static bool start(const memscan_request_t& request) noexcept;
+
+    //
+    // Scans on the current VCPU until the time budget is spent or until
+    // there is no work left.
+    //
+    static void run() noexcept
+    {
+      if (state_.load(std::memory_order_acquire) == memscan_status_t::state_running)
+      {
+        run_slice();
+      }
+    }
+
+    static memscan_status_t status() noexcept;
+
+    //
+    // Copies matches starting at ring index "cursor" into the buffer.
+    // Returns number of copied matches. Overwritten matches are skipped -
+    // the index of the first copied match is returned in "cursor".
+    //
+    static uint32_t read_matches(uint64_t& cursor, memscan_match_t* buffer, uint32_t count) noexcept;
+
+  private:
+    //
+    // Range of chunk indexes [begin, end) of one VCPU, packed into one
+    // 64-bit value so that it can be shrunk by CAS from both sides.
+    //
+    struct alignas(64) queue_t
+    {
+      std::atomic<uint64_t> range;
+      uint64_t              scanned_bytes;
+      uint64_t              skipped_bytes;
+      uint64_t              busy_cycles;
+      uint64_t              steal_count;
+    };
+
+    //
+    // Patterns with the same first two bytes share one filter - SSE2
+    // compare of 16 bytes of memory with the first two bytes finds the
+    // candidates, which are then compared with whole patterns.
+    //
+    struct filter_t
+    {
+      uint8_t  byte[2];
+      bool     single;
+      uint16_t pattern_mask;
+    };
+
+    static void run_slice() noexcept;
+
+    static bool pop(queue_t& queue, uint32_t& chunk) noexcept;
+    static bool steal(queue_t& queue) noexcept;
+
+    static void scan_chunk(queue_t& queue, uint32_t chunk) noexcept;
+    static bool scan_page(pa_t pa, bool has_next) noexcept;
+    static void scan(pa_t pa, const uint8_t* va, uint32_t position_count, uint32_t size) noexcept;
+    static void report(pa_t pa, uint32_t pattern_index) noexcept;
+
+    static std::atomic<uint32_t> state_;
+    static std::atomic<uint32_t> active_;
+
+    static memscan_request_t request_;
+    static filter_t          filter_[memscan_request_t::max_pattern_count];
+    static uint32_t          filter_count_;
+    static uint64_t          budget_cycles_;
+
+    //
+    // First chunk index of each physical memory range.
+    //
+    static uint32_t          range_chunk_[physical_memory_descriptor::max_range_count + 1];
+    static uint32_t          range_count_;
+    static uint64_t          total_bytes_;
+
+    static queue_t*          queue_;
+    static uint32_t          queue_count_;
+
+    static std::atomic<uint64_t> done_bytes_;
+    static uint64_t          start_tsc_;
+    static uint64_t          end_tsc_;
+
+    static memscan_match_t*  ring_;
+    static std::atomic<uint64_t> ring_index_;
+};
+
+}
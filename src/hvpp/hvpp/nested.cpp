@@ -0,0 +1,2137 @@
+#include "nested.h"
+#include "vcpu.h"
+#include "vmexit.h"
+#include "config.h"
+
+#include "ia32/asm.h"
+#include "ia32/vmx.h"
+#include "lib/cr3_guard.h"
+#include "lib/mm.h"
+
+#include <cstring>
+#include <iterator> // std::size()
+
+#ifdef HVPP_ENABLE_NESTED_VMX
+
+namespace hvpp {
+
+namespace {
+
+using field = vmx::vmcs_t::field;
+
+//
+// Fields of the VMCS12 are divided into "hot" and "cold" ones. Hot fields
+// are accessed by L1 (almost) on each VM-exit of L2 - these are the fields
+// shadowed by the hardware (if VMCS shadowing is enabled) and synchronized
+// between VMCS12 and VMCS02 on each VM-entry and VM-exit. Cold fields are
+// copied into VMCS02 only if L1 has written into any of them since the last
+// VM-entry.
+//
+// The selection follows the fields accessed by common hypervisors (KVM,
+// Hyper-V, VMware) in their VM-exit handlers.
+//
+
+//
+// Hot read-write fields.
+//
+constexpr field hot_guest_fields[] = {
+  field::guest_rip,
+  field::guest_rsp,
+  field::guest_rflags,
+  field::guest_cr0,
+  field::guest_cr3,
+  field::guest_cr4,
+  field::guest_interruptibility_state,
+  field::guest_cs_access_rights,
+  field::guest_ss_access_rights,
+  field::guest_cs_base,
+  field::guest_es_base,
+  field::guest_interrupt_status,
+  field::guest_pml_index,
+};
+
+constexpr field hot_control_fields[] = {
+  field::ctrl_processor_based_vm_execution_controls,
+  field::ctrl_exception_bitmap,
+  field::ctrl_vmentry_interruption_info,
+  field::ctrl_vmentry_exception_error_code,
+  field::ctrl_vmentry_instruction_length,
+  field::ctrl_tpr_threshold,
+  field::ctrl_cr0_read_shadow,
+  field::ctrl_cr4_read_shadow,
+  field::ctrl_tsc_offset,
+};
+
+constexpr field hot_host_fields[] = {
+  field::host_fs_selector,
+  field::host_gs_selector,
+  field::host_fs_base,
+  field::host_gs_base,
+};
+
+//
+// Hot read-only fields - the exit information copied from VMCS02 on each
+// VM-exit of L2. These can be shadowed only if the CPU allows VMWRITE into
+// the VM-exit information fields (see handle_vmwrite()).
+//
+constexpr field exit_info_fields[] = {
+  field::vmexit_reason,
+  field::vmexit_qualification,
+  field::vmexit_instruction_length,
+  field::vmexit_instruction_info,
+  field::vmexit_interruption_info,
+  field::vmexit_interruption_error_code,
+  field::vmexit_idt_vectoring_info,
+  field::vmexit_idt_vectoring_error_code,
+  field::vmexit_guest_physical_address,
+  field::vmexit_guest_linear_address,
+};
+
+//
+// Cold guest fields.
+//
+constexpr field cold_guest_fields[] = {
+  field::guest_es_selector,
+  field::guest_cs_selector,
+  field::guest_ss_selector,
+  field::guest_ds_selector,
+  field::guest_fs_selector,
+  field::guest_gs_selector,
+  field::guest_ldtr_selector,
+  field::guest_tr_selector,
+  field::guest_debugctl,
+  field::guest_pat,
+  field::guest_efer,
+  field::guest_perf_global_ctrl,
+  field::guest_pdpte0,
+  field::guest_pdpte1,
+  field::guest_pdpte2,
+  field::guest_pdpte3,
+  field::guest_es_limit,
+  field::guest_cs_limit,
+  field::guest_ss_limit,
+  field::guest_ds_limit,
+  field::guest_fs_limit,
+  field::guest_gs_limit,
+  field::guest_ldtr_limit,
+  field::guest_tr_limit,
+  field::guest_gdtr_limit,
+  field::guest_idtr_limit,
+  field::guest_es_access_rights,
+  field::guest_ds_access_rights,
+  field::guest_fs_access_rights,
+  field::guest_gs_access_rights,
+  field::guest_ldtr_access_rights,
+  field::guest_tr_access_rights,
+  field::guest_activity_state,
+  field::guest_sysenter_cs,
+  field::guest_vmx_preemption_timer_value,
+  field::guest_ss_base,
+  field::guest_ds_base,
+  field::guest_fs_base,
+  field::guest_gs_base,
+  field::guest_ldtr_base,
+  field::guest_tr_base,
+  field::guest_gdtr_base,
+  field::guest_idtr_base,
+  field::guest_dr7,
+  field::guest_pending_debug_exceptions,
+  field::guest_sysenter_esp,
+  field::guest_sysenter_eip,
+};
+
+//
+// Cold control fields which are copied into VMCS02 as they are. Remaining
+// control fields are merged with the state of hvpp (see prepare_vmcs02()).
+//
+constexpr field cold_control_fields[] = {
+  field::ctrl_posted_interrupt_notification_vector,
+  field::ctrl_eptp_index,
+  field::ctrl_io_bitmap_a_address,
+  field::ctrl_io_bitmap_b_address,
+  field::ctrl_msr_bitmap_address,
+  field::ctrl_vmexit_msr_store_address,
+  field::ctrl_vmentry_msr_load_address,
+  field::ctrl_pml_address,
+  field::ctrl_virtual_apic_address,
+  field::ctrl_apic_access_address,
+  field::ctrl_posted_interrupt_descriptor_address,
+  field::ctrl_vmfunc_controls,
+  field::ctrl_eoi_exit_bitmap_0,
+  field::ctrl_eoi_exit_bitmap_1,
+  field::ctrl_eoi_exit_bitmap_2,
+  field::ctrl_eoi_exit_bitmap_3,
+  field::ctrl_ept_pointer_list_address,
+  field::ctrl_virtualization_exception_info_address,
+  field::ctrl_xss_exiting_bitmap,
+  field::ctrl_tsc_multiplier,
+  field::ctrl_pin_based_vm_execution_controls,
+  field::ctrl_pagefault_error_code_mask,
+  field::ctrl_pagefault_error_code_match,
+  field::ctrl_cr3_target_count,
+  field::ctrl_vmexit_msr_store_count,
+  field::ctrl_vmentry_controls,
+  field::ctrl_vmentry_msr_load_count,
+  field::ctrl_ple_gap,
+  field::ctrl_ple_window,
+  field::ctrl_cr0_guest_host_mask,
+  field::ctrl_cr4_guest_host_mask,
+  field::ctrl_cr3_target_value_0,
+  field::ctrl_cr3_target_value_1,
+  field::ctrl_cr3_target_value_2,
+  field::ctrl_cr3_target_value_3,
+};
+
+//
+// Fields which are valid in the VMCS12, but are not copied anywhere (or
+// are handled separately).
+//
+constexpr field other_fields[] = {
+  field::ctrl_virtual_processor_identifier,
+  field::ctrl_vmexit_msr_load_address,
+  field::ctrl_executive_vmcs_pointer,
+  field::ctrl_ept_pointer,
+  field::ctrl_vmread_bitmap_address,
+  field::ctrl_vmwrite_bitmap_address,
+  field::ctrl_encls_exiting_bitmap,
+  field::ctrl_vmexit_controls,
+  field::ctrl_vmexit_msr_load_count,
+  field::ctrl_secondary_processor_based_vm_execution_controls,
+  field::vmexit_instruction_error,
+  field::vmexit_io_rcx,
+  field::vmexit_io_rsx,
+  field::vmexit_io_rdi,
+  field::vmexit_io_rip,
+  field::guest_vmcs_link_pointer,
+  field::guest_smbase,
+  field::host_es_selector,
+  field::host_cs_selector,
+  field::host_ss_selector,
+  field::host_ds_selector,
+  field::host_tr_selector,
+  field::host_pat,
+  field::host_efer,
+  field::host_perf_global_ctrl,
+};
+
+//
+// Host state of VMCS02 - copied from VMCS01 (i.e. VM-exit from L2 lands
+// in hvpp the same way as VM-exit from L1).
+//
+constexpr field host_fields[] = {
+  field::host_es_selector,
+  field::host_cs_selector,
+  field::host_ss_selector,
+  field::host_ds_selector,
+  field::host_fs_selector,
+  field::host_gs_selector,
+  field::host_tr_selector,
+  field::host_sysenter_cs,
+  field::host_cr0,
+  field::host_cr3,
+  field::host_cr4,
+  field::host_fs_base,
+  field::host_gs_base,
+  field::host_tr_base,
+  field::host_gdtr_base,
+  field::host_idtr_base,
+  field::host_sysenter_esp,
+  field::host_sysenter_eip,
+  field::host_rsp,
+  field::host_rip,
+};
+
+//
+// Bitmap of valid field indexes - [width][type] (see vmcs12_t).
+//
+uint32_t valid_fields[4][4];
+
+constexpr uint32_t msr_sysenter_cs_id     = 0x00000174;
+constexpr uint32_t msr_sysenter_esp_id    = 0x00000175;
+constexpr uint32_t msr_sysenter_eip_id    = 0x00000176;
+constexpr uint32_t msr_pat_id             = 0x00000277;
+constexpr uint32_t msr_efer_id            = 0xC0000080;
+constexpr uint32_t msr_star_id            = 0xC0000081;
+constexpr uint32_t msr_lstar_id           = 0xC0000082;
+constexpr uint32_t msr_cstar_id           = 0xC0000083;
+constexpr uint32_t msr_fmask_id           = 0xC0000084;
+constexpr uint32_t msr_kernel_gs_base_id  = 0xC0000102;
+constexpr uint32_t msr_tsc_aux_id         = 0xC0000103;
+
+//
+// EFER.SCE, EFER.LME, EFER.LMA and EFER.NXE - the other bits are reserved.
+//
+constexpr uint64_t efer_lme        = 1ull << 8;
+constexpr uint64_t efer_lma        = 1ull << 10;
+constexpr uint64_t efer_valid_bits = (1ull << 0) | efer_lme | efer_lma | (1ull << 11);
+
+//
+// Activity state of the logical processor after VMX abort.
+//
+constexpr uint32_t activity_state_shutdown = 2;
+
+//
+// Access rights of segments loaded on VM-exit (Vol3C[27.5.2(Loading Host
+// Segment and Descriptor-Table Registers)]).
+//
+constexpr uint32_t access_rights_code64   = 0xa09b;
+constexpr uint32_t access_rights_data     = 0xc093;
+constexpr uint32_t access_rights_tss_busy = 0x008b;
+constexpr uint32_t access_rights_unusable = 0x10000;
+
+template <size_t N>
+void mark_valid(const field (&fields)[N]) noexcept
+{
+  for (auto vmcs_field : fields)
+  {
+    auto encoding = static_cast<uint32_t>(vmcs_field);
+    valid_fields[(encoding >> 13) & 3][(encoding >> 10) & 3] |= 1u << ((encoding >> 1) & 0x1ff);
+  }
+}
+
+template <size_t N>
+void clear_bits(uint8_t* bitmap, const field (&fields)[N]) noexcept
+{
+  for (auto vmcs_field : fields)
+  {
+    auto encoding = static_cast<uint32_t>(vmcs_field);
+    bitmap[encoding >> 3] &= ~(1 << (encoding & 7));
+
+    //
+    // Also clear the "high" access of 64-bit fields.
+    //
+    if (((encoding >> 13) & 3) == static_cast<uint32_t>(vmx::detail::vmcs_width_t::_64_bit))
+    {
+      encoding |= 1;
+      bitmap[encoding >> 3] &= ~(1 << (encoding & 7));
+    }
+  }
+}
+
+template <size_t N>
+void vmread_all(vmcs12_t& vmcs12, const field (&fields)[N]) noexcept
+{
+  for (auto vmcs_field : fields)
+  {
+    vmx::vmread(vmcs_field, vmcs12[vmcs_field]);
+  }
+}
+
+template <size_t N>
+void vmwrite_all(vmcs12_t& vmcs12, const field (&fields)[N]) noexcept
+{
+  for (auto vmcs_field : fields)
+  {
+    vmx::vmwrite(vmcs_field, vmcs12[vmcs_field]);
+  }
+}
+
+bool is_canonical(uint64_t va) noexcept
+{
+  return static_cast<uint64_t>(static_cast<int64_t>(va << 16) >> 16) == va;
+}
+
+//
+// Memory types 2, 3 and 8-255 are reserved (Vol3A[11.12.2(IA32_PAT MSR)]).
+//
+bool pat_valid(uint64_t pat) noexcept
+{
+  for (int i = 0; i < 8; ++i)
+  {
+    auto type = (pat >> (i * 8)) & 0xff;
+
+    if (type == 2 || type == 3 || type > 7)
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+//
+// Vol3C[26.2.2(Checks on Host Control Registers, MSRs, and SSP)] - LMA and
+// LME must match the "host address-space size" VM-exit control.
+//
+bool efer_valid(uint64_t efer, bool ia32e_mode_host) noexcept
+{
+  return !(efer & ~efer_valid_bits) &&
+         !!(efer & efer_lme) == ia32e_mode_host &&
+         !!(efer & efer_lma) == ia32e_mode_host;
+}
+
+//
+// The capability MSRs (either the TRUE ones or the original ones) share the
+// layout - allowed 0-settings in the low dword, allowed 1-settings in the
+// high dword.
+//
+bool controls_valid(uint64_t controls, uint32_t msr_id) noexcept
+{
+  auto true_ctls = msr::read<msr::vmx_true_ctls_t>(msr_id);
+
+  return (controls & true_ctls.allowed_0_settings) == true_ctls.allowed_0_settings &&
+         (controls & ~uint64_t(true_ctls.allowed_1_settings)) == 0;
+}
+
+//
+// Vol3C[26.2.1.3(VM-Entry Control Fields)] - event injection.
+//
+bool entry_interruption_valid(vmcs12_t& vmcs12,
+                              msr::vmx_procbased_ctls2_t procbased_ctls2,
+                              msr::vmx_misc_t vmx_misc) noexcept
+{
+  auto info = vmx::interrupt_info_t{};
+  info.flags = static_cast<uint32_t>(vmcs12[field::ctrl_vmentry_interruption_info]);
+
+  if (!info.valid)
+  {
+    return true;
+  }
+
+  //
+  // Bits 30:12 are reserved.
+  //
+  if (info.flags & 0x7ffff000)
+  {
+    return false;
+  }
+
+  auto type = static_cast<vmx::interrupt_type>(info.type);
+  auto vector = static_cast<exception_vector>(info.vector);
+
+  switch (type)
+  {
+    case vmx::interrupt_type::reserved:
+      return false;
+
+    case vmx::interrupt_type::nmi:
+      if (vector != exception_vector::nmi_interrupt) return false;
+      break;
+
+    case vmx::interrupt_type::hardware_exception:
+      if (info.vector > 31) return false;
+      break;
+
+    case vmx::interrupt_type::other_event:
+      //
+      // Pending MTF VM-exit - requires the "monitor trap flag" control
+      // (bit 27) to be supported.
+      //
+      if (info.vector != 0 ||
+          !(msr::read<msr::vmx_true_ctls_t>(msr::vmx_procbased_ctls_t::msr_id).allowed_1_settings & (1u << 27)))
+      {
+        return false;
+      }
+      break;
+
+    default:
+      break;
+  }
+
+  //
+  // Error code is delivered iff the exception pushes it (and the guest
+  // is in protected mode).
+  //
+  auto protected_mode = !procbased_ctls2.unrestricted_guest ||
+                        (vmcs12[field::guest_cr0] & 1);
+
+  auto error_code_expected = protected_mode &&
+    type == vmx::interrupt_type::hardware_exception &&
+    (vector == exception_vector::double_fault ||
+     vector == exception_vector::invalid_tss ||
+     vector == exception_vector::segment_not_present ||
+     vector == exception_vector::stack_segment_fault ||
+     vector == exception_vector::general_protection ||
+     vector == exception_vector::page_fault ||
+     vector == exception_vector::alignment_check);
+
+  if (!!info.error_code_valid != error_code_expected ||
+      (info.error_code_valid && (vmcs12[field::ctrl_vmentry_exception_error_code] & ~0xffffull)))
+  {
+    return false;
+  }
+
+  if (type == vmx::interrupt_type::software ||
+      type == vmx::interrupt_type::privileged_exception ||
+      type == vmx::interrupt_type::software_exception)
+  {
+    auto length = vmcs12[field::ctrl_vmentry_instruction_length];
+
+    if (length > 15 || (length == 0 && !vmx_misc.zero_length_instruction_vmentry_injection))
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+}
+
+//
+// vmcs12_t
+//
+
+bool vmcs12_t::valid(uint32_t encoding) noexcept
+{
+  //
+  // Bits 31:15 and bit 12 are reserved. "High" access is valid only for
+  // 64-bit fields.
+  //
+  if (encoding & ~0x6fffu)
+  {
+    return false;
+  }
+
+  auto width = (encoding >> 13) & 3;
+  auto type  = (encoding >> 10) & 3;
+  auto index = (encoding >>  1) & 0x1ff;
+
+  if ((encoding & 1) && width != static_cast<uint32_t>(vmx::detail::vmcs_width_t::_64_bit))
+  {
+    return false;
+  }
+
+  return index < index_count && (valid_fields[width][type] & (1u << index));
+}
+
+//
+// nested_vmx_t
+//
+
+void nested_vmx_t::initialize(vcpu_t& vp) noexcept
+{
+  static_assert(std::size(host_fields) == host_state_count);
+
+  vp_ = &vp;
+
+  memset(&vmcs02_, 0, sizeof(vmcs02_));
+  memset(&shadow_vmcs_, 0, sizeof(shadow_vmcs_));
+
+  vmxon_pa_         = invalid_pa;
+  current_pa_       = invalid_pa;
+  vmcs02_owner_pa_  = invalid_pa;
+  vmcs12_vpid_      = 0;
+  round_trip_begin_ = 0;
+
+  host_pat_         = 0;
+  host_efer_        = 0;
+  max_msr_count_    = 0;
+
+  //
+  // CPUID.80000008H:EAX[7:0] - physical-address width.
+  //
+  int cpu_info[4];
+  ia32_asm_cpuid(cpu_info, 0x80000008);
+  physical_address_width_ = static_cast<uint8_t>(cpu_info[0] & 0xff);
+
+  setup_done_       = false;
+  vmxon_            = false;
+  in_l2_            = false;
+  l1_ept_           = false;
+  vmcs02_launched_  = false;
+  launch_requested_ = false;
+  l1_pat_efer_switching_ = false;
+  dirty_            = true;
+  stale_            = false;
+
+  //
+  // Use VMCS shadowing by default (if supported).
+  //
+  shadowing_supported_ = false;
+  shadowing_enabled_   = true;
+  shadow_exit_info_    = false;
+
+  reset_stats();
+}
+
+void nested_vmx_t::shadowing(bool enable) noexcept
+{
+  if (!setup_done_)
+  {
+    //
+    // Capabilities of the CPU are not known yet - setup() will take care
+    // of it.
+    //
+    shadowing_enabled_ = enable;
+    return;
+  }
+
+  enable = enable && shadowing_supported_;
+
+  if (enable == shadowing_enabled_)
+  {
+    return;
+  }
+
+  if (current_pa_ != invalid_pa)
+  {
+    if (shadowing_enabled_)
+    {
+      shadow_to_vmcs12();
+      load_vmcs01();
+      disable_shadow_vmcs();
+    }
+    else
+    {
+      vmcs12_to_shadow();
+      load_vmcs01();
+      enable_shadow_vmcs();
+    }
+  }
+
+  shadowing_enabled_ = enable;
+}
+
+void nested_vmx_t::reset_stats() noexcept
+{
+  memset(&stats_, 0, sizeof(stats_));
+  round_trip_begin_ = 0;
+}
+
+bool nested_vmx_t::take_launch_request() noexcept
+{
+  bool result = launch_requested_;
+  launch_requested_ = false;
+  return result;
+}
+
+bool nested_vmx_t::reflect(vcpu_t& vp) noexcept
+{
+  auto exit_reason = vp.exit_reason();
+
+  //
+  // If L1 doesn't use EPT, L2 runs on the EPT of hvpp and EPT violations
+  // belong to hvpp.
+  //
+  if (!l1_ept_ &&
+      (exit_reason == vmx::exit_reason::ept_violation ||
+       exit_reason == vmx::exit_reason::ept_misconfiguration))
+  {
+    return false;
+  }
+
+  auto tsc_begin = ia32_asm_read_tsc();
+  auto& vmcs12 = *this->vmcs12();
+
+  //
+  // Save the exit information and the hot guest state of L2. RIP, RSP and
+  // RFLAGS have already been read by vcpu_t::entry_host(). Cold guest
+  // fields stay in VMCS02 until L1 asks for them.
+  //
+  vmread_all(vmcs12, exit_info_fields);
+  vmread_all(vmcs12, hot_guest_fields);
+
+  vmcs12[field::guest_rip]    = vp.exit_context().rip;
+  vmcs12[field::guest_rsp]    = vp.exit_context().rsp;
+  vmcs12[field::guest_rflags] = vp.exit_context().rflags.flags;
+
+  //
+  // The valid bit of the VM-entry interruption-information field is
+  // cleared on every VM-exit (Vol3C[27.2.3(Information About NMI Unblocking
+  // Due to Delivery Through Interrupt Gate)]).
+  //
+  vmcs12[field::ctrl_vmentry_interruption_info] &= ~(1ull << 31);
+
+  stale_ = true;
+
+  if (shadowing_enabled_)
+  {
+    load(shadow_vmcs_);
+    vmwrite_all(vmcs12, hot_guest_fields);
+    vmx::vmwrite(field::ctrl_vmentry_interruption_info, vmcs12[field::ctrl_vmentry_interruption_info]);
+
+    if (shadow_exit_info_)
+    {
+      vmwrite_all(vmcs12, exit_info_fields);
+    }
+  }
+
+  load_vmcs01();
+  load_l1_host_state(vp);
+
+  in_l2_ = false;
+
+  auto tsc_end = ia32_asm_read_tsc();
+  stats_.value[stats_t::id_l2_exits]       += 1;
+  stats_.value[stats_t::id_reflect_cycles] += tsc_end - tsc_begin;
+  round_trip_begin_ = tsc_begin;
+
+  return true;
+}
+
+void nested_vmx_t::handle_vmxon(vcpu_t& vp) noexcept
+{
+  if (vp.guest_segment_access(context_t::seg_cs).descriptor_privilege_level != 0)
+  {
+    vp.inject(interrupt_info_t(vmx::interrupt_type::hardware_exception,
+                               exception_vector::general_protection,
+                               exception_error_code_t{ 0 }));
+    return;
+  }
+
+  if (vmxon_)
+  {
+    if (current_pa_ != invalid_pa)
+    {
+      vm_fail_valid(vp, vmx::instruction_error::vmxon_in_vmx_root_op);
+    }
+    else
+    {
+      vm_fail_invalid(vp);
+    }
+
+    return;
+  }
+
+  uint64_t pa;
+  if (!read_vmcs_pointer(vp, pa))
+  {
+    return;
+  }
+
+  //
+  // The VMXON region is read only after its address has been validated -
+  // the address comes from L1.
+  //
+  auto vmxon_region = map_page(pa);
+  auto vmx_basic = msr::read<msr::vmx_basic_t>();
+
+  if (!vmxon_region ||
+      *reinterpret_cast<uint32_t*>(vmxon_region) != vmx_basic.vmcs_revision_id)
+  {
+    vm_fail_invalid(vp);
+    return;
+  }
+
+  if (!setup_done_)
+  {
+    setup();
+  }
+
+  vmxon_      = true;
+  vmxon_pa_   = pa;
+  current_pa_ = invalid_pa;
+
+  vm_succeed(vp);
+}
+
+void nested_vmx_t::handle_vmxoff(vcpu_t& vp) noexcept
+{
+  if (!check_vmx_operation(vp))
+  {
+    return;
+  }
+
+  release_current();
+
+  vmxon_      = false;
+  vmxon_pa_   = invalid_pa;
+
+  vm_succeed(vp);
+}
+
+void nested_vmx_t::handle_vmclear(vcpu_t& vp) noexcept
+{
+  uint64_t pa;
+  if (!check_vmx_operation(vp) || !read_vmcs_pointer(vp, pa))
+  {
+    return;
+  }
+
+  auto vmcs = reinterpret_cast<vmcs12_t*>(map_page(pa));
+
+  if (!vmcs)
+  {
+    vm_fail_valid(vp, vmx::instruction_error::vmclear_invalid_physical_address);
+    return;
+  }
+
+  if (pa == vmxon_pa_)
+  {
+    vm_fail_valid(vp, vmx::instruction_error::vmclear_invalid_vmxon_pointer);
+    return;
+  }
+
+  if (pa == current_pa_)
+  {
+    release_current();
+  }
+
+  if (pa == vmcs02_owner_pa_)
+  {
+    //
+    // VMCS02 holds the state of this VMCS12 - it has to be fully reloaded on
+    // the next VM-entry.
+    //
+    vmcs02_owner_pa_ = invalid_pa;
+  }
+
+  vmcs->launch_state = vmcs12_t::launch_state_clear;
+
+  vm_succeed(vp);
+}
+
+void nested_vmx_t::handle_vmptrld(vcpu_t& vp) noexcept
+{
+  uint64_t pa;
+  if (!check_vmx_operation(vp) || !read_vmcs_pointer(vp, pa))
+  {
+    return;
+  }
+
+  auto vmcs = reinterpret_cast<vmcs12_t*>(map_page(pa));
+
+  if (!vmcs)
+  {
+    vm_fail_valid(vp, vmx::instruction_error::vmptrld_invalid_physical_address);
+    return;
+  }
+
+  if (pa == vmxon_pa_)
+  {
+    vm_fail_valid(vp, vmx::instruction_error::vmptrld_vmxon_pointer);
+    return;
+  }
+
+  //
+  // Shadow VMCS of L1 (bit 31 of the revision identifier) isn't supported
+  // - it's reported by IA32_VMX_PROCBASED_CTLS2 (see vmexit_handler).
+  //
+  auto vmx_basic = msr::read<msr::vmx_basic_t>();
+  if (vmcs->revision_id != vmx_basic.vmcs_revision_id)
+  {
+    vm_fail_valid(vp, vmx::instruction_error::vmptrld_incorrect_vmcs_revision_id);
+    return;
+  }
+
+  if (pa != current_pa_)
+  {
+    release_current();
+
+    current_pa_ = pa;
+
+    if (shadowing_enabled_)
+    {
+      vmcs12_to_shadow();
+      load_vmcs01();
+      enable_shadow_vmcs();
+    }
+  }
+
+  vm_succeed(vp);
+}
+
+void nested_vmx_t::handle_vmptrst(vcpu_t& vp) noexcept
+{
+  if (!check_vmx_operation(vp))
+  {
+    return;
+  }
+
+  if (!write_operand(vp, &current_pa_, sizeof(current_pa_)))
+  {
+    return;
+  }
+
+  vm_succeed(vp);
+}
+
+void nested_vmx_t::handle_vmread(vcpu_t& vp) noexcept
+{
+  if (!check_vmx_operation(vp))
+  {
+    return;
+  }
+
+  stats_.value[stats_t::id_vmread_exits] += 1;
+
+  if (current_pa_ == invalid_pa)
+  {
+    vm_fail_invalid(vp);
+    return;
+  }
+
+  auto instruction_info = vp.exit_instruction_info().vmread_vmwrite;
+  auto encoding = static_cast<uint32_t>(vp.exit_context().gp_register[instruction_info.register_2]);
+
+  if (!vmcs12_t::valid(encoding))
+  {
+    vm_fail_valid(vp, vmx::instruction_error::vmread_vmwrite_invalid_component);
+    return;
+  }
+
+  auto type  = static_cast<vmx::detail::vmcs_type_t>((encoding >> 10) & 3);
+  auto width = static_cast<vmx::detail::vmcs_width_t>((encoding >> 13) & 3);
+
+  if (stale_ && type == vmx::detail::vmcs_type_t::guest)
+  {
+    sync_stale_vmcs02();
+  }
+
+  uint64_t value = (*vmcs12())[static_cast<field>(encoding)];
+
+  if (encoding & 1)
+  {
+    value >>= 32;
+  }
+  else if (width == vmx::detail::vmcs_width_t::_16_bit)
+  {
+    value &= 0xffff;
+  }
+  else if (width == vmx::detail::vmcs_width_t::_32_bit)
+  {
+    value &= 0xffffffff;
+  }
+
+  if (instruction_info.access_type == vmx::instruction_info_t::access_register)
+  {
+    vp.exit_context().gp_register[instruction_info.register_1] = value;
+  }
+  else if (!write_operand(vp, &value, sizeof(value)))
+  {
+    return;
+  }
+
+  vm_succeed(vp);
+}
+
+void nested_vmx_t::handle_vmwrite(vcpu_t& vp) noexcept
+{
+  if (!check_vmx_operation(vp))
+  {
+    return;
+  }
+
+  stats_.value[stats_t::id_vmwrite_exits] += 1;
+
+  if (current_pa_ == invalid_pa)
+  {
+    vm_fail_invalid(vp);
+    return;
+  }
+
+  auto instruction_info = vp.exit_instruction_info().vmread_vmwrite;
+  auto encoding = static_cast<uint32_t>(vp.exit_context().gp_register[instruction_info.register_2]);
+
+  if (!vmcs12_t::valid(encoding))
+  {
+    vm_fail_valid(vp, vmx::instruction_error::vmread_vmwrite_invalid_component);
+    return;
+  }
+
+  auto type = static_cast<vmx::detail::vmcs_type_t>((encoding >> 10) & 3);
+
+  if (type == vmx::detail::vmcs_type_t::vmexit && !shadow_exit_info_)
+  {
+    vm_fail_valid(vp, vmx::instruction_error::vmwrite_readonly_component);
+    return;
+  }
+
+  uint64_t value;
+
+  if (instruction_info.access_type == vmx::instruction_info_t::access_register)
+  {
+    value = vp.exit_context().gp_register[instruction_info.register_1];
+  }
+  else if (!read_operand(vp, &value, sizeof(value)))
+  {
+    return;
+  }
+
+  if (stale_ && type == vmx::detail::vmcs_type_t::guest)
+  {
+    sync_stale_vmcs02();
+  }
+
+  uint64_t& slot = (*vmcs12())[static_cast<field>(encoding)];
+
+  if (encoding & 1)
+  {
+    slot = (slot & 0xffffffff) | (value << 32);
+  }
+  else
+  {
+    slot = value;
+  }
+
+  //
+  // Hot fields are copied into VMCS02 on each VM-entry anyway. Host fields
+  // aren't copied into VMCS02 at all.
+  //
+  if ((type == vmx::detail::vmcs_type_t::control || type == vmx::detail::vmcs_type_t::guest) &&
+      !hot(encoding))
+  {
+    dirty_ = true;
+  }
+
+  vm_succeed(vp);
+}
+
+void nested_vmx_t::handle_vmlaunch(vcpu_t& vp) noexcept
+{
+  enter_l2(vp, true);
+}
+
+void nested_vmx_t::handle_vmresume(vcpu_t& vp) noexcept
+{
+  enter_l2(vp, false);
+}
+
+void nested_vmx_t::handle_invept(vcpu_t& vp) noexcept
+{
+  if (!check_vmx_operation(vp))
+  {
+    return;
+  }
+
+  auto instruction_info = vp.exit_instruction_info().invalidate;
+  auto type = vp.exit_context().gp_register[instruction_info.register_2];
+
+  if (type != static_cast<uint64_t>(vmx::invept_t::single_context) &&
+      type != static_cast<uint64_t>(vmx::invept_t::all_context))
+  {
+    vm_fail_valid(vp, vmx::instruction_error::invept_invvpid_invalid_operand);
+    return;
+  }
+
+  vmx::invept_desc_t descriptor;
+
+  if (!read_operand(vp, &descriptor, sizeof(descriptor)))
+  {
+    return;
+  }
+
+  //
+  // EPT pointer of L1 is used by VMCS02 as-is, therefore we can just execute
+  // the INVEPT on behalf of L1. Note that all-context invalidation also
+  // flushes mappings of hvpp's EPT - it's harmless.
+  //
+  vmx::invept(static_cast<vmx::invept_t>(type), &descriptor);
+
+  vm_succeed(vp);
+}
+
+void nested_vmx_t::handle_invvpid(vcpu_t& vp) noexcept
+{
+  if (!check_vmx_operation(vp))
+  {
+    return;
+  }
+
+  auto instruction_info = vp.exit_instruction_info().invalidate;
+  auto type = vp.exit_context().gp_register[instruction_info.register_2];
+
+  if (type > static_cast<uint64_t>(vmx::invvpid_t::single_context_retaining_globals))
+  {
+    vm_fail_valid(vp, vmx::instruction_error::invept_invvpid_invalid_operand);
+    return;
+  }
+
+  vmx::invvpid_desc_t descriptor;
+
+  if (!read_operand(vp, &descriptor, sizeof(descriptor)))
+  {
+    return;
+  }
+
+  if (descriptor.vpid == 0 && type != static_cast<uint64_t>(vmx::invvpid_t::all_context))
+  {
+    vm_fail_valid(vp, vmx::instruction_error::invept_invvpid_invalid_operand);
+    return;
+  }
+
+  //
+  // All VPIDs of L1 are mapped to the single VPID of L2. Therefore
+  // all-context invalidation becomes single-context invalidation.
+  //
+  descriptor.vpid = l2_vpid;
+
+  vmx::invvpid(type == static_cast<uint64_t>(vmx::invvpid_t::all_context)
+                 ? vmx::invvpid_t::single_context
+                 : static_cast<vmx::invvpid_t>(type),
+               &descriptor);
+
+  vm_succeed(vp);
+}
+
+//
+// Private
+//
+
+void nested_vmx_t::setup() noexcept
+{
+  mark_valid(hot_guest_fields);
+  mark_valid(hot_control_fields);
+  mark_valid(hot_host_fields);
+  mark_valid(exit_info_fields);
+  mark_valid(cold_guest_fields);
+  mark_valid(cold_control_fields);
+  mark_valid(other_fields);
+  mark_valid(host_fields);
+
+  auto vmx_basic = msr::read<msr::vmx_basic_t>();
+  auto vmx_misc  = msr::read<msr::vmx_misc_t>();
+  auto procbased_ctls2 = msr::read<msr::vmx_true_ctls_t>(msr::vmx_procbased_ctls2_t::msr_id);
+
+  shadowing_supported_ = !!(procbased_ctls2.allowed_1_settings & (1u << 14));
+  shadow_exit_info_    = !!vmx_misc.vmwrite_vmexit_info;
+
+  //
+  // setup() is called by the first VMXON - PAT and EFER are still those
+  // of the host.
+  //
+  host_pat_      = msr::read(msr_pat_id);
+  host_efer_     = msr::read(msr_efer_id);
+  max_msr_count_ = 512 * (static_cast<uint32_t>(vmx_misc.max_number_of_msr) + 1);
+
+  //
+  // Set bit means VM-exit - start with all fields and clear the shadowed
+  // ones.
+  //
+  memset(vmread_bitmap_, 0xff, sizeof(vmread_bitmap_));
+  memset(vmwrite_bitmap_, 0xff, sizeof(vmwrite_bitmap_));
+
+  clear_bits(vmread_bitmap_, hot_guest_fields);
+  clear_bits(vmread_bitmap_, hot_control_fields);
+  clear_bits(vmread_bitmap_, hot_host_fields);
+  clear_bits(vmwrite_bitmap_, hot_guest_fields);
+  clear_bits(vmwrite_bitmap_, hot_control_fields);
+  clear_bits(vmwrite_bitmap_, hot_host_fields);
+
+  if (shadow_exit_info_)
+  {
+    clear_bits(vmread_bitmap_, exit_info_fields);
+  }
+
+  //
+  // Shadow VMCS is indicated by bit 31 of the revision identifier
+  // (Vol3C[24.2(Format of the VMCS Region)]).
+  //
+  shadow_vmcs_.revision_id = vmx_basic.vmcs_revision_id | (1u << 31);
+  vmx::vmclear(pa_t::from_va(&shadow_vmcs_));
+
+  shadowing_enabled_ = shadowing_enabled_ && shadowing_supported_;
+  setup_done_ = true;
+}
+
+bool nested_vmx_t::hot(uint32_t encoding) const noexcept
+{
+  return !(vmwrite_bitmap_[(encoding & 0x7fff) >> 3] & (1 << (encoding & 7)));
+}
+
+bool nested_vmx_t::check_vmx_operation(vcpu_t& vp) noexcept
+{
+  if (!vmxon_)
+  {
+    vp.inject(interrupt_info_t(vmx::interrupt_type::hardware_exception,
+                               exception_vector::invalid_opcode));
+    return false;
+  }
+
+  if (vp.guest_segment_access(context_t::seg_cs).descriptor_privilege_level != 0)
+  {
+    vp.inject(interrupt_info_t(vmx::interrupt_type::hardware_exception,
+                               exception_vector::general_protection,
+                               exception_error_code_t{ 0 }));
+    return false;
+  }
+
+  if (round_trip_begin_)
+  {
+    stats_.value[stats_t::id_round_trip_vmx_exits] += 1;
+  }
+
+  return true;
+}
+
+bool nested_vmx_t::read_vmcs_pointer(vcpu_t& vp, uint64_t& pa) noexcept
+{
+  return read_operand(vp, &pa, sizeof(pa));
+}
+
+bool nested_vmx_t::read_operand(vcpu_t& vp, void* value, size_t size) noexcept
+{
+  cr3_guard _(vp.guest_cr3());
+
+  auto operand = vp.exit_instruction_info_guest_va();
+
+  if (!guest_buffer_present(operand, size))
+  {
+    inject_operand_page_fault(vp, false);
+    return false;
+  }
+
+  memcpy(value, operand, size);
+  return true;
+}
+
+bool nested_vmx_t::write_operand(vcpu_t& vp, const void* value, size_t size) noexcept
+{
+  cr3_guard _(vp.guest_cr3());
+
+  auto operand = vp.exit_instruction_info_guest_va();
+
+  if (!guest_buffer_writable(operand, size))
+  {
+    inject_operand_page_fault(vp, true);
+    return false;
+  }
+
+  memcpy(operand, value, size);
+  return true;
+}
+
+void nested_vmx_t::inject_operand_page_fault(vcpu_t& vp, bool write_access) noexcept
+{
+  //
+  // The operand (or a part of it) is not present - let L1 page it in and
+  // execute the instruction again. CR2 isn't switched by VM-entry, so it's
+  // written here. Note that CR2 holds the start of the operand even if only
+  // its second page is missing.
+  //
+  exception_error_code_t error_code{ 0 };
+  error_code.pagefault.write = write_access;
+
+  write<cr2_t>(cr2_t{ reinterpret_cast<uint64_t>(vp.exit_instruction_info_guest_va()) });
+
+  vp.inject(interrupt_info_t(vmx::interrupt_type::hardware_exception,
+                             exception_vector::page_fault,
+                             error_code));
+}
+
+void nested_vmx_t::vm_succeed(vcpu_t& vp) noexcept
+{
+  auto& rflags = vp.exit_context().rflags;
+  rflags.carry_flag = false;
+  rflags.parity_flag = false;
+  rflags.auxiliary_carry_flag = false;
+  rflags.zero_flag = false;
+  rflags.sign_flag = false;
+  rflags.overflow_flag = false;
+}
+
+void nested_vmx_t::vm_fail_invalid(vcpu_t& vp) noexcept
+{
+  vm_succeed(vp);
+  vp.exit_context().rflags.carry_flag = true;
+}
+
+void nested_vmx_t::vm_fail_valid(vcpu_t& vp, vmx::instruction_error error) noexcept
+{
+  if (current_pa_ == invalid_pa)
+  {
+    vm_fail_invalid(vp);
+    return;
+  }
+
+  vm_succeed(vp);
+  vp.exit_context().rflags.zero_flag = true;
+
+  (*vmcs12())[field::vmexit_instruction_error] = static_cast<uint64_t>(error);
+
+  if (shadowing_enabled_ && shadow_exit_info_)
+  {
+    load(shadow_vmcs_);
+    vmx::vmwrite(field::vmexit_instruction_error, static_cast<uint64_t>(error));
+    load_vmcs01();
+  }
+}
+
+vmcs12_t* nested_vmx_t::vmcs12() const noexcept
+{
+  //
+  // current_pa_ is set only by VMPTRLD - after map_page() has validated it.
+  //
+  return reinterpret_cast<vmcs12_t*>(pa_t{ current_pa_ }.va());
+}
+
+bool nested_vmx_t::pa_valid(uint64_t pa, uint64_t alignment, uint64_t size) const noexcept
+{
+  return !(pa & (alignment - 1)) &&
+         !((pa + size - 1) >> physical_address_width_) &&
+         pa + size - 1 >= pa;
+}
+
+uint8_t* nested_vmx_t::map_page(uint64_t pa) const noexcept
+{
+  if (!pa_valid(pa, page_size))
+  {
+    return nullptr;
+  }
+
+  bool ram = false;
+
+  for (auto& range : memory_manager::physical_memory_descriptor())
+  {
+    if (range.contains(pa_t{ pa }))
+    {
+      ram = true;
+      break;
+    }
+  }
+
+  if (!ram)
+  {
+    return nullptr;
+  }
+
+  //
+  // Same check as in the memory scanner - the page must be mapped by the
+  // host and the mapping must translate back to the same page.
+  //
+  auto va = pa_t{ pa }.va();
+
+  return va && pa_t::from_va(va) == pa_t{ pa }
+    ? static_cast<uint8_t*>(va)
+    : nullptr;
+}
+
+void nested_vmx_t::load(vmx::vmcs_t& vmcs) noexcept
+{
+  vmx::vmptrld(pa_t::from_va(&vmcs));
+}
+
+void nested_vmx_t::load_vmcs01() noexcept
+{
+  load(vp_->vmcs_);
+}
+
+void nested_vmx_t::shadow_to_vmcs12() noexcept
+{
+  //
+  // Leaves the shadow VMCS loaded.
+  //
+  auto& vmcs12 = *this->vmcs12();
+
+  load(shadow_vmcs_);
+  vmread_all(vmcs12, hot_guest_fields);
+  vmread_all(vmcs12, hot_control_fields);
+  vmread_all(vmcs12, hot_host_fields);
+}
+
+void nested_vmx_t::vmcs12_to_shadow() noexcept
+{
+  //
+  // Leaves the shadow VMCS loaded.
+  //
+  auto& vmcs12 = *this->vmcs12();
+
+  load(shadow_vmcs_);
+  vmwrite_all(vmcs12, hot_guest_fields);
+  vmwrite_all(vmcs12, hot_control_fields);
+  vmwrite_all(vmcs12, hot_host_fields);
+
+  if (shadow_exit_info_)
+  {
+    vmwrite_all(vmcs12, exit_info_fields);
+    vmx::vmwrite(field::vmexit_instruction_error, vmcs12[field::vmexit_instruction_error]);
+  }
+}
+
+void nested_vmx_t::sync_stale_vmcs02() noexcept
+{
+  //
+  // Copy the cold guest state of L2 from the VMCS02. Called lazily - only
+  // when L1 accesses a guest field which isn't synchronized on VM-exit.
+  //
+  load(vmcs02_);
+  vmread_all(*vmcs12(), cold_guest_fields);
+  load_vmcs01();
+
+  stale_ = false;
+}
+
+void nested_vmx_t::release_current() noexcept
+{
+  if (current_pa_ == invalid_pa)
+  {
+    return;
+  }
+
+  if (shadowing_enabled_)
+  {
+    shadow_to_vmcs12();
+    load_vmcs01();
+    disable_shadow_vmcs();
+  }
+
+  if (stale_)
+  {
+    sync_stale_vmcs02();
+  }
+
+  current_pa_ = invalid_pa;
+}
+
+void nested_vmx_t::enable_shadow_vmcs() noexcept
+{
+  //
+  // Expects VMCS01 to be loaded.
+  //
+  auto procbased_ctls2 = vp_->processor_based_controls2();
+  procbased_ctls2.vmcs_shadowing = true;
+  vp_->processor_based_controls2(procbased_ctls2);
+
+  vp_->vmcs_link_pointer(pa_t::from_va(&shadow_vmcs_));
+  vmx::vmwrite(field::ctrl_vmread_bitmap_address, pa_t::from_va(vmread_bitmap_));
+  vmx::vmwrite(field::ctrl_vmwrite_bitmap_address, pa_t::from_va(vmwrite_bitmap_));
+}
+
+void nested_vmx_t::disable_shadow_vmcs() noexcept
+{
+  //
+  // Expects VMCS01 to be loaded.
+  //
+  auto procbased_ctls2 = vp_->processor_based_controls2();
+  procbased_ctls2.vmcs_shadowing = false;
+  vp_->processor_based_controls2(procbased_ctls2);
+
+  vp_->vmcs_link_pointer(~0ull);
+}
+
+bool nested_vmx_t::check_controls() noexcept
+{
+  //
+  // Checks on VMX controls (Vol3C[26.2.1(Checks on VMX Controls)]). The
+  // controls of VMCS12 end up in VMCS02 - if the CPU failed VMLAUNCH or
+  // VMRESUME of VMCS02 because of them, it would fail the VM-entry of
+  // hvpp itself. Checks of the guest state are left to the CPU (they're
+  // reported by VM-exit, see reflect()).
+  //
+  auto& vmcs12 = vmcs12_cache_;
+
+  auto pinbased_ctls = msr::vmx_pinbased_ctls_t{ vmcs12[field::ctrl_pin_based_vm_execution_controls] };
+  auto procbased_ctls = msr::vmx_procbased_ctls_t{ vmcs12[field::ctrl_processor_based_vm_execution_controls] };
+  auto procbased_ctls2 = msr::vmx_procbased_ctls2_t{ procbased_ctls.activate_secondary_controls
+    ? vmcs12[field::ctrl_secondary_processor_based_vm_execution_controls]
+    : 0 };
+  auto exit_ctls = msr::vmx_exit_ctls_t{ vmcs12[field::ctrl_vmexit_controls] };
+  auto entry_ctls = msr::vmx_entry_ctls_t{ vmcs12[field::ctrl_vmentry_controls] };
+
+  auto vmx_basic = msr::read<msr::vmx_basic_t>();
+  auto vmx_misc = msr::read<msr::vmx_misc_t>();
+
+  //
+  // TRUE capability MSRs (msr_id + 0xC) exist only if IA32_VMX_BASIC[55]
+  // is set.
+  //
+  auto true_offset = vmx_basic.true_controls ? 0xC : 0;
+
+  if (!controls_valid(pinbased_ctls.flags, msr::vmx_pinbased_ctls_t::msr_id + true_offset) ||
+      !controls_valid(procbased_ctls.flags, msr::vmx_procbased_ctls_t::msr_id + true_offset) ||
+      !controls_valid(exit_ctls.flags, msr::vmx_exit_ctls_t::msr_id + true_offset) ||
+      !controls_valid(entry_ctls.flags, msr::vmx_entry_ctls_t::msr_id + true_offset))
+  {
+    return false;
+  }
+
+  if (procbased_ctls.activate_secondary_controls &&
+      (!controls_valid(procbased_ctls2.flags, msr::vmx_procbased_ctls2_t::msr_id) ||
+       procbased_ctls2.vmcs_shadowing))
+  {
+    return false;
+  }
+
+  //
+  // Vol3C[26.2.1.1(VM-Execution Control Fields)].
+  //
+  if (vmcs12[field::ctrl_cr3_target_count] > vmx_misc.cr3_target_count)
+  {
+    return false;
+  }
+
+  if (procbased_ctls.use_io_bitmaps &&
+      (!pa_valid(vmcs12[field::ctrl_io_bitmap_a_address], page_size) ||
+       !pa_valid(vmcs12[field::ctrl_io_bitmap_b_address], page_size)))
+  {
+    return false;
+  }
+
+  if (procbased_ctls.use_msr_bitmaps &&
+      !pa_valid(vmcs12[field::ctrl_msr_bitmap_address], page_size))
+  {
+    return false;
+  }
+
+  if (procbased_ctls.use_tpr_shadow)
+  {
+    auto tpr_threshold = vmcs12[field::ctrl_tpr_threshold];
+
+    if (!pa_valid(vmcs12[field::ctrl_virtual_apic_address], page_size) ||
+        (!procbased_ctls2.virtual_interrupt_delivery && (tpr_threshold & ~0xfull)))
+    {
+      return false;
+    }
+
+    if (!procbased_ctls2.virtual_interrupt_delivery &&
+        !procbased_ctls2.virtualize_apic_accesses)
+    {
+      //
+      // Bits 3:0 of the TPR threshold must not be greater than bits 7:4 of
+      // VTPR (offset 0x80 of the virtual-APIC page).
+      //
+      auto virtual_apic_page = map_page(vmcs12[field::ctrl_virtual_apic_address]);
+
+      if (!virtual_apic_page || tpr_threshold > (virtual_apic_page[0x80] >> 4))
+      {
+        return false;
+      }
+    }
+  }
+  else if (procbased_ctls2.virtualize_x2apic_mode ||
+           procbased_ctls2.apic_register_virtualization ||
+           procbased_ctls2.virtual_interrupt_delivery)
+  {
+    return false;
+  }
+
+  if ((!pinbased_ctls.nmi_exiting && pinbased_ctls.virtual_nmis) ||
+      (!pinbased_ctls.virtual_nmis && procbased_ctls.nmi_window_exiting))
+  {
+    return false;
+  }
+
+  if ((procbased_ctls2.virtualize_apic_accesses &&
+       !pa_valid(vmcs12[field::ctrl_apic_access_address], page_size)) ||
+      (procbased_ctls2.virtualize_x2apic_mode && procbased_ctls2.virtualize_apic_accesses) ||
+      (procbased_ctls2.virtual_interrupt_delivery && !pinbased_ctls.external_interrupt_exiting))
+  {
+    return false;
+  }
+
+  if (pinbased_ctls.process_posted_interrupts &&
+      (!procbased_ctls2.virtual_interrupt_delivery ||
+       !exit_ctls.acknowledge_interrupt_on_exit ||
+       (vmcs12[field::ctrl_posted_interrupt_notification_vector] & ~0xffull) ||
+       !pa_valid(vmcs12[field::ctrl_posted_interrupt_descriptor_address], 64)))
+  {
+    return false;
+  }
+
+  if (procbased_ctls2.enable_vpid && vmcs12[field::ctrl_virtual_processor_identifier] == 0)
+  {
+    return false;
+  }
+
+  if (procbased_ctls2.enable_ept)
+  {
+    //
+    // EPT pointer of L1 is used by VMCS02 as-is.
+    //
+    auto ept_pointer = ept_ptr_t{ vmcs12[field::ctrl_ept_pointer] };
+    auto ept_vpid_cap = msr::read<msr::vmx_ept_vpid_cap_t>();
+
+    if (!((ept_pointer.memory_type == 0 && ept_vpid_cap.memory_type_uncacheable) ||
+          (ept_pointer.memory_type == 6 && ept_vpid_cap.memory_type_write_back)) ||
+        ept_pointer.page_walk_length != ept_ptr_t::page_walk_length_4 ||
+        (ept_pointer.enable_access_and_dirty_flags && !ept_vpid_cap.ept_accessed_and_dirty_flags) ||
+        ept_pointer.reserved_1 ||
+        !pa_valid(ept_pointer.flags & ~uint64_t(page_size - 1), page_size))
+    {
+      return false;
+    }
+  }
+  else if (procbased_ctls2.enable_pml ||
+           procbased_ctls2.unrestricted_guest ||
+           procbased_ctls2.mode_based_execute_control_for_ept)
+  {
+    return false;
+  }
+
+  if (procbased_ctls2.enable_pml &&
+      !pa_valid(vmcs12[field::ctrl_pml_address], page_size))
+  {
+    return false;
+  }
+
+  if (procbased_ctls2.ept_violation_ve &&
+      !pa_valid(vmcs12[field::ctrl_virtualization_exception_info_address], page_size))
+  {
+    return false;
+  }
+
+  if (procbased_ctls2.enable_vm_functions)
+  {
+    //
+    // EPTP switching (the only VM function) needs a valid EPTP list.
+    //
+    auto vmfunc_ctls = vmcs12[field::ctrl_vmfunc_controls];
+
+    if ((vmfunc_ctls & ~1ull) ||
+        ((vmfunc_ctls & 1) &&
+         (!procbased_ctls2.enable_ept ||
+          !pa_valid(vmcs12[field::ctrl_ept_pointer_list_address], page_size))))
+    {
+      return false;
+    }
+  }
+
+  //
+  // Vol3C[26.2.1.2(VM-Exit Control Fields)].
+  //
+  if (!pinbased_ctls.activate_vmx_preemption_timer && exit_ctls.save_vmx_preemption_timer_value)
+  {
+    return false;
+  }
+
+  auto msr_store_count = vmcs12[field::ctrl_vmexit_msr_store_count];
+  auto msr_load_count = vmcs12[field::ctrl_vmexit_msr_load_count];
+
+  if ((msr_store_count &&
+       !pa_valid(vmcs12[field::ctrl_vmexit_msr_store_address], 16, msr_store_count * sizeof(vmx::msr_entry_t))) ||
+      (msr_load_count &&
+       !pa_valid(vmcs12[field::ctrl_vmexit_msr_load_address], 16, msr_load_count * sizeof(vmx::msr_entry_t))))
+  {
+    return false;
+  }
+
+  //
+  // Vol3C[26.2.1.3(VM-Entry Control Fields)].
+  //
+  if (!entry_interruption_valid(vmcs12, procbased_ctls2, vmx_misc))
+  {
+    return false;
+  }
+
+  auto entry_msr_load_count = vmcs12[field::ctrl_vmentry_msr_load_count];
+
+  if ((entry_msr_load_count &&
+       !pa_valid(vmcs12[field::ctrl_vmentry_msr_load_address], 16, entry_msr_load_count * sizeof(vmx::msr_entry_t))) ||
+      entry_ctls.entry_to_smm ||
+      entry_ctls.deactivate_dual_monitor_treatment)
+  {
+    return false;
+  }
+
+  return true;
+}
+
+bool nested_vmx_t::check_host_state() noexcept
+{
+  //
+  // Checks on the host-state area (Vol3C[26.2.2(Checks on Host Control
+  // Registers, MSRs, and SSP)] and Vol3C[26.2.3(Checks on Host Segment
+  // and Descriptor-Table Registers)]). VMCS02 has hvpp's own host state -
+  // the host state of VMCS12 is loaded into VMCS01 by load_l1_host_state().
+  //
+  auto& vmcs12 = vmcs12_cache_;
+
+  auto exit_ctls = msr::vmx_exit_ctls_t{ vmcs12[field::ctrl_vmexit_controls] };
+  auto entry_ctls = msr::vmx_entry_ctls_t{ vmcs12[field::ctrl_vmentry_controls] };
+
+  auto host_cr0 = vmcs12[field::host_cr0];
+  auto host_cr4 = cr4_t{ vmcs12[field::host_cr4] };
+  auto cr0_fixed0 = msr::read<msr::vmx_cr0_fixed0_t>().flags;
+  auto cr0_fixed1 = msr::read<msr::vmx_cr0_fixed1_t>().flags;
+  auto cr4_fixed0 = msr::read<msr::vmx_cr4_fixed0_t>().flags;
+  auto cr4_fixed1 = msr::read<msr::vmx_cr4_fixed1_t>().flags;
+
+  if ((host_cr0 & cr0_fixed0) != cr0_fixed0 || (host_cr0 & ~cr0_fixed1) ||
+      (host_cr4.flags & cr4_fixed0) != cr4_fixed0 || (host_cr4.flags & ~cr4_fixed1) ||
+      (vmcs12[field::host_cr3] >> physical_address_width_))
+  {
+    return false;
+  }
+
+  if (!is_canonical(vmcs12[field::host_sysenter_esp]) ||
+      !is_canonical(vmcs12[field::host_sysenter_eip]))
+  {
+    return false;
+  }
+
+  if ((exit_ctls.load_ia32_pat && !pat_valid(vmcs12[field::host_pat])) ||
+      (exit_ctls.load_ia32_efer && !efer_valid(vmcs12[field::host_efer], exit_ctls.ia32e_mode_host)))
+  {
+    return false;
+  }
+
+  //
+  // RPL and TI of all selectors must be 0, CS and TR must not be null.
+  //
+  for (int index = context_t::seg_es; index <= context_t::seg_gs; ++index)
+  {
+    if (vmcs12[field::host_es_selector + (index << 1)] & 7)
+    {
+      return false;
+    }
+  }
+
+  if ((vmcs12[field::host_tr_selector] & 7) ||
+      vmcs12[field::host_cs_selector] == 0 ||
+      vmcs12[field::host_tr_selector] == 0)
+  {
+    return false;
+  }
+
+  if (!is_canonical(vmcs12[field::host_fs_base]) ||
+      !is_canonical(vmcs12[field::host_gs_base]) ||
+      !is_canonical(vmcs12[field::host_gdtr_base]) ||
+      !is_canonical(vmcs12[field::host_idtr_base]) ||
+      !is_canonical(vmcs12[field::host_tr_base]))
+  {
+    return false;
+  }
+
+  //
+  // Vol3C[26.2.4(Checks Related to Address-Space Size)] - L1 is in IA-32e
+  // mode if VMCS01 enters it in IA-32e mode (the CPU updates the control
+  // on each VM-exit).
+  //
+  if (vp_->vm_entry_controls().ia32e_mode_guest)
+  {
+    if (!exit_ctls.ia32e_mode_host ||
+        !host_cr4.physical_address_extension ||
+        !is_canonical(vmcs12[field::host_rip]))
+    {
+      return false;
+    }
+  }
+  else
+  {
+    if (exit_ctls.ia32e_mode_host ||
+        entry_ctls.ia32e_mode_guest ||
+        host_cr4.pcid_enable ||
+        (vmcs12[field::host_rip] >> 32))
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void nested_vmx_t::prepare_vmcs02(vcpu_t& vp) noexcept
+{
+  auto& vmcs12 = vmcs12_cache_;
+
+  if (!vmcs02_launched_)
+  {
+    vmcs02_.revision_id = vp_->vmcs_.revision_id;
+
+    vmx::vmclear(pa_t::from_va(&vmcs02_));
+    load(vmcs02_);
+
+    for (int i = 0; i < host_state_count; ++i)
+    {
+      vmx::vmwrite(host_fields[i], vmcs01_host_state_[i]);
+    }
+
+    vmx::vmwrite(field::guest_vmcs_link_pointer, ~0ull);
+  }
+  else
+  {
+    load(vmcs02_);
+  }
+
+  auto procbased_ctls = msr::vmx_procbased_ctls_t{ vmcs12[field::ctrl_processor_based_vm_execution_controls] };
+
+  if (dirty_ || vmcs02_owner_pa_ != current_pa_)
+  {
+    vmwrite_all(vmcs12, cold_guest_fields);
+    vmwrite_all(vmcs12, cold_control_fields);
+
+    //
+    // EPT and VPID are always enabled in VMCS02. If L1 doesn't use EPT, L2
+    // runs on the EPT of hvpp.
+    //
+    auto procbased_ctls2 = msr::vmx_procbased_ctls2_t{ procbased_ctls.activate_secondary_controls
+      ? vmcs12[field::ctrl_secondary_processor_based_vm_execution_controls]
+      : 0 };
+
+    l1_ept_ = !!procbased_ctls2.enable_ept;
+
+    procbased_ctls2.vmcs_shadowing = false;
+    procbased_ctls2.enable_ept = true;
+    procbased_ctls2.enable_vpid = true;
+    vmx::vmwrite(field::ctrl_secondary_processor_based_vm_execution_controls, vmx::adjust(procbased_ctls2));
+
+    if (l1_ept_)
+    {
+      vmx::vmwrite(field::ctrl_ept_pointer, vmcs12[field::ctrl_ept_pointer]);
+    }
+    else
+    {
+      vmx::vmwrite(field::ctrl_ept_pointer, vp.ept().ept_pointer());
+    }
+
+    vmx::vmwrite(field::ctrl_virtual_processor_identifier, l2_vpid);
+
+    //
+    // VM-exit from L2 always returns to hvpp (64-bit). PAT and EFER of L1
+    // are restored by the CPU, the VM-exit MSR-load list of L1 is applied
+    // in load_l1_host_state().
+    //
+    // Note that the PAT and EFER values are captured here - if L1 changes
+    // them without touching any cold field, VMCS02 keeps the old values.
+    //
+    auto exit_ctls = msr::vmx_exit_ctls_t{ vmcs12[field::ctrl_vmexit_controls] };
+    exit_ctls.ia32e_mode_host = true;
+    exit_ctls.load_ia32_pat = true;
+    exit_ctls.load_ia32_efer = true;
+    exit_ctls.load_ia32_perf_global_ctrl = false;
+    vmx::vmwrite(field::ctrl_vmexit_controls, vmx::adjust(exit_ctls));
+    vmx::vmwrite(field::ctrl_vmexit_msr_load_count, 0u);
+
+    vmx::vmwrite(field::host_pat, msr::read(msr_pat_id));
+    vmx::vmwrite(field::host_efer, msr::read(msr_efer_id));
+
+    dirty_ = false;
+  }
+
+  //
+  // VPID of L2 is shared by all VPIDs of L1. Flush it whenever L1 wouldn't
+  // expect the translations to be retained.
+  //
+  uint16_t vpid = 0;
+  if (procbased_ctls.activate_secondary_controls &&
+      msr::vmx_procbased_ctls2_t{ vmcs12[field::ctrl_secondary_processor_based_vm_execution_controls] }.enable_vpid)
+  {
+    vpid = static_cast<uint16_t>(vmcs12[field::ctrl_virtual_processor_identifier]);
+  }
+
+  if (vpid == 0 || vpid != vmcs12_vpid_)
+  {
+    vmx::invvpid_desc_t descriptor{};
+    descriptor.vpid = l2_vpid;
+    vmx::invvpid(vmx::invvpid_t::single_context, &descriptor);
+  }
+
+  vmcs12_vpid_ = vpid;
+
+  vmwrite_all(vmcs12, hot_guest_fields);
+  vmwrite_all(vmcs12, hot_control_fields);
+
+  procbased_ctls.activate_secondary_controls = true;
+  vmx::vmwrite(field::ctrl_processor_based_vm_execution_controls, vmx::adjust(procbased_ctls));
+}
+
+void nested_vmx_t::enter_l2(vcpu_t& vp, bool launch) noexcept
+{
+  if (!check_vmx_operation(vp))
+  {
+    return;
+  }
+
+  if (current_pa_ == invalid_pa)
+  {
+    vm_fail_invalid(vp);
+    return;
+  }
+
+  auto tsc_begin = ia32_asm_read_tsc();
+  auto& vmcs12 = *this->vmcs12();
+
+  if (launch && vmcs12.launch_state != vmcs12_t::launch_state_clear)
+  {
+    vm_fail_valid(vp, vmx::instruction_error::vmlauch_non_clear_vmcs);
+    return;
+  }
+
+  if (!launch && vmcs12.launch_state != vmcs12_t::launch_state_launched)
+  {
+    vm_fail_valid(vp, vmx::instruction_error::vmresume_non_launched_vmcs);
+    return;
+  }
+
+  if (!vmcs02_launched_)
+  {
+    for (int i = 0; i < host_state_count; ++i)
+    {
+      vmx::vmread(host_fields[i], vmcs01_host_state_[i]);
+    }
+  }
+
+  if (shadowing_enabled_)
+  {
+    shadow_to_vmcs12();
+  }
+
+  //
+  // VMCS12 lives in the memory of L1 - L1 (or any other of its CPUs) can
+  // change it at any time. The fields are checked and used only from the
+  // private copy, which is also the source of the host state on VM-exit
+  // (see load_l1_host_state()).
+  //
+  vmcs12_cache_ = vmcs12;
+
+  if (!check_controls())
+  {
+    load_vmcs01();
+    vm_fail_valid(vp, vmx::instruction_error::vmentry_invalid_control_fields);
+    return;
+  }
+
+  if (!check_host_state())
+  {
+    load_vmcs01();
+    vm_fail_valid(vp, vmx::instruction_error::vmentry_invalid_host_state);
+    return;
+  }
+
+  //
+  // From now on, the VMCS02 is loaded.
+  //
+  prepare_vmcs02(vp);
+
+  vp.exit_context().rip = vmcs12_cache_[field::guest_rip];
+  vp.exit_context().rsp = vmcs12_cache_[field::guest_rsp];
+  vp.exit_context().rflags.flags = vmcs12_cache_[field::guest_rflags];
+  vp.suppress_rip_adjust();
+
+  vmcs12.launch_state = vmcs12_t::launch_state_launched;
+  vmcs02_owner_pa_ = current_pa_;
+  stale_ = false;
+  in_l2_ = true;
+
+  if (!vmcs02_launched_)
+  {
+    vmcs02_launched_ = true;
+    launch_requested_ = true;
+  }
+
+  auto tsc_end = ia32_asm_read_tsc();
+  stats_.value[stats_t::id_entry_cycles] += tsc_end - tsc_begin;
+
+  if (round_trip_begin_)
+  {
+    stats_.value[stats_t::id_round_trip_cycles] += tsc_end - round_trip_begin_;
+    round_trip_begin_ = 0;
+  }
+}
+
+void nested_vmx_t::load_l1_host_state(vcpu_t& vp) noexcept
+{
+  //
+  // Emulates loading of the host state of VMCS12 on VM-exit (Vol3C[27.5
+  // (Loading Host State)]) - the host state of L1 becomes the guest state
+  // of VMCS01. Expects VMCS01 to be loaded.
+  //
+  // The host state comes from the copy of VMCS12 which has been checked by
+  // check_host_state() on VM-entry - not from the memory of L1.
+  //
+  auto& vmcs12 = vmcs12_cache_;
+
+  vmx::vmwrite(field::guest_cr0, vmcs12[field::host_cr0]);
+  vmx::vmwrite(field::guest_cr3, vmcs12[field::host_cr3]);
+  vmx::vmwrite(field::guest_cr4, vmcs12[field::host_cr4]);
+  vmx::vmwrite(field::ctrl_cr0_read_shadow, vmcs12[field::host_cr0]);
+  vmx::vmwrite(field::ctrl_cr4_read_shadow, vmcs12[field::host_cr4]);
+
+  vmx::vmwrite(field::guest_dr7, 0x400ull);
+  vmx::vmwrite(field::guest_debugctl, 0ull);
+
+  vmx::vmwrite(field::guest_sysenter_cs, vmcs12[field::host_sysenter_cs]);
+  vmx::vmwrite(field::guest_sysenter_esp, vmcs12[field::host_sysenter_esp]);
+  vmx::vmwrite(field::guest_sysenter_eip, vmcs12[field::host_sysenter_eip]);
+
+  vmx::vmwrite(field::guest_gdtr_base, vmcs12[field::host_gdtr_base]);
+  vmx::vmwrite(field::guest_idtr_base, vmcs12[field::host_idtr_base]);
+  vmx::vmwrite(field::guest_gdtr_limit, 0xffffu);
+  vmx::vmwrite(field::guest_idtr_limit, 0xffffu);
+
+  for (int index = context_t::seg_es; index <= context_t::seg_gs; ++index)
+  {
+    auto selector = vmcs12[field::host_es_selector + (index << 1)];
+
+    uint32_t access_rights =
+      index == context_t::seg_cs ? access_rights_code64 :
+      selector != 0              ? access_rights_data   :
+                                   access_rights_unusable;
+
+    uint64_t base =
+      index == context_t::seg_fs ? vmcs12[field::host_fs_base] :
+      index == context_t::seg_gs ? vmcs12[field::host_gs_base] :
+                                   0;
+
+    vmx::vmwrite(field::guest_es_selector + (index << 1), selector);
+    vmx::vmwrite(field::guest_es_limit + (index << 1), 0xffffffffu);
+    vmx::vmwrite(field::guest_es_access_rights + (index << 1), access_rights);
+    vmx::vmwrite(field::guest_es_base + (index << 1), base);
+  }
+
+  vmx::vmwrite(field::guest_tr_selector, vmcs12[field::host_tr_selector]);
+  vmx::vmwrite(field::guest_tr_limit, 0x67u);
+  vmx::vmwrite(field::guest_tr_access_rights, access_rights_tss_busy);
+  vmx::vmwrite(field::guest_tr_base, vmcs12[field::host_tr_base]);
+
+  vmx::vmwrite(field::guest_ldtr_selector, 0u);
+  vmx::vmwrite(field::guest_ldtr_access_rights, access_rights_unusable);
+
+  vmx::vmwrite(field::guest_interruptibility_state, 0u);
+  vmx::vmwrite(field::guest_activity_state, 0u);
+  vmx::vmwrite(field::guest_pending_debug_exceptions, 0ull);
+
+  auto exit_ctls = msr::vmx_exit_ctls_t{ vmcs12[field::ctrl_vmexit_controls] };
+
+  auto entry_ctls = vp.vm_entry_controls();
+  entry_ctls.ia32e_mode_guest = exit_ctls.ia32e_mode_host;
+  vp.vm_entry_controls(entry_ctls);
+
+  //
+  // PAT, EFER and the VM-exit MSR-load list (Vol3C[27.6(Loading MSRs)])
+  // come from L1 - they're validated and emulated, MSRs which fail the
+  // checks (or which aren't emulated) cause VMX abort. Note that the
+  // MSR-load list lives in the memory of L1, so its entries could have
+  // been changed since the VM-entry.
+  //
+  if ((exit_ctls.load_ia32_pat && !load_l1_msr(vp, msr_pat_id, vmcs12[field::host_pat])) ||
+      (exit_ctls.load_ia32_efer && !load_l1_msr(vp, msr_efer_id, vmcs12[field::host_efer])))
+  {
+    vmx_abort(abort_load_host_msr_failed);
+  }
+  else
+  {
+    auto msr_load_count = static_cast<uint32_t>(vmcs12[field::ctrl_vmexit_msr_load_count]);
+    auto msr_load_address = vmcs12[field::ctrl_vmexit_msr_load_address];
+
+    if (msr_load_count > max_msr_count_ || (msr_load_address & 0xf))
+    {
+      msr_load_count = 0;
+      vmx_abort(abort_load_host_msr_failed);
+    }
+
+    for (uint32_t i = 0; i < msr_load_count; ++i)
+    {
+      //
+      // Entries are 16-byte aligned - none of them crosses a page boundary.
+      //
+      auto entry_pa = msr_load_address + i * sizeof(vmx::msr_entry_t);
+      auto page = map_page(entry_pa & ~uint64_t(page_size - 1));
+
+      vmx::msr_entry_t entry;
+
+      if (page)
+      {
+        memcpy(&entry, page + (entry_pa & (page_size - 1)), sizeof(entry));
+      }
+
+      if (!page || entry.reserved || !load_l1_msr(vp, entry.msr_id, entry.value))
+      {
+        vmx_abort(abort_load_host_msr_failed);
+        break;
+      }
+    }
+  }
+
+  vp.exit_context().rip = vmcs12[field::host_rip];
+  vp.exit_context().rsp = vmcs12[field::host_rsp];
+  vp.exit_context().rflags.flags = 2;
+  vp.suppress_rip_adjust();
+}
+
+bool nested_vmx_t::load_l1_msr(vcpu_t& vp, uint32_t msr_id, uint64_t value) noexcept
+{
+  //
+  // Only MSRs which are commonly switched by hypervisors on VM-exit are
+  // emulated. MSRs which have a guest field in VMCS01 are written into that
+  // field, the rest of them is written into the MSR - but only after the
+  // value has been checked, so that WRMSR can't fault in VMX root.
+  //
+  auto ia32e_mode_host = !!msr::vmx_exit_ctls_t{ vmcs12_cache_[field::ctrl_vmexit_controls] }.ia32e_mode_host;
+
+  switch (msr_id)
+  {
+    case msr_sysenter_cs_id:
+      if (value >> 32) return false;
+      vmx::vmwrite(field::guest_sysenter_cs, value);
+      return true;
+
+    case msr_sysenter_esp_id:
+      if (!is_canonical(value)) return false;
+      vmx::vmwrite(field::guest_sysenter_esp, value);
+      return true;
+
+    case msr_sysenter_eip_id:
+      if (!is_canonical(value)) return false;
+      vmx::vmwrite(field::guest_sysenter_eip, value);
+      return true;
+
+    case msr_pat_id:
+      if (!pat_valid(value)) return false;
+      switch_l1_pat_efer(vp);
+      vmx::vmwrite(field::guest_pat, value);
+      return true;
+
+    case msr_efer_id:
+      if (!efer_valid(value, ia32e_mode_host)) return false;
+      switch_l1_pat_efer(vp);
+      vmx::vmwrite(field::guest_efer, value);
+      return true;
+
+    case msr_star_id:
+      msr::write(msr_id, value);
+      return true;
+
+    case msr_lstar_id:
+    case msr_cstar_id:
+    case msr_kernel_gs_base_id:
+      if (!is_canonical(value)) return false;
+      msr::write(msr_id, value);
+      return true;
+
+    case msr_fmask_id:
+    case msr_tsc_aux_id:
+      if (value >> 32) return false;
+      msr::write(msr_id, value);
+      return true;
+
+    default:
+      return false;
+  }
+}
+
+void nested_vmx_t::switch_l1_pat_efer(vcpu_t& vp) noexcept
+{
+  //
+  // PAT and EFER are shared by L1 and the host until L1 loads them on
+  // VM-exit - from then on, VMCS01 switches them on each VM-entry and
+  // VM-exit, and the host keeps its own values. Expects VMCS01 to be
+  // loaded.
+  //
+  if (l1_pat_efer_switching_)
+  {
+    return;
+  }
+
+  vmx::vmwrite(field::guest_pat, msr::read(msr_pat_id));
+  vmx::vmwrite(field::guest_efer, msr::read(msr_efer_id));
+  vmx::vmwrite(field::host_pat, host_pat_);
+  vmx::vmwrite(field::host_efer, host_efer_);
+
+  auto entry_ctls = vp.vm_entry_controls();
+  entry_ctls.load_ia32_pat = true;
+  entry_ctls.load_ia32_efer = true;
+  vp.vm_entry_controls(entry_ctls);
+
+  auto exit_ctls = vp.vm_exit_controls();
+  exit_ctls.save_ia32_pat = true;
+  exit_ctls.load_ia32_pat = true;
+  exit_ctls.save_ia32_efer = true;
+  exit_ctls.load_ia32_efer = true;
+  vp.vm_exit_controls(exit_ctls);
+
+  l1_pat_efer_switching_ = true;
+}
+
+void nested_vmx_t::vmx_abort(uint32_t indicator) noexcept
+{
+  //
+  // Vol3C[27.7(VMX Aborts)] - the indicator is written into the VMCS12 and
+  // the logical processor of L1 is put into shutdown state (if the CPU
+  // supports it - otherwise L1 continues at its host RIP with the abort
+  // indicator set). Expects VMCS01 to be loaded.
+  //
+  vmcs12()->abort_indicator = indicator;
+
+  auto vmx_misc = msr::read<msr::vmx_misc_t>();
+
+  if (vmx_misc.activity_states & 2)
+  {
+    vmx::vmwrite(field::guest_activity_state, activity_state_shutdown);
+  }
+}
+
+}
+
+#endif
@@ -0,0 +1,294 @@
+#pragma once
+#include "config.h"
+
+#include "ia32/arch.h"
+#include "ia32/vmx.h"
+
+#include <cstdint>
+
+namespace hvpp {
+
+using namespace ia32;
+
+class vcpu_t;
+
+#ifdef HVPP_ENABLE_NESTED_VMX
+
+//
+// Virtual VMCS ("VMCS12") - VMCS of the L1 hypervisor as seen by L1.
+//
+// The format of the VMCS region is implementation-specific and software is
+// allowed to access it only via VMREAD/VMWRITE (Vol3C[24.2(Format of the
+// VMCS Region)]). Therefore we keep the virtual VMCS directly in the VMCS
+// region provided by L1 (the operand of VMCLEAR/VMPTRLD) with our own
+// layout: each field has its own 64-bit slot, addressed by the width, type
+// and index parts of the field encoding. Translation of the field encoding
+// to the slot is just few bit operations.
+//
+
+struct vmcs12_t
+{
+  static constexpr int index_count = 28;
+
+  enum : uint32_t
+  {
+    launch_state_clear    = 0,
+    launch_state_launched = 1,
+  };
+
+  static bool valid(uint32_t encoding) noexcept;
+
+  uint64_t& operator[](vmx::vmcs_t::field vmcs_field) noexcept
+  {
+    auto encoding = static_cast<uint32_t>(vmcs_field);
+    return field[(encoding >> 13) & 3][(encoding >> 10) & 3][(encoding >> 1) & 0x1ff];
+  }
+
+  uint32_t revision_id;
+  uint32_t abort_indicator;
+  uint32_t launch_state;
+  uint32_t reserved;
+
+  //
+  // [width][type][index]
+  //
+  uint64_t field[4][4][index_count];
+};
+
+static_assert(sizeof(vmcs12_t) <= page_size);
+
+//
+// Nested VMX - emulation of VMX for the hypervisor running in the guest
+// (L1). Its guests (L2) are run on hardware VMCS ("VMCS02") built from the
+// VMCS12, VM-exits from L2 are reflected back to L1.
+//
+// If the CPU supports VMCS shadowing, frequently accessed VMCS12 fields are
+// kept in the hardware shadow VMCS linked to the VMCS of L1 ("VMCS01") -
+// VMREAD/VMWRITE of these fields in L1 don't cause VM-exit at all.
+//
+// Because EPT of hvpp maps guest-physical memory 1:1, guest-physical
+// addresses in the VMCS12 (EPT pointer, MSR/IO bitmaps, MSR lists, ...) are
+// also host-physical addresses and they're passed to the VMCS02 as-is.
+// Note that EPT hooks of hvpp therefore don't apply to L2 if L1 uses EPT.
+//
+
+class nested_vmx_t
+{
+  public:
+    //
+    // Per-VCPU counters. Round-trip is the time from VM-exit of L2 to the
+    // next VM-entry of L2 - i.e. what L2 sees as VM-exit latency - and it
+    // includes handling of the VM-exit in L1.
+    //
+    struct stats_t
+    {
+      enum
+      {
+        id_l2_exits,
+        id_round_trip_cycles,
+        id_round_trip_vmx_exits,
+        id_reflect_cycles,
+        id_entry_cycles,
+        id_vmread_exits,
+        id_vmwrite_exits,
+
+        id_count
+      };
+
+      uint64_t value[id_count];
+    };
+
+    void initialize(vcpu_t& vp) noexcept;
+
+    bool in_l2() const noexcept { return in_l2_; }
+
+    //
+    // Returns true if the VM-exit (which occurred in L2) has been reflected
+    // to L1. Returns false if the VM-exit should be handled by hvpp itself.
+    //
+    bool reflect(vcpu_t& vp) noexcept;
+
+    void handle_vmxon(vcpu_t& vp) noexcept;
+    void handle_vmxoff(vcpu_t& vp) noexcept;
+    void handle_vmclear(vcpu_t& vp) noexcept;
+    void handle_vmptrld(vcpu_t& vp) noexcept;
+    void handle_vmptrst(vcpu_t& vp) noexcept;
+    void handle_vmread(vcpu_t& vp) noexcept;
+    void handle_vmwrite(vcpu_t& vp) noexcept;
+    void handle_vmlaunch(vcpu_t& vp) noexcept;
+    void handle_vmresume(vcpu_t& vp) noexcept;
+    void handle_invept(vcpu_t& vp) noexcept;
+    void handle_invvpid(vcpu_t& vp) noexcept;
+
+    //
+    // Enables/disables use of VMCS shadowing (if the CPU supports it).
+    // Must be called in the context of L1.
+    //
+    bool shadowing() const noexcept { return shadowing_enabled_; }
+    void shadowing(bool enable) noexcept;
+
+    const stats_t& stats() const noexcept { return stats_; }
+    void reset_stats() noexcept;
+
+    //
+    // Returns true (once) if VMCS02 hasn't been launched yet - the next
+    // VM-entry has to be performed by VMLAUNCH instead of VMRESUME.
+    //
+    bool take_launch_request() noexcept;
+
+  private:
+    //
+    // VPID of L2. VPID 1 is used by L1 (see vcpu_t::setup_guest()).
+    //
+    static constexpr uint16_t l2_vpid = 2;
+
+    static constexpr uint64_t invalid_pa = ~0ull;
+
+    static constexpr int host_state_count = 20;
+
+    //
+    // VMX-abort indicators (Vol3C[27.7(VMX Aborts)]).
+    //
+    static constexpr uint32_t abort_load_host_msr_failed = 4;
+
+    void setup() noexcept;
+    bool hot(uint32_t encoding) const noexcept;
+
+    bool check_vmx_operation(vcpu_t& vp) noexcept;
+    bool read_vmcs_pointer(vcpu_t& vp, uint64_t& pa) noexcept;
+
+    //
+    // Read/write the memory operand of the VMX instruction. If the operand
+    // isn't present in the address space of L1, #PF is injected and false
+    // is returned - the instruction must not be completed then.
+    //
+    bool read_operand(vcpu_t& vp, void* value, size_t size) noexcept;
+    bool write_operand(vcpu_t& vp, const void* value, size_t size) noexcept;
+    void inject_operand_page_fault(vcpu_t& vp, bool write_access) noexcept;
+
+    void vm_succeed(vcpu_t& vp) noexcept;
+    void vm_fail_invalid(vcpu_t& vp) noexcept;
+    void vm_fail_valid(vcpu_t& vp, vmx::instruction_error error) noexcept;
+
+    vmcs12_t* vmcs12() const noexcept;
+
+    //
+    // Returns virtual address of the guest-physical page (which is also
+    // host-physical, see above) or nullptr if the address is not aligned,
+    // exceeds the physical-address width or the page is not RAM mapped by
+    // the host.
+    //
+    uint8_t* map_page(uint64_t pa) const noexcept;
+
+    //
+    // Checks that the physical address is aligned and that the range lies
+    // within the physical-address width.
+    //
+    bool pa_valid(uint64_t pa, uint64_t alignment, uint64_t size = 1) const noexcept;
+
+    void load(vmx::vmcs_t& vmcs) noexcept;
+    void load_vmcs01() noexcept;
+
+    void shadow_to_vmcs12() noexcept;
+    void vmcs12_to_shadow() noexcept;
+    void sync_stale_vmcs02() noexcept;
+    void release_current() noexcept;
+
+    void enable_shadow_vmcs() noexcept;
+    void disable_shadow_vmcs() noexcept;
+
+    bool check_controls() noexcept;
+    bool check_host_state() noexcept;
+    void prepare_vmcs02(vcpu_t& vp) noexcept;
+    void enter_l2(vcpu_t& vp, bool launch) noexcept;
+    void load_l1_host_state(vcpu_t& vp) noexcept;
+    bool load_l1_msr(vcpu_t& vp, uint32_t msr_id, uint64_t value) noexcept;
+    void switch_l1_pat_efer(vcpu_t& vp) noexcept;
+    void vmx_abort(uint32_t indicator) noexcept;
+
+    //
+    // VMCS02 - hardware VMCS on which the L2 is run. Shadow VMCS - hardware
+    // VMCS which backs the shadowed VMCS12 fields while L1 runs.
+    //
+    vmx::vmcs_t        vmcs02_;
+    vmx::vmcs_t        shadow_vmcs_;
+
+    //
+    // VMREAD/VMWRITE bitmaps - set bit means that VMREAD/VMWRITE of the field
+    // with that encoding (bits 14:0) causes VM-exit.
+    //
+    alignas(page_size) uint8_t vmread_bitmap_[page_size];
+    alignas(page_size) uint8_t vmwrite_bitmap_[page_size];
+
+    //
+    // Private copy of VMCS12, taken on VM-entry - the checked controls and
+    // host state are used only from this copy (see enter_l2()).
+    //
+    vmcs12_t           vmcs12_cache_;
+
+    vcpu_t*            vp_;
+
+    uint64_t           vmxon_pa_;
+    uint64_t           current_pa_;
+    uint64_t           vmcs02_owner_pa_;
+    uint16_t           vmcs12_vpid_;
+
+    uint64_t           vmcs01_host_state_[host_state_count];
+    uint64_t           round_trip_begin_;
+
+    //
+    // PAT and EFER of the host (captured by setup()) and the recommended
+    // maximum number of entries in MSR lists (Vol3C[A.6(Miscellaneous
+    // Data)]).
+    //
+    uint64_t           host_pat_;
+    uint64_t           host_efer_;
+    uint32_t           max_msr_count_;
+    uint8_t            physical_address_width_;
+
+    bool               setup_done_;
+    bool               vmxon_;
+    bool               in_l2_;
+    bool               l1_ept_;
+    bool               vmcs02_launched_;
+    bool               launch_requested_;
+
+    //
+    // PAT and EFER of L1 are switched by VMCS01 (see switch_l1_pat_efer()).
+    //
+    bool               l1_pat_efer_switching_;
+
+    //
+    // Dirty - L1 has written into a field which is not synchronized to
+    // VMCS02 on each VM-entry. Stale - the guest state of L2 in VMCS12 is
+    // outdated, the actual values are in VMCS02.
+    //
+    bool               dirty_;
+    bool               stale_;
+
+    bool               shadowing_supported_;
+    bool               shadowing_enabled_;
+    bool               shadow_exit_info_;
+
+    stats_t            stats_;
+};
+
+#else
+
+//
+// Nested VMX is disabled - VMX instructions raise #UD and there's never
+// any nested guest. The stub keeps the per-VCPU state out of vcpu_t.
+//
+
+class nested_vmx_t
+{
+  public:
+    void initialize(vcpu_t& /* vp */) noexcept { }
+
+    constexpr bool in_l2() const noexcept { return false; }
+    constexpr bool take_launch_request() const noexcept { return false; }
+};
+
+#endif
+
+}
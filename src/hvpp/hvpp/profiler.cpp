@@ -0,0 +1,461 @@
+#include "profiler.h"
+#include "vcpu.h"
+
+#include "ia32/memory.h"
+#include "ia32/vmx.h"
+#include "lib/log.h"
+#include "lib/mp.h"
+#include "lib/nmi.h"
+
+#include <algorithm> // std::max(), std::min()
+
+namespace hvpp {
+
+//
+// LVT performance monitoring counter register - memory-mapped (xAPIC) or
+// MSR (x2APIC). See Vol3A[10.5.1(Local Vector Table)].
+//
+static constexpr uint32_t apic_lvt_pmi_offset = 0x340;
+static constexpr uint32_t x2apic_lvt_pmi_msr  = 0x834;
+
+//
+// Delivery mode NMI, not masked.
+//
+static constexpr uint32_t lvt_pmi_nmi         = 0x400;
+
+profiler_t::ring_t*   profiler_t::rings_          = nullptr;
+uint32_t              profiler_t::ring_count_     = 0;
+uint64_t              profiler_t::counter_mask_   = 0;
+void*                 profiler_t::apic_           = nullptr;
+bool                  profiler_t::nmi_registered_ = false;
+std::atomic<uint32_t> profiler_t::generation_{ 0 };
+std::atomic<uint32_t> profiler_t::period_{ 0 };
+uint32_t*             profiler_t::cpu_period_     = nullptr;
+
+void profiler_t::allocate() noexcept
+{
+  //
+  // Architectural performance monitoring version 2 (IA32_PERF_GLOBAL_*
+  // MSRs) with at least 2 fixed-function counters is required.
+  // See Vol3B[18.2(Architectural Performance Monitoring)].
+  //
+  int cpu_info[4];
+  ia32_asm_cpuid(cpu_info, 0);
+
+  if (cpu_info[0] < 0xa)
+  {
+    return;
+  }
+
+  ia32_asm_cpuid(cpu_info, 0xa);
+
+  auto version       = cpu_info[0] & 0xff;
+  auto fixed_count   = cpu_info[3] & 0x1f;
+  auto fixed_width   = (cpu_info[3] >> 5) & 0xff;
+
+  if (version < 2 || fixed_count < 2 || !fixed_width)
+  {
+    hvpp_info("profiler: architectural PMU not supported");
+    return;
+  }
+
+  counter_mask_ = fixed_width < 64 ? (1ull << fixed_width) - 1 : ~0ull;
+
+  //
+  // All local APICs are at the same physical address - each CPU sees its
+  // own, so single mapping is enough.
+  //
+  auto apic_base = msr::read<msr::apic_base_t>();
+  if (!apic_base.enable_x2apic_mode)
+  {
+    apic_ = map_io_space(pa_t::from_pfn(apic_base.page_frame_number), page_size);
+
+    if (!apic_)
+    {
+      return;
+    }
+  }
+
+  ring_count_ = mp::cpu_count();
+  rings_ = new ring_t[ring_count_];
+  cpu_period_ = new uint32_t[ring_count_];
+
+  if (!rings_ || !cpu_period_)
+  {
+    free();
+    return;
+  }
+
+  for (uint32_t i = 0; i < ring_count_; ++i)
+  {
+    rings_[i].index.store(0, std::memory_order_relaxed);
+    cpu_period_[i] = 0;
+  }
+
+  nmi_registered_ = nmi::initialize(&profiler_t::handle_nmi);
+
+  if (!nmi_registered_)
+  {
+    free();
+  }
+}
+
+void profiler_t::free() noexcept
+{
+  if (nmi_registered_)
+  {
+    nmi::destroy();
+    nmi_registered_ = false;
+  }
+
+  if (apic_)
+  {
+    unmap_io_space(apic_, page_size);
+    apic_ = nullptr;
+  }
+
+  delete[] rings_;
+  rings_ = nullptr;
+
+  delete[] cpu_period_;
+  cpu_period_ = nullptr;
+
+  ring_count_ = 0;
+}
+
+uint32_t profiler_t::configure(uint32_t period) noexcept
+{
+  if (!rings_)
+  {
+    return 0;
+  }
+
+  if (period)
+  {
+    period = std::max(period, min_period);
+  }
+
+  period_.store(period, std::memory_order_relaxed);
+  generation_.fetch_add(1, std::memory_order_release);
+
+  return period;
+}
+
+uint32_t profiler_t::read_samples(uint64_t& cursor, uint64_t* buffer, uint32_t count) noexcept
+{
+  auto cpu_index = mp::cpu_index();
+
+  if (!rings_ || cpu_index >= ring_count_)
+  {
+    return 0;
+  }
+
+  auto& ring = rings_[cpu_index];
+  auto end = ring.index.load(std::memory_order_acquire);
+
+  //
+  // The ring might have been overwritten since the last read.
+  //
+  if (cursor > end || end - cursor > ring_capacity)
+  {
+    cursor = end > ring_capacity ? end - ring_capacity : 0;
+  }
+
+  count = static_cast<uint32_t>(std::min<uint64_t>(count, end - cursor));
+
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    buffer[i] = ring.rip[(cursor + i) % ring_capacity];
+  }
+
+  return count;
+}
+
+profiler_status_t profiler_t::status() noexcept
+{
+  profiler_status_t result{};
+  auto cpu_index = mp::cpu_index();
+
+  result.cpu_index = cpu_index;
+
+  if (rings_ && cpu_index < ring_count_)
+  {
+    result.period       = cpu_period_[cpu_index];
+    result.sample_count = rings_[cpu_index].index.load(std::memory_order_acquire);
+  }
+
+  return result;
+}
+
+void profiler_t::initialize() noexcept
+{
+  generation_applied_   = 0;
+  period_applied_       = 0;
+  guest_lvt_pmi_        = 0;
+  guest_fixed_ctr_ctrl_ = msr::fixed_ctr_ctrl_t{ 0 };
+}
+
+void profiler_t::apply(vcpu_t& vp) noexcept
+{
+  //
+  // The controls belong to VMCS01 - keep the configuration pending while
+  // the nested guest runs (VMCS02 is current then).
+  //
+  if (vp.nested().in_l2())
+  {
+    return;
+  }
+
+  generation_applied_ = generation_.load(std::memory_order_acquire);
+  auto period = period_.load(std::memory_order_relaxed);
+
+  if (period == period_applied_)
+  {
+    return;
+  }
+
+  disable(vp);
+
+  if (period)
+  {
+    enable(vp, period);
+  }
+}
+
+void profiler_t::enable(vcpu_t& vp, uint32_t period) noexcept
+{
+  auto cpu_index = mp::cpu_index();
+
+  if (!rings_ || cpu_index >= ring_count_ || vp.nested().in_l2())
+  {
+    return;
+  }
+
+  guest_fixed_ctr_ctrl_ = msr::read<msr::fixed_ctr_ctrl_t>();
+  guest_lvt_pmi_ = read_lvt_pmi();
+
+  //
+  // Fixed counter 1 counts only in VMX root - it's enabled only in the host
+  // value of IA32_PERF_GLOBAL_CTRL.
+  //
+  auto guest_global_ctrl = msr::read<msr::perf_global_ctrl_t>();
+  guest_global_ctrl.fixed_ctr1 = false;
+
+  msr::perf_global_ctrl_t host_global_ctrl{ 0 };
+  host_global_ctrl.fixed_ctr1 = true;
+
+  vmx::vmwrite(vmx::vmcs_t::field::guest_perf_global_ctrl, guest_global_ctrl.flags);
+  vmx::vmwrite(vmx::vmcs_t::field::host_perf_global_ctrl, host_global_ctrl.flags);
+
+  auto entry_ctls = vp.vm_entry_controls();
+  entry_ctls.load_ia32_perf_global_ctrl = true;
+  vp.vm_entry_controls(entry_ctls);
+
+  auto exit_ctls = vp.vm_exit_controls();
+  exit_ctls.load_ia32_perf_global_ctrl = true;
+  vp.vm_exit_controls(exit_ctls);
+
+  vmx::msr_bitmap_t msr_bitmap = vp.msr_bitmap();
+  for (auto msr_id : { msr::perf_global_ctrl_t::msr_id, msr::fixed_ctr_ctrl_t::msr_id })
+  {
+    msr_bitmap.rdmsr_low[msr_id / 8] |= 1 << (msr_id % 8);
+    msr_bitmap.wrmsr_low[msr_id / 8] |= 1 << (msr_id % 8);
+  }
+  vp.msr_bitmap(msr_bitmap);
+
+  period_applied_ = period;
+  cpu_period_[cpu_index] = period;
+
+  auto fixed_ctr_ctrl = guest_fixed_ctr_ctrl_;
+  fixed_ctr_ctrl.en1_os      = true;
+  fixed_ctr_ctrl.en1_usr     = false;
+  fixed_ctr_ctrl.any_thread1 = false;
+  fixed_ctr_ctrl.en1_pmi     = true;
+  msr::write(fixed_ctr_ctrl);
+
+  arm(period);
+  write_lvt_pmi(lvt_pmi_nmi);
+
+  //
+  // Start counting right away - the rest of this VM-exit is profiled too.
+  //
+  msr::write(host_global_ctrl);
+}
+
+void profiler_t::disable(vcpu_t& vp) noexcept
+{
+  if (!enabled() || vp.nested().in_l2())
+  {
+    return;
+  }
+
+  period_applied_ = 0;
+  cpu_period_[mp::cpu_index()] = 0;
+
+  uint64_t guest_global_ctrl;
+  vmx::vmread(vmx::vmcs_t::field::guest_perf_global_ctrl, guest_global_ctrl);
+
+  msr::write(msr::perf_global_ctrl_t{ 0 });
+
+  auto entry_ctls = vp.vm_entry_controls();
+  entry_ctls.load_ia32_perf_global_ctrl = false;
+  vp.vm_entry_controls(entry_ctls);
+
+  auto exit_ctls = vp.vm_exit_controls();
+  exit_ctls.load_ia32_perf_global_ctrl = false;
+  vp.vm_exit_controls(exit_ctls);
+
+  vmx::msr_bitmap_t msr_bitmap = vp.msr_bitmap();
+  for (auto msr_id : { msr::perf_global_ctrl_t::msr_id, msr::fixed_ctr_ctrl_t::msr_id })
+  {
+    msr_bitmap.rdmsr_low[msr_id / 8] &= ~(1 << (msr_id % 8));
+    msr_bitmap.wrmsr_low[msr_id / 8] &= ~(1 << (msr_id % 8));
+  }
+  vp.msr_bitmap(msr_bitmap);
+
+  msr::perf_global_ctrl_t overflow{ 0 };
+  overflow.fixed_ctr1 = true;
+  msr::write(msr::perf_global_ovf_ctrl_t::msr_id, overflow);
+
+  msr::write(guest_fixed_ctr_ctrl_);
+  write_lvt_pmi(guest_lvt_pmi_);
+
+  //
+  // IA32_PERF_GLOBAL_CTRL isn't loaded on VM-entry anymore - it must hold
+  // the guest value from now on.
+  //
+  msr::write(msr::perf_global_ctrl_t::msr_id, guest_global_ctrl);
+}
+
+uint64_t profiler_t::guest_rdmsr(uint32_t msr_id) const noexcept
+{
+  if (!enabled())
+  {
+    return msr::read(msr_id);
+  }
+
+  switch (msr_id)
+  {
+    case msr::perf_global_ctrl_t::msr_id:
+      {
+        uint64_t result;
+        vmx::vmread(vmx::vmcs_t::field::guest_perf_global_ctrl, result);
+        return result;
+      }
+
+    case msr::fixed_ctr_ctrl_t::msr_id:
+      return guest_fixed_ctr_ctrl_.flags;
+
+    default:
+      return msr::read(msr_id);
+  }
+}
+
+void profiler_t::guest_wrmsr(uint32_t msr_id, uint64_t value) noexcept
+{
+  if (!enabled())
+  {
+    msr::write(msr_id, value);
+    return;
+  }
+
+  switch (msr_id)
+  {
+    case msr::perf_global_ctrl_t::msr_id:
+      {
+        //
+        // Fixed counter 1 belongs to the profiler.
+        //
+        msr::perf_global_ctrl_t guest_global_ctrl{ value };
+        guest_global_ctrl.fixed_ctr1 = false;
+        vmx::vmwrite(vmx::vmcs_t::field::guest_perf_global_ctrl, guest_global_ctrl.flags);
+      }
+      break;
+
+    case msr::fixed_ctr_ctrl_t::msr_id:
+      {
+        auto fixed_ctr_ctrl = msr::read<msr::fixed_ctr_ctrl_t>();
+        guest_fixed_ctr_ctrl_.flags = value;
+
+        auto new_fixed_ctr_ctrl = guest_fixed_ctr_ctrl_;
+        new_fixed_ctr_ctrl.en1_os      = fixed_ctr_ctrl.en1_os;
+        new_fixed_ctr_ctrl.en1_usr     = fixed_ctr_ctrl.en1_usr;
+        new_fixed_ctr_ctrl.any_thread1 = fixed_ctr_ctrl.any_thread1;
+        new_fixed_ctr_ctrl.en1_pmi     = fixed_ctr_ctrl.en1_pmi;
+        msr::write(new_fixed_ctr_ctrl);
+      }
+      break;
+
+    default:
+      msr::write(msr_id, value);
+      break;
+  }
+}
+
+bool profiler_t::handle_nmi(uint64_t rip) noexcept
+{
+  //
+  // Called in NMI context, in both VMX root and VMX non-root operation.
+  // The counter counts only in VMX root, but the NMI might be delivered
+  // after VM-entry (skid) - such samples have RIP of the guest.
+  //
+  auto cpu_index = mp::cpu_index();
+
+  if (!rings_ || cpu_index >= ring_count_ || !cpu_period_[cpu_index])
+  {
+    return false;
+  }
+
+  auto status = msr::read<msr::perf_global_status_t>();
+  if (!status.fixed_ctr1)
+  {
+    return false;
+  }
+
+  auto& ring = rings_[cpu_index];
+  auto index = ring.index.load(std::memory_order_relaxed);
+  ring.rip[index % ring_capacity] = rip;
+  ring.index.store(index + 1, std::memory_order_release);
+
+  arm(cpu_period_[cpu_index]);
+
+  msr::perf_global_ctrl_t overflow{ 0 };
+  overflow.fixed_ctr1 = true;
+  msr::write(msr::perf_global_ovf_ctrl_t::msr_id, overflow);
+
+  //
+  // Delivery of PMI sets the mask bit of the LVT entry.
+  //
+  write_lvt_pmi(lvt_pmi_nmi);
+
+  return true;
+}
+
+void profiler_t::write_lvt_pmi(uint32_t value) noexcept
+{
+  if (apic_)
+  {
+    *reinterpret_cast<volatile uint32_t*>(reinterpret_cast<uint8_t*>(apic_) + apic_lvt_pmi_offset) = value;
+  }
+  else
+  {
+    msr::write(x2apic_lvt_pmi_msr, static_cast<uint64_t>(value));
+  }
+}
+
+uint32_t profiler_t::read_lvt_pmi() noexcept
+{
+  return apic_
+    ? *reinterpret_cast<volatile uint32_t*>(reinterpret_cast<uint8_t*>(apic_) + apic_lvt_pmi_offset)
+    : static_cast<uint32_t>(msr::read(x2apic_lvt_pmi_msr));
+}
+
+void profiler_t::arm(uint32_t period) noexcept
+{
+  //
+  // The counter overflows after "period" increments.
+  //
+  msr::write(msr::fixed_ctr1_t::msr_id, (0 - static_cast<uint64_t>(period)) & counter_mask_);
+}
+
+}
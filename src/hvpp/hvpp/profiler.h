@@ -0,0 +1,154 @@
+#pragma once
+#include "ia32/msr.h"
+
+#include <atomic>
+#include <cstdint>
+
+namespace hvpp {
+
+using namespace ia32;
+
+class vcpu_t;
+
+//
+// Layout of the status which precedes the samples in the buffer of the
+// guest (see VMCALLs in vmcall.h).
+//
+
+struct profiler_status_t
+{
+  uint32_t cpu_index;
+
+  //
+  // Current sampling period (in unhalted core cycles spent in VMX root)
+  // or 0 if the profiler is disabled.
+  //
+  uint32_t period;
+
+  uint64_t sample_count;
+
+  //
+  // Ring index of the first sample which follows this structure.
+  //
+  uint64_t cursor;
+};
+
+//
+// Sampling profiler of the hypervisor itself.
+//
+// Fixed-function counter 1 (CPU_CLK_UNHALTED.CORE) counts only in VMX
+// root - IA32_PERF_GLOBAL_CTRL is switched by "load IA32_PERF_GLOBAL_CTRL"
+// VM-entry/VM-exit controls, with the counter enabled only in the host
+// value. Overflow of the counter raises PMI, which is delivered as NMI
+// (LVT performance monitoring entry of the local APIC). The NMI handler
+// (see nmi::initialize()) stores RIP of the interrupted code into the
+// per-CPU ring of samples and re-arms the counter.
+//
+// Each sample costs one NMI (roughly 1-2 us) per "period" cycles of VMX
+// root time. The period is clamped to min_period, which bounds the
+// overhead to a few percent of the time spent in the hypervisor - and to
+// nothing at all in the guest. The profiler is switched on/off at runtime
+// by VMCALL - each VCPU applies the change on its next VM-exit.
+//
+// Guest accesses of IA32_PERF_GLOBAL_CTRL and IA32_FIXED_CTR_CTRL are
+// intercepted while the profiler is enabled (see guest_rdmsr() and
+// guest_wrmsr()) - the guest can't use fixed counter 1 during that time.
+//
+
+class profiler_t
+{
+  public:
+    static constexpr uint32_t ring_capacity  = 8192;
+    static constexpr uint32_t min_period     = 100'000;
+    static constexpr uint32_t default_period = 1'000'000;
+
+    //
+    // Allocates (frees) the rings of all VCPUs and registers NMI handler.
+    // Called by the hypervisor before any VCPU is initialized (after all
+    // VCPUs are destroyed).
+    //
+    static void allocate() noexcept;
+    static void free() noexcept;
+
+    //
+    // Sets the sampling period of all VCPUs (0 disables the profiler).
+    // Returns the effective period.
+    //
+    static uint32_t configure(uint32_t period) noexcept;
+
+    //
+    // Copies samples (host RIPs) of the current CPU starting at ring index
+    // "cursor" into the buffer. Returns number of copied samples.
+    // Overwritten samples are skipped - the index of the first copied
+    // sample is returned in "cursor".
+    //
+    static uint32_t read_samples(uint64_t& cursor, uint64_t* buffer, uint32_t count) noexcept;
+
+    static profiler_status_t status() noexcept;
+
+    void initialize() noexcept;
+
+    //
+    // Applies the configuration on the current VCPU if it has changed.
+    // Must be called in VM-exit. While the nested guest runs, the
+    // configuration is applied on a later VM-exit.
+    //
+    void update(vcpu_t& vp) noexcept
+    {
+      if (generation_ != generation_applied_)
+      {
+        apply(vp);
+      }
+    }
+
+    void disable(vcpu_t& vp) noexcept;
+
+    bool enabled() const noexcept { return period_applied_ != 0; }
+
+    //
+    // Guest accesses of the intercepted MSRs.
+    //
+    uint64_t guest_rdmsr(uint32_t msr_id) const noexcept;
+    void     guest_wrmsr(uint32_t msr_id, uint64_t value) noexcept;
+
+  private:
+    struct alignas(64) ring_t
+    {
+      std::atomic<uint64_t> index;
+      uint64_t              rip[ring_capacity];
+    };
+
+    static bool handle_nmi(uint64_t rip) noexcept;
+
+    void apply(vcpu_t& vp) noexcept;
+    void enable(vcpu_t& vp, uint32_t period) noexcept;
+
+    static void write_lvt_pmi(uint32_t value) noexcept;
+    static uint32_t read_lvt_pmi() noexcept;
+    static void arm(uint32_t period) noexcept;
+
+    static ring_t*               rings_;
+    static uint32_t              ring_count_;
+    static uint64_t              counter_mask_;
+    static void*                 apic_;
+    static bool                  nmi_registered_;
+
+    static std::atomic<uint32_t> generation_;
+    static std::atomic<uint32_t> period_;
+
+    //
+    // Periods of the VCPUs (read by the NMI handler).
+    //
+    static uint32_t*             cpu_period_;
+
+    uint32_t                     generation_applied_;
+    uint32_t                     period_applied_;
+
+    //
+    // State of the guest before enable().
+    //
+    uint32_t                     guest_lvt_pmi_;
+    msr::fixed_ctr_ctrl_t        guest_fixed_ctr_ctrl_;
+};
+
+}
@@ -0,0 +1,147 @@
+#include "steal_time.h"
+#include "vcpu.h"
+#include "vmexit.h"
+
+#include "ia32/vmx.h"
+#include "lib/cr3_guard.h"
+#include "lib/mp.h"
+
+#include <cstring>
+#include <mutex>
+
+namespace hvpp {
+
+steal_time_page_t* steal_time_t::pages_        = nullptr;
+uint32_t           steal_time_t::page_count_   = 0;
+uint64_t*          steal_time_t::guest_pa_     = nullptr;
+uint32_t           steal_time_t::mapped_count_ = 0;
+spinlock           steal_time_t::lock_;
+
+void steal_time_t::allocate() noexcept
+{
+  page_count_ = mp::cpu_count();
+  pages_ = new steal_time_page_t[page_count_];
+  guest_pa_ = new uint64_t[page_count_];
+
+  if (!pages_ || !guest_pa_)
+  {
+    free();
+    return;
+  }
+
+  memset(pages_, 0, sizeof(steal_time_page_t) * page_count_);
+  memset(guest_pa_, 0, sizeof(uint64_t) * page_count_);
+
+  for (uint32_t i = 0; i < page_count_; ++i)
+  {
+    pages_[i].cpu_index = i;
+  }
+}
+
+void steal_time_t::free() noexcept
+{
+  delete[] guest_pa_;
+  delete[] pages_;
+  guest_pa_ = nullptr;
+  pages_ = nullptr;
+  page_count_ = 0;
+  mapped_count_ = 0;
+}
+
+void steal_time_t::initialize(uint32_t cpu_index) noexcept
+{
+  page_        = nullptr;
+  cpu_index_   = cpu_index;
+  exit_count_  = 0;
+  root_cycles_ = 0;
+}
+
+bool steal_time_t::map(vcpu_t& vp, void* guest_va, uint64_t page_count) noexcept
+{
+  auto guest_va_value = reinterpret_cast<uint64_t>(guest_va);
+
+  //
+  // Only kernel-mode registrants are accepted - see steal_time_t.
+  //
+  if (!pages_ || page_ ||
+      vp.guest_cs().selector.request_privilege_level != 0 ||
+      page_count < page_count_ ||
+      (guest_va_value & (page_size - 1)))
+  {
+    return false;
+  }
+
+  {
+    cr3_guard _(vp.guest_cr3());
+
+    //
+    // Pages which aren't present would translate to PA 0 - that would
+    // redirect the first page of RAM.
+    //
+    if (!guest_buffer_writable(guest_va, page_count_ * page_size))
+    {
+      return false;
+    }
+
+    std::lock_guard _lock(lock_);
+
+    //
+    // The first VCPU records the physical pages of the array, the others
+    // must register the same pages - unmap() restores the EPT entries by
+    // the recorded physical addresses (the registrant's address space
+    // isn't needed anymore then).
+    //
+    for (uint32_t i = 0; i < page_count_; ++i)
+    {
+      auto guest_pa = pa_t::from_va(reinterpret_cast<uint8_t*>(guest_va) + i * page_size);
+
+      if (mapped_count_ && guest_pa_[i] != guest_pa.value())
+      {
+        return false;
+      }
+    }
+
+    for (uint32_t i = 0; i < page_count_; ++i)
+    {
+      auto guest_pa = pa_t::from_va(reinterpret_cast<uint8_t*>(guest_va) + i * page_size);
+
+      guest_pa_[i] = guest_pa.value();
+      vp.ept().map_4kb(guest_pa, pa_t::from_va(&pages_[i]), epte_t::access_type::read_write);
+    }
+
+    mapped_count_ += 1;
+  }
+
+  vmx::invept(vmx::invept_t::all_context);
+
+  page_ = &pages_[cpu_index_];
+
+  return true;
+}
+
+bool steal_time_t::unmap(vcpu_t& vp) noexcept
+{
+  if (!page_ || vp.guest_cs().selector.request_privilege_level != 0)
+  {
+    return false;
+  }
+
+  {
+    std::lock_guard _(lock_);
+
+    for (uint32_t i = 0; i < page_count_; ++i)
+    {
+      vp.ept().map_4kb(pa_t(guest_pa_[i]), pa_t(guest_pa_[i]), epte_t::access_type::read_write_execute);
+    }
+
+    mapped_count_ -= 1;
+  }
+
+  vmx::invept(vmx::invept_t::all_context);
+
+  page_ = nullptr;
+
+  return true;
+}
+
+}
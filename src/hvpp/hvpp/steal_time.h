@@ -0,0 +1,127 @@
+#pragma once
+#include "ia32/memory.h"
+#include "lib/spinlock.h"
+
+#include <atomic>
+#include <cstdint>
+
+namespace hvpp {
+
+using namespace ia32;
+
+class vcpu_t;
+
+//
+// Layout of the page shared with the guest - one page per VCPU.
+//
+// The guest reads the page the same way as seqlock::read() does - "version"
+// is odd while the page is being updated:
+//
+//   do {
+//     version = page->version;
+//     copy = *page;
+//   } while ((version & 1) || version != page->version);
+//
+// All times are in TSC ticks. "root_cycles" is the time spent in hvpp
+// between the VM-exit and the following VM-entry - it does not include the
+// VM-exit/VM-entry transitions themselves.
+//
+
+struct alignas(page_size) steal_time_page_t
+{
+  uint32_t version;
+  uint32_t cpu_index;
+  uint64_t exit_count;
+  uint64_t root_cycles;
+  uint64_t last_exit_tsc;
+  uint8_t  reserved[page_size - 32];
+};
+
+static_assert(sizeof(steal_time_page_t) == page_size);
+
+//
+// Per-VCPU accounting of the time spent in VMX root, published to the
+// guest without any VM-exit.
+//
+// The pages are owned by the hypervisor. The guest registers its own
+// (page-aligned) array of pages - one page per logical CPU - on each
+// logical CPU, and each VCPU then maps these guest pages onto the
+// hypervisor pages in its EPT. Therefore the guest can read the counters
+// of any CPU from any CPU. All CPUs must register the same array.
+//
+// The registrant must run in kernel mode and the array must stay allocated
+// (in non-paged memory) until it's unregistered on all CPUs - the
+// redirection outlives the registrant, and whatever the OS put into these
+// physical pages after they've been freed would be lost. User-mode
+// registrants are refused, because their pages are freed by the OS
+// whenever the process exits (or crashes).
+//
+
+class steal_time_t
+{
+  public:
+    //
+    // Allocates (frees) the pages for all VCPUs. Called by the hypervisor
+    // before any VCPU is initialized (after all VCPUs are destroyed).
+    //
+    static void allocate() noexcept;
+    static void free() noexcept;
+
+    void initialize(uint32_t cpu_index) noexcept;
+
+    //
+    // Maps (unmaps) the guest pages in the EPT of the current VCPU.
+    // Returns false if the caller doesn't run in kernel mode, if the guest
+    // buffer is invalid, any of its pages isn't present or if it differs
+    // from the array registered on other CPUs.
+    //
+    bool map(vcpu_t& vp, void* guest_va, uint64_t page_count) noexcept;
+    bool unmap(vcpu_t& vp) noexcept;
+
+    uint64_t exit_count() const noexcept { return exit_count_; }
+    uint64_t root_cycles() const noexcept { return root_cycles_; }
+
+    void update(uint64_t exit_tsc, uint64_t entry_tsc) noexcept
+    {
+      exit_count_  += 1;
+      root_cycles_ += entry_tsc - exit_tsc;
+
+      if (!page_)
+      {
+        return;
+      }
+
+      page_->version += 1;
+      std::atomic_thread_fence(std::memory_order_release);
+
+      page_->exit_count    = exit_count_;
+      page_->root_cycles   = root_cycles_;
+      page_->last_exit_tsc = exit_tsc;
+
+      std::atomic_thread_fence(std::memory_order_release);
+      page_->version += 1;
+    }
+
+  private:
+    static steal_time_page_t* pages_;
+    static uint32_t           page_count_;
+
+    //
+    // Physical addresses of the registered guest pages - unmap() restores
+    // the EPT entries by them. Valid while "mapped_count_" is non-zero.
+    //
+    static uint64_t*          guest_pa_;
+    static uint32_t           mapped_count_;
+    static spinlock           lock_;
+
+    //
+    // Non-null while the guest pages are mapped.
+    //
+    steal_time_page_t* page_;
+    uint32_t           cpu_index_;
+
+    uint64_t           exit_count_;
+    uint64_t           root_cycles_;
+};
+
+}
@@ -0,0 +1,445 @@
+#pragma once
+#include "trace_file.h"
+
+#include <algorithm> // std::min()
+#include <cstdint>
+#include <cstring>
+
+//
+// Delta encoding of trace records - the chunks of compact traces (see
+// trace_file.h).
+//
+// Each record is encoded as:
+//   uint8_t control
+//     bits 0-1 - record type
+//     bit  2   - exit reason follows (it differs from the previous record)
+//     bit  3   - module id follows
+//     bit  4   - CR3 follows
+//     bit  5   - LBR entries follow
+//   varint  TSC - TSC of the previous record
+//   varint  zigzag(RIP - RIP of the previous record)
+//   varint  handler ticks            (VM-exits only)
+//   varint  exit reason              (bit 2)
+//   varint  module id + 1            (bit 3, 0 is invalid_module_id)
+//   varint  CR3 code                 (bit 4, see below)
+//   uint8_t LBR count                (bit 5), followed by LBR entries:
+//   varint    zigzag(from - from of the previous entry (RIP for the first))
+//   varint    zigzag(to - from)
+//
+// Varints are LEB128 - 7 bits per byte, the least significant group first.
+// TSC deltas are unsigned - records of one chunk belong to a single CPU and
+// are in the order of their TSC.
+//
+// CR3 code is either an index into the dictionary of recently seen CR3
+// values, or dictionary_size followed by the varint CR3 - the new value
+// then replaces dictionary entries round-robin. Address spaces are
+// switched far less often than VM-exits happen, so most records don't
+// carry CR3 at all and the rest usually take a single byte.
+//
+// module_offset isn't stored - the decoder computes it from the module
+// table (if there is any).
+//
+// The previous values and the dictionary are reset at each sync point
+// (chunk_header_t), so chunks are decoded independently of each other.
+// Neither the encoder nor the decoder allocate memory - the encoder can be
+// used in VM-exit handler.
+//
+
+namespace hvpp::trace_file {
+
+namespace codec {
+
+enum : uint8_t
+{
+  control_type_mask   = 0x03,
+  control_exit_reason = 0x04,
+  control_module_id   = 0x08,
+  control_cr3         = 0x10,
+  control_lbr         = 0x20,
+};
+
+static constexpr int dictionary_size = 16;
+
+//
+// Worst-case size of one encoded record.
+//
+static constexpr uint32_t max_record_size = 1 + 10 + 10 + 5 + 3 + 5 + (1 + 10) + 1 + max_lbr_count * (10 + 10);
+
+static constexpr uint32_t chunk_data_size = chunk_size - sizeof(chunk_header_t);
+
+inline uint64_t zigzag_encode(uint64_t value) noexcept
+{
+  return (value << 1) ^ static_cast<uint64_t>(static_cast<int64_t>(value) >> 63);
+}
+
+inline uint64_t zigzag_decode(uint64_t value) noexcept
+{
+  return (value >> 1) ^ (~(value & 1) + 1);
+}
+
+inline uint8_t* put_varint(uint8_t* p, uint64_t value) noexcept
+{
+  while (value >= 0x80)
+  {
+    *p++ = static_cast<uint8_t>(value) | 0x80;
+    value >>= 7;
+  }
+
+  *p++ = static_cast<uint8_t>(value);
+  return p;
+}
+
+//
+// Returns nullptr if the varint is truncated (reaches "end") or longer
+// than 10 bytes.
+//
+inline const uint8_t* get_varint(const uint8_t* p, const uint8_t* end, uint64_t& value) noexcept
+{
+  value = 0;
+
+  for (int shift = 0; shift < 64 && p < end; shift += 7)
+  {
+    auto byte = *p++;
+    value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+
+    if (!(byte & 0x80))
+    {
+      return p;
+    }
+  }
+
+  return nullptr;
+}
+
+//
+// Values of the previous record - shared by the encoder and the decoder,
+// so that both of them evolve the same way.
+//
+struct state_t
+{
+  void reset(const chunk_header_t& chunk) noexcept
+  {
+    tsc         = chunk.tsc;
+    rip         = chunk.rip;
+    cr3         = 0;
+    module_id   = module_map::invalid_module_id;
+    exit_reason = 0;
+    next_entry  = 0;
+    memset(dictionary, 0, sizeof(dictionary));
+  }
+
+  void insert(uint64_t value) noexcept
+  {
+    dictionary[next_entry] = value;
+    next_entry = (next_entry + 1) % dictionary_size;
+  }
+
+  uint64_t tsc;
+  uint64_t rip;
+  uint64_t cr3;
+  uint32_t module_id;
+  uint16_t exit_reason;
+  uint16_t next_entry;
+  uint64_t dictionary[dictionary_size];
+};
+
+}
+
+class compact_encoder_t
+{
+  public:
+    compact_encoder_t() noexcept
+      : chunk_(nullptr)
+      , state_()
+    {
+
+    }
+
+    //
+    // Starts new chunk - the record (which is then passed to encode()) is
+    // its sync point. The memory of the chunk must be chunk_size bytes.
+    //
+    void begin(chunk_header_t* chunk, uint64_t sequence, const record_t& record) noexcept
+    {
+      chunk->sequence     = sequence;
+      chunk->tsc          = record.tsc;
+      chunk->rip          = record.rip;
+      chunk->cpu_index    = record.cpu_index;
+      chunk->record_count = 0;
+      chunk->data_size    = 0;
+      chunk->reserved     = 0;
+
+      chunk_ = chunk;
+      state_.reset(*chunk);
+    }
+
+    //
+    // Detaches the encoder from the current chunk (e.g. when the memory of
+    // the chunk is about to be reused).
+    //
+    void end() noexcept
+    {
+      chunk_ = nullptr;
+    }
+
+    //
+    // Appends the record to the current chunk. Returns false if there is
+    // no current chunk or the chunk is full - the caller then has to
+    // begin() new chunk and encode the record again.
+    //
+    bool encode(const record_t& record) noexcept
+    {
+      using namespace codec;
+
+      if (!chunk_ ||
+          chunk_->data_size + max_record_size > chunk_data_size ||
+          chunk_->record_count == UINT16_MAX)
+      {
+        return false;
+      }
+
+      auto begin = reinterpret_cast<uint8_t*>(chunk_ + 1) + chunk_->data_size;
+      auto p = begin + 1;
+      auto control = static_cast<uint8_t>(static_cast<uint8_t>(record.type) & control_type_mask);
+
+      p = put_varint(p, record.tsc - state_.tsc);
+      p = put_varint(p, zigzag_encode(record.rip - state_.rip));
+
+      if (record.type == record_type::vmexit)
+      {
+        p = put_varint(p, record.handler_ticks);
+      }
+
+      if (record.exit_reason != state_.exit_reason)
+      {
+        control |= control_exit_reason;
+        p = put_varint(p, record.exit_reason);
+      }
+
+      if (record.module_id != state_.module_id)
+      {
+        control |= control_module_id;
+        p = put_varint(p, static_cast<uint32_t>(record.module_id + 1));
+      }
+
+      if (record.cr3 != state_.cr3)
+      {
+        control |= control_cr3;
+        p = put_cr3(p, record.cr3);
+      }
+
+      auto lbr_count = record.flags & flag_lbr
+        ? std::min<uint32_t>(record.lbr_count, max_lbr_count)
+        : 0;
+
+      if (lbr_count)
+      {
+        control |= control_lbr;
+        *p++ = static_cast<uint8_t>(lbr_count);
+
+        auto previous = record.rip;
+
+        for (uint32_t i = 0; i < lbr_count; ++i)
+        {
+          p = put_varint(p, zigzag_encode(record.lbr[i].from - previous));
+          p = put_varint(p, zigzag_encode(record.lbr[i].to - record.lbr[i].from));
+          previous = record.lbr[i].from;
+        }
+      }
+
+      *begin = control;
+
+      state_.tsc         = record.tsc;
+      state_.rip         = record.rip;
+      state_.cr3         = record.cr3;
+      state_.module_id   = record.module_id;
+      state_.exit_reason = record.exit_reason;
+
+      chunk_->data_size    += static_cast<uint16_t>(p - begin);
+      chunk_->record_count += 1;
+      return true;
+    }
+
+  private:
+    uint8_t* put_cr3(uint8_t* p, uint64_t cr3) noexcept
+    {
+      using namespace codec;
+
+      for (int i = 0; i < dictionary_size; ++i)
+      {
+        if (state_.dictionary[i] == cr3)
+        {
+          return put_varint(p, i);
+        }
+      }
+
+      state_.insert(cr3);
+
+      p = put_varint(p, dictionary_size);
+      return put_varint(p, cr3);
+    }
+
+    chunk_header_t* chunk_;
+    codec::state_t  state_;
+};
+
+class compact_decoder_t
+{
+  public:
+    compact_decoder_t(const module_map::module_t* modules = nullptr, uint32_t module_count = 0) noexcept
+      : modules_(modules)
+      , module_count_(module_count)
+      , state_()
+    {
+
+    }
+
+    //
+    // Decodes records of the chunk (chunk_size bytes) and calls fn(record)
+    // for each of them. Returns number of decoded records - which is less
+    // than chunk->record_count if the chunk is corrupted.
+    //
+    template <typename FN>
+    uint32_t decode(const chunk_header_t* chunk, FN fn) noexcept
+    {
+      using namespace codec;
+
+      if (chunk->data_size > chunk_data_size)
+      {
+        return 0;
+      }
+
+      auto p = reinterpret_cast<const uint8_t*>(chunk + 1);
+      auto end = p + chunk->data_size;
+
+      record_t record{};
+      record.cpu_index = chunk->cpu_index;
+
+      state_.reset(*chunk);
+
+      uint32_t result = 0;
+
+      while (result < chunk->record_count)
+      {
+        if (!decode_record(p, end, record))
+        {
+          break;
+        }
+
+        fn(static_cast<const record_t&>(record));
+        result += 1;
+      }
+
+      return result;
+    }
+
+  private:
+    bool decode_record(const uint8_t*& p, const uint8_t* end, record_t& record) noexcept
+    {
+      using namespace codec;
+
+      if (p >= end)
+      {
+        return false;
+      }
+
+      auto control = *p++;
+      uint64_t value;
+
+      if (!(p = get_varint(p, end, value))) return false;
+      state_.tsc += value;
+
+      if (!(p = get_varint(p, end, value))) return false;
+      state_.rip += zigzag_decode(value);
+
+      record.type = static_cast<record_type>(control & control_type_mask);
+      record.handler_ticks = 0;
+
+      if (record.type == record_type::vmexit)
+      {
+        if (!(p = get_varint(p, end, value))) return false;
+        record.handler_ticks = static_cast<uint32_t>(value);
+      }
+
+      if (control & control_exit_reason)
+      {
+        if (!(p = get_varint(p, end, value))) return false;
+        state_.exit_reason = static_cast<uint16_t>(value);
+      }
+
+      if (control & control_module_id)
+      {
+        if (!(p = get_varint(p, end, value))) return false;
+        state_.module_id = static_cast<uint32_t>(value - 1);
+      }
+
+      if (control & control_cr3)
+      {
+        if (!(p = get_varint(p, end, value))) return false;
+
+        if (value < dictionary_size)
+        {
+          state_.cr3 = state_.dictionary[value];
+        }
+        else if (value == dictionary_size)
+        {
+          if (!(p = get_varint(p, end, value))) return false;
+          state_.cr3 = value;
+          state_.insert(value);
+        }
+        else
+        {
+          return false;
+        }
+      }
+
+      record.flags = 0;
+      record.lbr_count = 0;
+
+      if (control & control_lbr)
+      {
+        if (p >= end || *p == 0 || *p > max_lbr_count)
+        {
+          return false;
+        }
+
+        auto lbr_count = *p++;
+        auto previous = state_.rip;
+
+        for (uint32_t i = 0; i < lbr_count; ++i)
+        {
+          if (!(p = get_varint(p, end, value))) return false;
+          record.lbr[i].from = previous + zigzag_decode(value);
+
+          if (!(p = get_varint(p, end, value))) return false;
+          record.lbr[i].to = record.lbr[i].from + zigzag_decode(value);
+
+          previous = record.lbr[i].from;
+        }
+
+        record.flags = flag_lbr;
+        record.lbr_count = lbr_count;
+      }
+
+      record.tsc           = state_.tsc;
+      record.rip           = state_.rip;
+      record.cr3           = state_.cr3;
+      record.exit_reason   = state_.exit_reason;
+      record.module_id     = state_.module_id;
+      record.module_offset = 0;
+
+      if (record.module_id < module_count_ &&
+          record.rip - modules_[record.module_id].base < modules_[record.module_id].size)
+      {
+        record.module_offset = static_cast<uint32_t>(record.rip - modules_[record.module_id].base);
+      }
+
+      return true;
+    }
+
+    const module_map::module_t* modules_;
+    uint32_t                    module_count_;
+    codec::state_t              state_;
+};
+
+}
@@ -0,0 +1,147 @@
+#pragma once
+#include "lib/module_map.h"
+
+#include <cstddef>
+#include <cstdint>
+
+//
+// On-disk format of binary VM-exit/sample traces.
+//
+// The file consists of:
+//   - header (file_header_t)
+//   - module table (module_count * module_map::module_t) at module_offset
+//   - records (record_count * record_size bytes) at record_offset
+//
+// Records have fixed size, which is stored in the header. New fields may
+// only be appended to the record_t (and the version incremented) - readers
+// then step through the records by record_size and ignore fields they don't
+// know about. This allows the file to be mapped into memory and parsed in
+// place, without any copying.
+//
+// If the producer didn't finish the file (e.g. the system crashed),
+// record_count is 0 and the number of records is derived from the file size.
+//
+// Compact traces (magic "hvtc") use the same header and module table, but
+// the records are delta-encoded into fixed-size chunks (see
+// trace_codec.h). record_size is then the size of the chunk and
+// record_count the number of chunks. Each chunk starts with a sync point
+// (chunk_header_t) which carries absolute values, so any chunk can be
+// decoded without the preceding ones.
+//
+
+namespace hvpp::trace_file {
+
+static constexpr uint32_t magic   = 0x72747668; // "hvtr"
+static constexpr uint16_t version = 2;
+
+static constexpr uint32_t compact_magic   = 0x63747668; // "hvtc"
+static constexpr uint16_t compact_version = 1;
+
+//
+// Size of the record in version 1 (without LBR).
+//
+static constexpr uint32_t record_v1_size = 48;
+
+static constexpr int max_lbr_count = 8;
+
+enum class record_type : uint16_t
+{
+  vmexit = 0,
+  sample = 1,
+};
+
+enum : uint16_t
+{
+  flag_lbr = 0x0001,
+};
+
+struct lbr_entry_t
+{
+  uint64_t from;
+  uint64_t to;
+};
+
+struct file_header_t
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t header_size;
+  uint32_t record_size;
+  uint32_t module_count;
+  uint64_t module_offset;
+  uint64_t record_offset;
+  uint64_t record_count;
+  uint64_t tsc_frequency;
+  uint32_t cpu_count;
+  uint32_t reserved1;
+  uint64_t reserved2;
+};
+
+struct record_t
+{
+  uint64_t    tsc;
+  uint64_t    cr3;
+  uint64_t    rip;
+
+  //
+  // Guest RIP resolved by module_map::lookup() at the time of the record
+  // (module_id is module_map::invalid_module_id if RIP doesn't belong to
+  // any known module).
+  //
+  uint32_t    module_id;
+  uint32_t    module_offset;
+
+  //
+  // TSC ticks spent in the VM-exit handler (0 for samples).
+  //
+  uint32_t    handler_ticks;
+  uint16_t    exit_reason;
+  uint16_t    cpu_index;
+
+  record_type type;
+  uint16_t    flags;
+  uint32_t    reserved;
+
+  //
+  // Version 2 - top of the guest's LBR stack at the time of the VM-exit,
+  // the most recent branch first. Valid only if flags & flag_lbr.
+  //
+  uint32_t    lbr_count;
+  uint32_t    reserved2;
+  lbr_entry_t lbr[max_lbr_count];
+};
+
+//
+// Sync point at the beginning of each chunk of the compact trace. The
+// encoded records (data_size bytes) follow the header. All records of the
+// chunk belong to the same CPU.
+//
+struct chunk_header_t
+{
+  //
+  // Per-CPU sequence number of the chunk - chunks of single CPU are
+  // ordered by it.
+  //
+  uint64_t sequence;
+
+  //
+  // TSC and RIP of the first record of the chunk - deltas of the first
+  // record are relative to these.
+  //
+  uint64_t tsc;
+  uint64_t rip;
+
+  uint16_t cpu_index;
+  uint16_t record_count;
+  uint16_t data_size;
+  uint16_t reserved;
+};
+
+static constexpr uint32_t chunk_size = 4096;
+
+static_assert(sizeof(file_header_t) == 64);
+static_assert(sizeof(chunk_header_t) == 32);
+static_assert(offsetof(record_t, lbr_count) == record_v1_size);
+static_assert(sizeof(record_t) == 184);
+
+}
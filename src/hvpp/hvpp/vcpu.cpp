@@ -1,9 +1,11 @@
 #include "vcpu.h"
+#include "memscan.h"
 #include "vmexit.h"
 
 #include "lib/assert.h"
 #include "lib/bitmap.h"
 #include "lib/log.h"
+#include "lib/mp.h"
 
 #include <iterator> // std::end()
 
@@ -40,6 +42,36 @@ void vcpu_t::initialize(vmexit_handler* handler) noexcept
   //
   ept_.initialize();
 
+  //
+  // Initialize queue of pending events.
+  //
+  event_queue_.initialize();
+
+  //
+  // Initialize nested VMX state.
+  //
+  nested_.initialize(*this);
+
+  //
+  // Initialize accounting of the time spent in VMX root.
+  //
+  steal_time_.initialize(mp::cpu_index());
+
+  //
+  // HLT exiting is enabled on demand (see idle_time_t::enable()).
+  //
+  idle_time_.initialize(mp::cpu_index());
+
+  //
+  // Detect LBRs (they're enabled on demand - see vmexit_stats_handler).
+  //
+  lbr_.initialize();
+
+  //
+  // Profiler is enabled on demand (see profiler_t::configure()).
+  //
+  profiler_.initialize();
+
   //
   // Initialize VM-exit handler.
   //
@@ -171,6 +203,12 @@ void vcpu_t::terminate() noexcept
     //
     write<cr3_t>(guest_cr3());
 
+    //
+    // Give LBRs back to the guest (this restores IA32_LBR_SELECT).
+    //
+    lbr_.disable(*this);
+    profiler_.disable(*this);
+
     //
     // Turn off VMX-root mode on this logical processor.
     //
@@ -443,6 +481,11 @@ void vcpu_t::setup_guest() noexcept
 
 void vcpu_t::entry_host() noexcept
 {
+  //
+  // Time of the VM-exit as close as we can get (see steal_time_t).
+  //
+  auto exit_tsc = ia32_asm_read_tsc();
+
   //
   // Reset RIP-adjust flag.
   //
@@ -471,6 +514,18 @@ void vcpu_t::entry_host() noexcept
   //
   ia32_asm_fx_save(&fxsave_area_);
 
+  //
+  // End the halt of the guest (if any) which preceded this VM-exit. As the
+  // rest of the VM-exit processing, this must not run before the "fxsave"
+  // (only the TSC read above does).
+  //
+  idle_time_.exit(*this, exit_tsc);
+
+  //
+  // Take back the queued event if its delivery has been interrupted.
+  //
+  event_queue_.exit();
+
   auto saved_rsp    = exit_context_.rsp;
   auto saved_rflags = exit_context_.rflags;
 
@@ -506,9 +561,40 @@ void vcpu_t::entry_host() noexcept
     guest_rflags(exit_context_.rflags);
   }
 
+  //
+  // Inject queued event (if the guest can accept it).
+  //
+  event_queue_.deliver(*this);
+
   exit_context_.rflags = saved_rflags;
   exit_context_.rsp    = saved_rsp;
-  exit_context_.rip    = reinterpret_cast<uint64_t>(&vmx::vmresume);
+
+  //
+  // The first VM-entry into L2 has to be done by VMLAUNCH (see nested_vmx_t).
+  //
+  exit_context_.rip    = nested_.take_launch_request()
+                           ? reinterpret_cast<uint64_t>(&vmx::vmlaunch)
+                           : reinterpret_cast<uint64_t>(&vmx::vmresume);
+
+  //
+  // Deferred work - within the time budget of this VM-exit.
+  //
+  memory_scanner_t::run();
+
+  //
+  // Apply new profiler configuration (if any).
+  //
+  profiler_.update(*this);
+
+  //
+  // Time of the VM-entry as close as we can get.
+  //
+  {
+    auto entry_tsc = ia32_asm_read_tsc();
+
+    idle_time_.entry(entry_tsc);
+    steal_time_.update(exit_tsc, entry_tsc);
+  }
 
 exit:
   ia32_asm_fx_restore(&fxsave_area_);
@@ -1,5 +1,11 @@
 #pragma once
 #include "ept.h"
+#include "event_queue.h"
+#include "idle_time.h"
+#include "lbr.h"
+#include "nested.h"
+#include "profiler.h"
+#include "steal_time.h"
 
 #include "ia32/arch.h"
 #include "ia32/exception.h"
@@ -114,6 +120,12 @@ class vcpu_t
     void exit_handler(vmexit_handler* handler) noexcept;
 
     ept_t& ept() noexcept { return ept_; }
+    event_queue_t& event_queue() noexcept { return event_queue_; }
+    nested_vmx_t& nested() noexcept { return nested_; }
+    steal_time_t& steal_time() noexcept { return steal_time_; }
+    idle_time_t& idle_time() noexcept { return idle_time_; }
+    lbr_t& lbr() noexcept { return lbr_; }
+    profiler_t& profiler() noexcept { return profiler_; }
 
     context_t& exit_context() { return exit_context_; }
     void suppress_rip_adjust() noexcept { suppress_rip_adjust_ = true; }
@@ -125,15 +137,17 @@ class vcpu_t
   public:
     auto exit_interrupt_info() const noexcept -> interrupt_info_t;
     void inject(interrupt_info_t interrupt) noexcept;
+    bool post(interrupt_info_t interrupt) noexcept;
 
     auto exit_instruction_info_guest_va() const noexcept -> void*;
 
+    auto vcpu_id() const noexcept -> uint16_t;
+
   private:
     //
     // Control state
     //
 
-    auto vcpu_id() const noexcept -> uint16_t;
     void vcpu_id(uint16_t virtual_processor_identifier) noexcept;
     auto ept_pointer() const noexcept -> ept_ptr_t;
     void ept_pointer(ept_ptr_t ept_pointer) noexcept;
@@ -308,6 +322,8 @@ class vcpu_t
     //
 
   private:
+    friend class nested_vmx_t;
+
     void error() noexcept;
     void setup() noexcept;
 
@@ -348,6 +364,12 @@ class vcpu_t
     vmexit_handler*    handler_;
     vcpu_state         state_;
     ept_t              ept_;
+    event_queue_t      event_queue_;
+    nested_vmx_t       nested_;
+    steal_time_t       steal_time_;
+    idle_time_t        idle_time_;
+    lbr_t              lbr_;
+    profiler_t         profiler_;
     bool               suppress_rip_adjust_;
 };
 
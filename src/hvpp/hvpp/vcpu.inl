@@ -105,6 +105,16 @@ void vcpu_t::inject(interrupt_info_t interrupt) noexcept
   }
 }
 
+bool vcpu_t::post(interrupt_info_t interrupt) noexcept
+{
+  //
+  // Unlike inject(), the event is queued and injected as soon as the guest
+  // can accept it (see event_queue_t).
+  //
+  return event_queue_.post(interrupt.type(), interrupt.vector(),
+                           interrupt.error_code(), interrupt.error_code_valid());
+}
+
 auto vcpu_t::exit_instruction_info_guest_va() const noexcept -> void*
 {
   auto instruction_info = exit_instruction_info().common;
@@ -0,0 +1,171 @@
+#pragma once
+#include <cstdint>
+
+namespace hvpp {
+
+//
+// Numbers of all VMCALLs handled by hvpp (passed in RCX). Arguments are
+// passed in RDX, R8 and R9, the result is returned in RAX. Buffers are
+// virtual addresses in the address space of the caller and they must be
+// locked in memory.
+//
+// Note that hvppctrl uses the raw numbers - keep them stable.
+//
+
+//
+// vmexit_handler
+//
+
+//
+// Turns the hypervisor off on the current CPU (kernel mode only).
+//
+static constexpr uint64_t vmcall_terminate_id         = 0xDEAD;
+
+//
+// Breaks into the debugger attached to the hypervisor.
+//
+static constexpr uint64_t vmcall_breakpoint_id        = 0xAABB;
+
+//
+// Nested VMX (only with HVPP_ENABLE_NESTED_VMX).
+//   shadowing - RDX = enable VMCS shadowing, previous state is returned.
+//               Statistics are reset, so that they can be compared
+//               afterwards.
+//   stats     - RDX = index of the counter (see nested_vmx_t::stats_t).
+//
+static constexpr uint64_t vmcall_nested_shadowing_id  = 0xc7;
+static constexpr uint64_t vmcall_nested_stats_id      = 0xc8;
+
+//
+// vmexit_stats_handler
+//
+
+//
+// Copies history of the current CPU into the caller's buffer.
+//   RDX - pointer to the buffer
+//   R8  - size of the buffer
+// Number of copied bytes is returned.
+//
+static constexpr uint64_t vmcall_history_id           = 0xc4;
+
+//
+// Copies current configuration (config_t) into the caller's buffer (get)
+// or replaces the configuration with the content of the caller's buffer
+// (set).
+//   RDX - pointer to config_t
+// 1 is returned on success, 0 otherwise.
+//
+static constexpr uint64_t vmcall_config_get_id        = 0xc5;
+static constexpr uint64_t vmcall_config_set_id        = 0xc6;
+
+//
+// Copies LBR trace (lbr_trace_t) of the current CPU into the caller's
+// buffer.
+//   RDX - pointer to the buffer
+//   R8  - size of the buffer
+// Number of copied bytes is returned.
+//
+static constexpr uint64_t vmcall_lbr_trace_id         = 0xcc;
+
+//
+// Copies compact trace (compact_trace_t) of the current CPU into the
+// caller's buffer.
+//   RDX - pointer to the buffer
+//   R8  - size of the buffer
+// Number of copied bytes is returned.
+//
+static constexpr uint64_t vmcall_compact_trace_id     = 0xd6;
+
+//
+// custom_vmexit_handler
+//
+
+//
+// EPT hook example - RDX = page with the data the guest reads, R8 = page
+// with the code the guest executes (hook), no arguments for unhook.
+//
+static constexpr uint64_t vmcall_hook_id              = 0xc1;
+static constexpr uint64_t vmcall_unhook_id            = 0xc2;
+
+//
+// RDX = non-zero turns CR3-load exiting on, zero turns it off.
+//
+static constexpr uint64_t vmcall_cr3_load_exiting_id  = 0xc3;
+
+//
+// Steal time (see steal_time_t).
+//   RDX - page-aligned array of R8 pages (at least one per logical CPU),
+//         or NULL to unregister
+// Must be called from kernel mode on each logical CPU, with the same
+// array. Non-zero is returned on success.
+//
+static constexpr uint64_t vmcall_steal_time_id        = 0xc9;
+
+//
+// Memory scanner (see memory_scanner_t).
+//   start - RDX = memscan_request_t. Request with no patterns aborts the
+//           current scan. Non-zero is returned on success.
+//   poll  - RDX = buffer for memscan_status_t followed by matches, R8 =
+//           size of the buffer, R9 = index of the first match. Index of the
+//           first copied match is returned in memscan_status_t::cursor,
+//           number of copied matches in RAX.
+//
+static constexpr uint64_t vmcall_memscan_start_id     = 0xca;
+static constexpr uint64_t vmcall_memscan_poll_id      = 0xcb;
+
+//
+// Profiler (see profiler_t).
+//   configure - RDX = sampling period (in cycles spent in VMX root), 0
+//               disables the profiler. Effective period is returned.
+//   read      - RDX = buffer for profiler_status_t followed by samples (host
+//               RIPs) of the current CPU, R8 = size of the buffer, R9 = index
+//               of the first sample. Index of the first copied sample is
+//               returned in profiler_status_t::cursor, number of copied
+//               samples in RAX.
+//
+static constexpr uint64_t vmcall_profiler_id          = 0xcd;
+static constexpr uint64_t vmcall_profiler_read_id     = 0xce;
+
+//
+// Idle time (see idle_time_t).
+//   enable - RDX = non-zero enables (and resets) idle time accounting on
+//            the current CPU, zero disables it. Non-zero is returned on
+//            success.
+//   status - RDX = buffer for idle_status_t of the current CPU. Non-zero
+//            is returned on success.
+//
+static constexpr uint64_t vmcall_idle_time_id         = 0xcf;
+static constexpr uint64_t vmcall_idle_status_id       = 0xd0;
+
+//
+// Bulk read of kernel memory (see bulk_reader_t).
+//   RDX - array of R8 bulk_read_descriptor_t
+//   R9  - output buffer, its size must be at least the sum of the lengths
+//         of all descriptors
+// Status of each descriptor is written back into the array, number of
+// completely read descriptors is returned.
+//
+static constexpr uint64_t vmcall_bulk_read_id         = 0xd1;
+
+//
+// Code coverage (see coverage_t).
+//   setup - RDX = coverage_request_t with virtual address ranges of the
+//           caller. Fails if coverage is armed on any CPU. Number of
+//           tracked pages is returned.
+//   arm   - RDX = non-zero arms the coverage on the current CPU, zero
+//           disarms it. Must be called on each CPU. Non-zero is returned
+//           on success.
+//   reset - RDX = new generation (coverage_status_t::generation + 1). Must
+//           be called on each CPU. Non-zero is returned on success.
+//   read  - RDX = buffer, R8 = size of the buffer. coverage_status_t is
+//           copied if the buffer is large enough for it, the bitmap and the
+//           page records only if the buffer is large enough for all of them
+//           (see coverage_status_t::required_size). Non-zero is returned if
+//           everything has been copied.
+//
+static constexpr uint64_t vmcall_coverage_setup_id    = 0xd2;
+static constexpr uint64_t vmcall_coverage_arm_id      = 0xd3;
+static constexpr uint64_t vmcall_coverage_reset_id    = 0xd4;
+static constexpr uint64_t vmcall_coverage_read_id     = 0xd5;
+
+}
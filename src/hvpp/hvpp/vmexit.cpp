@@ -1,20 +1,118 @@
 #include "vmexit.h"
 #include "vcpu.h"
+#include "coverage.h"
 #include "config.h"
+#include "vmcall.h"
 
 #include "ia32/vmx.h"
 
 #include "lib/assert.h"
 #include "lib/cr3_guard.h"
 
+#include <cstring>
+
 #ifdef HVPP_ENABLE_VMWARE_WORKAROUND
 # include "lib/vmware/vmware.h"
 #endif
 
 namespace hvpp {
 
-static constexpr uint64_t vmcall_terminate_id  = 0xDEAD;
-static constexpr uint64_t vmcall_breakpoint_id = 0xAABB;
+static constexpr uint64_t pte_present    = 1ull << 0;
+static constexpr uint64_t pte_read_write = 1ull << 1;
+static constexpr uint64_t pte_large      = 1ull << 7;
+static constexpr uint64_t pte_pfn_mask   = 0x000ffffffffff000;
+
+static bool guest_buffer_range_valid(void* buffer, size_t size) noexcept
+{
+  auto begin = reinterpret_cast<uintptr_t>(buffer);
+
+  return begin + size >= begin;
+}
+
+static bool guest_page_writable(void* va) noexcept
+{
+  auto va_value = reinterpret_cast<uint64_t>(va);
+
+  if (static_cast<uint64_t>(static_cast<int64_t>(va_value << 16) >> 16) != va_value)
+  {
+    return false;
+  }
+
+  //
+  // Walk the paging structures of the current address space - the page is
+  // writable only if the R/W bit is set in every entry on the way.
+  //
+  auto table_pa = pa_t::from_pfn(read<cr3_t>().page_frame_number);
+
+  for (auto level = page_table_level::pml4; ; --level)
+  {
+    auto table = static_cast<uint64_t*>(table_pa.va());
+
+    if (!table || pa_t::from_va(table) != table_pa)
+    {
+      return false;
+    }
+
+    auto entry = table[pa_t(va_value).index(level)];
+
+    if (!(entry & pte_present) || !(entry & pte_read_write))
+    {
+      return false;
+    }
+
+    if (level == page_table_level::pt ||
+        (level != page_table_level::pml4 && (entry & pte_large)))
+    {
+      return true;
+    }
+
+    table_pa = pa_t(entry & pte_pfn_mask);
+  }
+}
+
+bool guest_buffer_present(void* buffer, size_t size) noexcept
+{
+  if (!guest_buffer_range_valid(buffer, size))
+  {
+    return false;
+  }
+
+  auto begin = reinterpret_cast<uint8_t*>(buffer);
+
+  for (auto page = reinterpret_cast<uint8_t*>(page_align(begin));
+       page < begin + size;
+       page += page_size)
+  {
+    if (!pa_t::from_va(page).value())
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool guest_buffer_writable(void* buffer, size_t size) noexcept
+{
+  if (!guest_buffer_range_valid(buffer, size))
+  {
+    return false;
+  }
+
+  auto begin = reinterpret_cast<uint8_t*>(buffer);
+
+  for (auto page = reinterpret_cast<uint8_t*>(page_align(begin));
+       page < begin + size;
+       page += page_size)
+  {
+    if (!guest_page_writable(page))
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
 
 vmexit_handler::vmexit_handler() noexcept
 {
@@ -110,10 +208,41 @@ void vmexit_handler::setup(vcpu_t& vp) noexcept
   vp.guest_ss(seg_t{ gdtr, read<ss_t>() });
   vp.guest_tr(seg_t{ gdtr, read<tr_t>() });
   vp.guest_ldtr(seg_t{ gdtr, read<ldtr_t>() });
+
+  //
+  // Pick the narrowest INVVPID type supported by the CPU for MOV to CR3
+  // emulation (see handle_mov_cr()).
+  //
+  auto vmx_ept_vpid_cap = msr::read<msr::vmx_ept_vpid_cap_t>();
+  invvpid_cr3_type_ =
+    vmx_ept_vpid_cap.invvpid_single_context_retain_globals ? vmx::invvpid_t::single_context_retaining_globals :
+    vmx_ept_vpid_cap.invvpid_single_context                ? vmx::invvpid_t::single_context :
+                                                             vmx::invvpid_t::all_context;
+
+#ifdef HVPP_ENABLE_NESTED_VMX
+  //
+  // Intercept reads of IA32_VMX_PROCBASED_CTLS2 - VMCS shadowing isn't
+  // offered to the guest (see handle_execute_rdmsr()).
+  //
+  vmx::msr_bitmap_t msr_bitmap = vp.msr_bitmap();
+  msr_bitmap.rdmsr_low[msr::vmx_procbased_ctls2_t::msr_id / 8] |= 1 << (msr::vmx_procbased_ctls2_t::msr_id % 8);
+  vp.msr_bitmap(msr_bitmap);
+#endif
 }
 
 void vmexit_handler::handle(vcpu_t& vp) noexcept
 {
+#ifdef HVPP_ENABLE_NESTED_VMX
+  //
+  // VM-exits of the nested guest (L2) are reflected to the hypervisor
+  // running in the guest (L1).
+  //
+  if (vp.nested().in_l2() && vp.nested().reflect(vp))
+  {
+    return;
+  }
+#endif
+
   auto handler_index = static_cast<int>(vp.exit_reason());
   (this->*handlers_[handler_index])(vp);
 }
@@ -124,24 +253,35 @@ void vmexit_handler::invoke_termination() noexcept
 }
 
 // void vmexit_handler::handle_exception_or_nmi(vcpu_t& vp)                        noexcept { handle_fallback(vp); }
-void vmexit_handler::handle_external_interrupt(vcpu_t& vp)                      noexcept { handle_fallback(vp); }
+// void vmexit_handler::handle_external_interrupt(vcpu_t& vp)                      noexcept { handle_fallback(vp); }
 //void vmexit_handler::handle_triple_fault(vcpu_t& vp)                            noexcept { handle_fallback(vp); }
 void vmexit_handler::handle_init_signal(vcpu_t& vp)                             noexcept { handle_fallback(vp); }
 void vmexit_handler::handle_startup_ipi(vcpu_t& vp)                             noexcept { handle_fallback(vp); }
 void vmexit_handler::handle_io_smi(vcpu_t& vp)                                  noexcept { handle_fallback(vp); }
 void vmexit_handler::handle_smi(vcpu_t& vp)                                     noexcept { handle_fallback(vp); }
-void vmexit_handler::handle_interrupt_window(vcpu_t& vp)                        noexcept { handle_fallback(vp); }
-void vmexit_handler::handle_nmi_window(vcpu_t& vp)                              noexcept { handle_fallback(vp); }
+// void vmexit_handler::handle_interrupt_window(vcpu_t& vp)                        noexcept { handle_fallback(vp); }
+// void vmexit_handler::handle_nmi_window(vcpu_t& vp)                              noexcept { handle_fallback(vp); }
 void vmexit_handler::handle_task_switch(vcpu_t& vp)                             noexcept { handle_fallback(vp); }
 // void vmexit_handler::handle_execute_cpuid(vcpu_t& vp)                           noexcept { handle_fallback(vp); }
 void vmexit_handler::handle_execute_getsec(vcpu_t& vp)                          noexcept { handle_fallback(vp); }
-void vmexit_handler::handle_execute_hlt(vcpu_t& vp)                             noexcept { handle_fallback(vp); }
+// void vmexit_handler::handle_execute_hlt(vcpu_t& vp)                             noexcept { handle_fallback(vp); }
 // void vmexit_handler::handle_execute_invd(vcpu_t& vp)                            noexcept { handle_fallback(vp); }
 void vmexit_handler::handle_execute_invlpg(vcpu_t& vp)                          noexcept { handle_fallback(vp); }
 void vmexit_handler::handle_execute_rdpmc(vcpu_t& vp)                           noexcept { handle_fallback(vp); }
 // void vmexit_handler::handle_execute_rdtsc(vcpu_t& vp)                           noexcept { handle_fallback(vp); }
 void vmexit_handler::handle_execute_rsm_in_smm(vcpu_t& vp)                      noexcept { handle_fallback(vp); }
 // void vmexit_handler::handle_execute_vmcall(vcpu_t& vp)                          noexcept { handle_execute_vm_fallback(vp); }
+#ifdef HVPP_ENABLE_NESTED_VMX
+void vmexit_handler::handle_execute_vmclear(vcpu_t& vp)                         noexcept { vp.nested().handle_vmclear(vp); }
+void vmexit_handler::handle_execute_vmlaunch(vcpu_t& vp)                        noexcept { vp.nested().handle_vmlaunch(vp); }
+void vmexit_handler::handle_execute_vmptrld(vcpu_t& vp)                         noexcept { vp.nested().handle_vmptrld(vp); }
+void vmexit_handler::handle_execute_vmptrst(vcpu_t& vp)                         noexcept { vp.nested().handle_vmptrst(vp); }
+void vmexit_handler::handle_execute_vmread(vcpu_t& vp)                          noexcept { vp.nested().handle_vmread(vp); }
+void vmexit_handler::handle_execute_vmresume(vcpu_t& vp)                        noexcept { vp.nested().handle_vmresume(vp); }
+void vmexit_handler::handle_execute_vmwrite(vcpu_t& vp)                         noexcept { vp.nested().handle_vmwrite(vp); }
+void vmexit_handler::handle_execute_vmxoff(vcpu_t& vp)                          noexcept { vp.nested().handle_vmxoff(vp); }
+void vmexit_handler::handle_execute_vmxon(vcpu_t& vp)                           noexcept { vp.nested().handle_vmxon(vp); }
+#else
 void vmexit_handler::handle_execute_vmclear(vcpu_t& vp)                         noexcept { handle_execute_vm_fallback(vp); }
 void vmexit_handler::handle_execute_vmlaunch(vcpu_t& vp)                        noexcept { handle_execute_vm_fallback(vp); }
 void vmexit_handler::handle_execute_vmptrld(vcpu_t& vp)                         noexcept { handle_execute_vm_fallback(vp); }
@@ -151,6 +291,7 @@ void vmexit_handler::handle_execute_vmresume(vcpu_t& vp)
 void vmexit_handler::handle_execute_vmwrite(vcpu_t& vp)                         noexcept { handle_execute_vm_fallback(vp); }
 void vmexit_handler::handle_execute_vmxoff(vcpu_t& vp)                          noexcept { handle_execute_vm_fallback(vp); }
 void vmexit_handler::handle_execute_vmxon(vcpu_t& vp)                           noexcept { handle_execute_vm_fallback(vp); }
+#endif
 // void vmexit_handler::handle_mov_cr(vcpu_t& vp)                                  noexcept { handle_execute_vm_fallback(vp); }
 // void vmexit_handler::handle_mov_dr(vcpu_t& vp)                                  noexcept { handle_execute_vm_fallback(vp); }
 // void vmexit_handler::handle_execute_io_instruction(vcpu_t& vp)                  noexcept { handle_execute_vm_fallback(vp); }
@@ -170,10 +311,18 @@ void vmexit_handler::handle_virtualized_eoi(vcpu_t& vp)
 //void vmexit_handler::handle_ldtr_tr_access(vcpu_t& vp)                          noexcept { handle_fallback(vp); }
 // void vmexit_handler::handle_ept_violation(vcpu_t& vp)                           noexcept { handle_fallback(vp); }
 void vmexit_handler::handle_ept_misconfiguration(vcpu_t& vp)                    noexcept { handle_fallback(vp); }
+#ifdef HVPP_ENABLE_NESTED_VMX
+void vmexit_handler::handle_execute_invept(vcpu_t& vp)                          noexcept { vp.nested().handle_invept(vp); }
+#else
 void vmexit_handler::handle_execute_invept(vcpu_t& vp)                          noexcept { handle_execute_vm_fallback(vp); }
+#endif
 // void vmexit_handler::handle_execute_rdtscp(vcpu_t& vp)                          noexcept { handle_fallback(vp); }
 void vmexit_handler::handle_vmx_preemption_timer_expired(vcpu_t& vp)            noexcept { handle_fallback(vp); }
+#ifdef HVPP_ENABLE_NESTED_VMX
+void vmexit_handler::handle_execute_invvpid(vcpu_t& vp)                         noexcept { vp.nested().handle_invvpid(vp); }
+#else
 void vmexit_handler::handle_execute_invvpid(vcpu_t& vp)                         noexcept { handle_execute_vm_fallback(vp); }
+#endif
 // void vmexit_handler::handle_execute_wbinvd(vcpu_t& vp)                          noexcept { handle_fallback(vp); }
 // void vmexit_handler::handle_execute_xsetbv(vcpu_t& vp)                          noexcept { handle_fallback(vp); }
 void vmexit_handler::handle_apic_write(vcpu_t& vp)                              noexcept { handle_fallback(vp); }
@@ -255,6 +404,17 @@ void vmexit_handler::handle_exception_or_nmi(vcpu_t& vp) noexcept
   vp.suppress_rip_adjust();
 }
 
+void vmexit_handler::handle_external_interrupt(vcpu_t& vp) noexcept
+{
+  //
+  // External-interrupt exiting is armed only while the guest is halted
+  // (see idle_time_t). "Acknowledge interrupt on exit" is off - the
+  // interrupt stays pending and is delivered to the guest after the
+  // VM-entry, so there's nothing to re-inject.
+  //
+  vp.suppress_rip_adjust();
+}
+
 void vmexit_handler::handle_triple_fault(vcpu_t& vp) noexcept
 {
   (void)(vp);
@@ -319,6 +479,36 @@ void vmexit_handler::handle_execute_invd(vcpu_t& vp) noexcept
   ia32_asm_wb_invd();
 }
 
+void vmexit_handler::handle_interrupt_window(vcpu_t& vp) noexcept
+{
+  //
+  // Window exiting is armed only by the event queue - the queued events
+  // are injected at the end of this VM-exit (see event_queue_t::deliver()).
+  // There is no instruction to skip.
+  //
+  vp.suppress_rip_adjust();
+}
+
+void vmexit_handler::handle_nmi_window(vcpu_t& vp) noexcept
+{
+  vp.suppress_rip_adjust();
+}
+
+void vmexit_handler::handle_execute_hlt(vcpu_t& vp) noexcept
+{
+  //
+  // HLT exiting is enabled only for idle time accounting.
+  //
+  if (vp.idle_time().enabled())
+  {
+    vp.idle_time().halt(vp);
+  }
+  else
+  {
+    handle_fallback(vp);
+  }
+}
+
 void vmexit_handler::handle_execute_rdtsc(vcpu_t& vp) noexcept
 {
   uint64_t tsc = ia32_asm_read_tsc();
@@ -328,6 +518,10 @@ void vmexit_handler::handle_execute_rdtsc(vcpu_t& vp) noexcept
 
 void vmexit_handler::handle_execute_vmcall(vcpu_t& vp) noexcept
 {
+  //
+  // See vmcall.h - VMCALLs of the optional features are dispatched by the
+  // derived handlers.
+  //
   if (vp.exit_context().rcx == vmcall_terminate_id &&
       vp.guest_cs().selector.request_privilege_level == 0)
   {
@@ -337,6 +531,21 @@ void vmexit_handler::handle_execute_vmcall(vcpu_t& vp) noexcept
   {
     __debugbreak();
   }
+#ifdef HVPP_ENABLE_NESTED_VMX
+  else if (vp.exit_context().rcx == vmcall_nested_shadowing_id)
+  {
+    vp.exit_context().rax = vp.nested().shadowing();
+    vp.nested().shadowing(!!vp.exit_context().rdx);
+    vp.nested().reset_stats();
+  }
+  else if (vp.exit_context().rcx == vmcall_nested_stats_id)
+  {
+    auto index = vp.exit_context().rdx;
+    vp.exit_context().rax = index < nested_vmx_t::stats_t::id_count
+      ? vp.nested().stats().value[index]
+      : 0;
+  }
+#endif
   else
   {
     handle_execute_vm_fallback(vp);
@@ -367,18 +576,43 @@ void vmexit_handler::handle_mov_cr(vcpu_t& vp) noexcept
             // (ref: Vol2B(MOV-Move to/from Control Registers)
             // (see: Vol3A[4.10.4.1(Operations that Invalidate TLBs and Paging-Structure Caches)]
             //
-                auto cr3 = cr3_t{ gp_register };
-                if (vp.guest_cr4().pcid_enable)
-                {
-                  //
-                  // Equivalent to:
-                  //   gp_register &= ~(1ull << 63);
-                  //
-                  cr3.pcid_invalidate = false;
-                }
-                vp.guest_cr3(cr3);
-                vmx::invvpid(vmx::invvpid_t::all_context);
+            auto cr3 = cr3_t{ gp_register };
+            bool invalidate = true;
+
+            if (vp.guest_cr4().pcid_enable)
+            {
+              //
+              // Bit 63 set means "do not invalidate". Windows uses it on
+              // most context switches (PCID/KVA shadow), so flushing here
+              // would throw away the guest TLB on each switch.
+              //
+              // Equivalent to:
+              //   gp_register &= ~(1ull << 63);
+              //
+              invalidate = !cr3.pcid_invalidate;
+              cr3.pcid_invalidate = false;
+            }
+
+            vp.guest_cr3(cr3);
+
+            if (invalidate)
+            {
+              //
+              // MOV to CR3 invalidates all non-global TLB entries associated
+              // with PCID 000H (CR4.PCIDE = 0) or with the PCID specified in
+              // bits 11:0 of the source operand (CR4.PCIDE = 1).
+              //
+              // INVPCID executed in VMX root would target VPID 0, therefore
+              // we can't invalidate single guest PCID. Invalidate non-global
+              // mappings of the guest VPID instead - it's superset of what
+              // the CPU does, but it keeps global (kernel) mappings and it
+              // doesn't touch other VPIDs.
+              //
+              vmx::invvpid_desc_t descriptor{};
+              descriptor.vpid = vp.vcpu_id();
+              vmx::invvpid(invvpid_cr3_type_, &descriptor);
             }
+          }
           break;
 
         case 4:
@@ -735,7 +969,12 @@ void vmexit_handler::handle_execute_rdmsr(vcpu_t& vp) noexcept
   switch (msr_id)
   {
     case msr::debugctl_t::msr_id:
-      msr_value = vp.guest_debugctl().flags;
+      msr_value = vp.lbr().to_guest(vp.guest_debugctl()).flags;
+      break;
+
+    case msr::perf_global_ctrl_t::msr_id:
+    case msr::fixed_ctr_ctrl_t::msr_id:
+      msr_value = vp.profiler().guest_rdmsr(msr_id);
       break;
 
     case msr::fs_base_t::msr_id:
@@ -746,6 +985,20 @@ void vmexit_handler::handle_execute_rdmsr(vcpu_t& vp) noexcept
       msr_value = reinterpret_cast<uint64_t>(vp.guest_segment_base_address(context_t::seg_gs));
       break;
 
+#ifdef HVPP_ENABLE_NESTED_VMX
+    case msr::vmx_procbased_ctls2_t::msr_id:
+      {
+        //
+        // Hide "VMCS shadowing" (allowed 1-setting in bits 63:32) - shadow
+        // VMCS of L1 isn't supported by nested_vmx_t.
+        //
+        msr::vmx_procbased_ctls2_t unsupported{ 0 };
+        unsupported.vmcs_shadowing = true;
+        msr_value = msr::read(msr_id) & ~(unsupported.flags << 32);
+      }
+      break;
+#endif
+
     default:
       msr_value = msr::read(msr_id);
       break;
@@ -765,7 +1018,12 @@ void vmexit_handler::handle_execute_wrmsr(vcpu_t& vp) noexcept
   switch (msr_id)
   {
     case msr::debugctl_t::msr_id:
-      vp.guest_debugctl(msr::debugctl_t{ msr_value });
+      vp.guest_debugctl(vp.lbr().from_guest(msr::debugctl_t{ msr_value }));
+      break;
+
+    case msr::perf_global_ctrl_t::msr_id:
+    case msr::fixed_ctr_ctrl_t::msr_id:
+      vp.profiler().guest_wrmsr(msr_id, msr_value);
       break;
 
     case msr::fs_base_t::msr_id:
@@ -869,6 +1127,11 @@ void vmexit_handler::handle_ldtr_tr_access(vcpu_t& vp) noexcept
 
 void vmexit_handler::handle_ept_violation(vcpu_t& vp) noexcept
 {
+  if (coverage_t::handle_ept_violation(vp))
+  {
+    return;
+  }
+
   //
   // TODO
   //
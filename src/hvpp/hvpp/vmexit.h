@@ -1,5 +1,6 @@
 #pragma once
 #include "ia32/arch.h"
+#include "ia32/vmx.h"
 
 namespace hvpp {
 
@@ -7,6 +8,25 @@ using namespace ia32;
 
 class vcpu_t;
 
+//
+// Checks if all pages of the buffer (in the current address space) are
+// present. Page-fault in VM-exit handler would be fatal. Note that this
+// doesn't protect us from the page being paged out right after the check -
+// that's why the caller should lock the buffer in memory.
+//
+// Buffers which wrap around the end of the address space are rejected.
+// The caller is responsible for clamping "size" to the length it actually
+// uses - the check walks every page of the buffer.
+//
+bool guest_buffer_present(void* buffer, size_t size) noexcept;
+
+//
+// Same as guest_buffer_present(), but additionally checks that all pages
+// of the buffer are mapped as writable - for buffers the VM-exit handler
+// writes into (write into read-only page would be fatal too).
+//
+bool guest_buffer_writable(void* buffer, size_t size) noexcept;
+
 //
 // Base VM-exit handler.
 // This handler tries to emulate what CPU normally does when trapped events and
@@ -96,6 +116,12 @@ class vmexit_handler
   private:
     using handler_fn_t = void (vmexit_handler::*)(vcpu_t&);
     handler_fn_t handlers_[65];
+
+    //
+    // Type of INVVPID used when guest's MOV to CR3 requires TLB invalidation.
+    // Resolved in setup() according to IA32_VMX_EPT_VPID_CAP.
+    //
+    vmx::invvpid_t invvpid_cr3_type_;
 };
 
 }
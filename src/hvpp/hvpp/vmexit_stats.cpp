@@ -1,39 +1,411 @@
 #include "vmexit_stats.h"
 #include "vcpu.h"
+#include "vmcall.h"
 
 #include "ia32/vmx.h"
 #include "lib/log.h"
-#include "lib/mp.h" // mp::cpu_index()
+#include "lib/cr3_guard.h"
+#include "lib/hash_map.h"
+#include "lib/module_map.h"
+#include "lib/mp.h"  // mp::cpu_index()
+#include "lib/tsc.h" // tsc::ticks_per_ms()
 
-#include <iterator> // std::size()
+#include <algorithm> // std::partial_sort()
+#include <iterator>  // std::size()
 
 #define hv_trace_if_enabled(format, ...)                          \
   do                                                              \
   {                                                               \
-    if (vmexit_trace_bitmap_.test(static_cast<int>(exit_reason))) \
+    if (config.trace_enabled(exit_reason))                        \
     {                                                             \
-      hvpp_trace(format, __VA_ARGS__);                            \
+      hvpp_trace_rl(format, __VA_ARGS__);                         \
     }                                                             \
   } while (0)
 
 namespace hvpp {
 
+static vmexit_stats_handler::exit_class exit_class_from_reason(vmx::exit_reason exit_reason) noexcept
+{
+  using exit_class = vmexit_stats_handler::exit_class;
+
+  switch (exit_reason)
+  {
+    case vmx::exit_reason::exception_or_nmi:       return exit_class::exception_or_nmi;
+    case vmx::exit_reason::execute_cpuid:          return exit_class::cpuid;
+    case vmx::exit_reason::mov_cr:                 return exit_class::mov_cr;
+    case vmx::exit_reason::mov_dr:                 return exit_class::mov_dr;
+    case vmx::exit_reason::execute_io_instruction: return exit_class::io_instruction;
+    case vmx::exit_reason::execute_rdmsr:
+    case vmx::exit_reason::execute_wrmsr:          return exit_class::msr;
+    case vmx::exit_reason::ept_violation:
+    case vmx::exit_reason::ept_misconfiguration:   return exit_class::ept;
+    case vmx::exit_reason::execute_vmcall:         return exit_class::vmcall;
+    case vmx::exit_reason::monitor_trap_flag:      return exit_class::monitor_trap_flag;
+    default:                                       return exit_class::other;
+  }
+}
+
+static const char* exit_class_to_string(vmexit_stats_handler::exit_class value) noexcept
+{
+  using exit_class = vmexit_stats_handler::exit_class;
+
+  switch (value)
+  {
+    case exit_class::exception_or_nmi:  return "exception_or_nmi";
+    case exit_class::cpuid:             return "cpuid";
+    case exit_class::mov_cr:            return "mov_cr";
+    case exit_class::mov_dr:            return "mov_dr";
+    case exit_class::io_instruction:    return "io_instruction";
+    case exit_class::msr:               return "msr";
+    case exit_class::ept:               return "ept";
+    case exit_class::vmcall:            return "vmcall";
+    case exit_class::monitor_trap_flag: return "monitor_trap_flag";
+    case exit_class::other:             return "other";
+    default:                            return "";
+  }
+}
+
+uint64_t vmexit_stats_handler::cr3_stats_t::total_cycles() const noexcept
+{
+  uint64_t result = 0;
+  for (auto value : cycles)
+  {
+    result += value;
+  }
+  return result;
+}
+
+uint64_t vmexit_stats_handler::cr3_stats_t::total_count() const noexcept
+{
+  uint64_t result = 0;
+  for (auto value : count)
+  {
+    result += value;
+  }
+  return result;
+}
+
+auto vmexit_stats_handler::cr3_table_t::lookup(uint64_t cr3) noexcept -> cr3_stats_t&
+{
+  tick += 1;
+
+  //
+  // Consecutive VM-exits usually come from the same address space, so try
+  // the last hit first.
+  //
+  if (entry[hint].cr3 == cr3)
+  {
+    entry[hint].last_use = tick;
+    return entry[hint];
+  }
+
+  int lru_index = 0;
+  for (int i = 0; i < capacity; ++i)
+  {
+    if (entry[i].cr3 == cr3)
+    {
+      hint = i;
+      entry[i].last_use = tick;
+      return entry[i];
+    }
+
+    if (entry[i].last_use < entry[lru_index].last_use)
+    {
+      lru_index = i;
+    }
+  }
+
+  //
+  // Not found - evict the least recently used entry. Note that unused
+  // entries have last_use == 0, so they're picked first.
+  //
+  auto& result = entry[lru_index];
+  memset(&result, 0, sizeof(result));
+  result.cr3 = cr3;
+  result.last_use = tick;
+
+  hint = lru_index;
+  return result;
+}
+
+int vmexit_stats_handler::transition_stats_t::gap_bucket(uint64_t gap) noexcept
+{
+  int result = 0;
+  uint64_t limit = 1024;
+
+  while (gap >= limit && result < gap_bucket_count - 1)
+  {
+    limit <<= 2;
+    result += 1;
+  }
+
+  return result;
+}
+
 vmexit_stats_handler::vmexit_stats_handler() noexcept
   : stats_()
-  , vmexit_trace_bitmap_(vmexit_trace_bitmap_buffer_, 128)
+  , cr3_table_(nullptr)
+  , cr3_table_count_(0)
+  , transition_stats_(nullptr)
+  , transition_stats_count_(0)
+  , history_(nullptr)
+  , history_count_(0)
+  , fine_bucket_ticks_(0)
+  , coarse_bucket_ticks_(0)
+  , lbr_trace_(nullptr)
+  , lbr_trace_count_(0)
+  , compact_trace_(nullptr)
+  , compact_trace_count_(0)
+  , config_()
 {
   //
   // Trace all VM-exit reasons.
   // Tracing of specific exit reasons can be enabled/disabled via this bitmap.
   //
-  vmexit_trace_bitmap_.set();
-  // vmexit_trace_bitmap_.clear(static_cast<int>(vmx::exit_reason::exception_or_nmi));
+  config_t config;
+  memset(config.trace_bitmap, 0xff, sizeof(config.trace_bitmap));
+  config.flags = config_t::default_flags;
+
+  //
+  // LBR snapshots are disabled by default - when enabled (collect_lbr),
+  // exit reasons have to be selected explicitly.
+  //
+  memset(config.lbr_bitmap, 0, sizeof(config.lbr_bitmap));
+  config.lbr_count = trace_file::max_lbr_count;
+  config_.write(config);
+}
+
+void vmexit_stats_handler::initialize() noexcept
+{
+  vmexit_handler::initialize();
+
+  //
+  // Each VCPU has its own table, so they don't need any synchronization
+  // on the VM-exit path. They are merged when they're read.
+  //
+  // If any of the per-CPU arrays can't be allocated, only the feature
+  // which uses it is disabled (its count stays 0).
+  //
+  cr3_table_ = new cr3_table_t[mp::cpu_count()];
+
+  if (cr3_table_)
+  {
+    cr3_table_count_ = mp::cpu_count();
+    memset(cr3_table_, 0, sizeof(cr3_table_t) * cr3_table_count_);
+  }
+  else
+  {
+    hvpp_warn("Failed to allocate CR3 tables, statistics per CR3 are disabled");
+  }
+
+  transition_stats_ = new transition_stats_t[mp::cpu_count()];
+
+  if (transition_stats_)
+  {
+    transition_stats_count_ = mp::cpu_count();
+    memset(transition_stats_, 0, sizeof(transition_stats_t) * transition_stats_count_);
+  }
+  else
+  {
+    hvpp_warn("Failed to allocate transition statistics, they are disabled");
+  }
+
+  //
+  // History is kept only if TSC frequency is known - otherwise we can't
+  // convert time slots to TSC ticks.
+  //
+  fine_bucket_ticks_   = tsc::ticks_per_ms() * history_t::fine_bucket_ms;
+  coarse_bucket_ticks_ = tsc::ticks_per_ms() * history_t::coarse_bucket_ms;
+
+  if (fine_bucket_ticks_ && coarse_bucket_ticks_)
+  {
+    history_ = new history_state_t[mp::cpu_count()];
+  }
+
+  if (history_)
+  {
+    history_count_ = mp::cpu_count();
+    memset(history_, 0, sizeof(history_state_t) * history_count_);
+
+    for (uint32_t cpu_index = 0; cpu_index < history_count_; ++cpu_index)
+    {
+      history_[cpu_index].history.cpu_index = cpu_index;
+      history_[cpu_index].history.tsc_frequency = tsc::frequency();
+    }
+  }
+  else if (fine_bucket_ticks_ && coarse_bucket_ticks_)
+  {
+    hvpp_warn("Failed to allocate history, it is disabled");
+  }
+
+  lbr_trace_ = new lbr_trace_t[mp::cpu_count()];
+
+  if (lbr_trace_)
+  {
+    lbr_trace_count_ = mp::cpu_count();
+    memset(lbr_trace_, 0, sizeof(lbr_trace_t) * lbr_trace_count_);
+  }
+  else
+  {
+    hvpp_warn("Failed to allocate LBR traces, they are disabled");
+  }
+
+  compact_trace_ = new compact_trace_state_t[mp::cpu_count()];
+
+  if (compact_trace_)
+  {
+    compact_trace_count_ = mp::cpu_count();
+
+    for (uint32_t cpu_index = 0; cpu_index < compact_trace_count_; ++cpu_index)
+    {
+      memset(&compact_trace_[cpu_index].trace, 0, sizeof(compact_trace_t));
+    }
+  }
+  else
+  {
+    hvpp_warn("Failed to allocate compact traces, they are disabled");
+  }
+}
+
+void vmexit_stats_handler::destroy() noexcept
+{
+  delete[] compact_trace_;
+  compact_trace_ = nullptr;
+  compact_trace_count_ = 0;
+
+  delete[] lbr_trace_;
+  lbr_trace_ = nullptr;
+  lbr_trace_count_ = 0;
+
+  delete[] history_;
+  history_ = nullptr;
+  history_count_ = 0;
+
+  delete[] transition_stats_;
+  transition_stats_ = nullptr;
+  transition_stats_count_ = 0;
+
+  delete[] cr3_table_;
+  cr3_table_ = nullptr;
+  cr3_table_count_ = 0;
+
+  vmexit_handler::destroy();
 }
 
 void vmexit_stats_handler::handle(vcpu_t& vp) noexcept
 {
-  update_stats(vp);
+  //
+  // Save exit reason and CR3 before the handler is called - the handler
+  // might terminate the VCPU, after which VMREAD isn't allowed.
+  //
+  auto exit_reason = vp.exit_reason();
+  auto cr3 = vp.guest_cr3();
+  cr3.pcid_invalidate = false;
+
+  //
+  // Take snapshot of the configuration - it might be changed by another
+  // CPU while this VM-exit is being handled.
+  //
+  auto config = config_.read();
+
+  //
+  // Enable/disable LBRs of this VCPU when the configuration changes.
+  //
+  auto& lbr = vp.lbr();
+  bool collect_lbr = !!(config.flags & config_t::collect_lbr);
+  bool collect_trace = !!(config.flags & config_t::collect_trace);
+
+  if (lbr.supported() && lbr.enabled() != collect_lbr)
+  {
+    if (collect_lbr)
+    {
+      lbr.enable(vp);
+    }
+    else
+    {
+      lbr.disable(vp);
+    }
+  }
+
+  //
+  // The LBR stack must be read before the handler is called - the handler
+  // itself might switch to the guest's address space or resume the guest
+  // (e.g. on termination).
+  //
+  trace_file::record_t record;
+  record.lbr_count = 0;
+
+  if (lbr.enabled() && config.lbr_enabled(exit_reason))
+  {
+    lbr_t::entry_t entries[trace_file::max_lbr_count];
+    auto count = lbr.snapshot(entries, std::min(static_cast<int>(config.lbr_count),
+                                                static_cast<int>(std::size(entries))));
+
+    for (int i = 0; i < count; ++i)
+    {
+      record.lbr[i].from = entries[i].from;
+      record.lbr[i].to   = entries[i].to;
+    }
+
+    record.lbr_count = count;
+  }
+
+  if (record.lbr_count || collect_trace)
+  {
+    record.rip = vp.guest_rip();
+  }
+
+  auto tsc_begin = ia32_asm_read_tsc();
+
+  if (config.flags & config_t::collect_history)
+  {
+    update_history(vp, exit_reason, tsc_begin);
+  }
+
+  update_stats(vp, config);
   vmexit_handler::handle(vp);
+
+  auto tsc_end = ia32_asm_read_tsc();
+
+  if (config.flags & config_t::collect_cr3_stats)
+  {
+    update_cr3_stats(cr3.flags, exit_reason, tsc_end - tsc_begin);
+  }
+
+  if (config.flags & config_t::collect_transition_stats)
+  {
+    update_transition_stats(exit_reason, tsc_begin, tsc_end);
+  }
+
+  if (record.lbr_count || collect_trace)
+  {
+    record.tsc           = tsc_begin;
+    record.cr3           = cr3.flags;
+    record.handler_ticks = static_cast<uint32_t>(tsc_end - tsc_begin);
+    record.exit_reason   = static_cast<uint16_t>(exit_reason);
+    record.cpu_index     = static_cast<uint16_t>(mp::cpu_index());
+    record.type          = trace_file::record_type::vmexit;
+    record.flags         = record.lbr_count ? trace_file::flag_lbr : 0;
+    record.reserved      = 0;
+    record.reserved2     = 0;
+
+    uint64_t module_offset = 0;
+    record.module_id = module_map::invalid_module_id;
+    module_map::lookup(record.rip, record.module_id, module_offset);
+    record.module_offset = static_cast<uint32_t>(module_offset);
+
+    if (record.lbr_count)
+    {
+      update_lbr_trace(record);
+
+      hv_trace_if_enabled("lbr: %p -> %p (%u)", record.lbr[0].from, record.lbr[0].to, record.lbr_count);
+    }
+
+    if (collect_trace)
+    {
+      update_compact_trace(record);
+    }
+  }
 }
 
 void vmexit_stats_handler::invoke_termination() noexcept
@@ -46,7 +418,11 @@ void vmexit_stats_handler::invoke_termination() noexcept
   //
   if (mp::cpu_index() == 0)
   {
+    logger::rate_limit_t::flush();
+
     stats_.dump();
+    dump_cr3_stats(16);
+    dump_transition_stats(16);
   }
 }
 
@@ -55,7 +431,641 @@ const vmexit_stats_handler::stats_t& vmexit_stats_handler::stats() const noexcep
   return stats_;
 }
 
-void vmexit_stats_handler::update_stats(vcpu_t& vp) noexcept
+auto vmexit_stats_handler::config() const noexcept -> config_t
+{
+  return config_.read();
+}
+
+void vmexit_stats_handler::config(const config_t& new_config) noexcept
+{
+  config_.write(new_config);
+}
+
+void vmexit_stats_handler::handle_execute_vmcall(vcpu_t& vp) noexcept
+{
+  auto buffer = vp.exit_context().rdx_as_pointer;
+
+  switch (vp.exit_context().rcx)
+  {
+    case vmcall_history_id:
+      {
+        auto cpu_index = mp::cpu_index();
+        auto size = std::min(static_cast<size_t>(vp.exit_context().r8), sizeof(history_t));
+
+        vp.exit_context().rax = 0;
+
+        if (cpu_index >= history_count_ || !buffer || !size)
+        {
+          break;
+        }
+
+        cr3_guard _(vp.guest_cr3());
+
+        if (!guest_buffer_writable(buffer, size))
+        {
+          hvpp_trace("vmcall (history) buffer not writable: 0x%p", buffer);
+          break;
+        }
+
+        memcpy(buffer, &history_[cpu_index].history, size);
+        vp.exit_context().rax = size;
+      }
+      break;
+
+    case vmcall_lbr_trace_id:
+      {
+        auto cpu_index = mp::cpu_index();
+        auto size = std::min(static_cast<size_t>(vp.exit_context().r8), sizeof(lbr_trace_t));
+
+        vp.exit_context().rax = 0;
+
+        if (cpu_index >= lbr_trace_count_ || !buffer || !size)
+        {
+          break;
+        }
+
+        cr3_guard _(vp.guest_cr3());
+
+        if (!guest_buffer_writable(buffer, size))
+        {
+          hvpp_trace("vmcall (lbr trace) buffer not writable: 0x%p", buffer);
+          break;
+        }
+
+        memcpy(buffer, &lbr_trace_[cpu_index], size);
+        vp.exit_context().rax = size;
+      }
+      break;
+
+    case vmcall_compact_trace_id:
+      {
+        auto cpu_index = mp::cpu_index();
+        auto size = std::min(static_cast<size_t>(vp.exit_context().r8), sizeof(compact_trace_t));
+
+        vp.exit_context().rax = 0;
+
+        if (cpu_index >= compact_trace_count_ || !buffer || !size)
+        {
+          break;
+        }
+
+        cr3_guard _(vp.guest_cr3());
+
+        if (!guest_buffer_writable(buffer, size))
+        {
+          hvpp_trace("vmcall (compact trace) buffer not writable: 0x%p", buffer);
+          break;
+        }
+
+        memcpy(buffer, &compact_trace_[cpu_index].trace, size);
+        vp.exit_context().rax = size;
+      }
+      break;
+
+    case vmcall_config_get_id:
+    case vmcall_config_set_id:
+      {
+        vp.exit_context().rax = 0;
+
+        if (!buffer)
+        {
+          break;
+        }
+
+        cr3_guard _(vp.guest_cr3());
+
+        if (vp.exit_context().rcx == vmcall_config_get_id
+              ? !guest_buffer_writable(buffer, sizeof(config_t))
+              : !guest_buffer_present(buffer, sizeof(config_t)))
+        {
+          hvpp_trace("vmcall (config) buffer not present: 0x%p", buffer);
+          break;
+        }
+
+        if (vp.exit_context().rcx == vmcall_config_get_id)
+        {
+          auto current_config = config();
+          memcpy(buffer, &current_config, sizeof(config_t));
+        }
+        else
+        {
+          config_t new_config;
+          memcpy(&new_config, buffer, sizeof(config_t));
+          config(new_config);
+
+          hvpp_trace("vmcall (config) flags: 0x%x", new_config.flags);
+        }
+
+        vp.exit_context().rax = 1;
+      }
+      break;
+
+    default:
+      vmexit_handler::handle_execute_vmcall(vp);
+      break;
+  }
+}
+
+int vmexit_stats_handler::top_cr3_stats(cr3_stats_t* result, int count) const noexcept
+{
+  if (!cr3_table_ || count <= 0)
+  {
+    return 0;
+  }
+
+  //
+  // Merge entries with the same CR3 from all per-CPU tables.
+  //
+  auto merged = new cr3_stats_t[cr3_table_count_ * cr3_table_t::capacity];
+  int merged_count = 0;
+
+  if (!merged)
+  {
+    return 0;
+  }
+
+  //
+  // Index of the merged entry by CR3 - avoids quadratic lookups when there
+  // are many CPUs.
+  //
+  hash_map<uint64_t, int> merged_index(cr3_table_count_ * cr3_table_t::capacity);
+
+  if (merged_index.capacity() == 0)
+  {
+    delete[] merged;
+    return 0;
+  }
+
+  for (uint32_t cpu_index = 0; cpu_index < cr3_table_count_; ++cpu_index)
+  {
+    for (auto& entry : cr3_table_[cpu_index].entry)
+    {
+      if (entry.last_use == 0)
+      {
+        continue;
+      }
+
+      bool inserted;
+      auto index = merged_index.find_or_insert(entry.cr3, inserted);
+
+      if (inserted)
+      {
+        *index = merged_count;
+        merged[merged_count] = entry;
+        merged_count += 1;
+        continue;
+      }
+
+      auto& other = merged[*index];
+      for (int i = 0; i < static_cast<int>(exit_class::count); ++i)
+      {
+        other.count[i]  += entry.count[i];
+        other.cycles[i] += entry.cycles[i];
+      }
+    }
+  }
+
+  //
+  // Sort by the time spent in the handler.
+  //
+  count = std::min(count, merged_count);
+  std::partial_sort(merged, merged + count, merged + merged_count,
+                    [](auto& lhs, auto& rhs) { return lhs.total_cycles() > rhs.total_cycles(); });
+
+  std::copy(merged, merged + count, result);
+
+  delete[] merged;
+  return count;
+}
+
+void vmexit_stats_handler::dump_cr3_stats(int count) const noexcept
+{
+  auto top = new cr3_stats_t[count];
+
+  if (!top)
+  {
+    hvpp_warn("Failed to allocate memory for CR3 statistics");
+    return;
+  }
+
+  count = top_cr3_stats(top, count);
+
+  hvpp_info("VMEXIT statistics per CR3 (top %i)", count);
+  for (int index = 0; index < count; ++index)
+  {
+    hvpp_info("  CR3 0x%p: %llu exits, %llu cycles",
+      top[index].cr3, top[index].total_count(), top[index].total_cycles());
+
+    for (int i = 0; i < static_cast<int>(exit_class::count); ++i)
+    {
+      if (top[index].count[i] > 0)
+      {
+        hvpp_info("    %s: %u exits, %llu cycles (avg %llu)",
+          exit_class_to_string(static_cast<exit_class>(i)),
+          top[index].count[i], top[index].cycles[i],
+          top[index].cycles[i] / top[index].count[i]);
+      }
+    }
+  }
+
+  delete[] top;
+}
+
+void vmexit_stats_handler::dump_transition_stats(int count) const noexcept
+{
+  using stats = transition_stats_t;
+
+  if (!transition_stats_ || count <= 0)
+  {
+    return;
+  }
+
+  //
+  // Merge per-CPU matrices.
+  //
+  auto merged = new stats;
+
+  if (!merged)
+  {
+    hvpp_warn("Failed to allocate memory for transition statistics");
+    return;
+  }
+
+  memset(merged, 0, sizeof(*merged));
+
+  for (uint32_t cpu_index = 0; cpu_index < transition_stats_count_; ++cpu_index)
+  {
+    auto& cpu_stats = transition_stats_[cpu_index];
+
+    for (int from = 0; from < stats::reason_count; ++from)
+    {
+      for (int to = 0; to < stats::reason_count; ++to)
+      {
+        merged->count[from][to] += cpu_stats.count[from][to];
+      }
+    }
+
+    for (int from = 0; from < stats::class_count; ++from)
+    {
+      for (int to = 0; to < stats::class_count; ++to)
+      {
+        for (int bucket = 0; bucket < stats::gap_bucket_count; ++bucket)
+        {
+          merged->gap[from][to][bucket] += cpu_stats.gap[from][to][bucket];
+        }
+      }
+    }
+  }
+
+  //
+  // Find the most frequent transitions. Each transition is identified by
+  // its index into the (flattened) count matrix.
+  //
+  constexpr int transition_count = stats::reason_count * stats::reason_count;
+  auto transitions = new int[transition_count];
+
+  if (!transitions)
+  {
+    hvpp_warn("Failed to allocate memory for transition statistics");
+    delete merged;
+    return;
+  }
+
+  for (int i = 0; i < transition_count; ++i)
+  {
+    transitions[i] = i;
+  }
+
+  auto flat_count = &merged->count[0][0];
+
+  count = std::min(count, transition_count);
+  std::partial_sort(transitions, transitions + count, transitions + transition_count,
+                    [&](int lhs, int rhs) { return flat_count[lhs] > flat_count[rhs]; });
+
+  hvpp_info("VMEXIT transitions (top %i)", count);
+
+  for (int index = 0; index < count; ++index)
+  {
+    auto from = static_cast<vmx::exit_reason>(transitions[index] / stats::reason_count);
+    auto to   = static_cast<vmx::exit_reason>(transitions[index] % stats::reason_count);
+
+    if (flat_count[transitions[index]] == 0)
+    {
+      break;
+    }
+
+    hvpp_info("  %s -> %s: %u",
+      vmx::exit_reason_to_string(from),
+      vmx::exit_reason_to_string(to),
+      flat_count[transitions[index]]);
+  }
+
+  //
+  // Gap histograms are kept per exit class pair - they aggregate all
+  // transitions between the two classes, so they're printed separately.
+  //
+  hvpp_info("VMEXIT transition gaps (per exit class pair)");
+  hvpp_info("  gap buckets (TSC ticks): <1k, <4k, <16k, <64k, <256k, <1M, <4M, >=4M");
+
+  for (int from = 0; from < stats::class_count; ++from)
+  {
+    for (int to = 0; to < stats::class_count; ++to)
+    {
+      auto& gap = merged->gap[from][to];
+
+      uint64_t total = 0;
+      for (int bucket = 0; bucket < stats::gap_bucket_count; ++bucket)
+      {
+        total += gap[bucket];
+      }
+
+      if (total == 0)
+      {
+        continue;
+      }
+
+      hvpp_info("  %s -> %s: %u %u %u %u %u %u %u %u",
+        exit_class_to_string(static_cast<exit_class>(from)),
+        exit_class_to_string(static_cast<exit_class>(to)),
+        gap[0], gap[1], gap[2], gap[3], gap[4], gap[5], gap[6], gap[7]);
+    }
+  }
+
+  delete[] transitions;
+  delete merged;
+}
+
+void vmexit_stats_handler::update_cr3_stats(uint64_t cr3, vmx::exit_reason exit_reason, uint64_t cycles) noexcept
+{
+  auto cpu_index = mp::cpu_index();
+  if (cpu_index >= cr3_table_count_)
+  {
+    return;
+  }
+
+  auto& entry = cr3_table_[cpu_index].lookup(cr3);
+  auto index = static_cast<int>(exit_class_from_reason(exit_reason));
+
+  entry.count[index]  += 1;
+  entry.cycles[index] += cycles;
+}
+
+static vmexit_stats_handler::history_bucket_t& history_bucket(
+  vmexit_stats_handler::history_bucket_t* ring,
+  int ring_size,
+  uint64_t bucket_ticks,
+  uint64_t tsc,
+  uint64_t& next_tsc,
+  int& index) noexcept
+{
+  //
+  // Fast path - we're still in the same time slot.
+  //
+  if (tsc < next_tsc)
+  {
+    return ring[index];
+  }
+
+  auto epoch = tsc / bucket_ticks;
+  index = static_cast<int>(epoch % ring_size);
+
+  //
+  // Reuse the bucket only if it belongs to this very time slot - otherwise
+  // it contains counters from the previous round of the ring.
+  //
+  if (ring[index].epoch != epoch)
+  {
+    memset(&ring[index], 0, sizeof(ring[index]));
+    ring[index].epoch = epoch;
+  }
+
+  next_tsc = (epoch + 1) * bucket_ticks;
+  return ring[index];
+}
+
+void vmexit_stats_handler::update_history(vcpu_t& vp, vmx::exit_reason exit_reason, uint64_t tsc) noexcept
+{
+  auto cpu_index = mp::cpu_index();
+  if (cpu_index >= history_count_)
+  {
+    return;
+  }
+
+  auto& state = history_[cpu_index];
+
+  //
+  // Report messages suppressed by rate-limited log call-sites which haven't
+  // fired since - once per coarse bucket.
+  //
+  if (tsc >= state.coarse_next_tsc)
+  {
+    logger::rate_limit_t::flush();
+  }
+
+  auto& fine   = history_bucket(state.history.fine, history_t::fine_count,
+                                fine_bucket_ticks_, tsc,
+                                state.fine_next_tsc, state.fine_index);
+
+  auto& coarse = history_bucket(state.history.coarse, history_t::coarse_count,
+                                coarse_bucket_ticks_, tsc,
+                                state.coarse_next_tsc, state.coarse_index);
+
+  fine.vmexit[static_cast<int>(exit_reason)] += 1;
+  coarse.vmexit[static_cast<int>(exit_reason)] += 1;
+
+  if (exit_reason == vmx::exit_reason::exception_or_nmi)
+  {
+    auto interrupt_info = vp.exit_interrupt_info();
+
+    if (interrupt_info.type() == vmx::interrupt_type::hardware_exception ||
+        interrupt_info.type() == vmx::interrupt_type::software_exception)
+    {
+      fine.expt_vector[static_cast<int>(interrupt_info.vector())] += 1;
+      coarse.expt_vector[static_cast<int>(interrupt_info.vector())] += 1;
+    }
+  }
+
+  //
+  // Subcategories - see update_stats().
+  //
+  uint32_t* counter[2] = { nullptr, nullptr };
+
+  switch (exit_reason)
+  {
+    case vmx::exit_reason::execute_cpuid:
+    {
+      auto leaf = vp.exit_context().eax;
+
+      if (leaf <= 0x0000'000fu)
+      {
+        counter[0] = &fine.cpuid_0[leaf];
+        counter[1] = &coarse.cpuid_0[leaf];
+      }
+      else if (leaf >= 0x8000'0000u && leaf <= 0x8000'000fu)
+      {
+        counter[0] = &fine.cpuid_8[leaf - 0x8000'0000u];
+        counter[1] = &coarse.cpuid_8[leaf - 0x8000'0000u];
+      }
+      else
+      {
+        counter[0] = &fine.cpuid_other;
+        counter[1] = &coarse.cpuid_other;
+      }
+      break;
+    }
+
+    case vmx::exit_reason::mov_cr:
+    {
+      auto mov_cr = vp.exit_qualification().mov_cr;
+
+      switch (mov_cr.access_type)
+      {
+        case vmx::exit_qualification_mov_cr_t::access_to_cr:
+          counter[0] = &fine.mov_to_cr[mov_cr.cr_number];
+          counter[1] = &coarse.mov_to_cr[mov_cr.cr_number];
+          break;
+
+        case vmx::exit_qualification_mov_cr_t::access_from_cr:
+          counter[0] = &fine.mov_from_cr[mov_cr.cr_number];
+          counter[1] = &coarse.mov_from_cr[mov_cr.cr_number];
+          break;
+
+        case vmx::exit_qualification_mov_cr_t::access_clts:
+          counter[0] = &fine.clts;
+          counter[1] = &coarse.clts;
+          break;
+
+        case vmx::exit_qualification_mov_cr_t::access_lmsw:
+          counter[0] = &fine.lmsw;
+          counter[1] = &coarse.lmsw;
+          break;
+      }
+      break;
+    }
+
+    case vmx::exit_reason::execute_rdmsr:
+    case vmx::exit_reason::execute_wrmsr:
+    {
+      auto msr_id = vp.exit_context().ecx;
+      auto msr_range = msr_id <= 0x0000'1fffu                          ? 0
+                     : msr_id >= 0xc000'0000u && msr_id <= 0xc000'1fffu ? 1
+                     :                                                    2;
+
+      if (exit_reason == vmx::exit_reason::execute_rdmsr)
+      {
+        counter[0] = &fine.rdmsr[msr_range];
+        counter[1] = &coarse.rdmsr[msr_range];
+      }
+      else
+      {
+        counter[0] = &fine.wrmsr[msr_range];
+        counter[1] = &coarse.wrmsr[msr_range];
+      }
+      break;
+    }
+
+    case vmx::exit_reason::execute_io_instruction:
+      if (vp.exit_qualification().io_instruction.access_type == vmx::exit_qualification_io_instruction_t::access_in)
+      {
+        counter[0] = &fine.io_in;
+        counter[1] = &coarse.io_in;
+      }
+      else
+      {
+        counter[0] = &fine.io_out;
+        counter[1] = &coarse.io_out;
+      }
+      break;
+
+    default:
+      break;
+  }
+
+  if (counter[0])
+  {
+    *counter[0] += 1;
+    *counter[1] += 1;
+  }
+}
+
+void vmexit_stats_handler::update_transition_stats(vmx::exit_reason exit_reason, uint64_t tsc_begin, uint64_t tsc_end) noexcept
+{
+  auto cpu_index = mp::cpu_index();
+  if (cpu_index >= transition_stats_count_)
+  {
+    return;
+  }
+
+  auto& stats = transition_stats_[cpu_index];
+  auto from = static_cast<int>(stats.last_exit_reason);
+  auto to   = static_cast<int>(exit_reason);
+
+  if (stats.last_exit_tsc &&
+      from < transition_stats_t::reason_count &&
+      to   < transition_stats_t::reason_count)
+  {
+    //
+    // Time between the end of the previous VM-exit handler and the beginning
+    // of this one - i.e. how long the guest was running (including VM-entry
+    // and VM-exit transitions themselves).
+    //
+    auto gap = tsc_begin - stats.last_exit_tsc;
+
+    stats.count[from][to] += 1;
+    stats.gap[static_cast<int>(exit_class_from_reason(stats.last_exit_reason))]
+             [static_cast<int>(exit_class_from_reason(exit_reason))]
+             [transition_stats_t::gap_bucket(gap)] += 1;
+  }
+
+  stats.last_exit_reason = exit_reason;
+  stats.last_exit_tsc = tsc_end;
+}
+
+void vmexit_stats_handler::update_lbr_trace(const trace_file::record_t& record) noexcept
+{
+  auto cpu_index = mp::cpu_index();
+
+  if (cpu_index >= lbr_trace_count_)
+  {
+    return;
+  }
+
+  auto& trace = lbr_trace_[cpu_index];
+  trace.record[trace.count % lbr_trace_t::capacity] = record;
+  trace.count += 1;
+}
+
+void vmexit_stats_handler::update_compact_trace(const trace_file::record_t& record) noexcept
+{
+  auto cpu_index = mp::cpu_index();
+
+  if (cpu_index >= compact_trace_count_)
+  {
+    return;
+  }
+
+  auto& state = compact_trace_[cpu_index];
+  auto& trace = state.trace;
+  auto tsc_begin = ia32_asm_read_tsc();
+
+  if (!state.encoder.encode(record))
+  {
+    //
+    // The current chunk is full (or there is none yet) - the record
+    // becomes sync point of the next chunk, which replaces the oldest one.
+    //
+    auto chunk = trace.chunk[trace.chunk_count % compact_trace_t::capacity];
+
+    state.encoder.begin(reinterpret_cast<trace_file::chunk_header_t*>(chunk), trace.chunk_count, record);
+    state.encoder.encode(record);
+    trace.chunk_count += 1;
+  }
+
+  trace.record_count += 1;
+  trace.encode_ticks += ia32_asm_read_tsc() - tsc_begin;
+}
+
+void vmexit_stats_handler::update_stats(vcpu_t& vp, const config_t& config) noexcept
 {
   auto exit_reason = vp.exit_reason();
   stats_.vmexit[static_cast<int>(exit_reason)] += 1;
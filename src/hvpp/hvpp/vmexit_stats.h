@@ -1,7 +1,9 @@
 #pragma once
 #include "vmexit.h"
+#include "trace_codec.h"
 
-#include "lib/bitmap.h"
+#include "ia32/vmx.h"
+#include "lib/seqlock.h"
 
 namespace hvpp {
 
@@ -107,18 +109,301 @@ class vmexit_stats_handler
       uint32_t wrmsr_other;
     };
 
+    //
+    // Coarse classification of VM-exits used by per-CR3 accounting.
+    //
+    enum class exit_class : uint32_t
+    {
+      exception_or_nmi,
+      cpuid,
+      mov_cr,
+      mov_dr,
+      io_instruction,
+      msr,
+      ept,
+      vmcall,
+      monitor_trap_flag,
+      other,
+
+      count
+    };
+
+    //
+    // Exit counters and cycles spent in the handler, per exit class, for
+    // single address space (CR3 including PCID).
+    //
+    struct cr3_stats_t
+    {
+      uint64_t total_cycles() const noexcept;
+      uint64_t total_count() const noexcept;
+
+      uint64_t cr3;
+      uint64_t last_use;
+      uint64_t cycles[static_cast<int>(exit_class::count)];
+      uint32_t count[static_cast<int>(exit_class::count)];
+    };
+
+    //
+    // Per-CPU table of cr3_stats_t. The table is bounded - when it is full,
+    // the least recently used entry is evicted.
+    //
+    struct cr3_table_t
+    {
+      static constexpr int capacity = 64;
+
+      cr3_stats_t& lookup(uint64_t cr3) noexcept;
+
+      cr3_stats_t entry[capacity];
+      uint64_t    tick;
+      int         hint;
+    };
+
+    //
+    // Counters of VM-exits which occurred within single time slot.
+    // Epoch is the TSC value (at the time of VM-exit) divided by the length
+    // of the time slot in TSC ticks - it's used both for rotation and for
+    // reconstruction of the timeline.
+    //
+    // Subcategories follow stats_t, except for the per-MSR and per-port
+    // counters - these would make each bucket hundreds of kilobytes large.
+    // MSRs are counted per range (0x0000'0000 - 0x0000'1fff, 0xc000'0000 -
+    // 0xc000'1fff, other) and I/O instructions per direction only.
+    //
+    struct history_bucket_t
+    {
+      uint64_t epoch;
+      uint32_t vmexit[80];
+      uint32_t expt_vector[20];
+      uint32_t cpuid_0[16];
+      uint32_t cpuid_8[16];
+      uint32_t cpuid_other;
+      uint32_t mov_from_cr[8];
+      uint32_t mov_to_cr[8];
+      uint32_t clts;
+      uint32_t lmsw;
+      uint32_t rdmsr[3];
+      uint32_t wrmsr[3];
+      uint32_t io_in;
+      uint32_t io_out;
+    };
+
+    //
+    // Rolling history of VM-exit counters of single CPU. It consists of two
+    // rings with fixed size - "fine" ring with 100ms slots (covering last 20
+    // seconds) and "coarse" ring with 1s slots (covering last 5 minutes).
+    // Buckets are rotated lazily on VM-exit, based on TSC - if no VM-exit
+    // occurs within the slot, the bucket keeps its old (stale) epoch.
+    //
+    struct history_t
+    {
+      static constexpr int fine_bucket_ms   = 100;
+      static constexpr int fine_count       = 200;
+      static constexpr int coarse_bucket_ms = 1000;
+      static constexpr int coarse_count     = 300;
+
+      uint32_t         cpu_index;
+      uint32_t         reserved;
+      uint64_t         tsc_frequency;
+      history_bucket_t fine[fine_count];
+      history_bucket_t coarse[coarse_count];
+    };
+
+    //
+    // Statistics of consecutive VM-exit pairs (previous -> current) of single
+    // CPU. They show which VM-exits tend to be followed by which, and how long
+    // the guest runs between them.
+    //
+    struct transition_stats_t
+    {
+      static constexpr int reason_count     = 65;
+      static constexpr int class_count      = static_cast<int>(exit_class::count);
+      static constexpr int gap_bucket_count = 8;
+
+      //
+      // Guest run time between two VM-exits (in TSC ticks) is put into
+      // logarithmic buckets (base 4):
+      //   <1k, <4k, <16k, <64k, <256k, <1M, <4M, >=4M
+      //
+      static int gap_bucket(uint64_t gap) noexcept;
+
+      //
+      // Transition counters - indexed by [previous][current] exit reason.
+      //
+      uint32_t count[reason_count][reason_count];
+
+      //
+      // Histograms of guest run time - indexed by [previous][current] exit
+      // class. Exit classes are used instead of exit reasons to keep memory
+      // footprint reasonable.
+      //
+      uint32_t gap[class_count][class_count][gap_bucket_count];
+
+      //
+      // Last VM-exit state. Zero last_exit_tsc means there was no VM-exit
+      // yet.
+      //
+      vmx::exit_reason last_exit_reason;
+      uint64_t         last_exit_tsc;
+    };
+
+    //
+    // Runtime configuration. It's published via seqlock - each VM-exit works
+    // with consistent snapshot of it. It can be changed at any time by
+    // VMCALL (see handle_execute_vmcall()).
+    //
+    struct config_t
+    {
+      enum : uint32_t
+      {
+        collect_cr3_stats        = 0x01,
+        collect_transition_stats = 0x02,
+        collect_history          = 0x04,
+        collect_lbr              = 0x08,
+        collect_trace            = 0x10,
+
+        default_flags = collect_cr3_stats | collect_transition_stats | collect_history
+      };
+
+      bool trace_enabled(vmx::exit_reason exit_reason) const noexcept
+      {
+        auto index = static_cast<int>(exit_reason);
+        return !!(trace_bitmap[index / 8] & (1 << (index % 8)));
+      }
+
+      bool lbr_enabled(vmx::exit_reason exit_reason) const noexcept
+      {
+        auto index = static_cast<int>(exit_reason);
+        return !!(lbr_bitmap[index / 8] & (1 << (index % 8)));
+      }
+
+      //
+      // Bitmap of exit reasons which are traced (by hvpp_trace_rl()).
+      //
+      uint8_t  trace_bitmap[16];
+      uint32_t flags;
+
+      //
+      // Bitmap of exit reasons which get LBR snapshot (if collect_lbr is
+      // set) and number of LBR entries in each snapshot (at most
+      // trace_file::max_lbr_count).
+      //
+      uint8_t  lbr_bitmap[16];
+      uint32_t lbr_count;
+    };
+
+    //
+    // Ring of the last VM-exit records with LBR snapshot of single CPU.
+    // Records are in the trace file format, so they can be written into
+    // the trace file as they are.
+    //
+    struct lbr_trace_t
+    {
+      static constexpr int capacity = 256;
+
+      //
+      // Total number of records written - the most recent record is at
+      // index (count - 1) % capacity.
+      //
+      uint64_t             count;
+      trace_file::record_t record[capacity];
+    };
+
+    //
+    // Ring of delta-encoded records (see trace_codec.h) of all VM-exits of
+    // single CPU (if collect_trace is set). The ring consists of chunks of
+    // the compact trace file - a full chunk is followed by the next one,
+    // which overwrites the oldest chunk. Chunks can be written into the
+    // compact trace file as they are.
+    //
+    struct compact_trace_t
+    {
+      static constexpr int capacity = 64;
+
+      //
+      // Total number of chunks started - the current chunk is at index
+      // (chunk_count - 1) % capacity.
+      //
+      uint64_t chunk_count;
+      uint64_t record_count;
+
+      //
+      // TSC ticks spent in the encoder (all records).
+      //
+      uint64_t encode_ticks;
+      uint64_t reserved;
+
+      uint8_t  chunk[capacity][trace_file::chunk_size];
+    };
+
     vmexit_stats_handler() noexcept;
+    void initialize() noexcept override;
+    void destroy() noexcept override;
+
     void handle(vcpu_t& vp) noexcept override;
     void invoke_termination() noexcept override;
 
+    void handle_execute_vmcall(vcpu_t& vp) noexcept override;
+
     const stats_t& stats() const noexcept;
 
+    config_t config() const noexcept;
+    void config(const config_t& new_config) noexcept;
+
+    //
+    // Merges per-CPU tables and fills "result" with (at most) "count"
+    // address spaces with the highest number of cycles spent in the handler.
+    // Returns number of filled entries.
+    //
+    int top_cr3_stats(cr3_stats_t* result, int count) const noexcept;
+    void dump_cr3_stats(int count) const noexcept;
+
+    //
+    // Prints (at most) "count" most frequent VM-exit transitions, merged
+    // from all CPUs.
+    //
+    void dump_transition_stats(int count) const noexcept;
+
   private:
-    void update_stats(vcpu_t& vp) noexcept;
+    void update_stats(vcpu_t& vp, const config_t& config) noexcept;
+    void update_cr3_stats(uint64_t cr3, vmx::exit_reason exit_reason, uint64_t cycles) noexcept;
+    void update_history(vcpu_t& vp, vmx::exit_reason exit_reason, uint64_t tsc) noexcept;
+    void update_transition_stats(vmx::exit_reason exit_reason, uint64_t tsc_begin, uint64_t tsc_end) noexcept;
+    void update_lbr_trace(const trace_file::record_t& record) noexcept;
+    void update_compact_trace(const trace_file::record_t& record) noexcept;
+
+    struct history_state_t
+    {
+      history_t history;
+
+      //
+      // TSC values at which the current fine/coarse bucket expires.
+      //
+      uint64_t  fine_next_tsc;
+      uint64_t  coarse_next_tsc;
+      int       fine_index;
+      int       coarse_index;
+    };
+
+    struct compact_trace_state_t
+    {
+      compact_trace_t               trace;
+      trace_file::compact_encoder_t encoder;
+    };
 
     stats_t stats_;
-    bitmap vmexit_trace_bitmap_;
-    uint8_t vmexit_trace_bitmap_buffer_[16];
+    cr3_table_t* cr3_table_;
+    uint32_t     cr3_table_count_;
+    transition_stats_t* transition_stats_;
+    uint32_t            transition_stats_count_;
+    history_state_t* history_;
+    uint32_t         history_count_;
+    uint64_t         fine_bucket_ticks_;
+    uint64_t         coarse_bucket_ticks_;
+    lbr_trace_t*     lbr_trace_;
+    uint32_t         lbr_trace_count_;
+    compact_trace_state_t* compact_trace_;
+    uint32_t               compact_trace_count_;
+    seqlock<config_t> config_;
 };
 
 }
@@ -1,2 +1,6 @@
 #pragma once
-#include "win32/asm.h"
+#ifdef _WIN32
+# include "win32/asm.h"
+#else
+# include "linux/asm.h"
+#endif
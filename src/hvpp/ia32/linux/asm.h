@@ -0,0 +1,357 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+
+//
+// GCC/Clang counterparts of MSVC intrinsics (and of functions implemented
+// in ia32/asm.asm) used by the ia32 layer.
+//
+// Note that most of these instructions are privileged - they're provided so
+// the code compiles, but executing them in user-mode raises #GP.
+//
+
+#define IA32_ASM_INLINE inline __attribute__((always_inline))
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// Segment registers.
+//
+
+#define IA32_ASM_SEGMENT(name)                                                          \
+  IA32_ASM_INLINE unsigned short ia32_asm_read_##name() noexcept                        \
+  { unsigned short result; asm volatile ("mov %%" #name ", %0" : "=r"(result)); return result; } \
+  IA32_ASM_INLINE void ia32_asm_write_##name(unsigned short selector) noexcept         \
+  { asm volatile ("mov %0, %%" #name :: "r"(selector) : "memory"); }
+
+IA32_ASM_SEGMENT(ds)
+IA32_ASM_SEGMENT(es)
+IA32_ASM_SEGMENT(fs)
+IA32_ASM_SEGMENT(gs)
+IA32_ASM_SEGMENT(ss)
+
+#undef IA32_ASM_SEGMENT
+
+IA32_ASM_INLINE unsigned short ia32_asm_read_cs() noexcept
+{ unsigned short result; asm volatile ("mov %%cs, %0" : "=r"(result)); return result; }
+
+//
+// CS can't be loaded by MOV - it needs far jump/return (see asm.asm).
+//
+void                ia32_asm_write_cs           (unsigned short cs)           noexcept;
+
+IA32_ASM_INLINE unsigned short ia32_asm_read_tr() noexcept
+{ unsigned short result; asm volatile ("str %0" : "=r"(result)); return result; }
+
+IA32_ASM_INLINE void ia32_asm_write_tr(unsigned short tr) noexcept
+{ asm volatile ("ltr %0" :: "r"(tr) : "memory"); }
+
+IA32_ASM_INLINE unsigned short ia32_asm_read_ldtr() noexcept
+{ unsigned short result; asm volatile ("sldt %0" : "=r"(result)); return result; }
+
+IA32_ASM_INLINE void ia32_asm_write_ldtr(unsigned short ldt) noexcept
+{ asm volatile ("lldt %0" :: "r"(ldt) : "memory"); }
+
+IA32_ASM_INLINE unsigned long ia32_asm_read_ar(unsigned short selector) noexcept
+{ uint64_t result; asm volatile ("lar %1, %0" : "=r"(result) : "r"((uint64_t)selector)); return (unsigned long)result; }
+
+IA32_ASM_INLINE unsigned long ia32_asm_read_sl(unsigned long seg) noexcept
+{ uint64_t result; asm volatile ("lsl %1, %0" : "=r"(result) : "r"((uint64_t)seg)); return (unsigned long)result; }
+
+IA32_ASM_INLINE void ia32_asm_read_gdtr(void* gdt) noexcept
+{ asm volatile ("sgdt %0" : "=m"(*(char(*)[10])gdt)); }
+
+IA32_ASM_INLINE void ia32_asm_write_gdtr(void* gdt) noexcept
+{ asm volatile ("lgdt %0" :: "m"(*(char(*)[10])gdt) : "memory"); }
+
+IA32_ASM_INLINE void ia32_asm_read_idtr(void* idt) noexcept
+{ asm volatile ("sidt %0" : "=m"(*(char(*)[10])idt)); }
+
+IA32_ASM_INLINE void ia32_asm_write_idtr(void* idt) noexcept
+{ asm volatile ("lidt %0" :: "m"(*(char(*)[10])idt) : "memory"); }
+
+//
+// Misc. instructions.
+//
+
+IA32_ASM_INLINE void ia32_asm_int3() noexcept
+{ __builtin_trap(); }
+
+IA32_ASM_INLINE void ia32_asm_invd() noexcept
+{ asm volatile ("invd" ::: "memory"); }
+
+IA32_ASM_INLINE void ia32_asm_wb_invd() noexcept
+{ asm volatile ("wbinvd" ::: "memory"); }
+
+IA32_ASM_INLINE void ia32_asm_halt() noexcept
+{ asm volatile ("hlt"); }
+
+IA32_ASM_INLINE void ia32_asm_write_msw(unsigned short msw) noexcept
+{ asm volatile ("lmsw %0" :: "r"(msw)); }
+
+IA32_ASM_INLINE void ia32_asm_clear_ts() noexcept
+{ asm volatile ("clts"); }
+
+IA32_ASM_INLINE void ia32_asm_inv_page(void* address) noexcept
+{ asm volatile ("invlpg (%0)" :: "r"(address) : "memory"); }
+
+IA32_ASM_INLINE void ia32_asm_pause() noexcept
+{ __builtin_ia32_pause(); }
+
+IA32_ASM_INLINE void ia32_asm_enable_interrupts() noexcept
+{ asm volatile ("sti" ::: "memory"); }
+
+IA32_ASM_INLINE void ia32_asm_disable_interrupts() noexcept
+{ asm volatile ("cli" ::: "memory"); }
+
+IA32_ASM_INLINE void ia32_asm_cpuid(int info[4], int function_id) noexcept
+{
+  asm volatile ("cpuid"
+                : "=a"(info[0]), "=b"(info[1]), "=c"(info[2]), "=d"(info[3])
+                : "a"(function_id), "c"(0));
+}
+
+IA32_ASM_INLINE void ia32_asm_cpuid_ex(int info[4], int function_id, int subfunction_id) noexcept
+{
+  asm volatile ("cpuid"
+                : "=a"(info[0]), "=b"(info[1]), "=c"(info[2]), "=d"(info[3])
+                : "a"(function_id), "c"(subfunction_id));
+}
+
+IA32_ASM_INLINE void ia32_asm_fx_save(void* area) noexcept
+{ asm volatile ("fxsave64 %0" : "=m"(*(char(*)[512])area)); }
+
+IA32_ASM_INLINE void ia32_asm_fx_restore(const void* area) noexcept
+{ asm volatile ("fxrstor64 %0" :: "m"(*(const char(*)[512])area)); }
+
+IA32_ASM_INLINE unsigned long long ia32_asm_read_tsc() noexcept
+{ return __builtin_ia32_rdtsc(); }
+
+IA32_ASM_INLINE unsigned long long ia32_asm_read_tscp(unsigned int* aux) noexcept
+{ return __builtin_ia32_rdtscp(aux); }
+
+//
+// I/O ports.
+//
+
+IA32_ASM_INLINE unsigned char ia32_asm_in_byte(unsigned short port) noexcept
+{ unsigned char result; asm volatile ("inb %1, %0" : "=a"(result) : "Nd"(port)); return result; }
+
+IA32_ASM_INLINE unsigned short ia32_asm_in_word(unsigned short port) noexcept
+{ unsigned short result; asm volatile ("inw %1, %0" : "=a"(result) : "Nd"(port)); return result; }
+
+IA32_ASM_INLINE unsigned long ia32_asm_in_dword(unsigned short port) noexcept
+{ unsigned int result; asm volatile ("inl %1, %0" : "=a"(result) : "Nd"(port)); return result; }
+
+IA32_ASM_INLINE void ia32_asm_out_byte(unsigned short port, unsigned char value) noexcept
+{ asm volatile ("outb %0, %1" :: "a"(value), "Nd"(port)); }
+
+IA32_ASM_INLINE void ia32_asm_out_word(unsigned short port, unsigned short value) noexcept
+{ asm volatile ("outw %0, %1" :: "a"(value), "Nd"(port)); }
+
+IA32_ASM_INLINE void ia32_asm_out_dword(unsigned short port, unsigned long value) noexcept
+{ asm volatile ("outl %0, %1" :: "a"((unsigned int)value), "Nd"(port)); }
+
+IA32_ASM_INLINE void ia32_asm_in_byte_string(unsigned short port, unsigned char* buffer, unsigned long count) noexcept
+{ asm volatile ("rep insb" : "+D"(buffer), "+c"(count) : "d"(port) : "memory"); }
+
+IA32_ASM_INLINE void ia32_asm_in_word_string(unsigned short port, unsigned short* buffer, unsigned long count) noexcept
+{ asm volatile ("rep insw" : "+D"(buffer), "+c"(count) : "d"(port) : "memory"); }
+
+IA32_ASM_INLINE void ia32_asm_in_dword_string(unsigned short port, unsigned long* buffer, unsigned long count) noexcept
+{ asm volatile ("rep insl" : "+D"(buffer), "+c"(count) : "d"(port) : "memory"); }
+
+IA32_ASM_INLINE void ia32_asm_out_byte_string(unsigned short port, unsigned char* buffer, unsigned long count) noexcept
+{ asm volatile ("rep outsb" : "+S"(buffer), "+c"(count) : "d"(port) : "memory"); }
+
+IA32_ASM_INLINE void ia32_asm_out_word_string(unsigned short port, unsigned short* buffer, unsigned long count) noexcept
+{ asm volatile ("rep outsw" : "+S"(buffer), "+c"(count) : "d"(port) : "memory"); }
+
+IA32_ASM_INLINE void ia32_asm_out_dword_string(unsigned short port, unsigned long* buffer, unsigned long count) noexcept
+{ asm volatile ("rep outsl" : "+S"(buffer), "+c"(count) : "d"(port) : "memory"); }
+
+//
+// Control, debug and model-specific registers.
+//
+
+#define IA32_ASM_CR(n)                                                                  \
+  IA32_ASM_INLINE unsigned long long ia32_asm_read_cr##n() noexcept                     \
+  { unsigned long long result; asm volatile ("mov %%cr" #n ", %0" : "=r"(result)); return result; } \
+  IA32_ASM_INLINE void ia32_asm_write_cr##n(unsigned long long value) noexcept          \
+  { asm volatile ("mov %0, %%cr" #n :: "r"(value) : "memory"); }
+
+IA32_ASM_CR(0)
+IA32_ASM_CR(2)
+IA32_ASM_CR(3)
+IA32_ASM_CR(4)
+
+#undef IA32_ASM_CR
+
+IA32_ASM_INLINE unsigned long long ia32_asm_read_dr(unsigned int index) noexcept
+{
+  unsigned long long result = 0;
+
+  switch (index)
+  {
+    case 0: asm volatile ("mov %%dr0, %0" : "=r"(result)); break;
+    case 1: asm volatile ("mov %%dr1, %0" : "=r"(result)); break;
+    case 2: asm volatile ("mov %%dr2, %0" : "=r"(result)); break;
+    case 3: asm volatile ("mov %%dr3, %0" : "=r"(result)); break;
+    case 6: asm volatile ("mov %%dr6, %0" : "=r"(result)); break;
+    case 7: asm volatile ("mov %%dr7, %0" : "=r"(result)); break;
+  }
+
+  return result;
+}
+
+IA32_ASM_INLINE void ia32_asm_write_dr(unsigned int index, unsigned long long value) noexcept
+{
+  switch (index)
+  {
+    case 0: asm volatile ("mov %0, %%dr0" :: "r"(value)); break;
+    case 1: asm volatile ("mov %0, %%dr1" :: "r"(value)); break;
+    case 2: asm volatile ("mov %0, %%dr2" :: "r"(value)); break;
+    case 3: asm volatile ("mov %0, %%dr3" :: "r"(value)); break;
+    case 6: asm volatile ("mov %0, %%dr6" :: "r"(value)); break;
+    case 7: asm volatile ("mov %0, %%dr7" :: "r"(value)); break;
+  }
+}
+
+IA32_ASM_INLINE unsigned long long ia32_asm_read_eflags() noexcept
+{ unsigned long long result; asm volatile ("pushfq; popq %0" : "=r"(result)); return result; }
+
+IA32_ASM_INLINE void ia32_asm_write_eflags(unsigned long long value) noexcept
+{ asm volatile ("pushq %0; popfq" :: "r"(value) : "memory", "cc"); }
+
+IA32_ASM_INLINE unsigned long long ia32_asm_read_msr(unsigned long msr) noexcept
+{
+  //
+  // RDMSR raises #GP at CPL > 0 - in user-mode every MSR reads as zero
+  // (which e.g. leaves MTRRs reported as disabled).
+  //
+  if (ia32_asm_read_cs() & 3)
+  {
+    return 0;
+  }
+
+  uint32_t low, high;
+  asm volatile ("rdmsr" : "=a"(low), "=d"(high) : "c"((uint32_t)msr));
+  return ((unsigned long long)high << 32) | low;
+}
+
+IA32_ASM_INLINE void ia32_asm_write_msr(unsigned long msr, unsigned long long value) noexcept
+{ asm volatile ("wrmsr" :: "c"((uint32_t)msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32))); }
+
+IA32_ASM_INLINE unsigned long long ia32_asm_read_xcr(unsigned int index) noexcept
+{
+  uint32_t low, high;
+  asm volatile ("xgetbv" : "=a"(low), "=d"(high) : "c"(index));
+  return ((unsigned long long)high << 32) | low;
+}
+
+IA32_ASM_INLINE void ia32_asm_write_xcr(unsigned int index, unsigned long long value) noexcept
+{ asm volatile ("xsetbv" :: "c"(index), "a"((uint32_t)value), "d"((uint32_t)(value >> 32))); }
+
+//
+// VMX instructions. Return values follow MSVC intrinsics:
+//   0 - success, 1 - VMfailValid, 2 - VMfailInvalid
+//
+
+#define IA32_ASM_VMX_RESULT "setz %b0; setc %%dl; shl $1, %%dl; or %%dl, %b0"
+
+IA32_ASM_INLINE unsigned char ia32_asm_vmx_on(uint64_t* pa) noexcept
+{ unsigned char result; asm volatile ("vmxon %1; " IA32_ASM_VMX_RESULT : "=q"(result) : "m"(*pa) : "rdx", "cc", "memory"); return result; }
+
+IA32_ASM_INLINE void ia32_asm_vmx_off() noexcept
+{ asm volatile ("vmxoff" ::: "cc", "memory"); }
+
+IA32_ASM_INLINE unsigned char ia32_asm_vmx_vmlaunch() noexcept
+{ unsigned char result; asm volatile ("vmlaunch; " IA32_ASM_VMX_RESULT : "=q"(result) :: "rdx", "cc", "memory"); return result; }
+
+IA32_ASM_INLINE unsigned char ia32_asm_vmx_vmresume() noexcept
+{ unsigned char result; asm volatile ("vmresume; " IA32_ASM_VMX_RESULT : "=q"(result) :: "rdx", "cc", "memory"); return result; }
+
+IA32_ASM_INLINE unsigned char ia32_asm_vmx_vmclear(uint64_t* pa) noexcept
+{ unsigned char result; asm volatile ("vmclear %1; " IA32_ASM_VMX_RESULT : "=q"(result) : "m"(*pa) : "rdx", "cc", "memory"); return result; }
+
+IA32_ASM_INLINE unsigned char ia32_asm_vmx_vmread(size_t field, size_t* value) noexcept
+{ unsigned char result; asm volatile ("vmread %2, %1; " IA32_ASM_VMX_RESULT : "=q"(result), "=rm"(*value) : "r"(field) : "rdx", "cc"); return result; }
+
+IA32_ASM_INLINE unsigned char ia32_asm_vmx_vmwrite(size_t field, size_t value) noexcept
+{ unsigned char result; asm volatile ("vmwrite %2, %1; " IA32_ASM_VMX_RESULT : "=q"(result) : "r"(field), "rm"(value) : "rdx", "cc"); return result; }
+
+IA32_ASM_INLINE void ia32_asm_vmx_vmptr_read(uint64_t* pa) noexcept
+{ asm volatile ("vmptrst %0" : "=m"(*pa)); }
+
+IA32_ASM_INLINE unsigned char ia32_asm_vmx_vmptr_write(uint64_t* pa) noexcept
+{ unsigned char result; asm volatile ("vmptrld %1; " IA32_ASM_VMX_RESULT : "=q"(result) : "m"(*pa) : "rdx", "cc", "memory"); return result; }
+
+IA32_ASM_INLINE unsigned long long ia32_asm_vmx_vmcall(unsigned long long rcx, unsigned long long rdx, unsigned long long r8, unsigned long long r9) noexcept
+{
+  unsigned long long result;
+  register unsigned long long r8_ asm("r8") = r8;
+  register unsigned long long r9_ asm("r9") = r9;
+  asm volatile ("vmcall" : "=a"(result) : "c"(rcx), "d"(rdx), "r"(r8_), "r"(r9_) : "memory");
+  return result;
+}
+
+IA32_ASM_INLINE void ia32_asm_inv_ept(unsigned long type, void* descriptor) noexcept
+{ asm volatile ("invept %1, %0" :: "r"((uint64_t)type), "m"(*(char(*)[16])descriptor) : "memory"); }
+
+IA32_ASM_INLINE void ia32_asm_inv_vpid(unsigned long type, void* descriptor) noexcept
+{ asm volatile ("invvpid %1, %0" :: "r"((uint64_t)type), "m"(*(char(*)[16])descriptor) : "memory"); }
+
+#undef IA32_ASM_VMX_RESULT
+
+//
+// Bit manipulation.
+//
+
+IA32_ASM_INLINE unsigned long long ia32_asm_popcnt(unsigned long long word) noexcept
+{ return __builtin_popcountll(word); }
+
+IA32_ASM_INLINE unsigned long ia32_asm_bsf(unsigned long long word) noexcept
+{ return __builtin_ctzll(word); }
+
+IA32_ASM_INLINE unsigned long ia32_asm_bsr(unsigned long long word) noexcept
+{ return 63 - __builtin_clzll(word); }
+
+IA32_ASM_INLINE unsigned char ia32_asm_bt(const void* base, unsigned long offset) noexcept
+{ return (((const uint8_t*)base)[offset / 8] >> (offset % 8)) & 1; }
+
+IA32_ASM_INLINE unsigned char ia32_asm_bts(void* base, unsigned long offset) noexcept
+{
+  auto byte = &((uint8_t*)base)[offset / 8];
+  unsigned char result = (*byte >> (offset % 8)) & 1;
+  *byte |= (uint8_t)(1 << (offset % 8));
+  return result;
+}
+
+//
+// Atomic operations.
+//
+
+IA32_ASM_INLINE unsigned long long ia32_asm_cmpxchg64(volatile unsigned long long* destination, unsigned long long exchange, unsigned long long comparand) noexcept
+{ return __sync_val_compare_and_swap(destination, comparand, exchange); }
+
+#ifdef __cplusplus
+}
+#endif
+
+#undef IA32_ASM_INLINE
+
+//
+// This macro expands to code which will cause compiler to print error message
+// which includes size of the object.
+//
+#define static_sizeof(object)                 \
+  do                                          \
+  {                                           \
+    switch (*reinterpret_cast<int*>(nullptr)) \
+    {                                         \
+      case sizeof(object): break;             \
+      case sizeof(object): break;             \
+    }                                         \
+  } while (0)
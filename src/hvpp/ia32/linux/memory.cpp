@@ -0,0 +1,47 @@
+#include "memory.h"
+#include "ia32/memory.h"
+
+#include <unistd.h>
+
+//
+// User-mode implementation - there is no access to physical memory, so
+// virtual addresses are treated as identity-mapped and the physical memory
+// descriptor is built from the amount of RAM reported by sysconf().
+//
+
+namespace ia32 {
+
+  namespace detail
+  {
+    uint64_t pa_from_va(void* va) noexcept
+    {
+      return reinterpret_cast<uint64_t>(va);
+    }
+
+    void* va_from_pa(uint64_t pa) noexcept
+    {
+      return reinterpret_cast<void*>(pa);
+    }
+
+    void* map_io_space(uint64_t pa, size_t size) noexcept
+    {
+      (void)pa;
+      (void)size;
+      return nullptr;
+    }
+
+    void unmap_io_space(void* va, size_t size) noexcept
+    {
+      (void)va;
+      (void)size;
+    }
+  }
+
+void physical_memory_descriptor::check_physical_memory() noexcept
+{
+  uint64_t size = static_cast<uint64_t>(sysconf(_SC_PHYS_PAGES)) * page_size;
+
+  range_[count_++] = memory_range(pa_t(0), pa_t(size));
+}
+
+}
@@ -0,0 +1,13 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+namespace ia32::detail {
+
+uint64_t pa_from_va(void* va) noexcept;
+void*    va_from_pa(uint64_t pa) noexcept;
+
+void*    map_io_space(uint64_t pa, size_t size) noexcept;
+void     unmap_io_space(void* va, size_t size) noexcept;
+
+}
@@ -1,7 +1,12 @@
 #pragma once
-#include "win32/memory.h"
+#ifdef _WIN32
+# include "win32/memory.h"
+#else
+# include "linux/memory.h"
+#endif
 #include "lib/log.h"
 
+#include <cstddef>
 #include <cstdint>
 #include <numeric>
 
@@ -128,6 +133,17 @@ class pa_t
     uint64_t value_;
 };
 
+//
+// Maps (unmaps) physical address range of a device (e.g. local APIC) into
+// the kernel address space as uncached memory. Must be called at
+// PASSIVE_LEVEL - the mapping itself can be used from any context.
+//
+inline void* map_io_space(pa_t pa, size_t size) noexcept
+{ return detail::map_io_space(pa.value(), size); }
+
+inline void unmap_io_space(void* va, size_t size) noexcept
+{ detail::unmap_io_space(va, size); }
+
 class page_iterator
 {
   public:
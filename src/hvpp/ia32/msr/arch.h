@@ -52,6 +52,130 @@ struct debugctl_t
   };
 };
 
+struct lbr_select_t
+{
+  static constexpr uint32_t msr_id = 0x000001c8;
+  using result_type = lbr_select_t;
+
+  union
+  {
+    uint64_t flags;
+
+    //
+    // Set bit means that the branches of that kind are NOT recorded
+    // (except en_callstack).
+    //
+    struct
+    {
+      uint64_t cpl_eq_0 : 1;
+      uint64_t cpl_neq_0 : 1;
+      uint64_t jcc : 1;
+      uint64_t near_rel_call : 1;
+      uint64_t near_ind_call : 1;
+      uint64_t near_ret : 1;
+      uint64_t near_ind_jmp : 1;
+      uint64_t near_rel_jmp : 1;
+      uint64_t far_branch : 1;
+      uint64_t en_callstack : 1;
+    };
+  };
+};
+
+struct lbr_tos_t
+{
+  static constexpr uint32_t msr_id = 0x000001c9;
+  using result_type = uint64_t;
+};
+
+struct perf_capabilities_t
+{
+  static constexpr uint32_t msr_id = 0x00000345;
+  using result_type = perf_capabilities_t;
+
+  union
+  {
+    uint64_t flags;
+
+    struct
+    {
+      uint64_t lbr_format : 6;
+      uint64_t pebs_trap : 1;
+      uint64_t pebs_save_arch_regs : 1;
+      uint64_t pebs_record_format : 4;
+      uint64_t freeze_while_smm_supported : 1;
+      uint64_t full_width_write : 1;
+    };
+  };
+};
+
+struct fixed_ctr1_t
+{
+  static constexpr uint32_t msr_id = 0x0000030a;
+  using result_type = uint64_t;
+};
+
+struct fixed_ctr_ctrl_t
+{
+  static constexpr uint32_t msr_id = 0x0000038d;
+  using result_type = fixed_ctr_ctrl_t;
+
+  union
+  {
+    uint64_t flags;
+
+    struct
+    {
+      uint64_t en0_os : 1;
+      uint64_t en0_usr : 1;
+      uint64_t any_thread0 : 1;
+      uint64_t en0_pmi : 1;
+      uint64_t en1_os : 1;
+      uint64_t en1_usr : 1;
+      uint64_t any_thread1 : 1;
+      uint64_t en1_pmi : 1;
+      uint64_t en2_os : 1;
+      uint64_t en2_usr : 1;
+      uint64_t any_thread2 : 1;
+      uint64_t en2_pmi : 1;
+    };
+  };
+};
+
+//
+// Layout of IA32_PERF_GLOBAL_CTRL, IA32_PERF_GLOBAL_STATUS and
+// IA32_PERF_GLOBAL_OVF_CTRL - enable/overflow bit of each counter.
+//
+struct perf_global_ctrl_t
+{
+  static constexpr uint32_t msr_id = 0x0000038f;
+  using result_type = perf_global_ctrl_t;
+
+  union
+  {
+    uint64_t flags;
+
+    struct
+    {
+      uint64_t pmc : 32;
+      uint64_t fixed_ctr0 : 1;
+      uint64_t fixed_ctr1 : 1;
+      uint64_t fixed_ctr2 : 1;
+    };
+  };
+};
+
+struct perf_global_status_t
+{
+  static constexpr uint32_t msr_id = 0x0000038e;
+  using result_type = perf_global_ctrl_t;
+};
+
+struct perf_global_ovf_ctrl_t
+{
+  static constexpr uint32_t msr_id = 0x00000390;
+  using result_type = perf_global_ctrl_t;
+};
+
 struct fs_base_t
 {
   static constexpr uint32_t msr_id = 0xc0000100;
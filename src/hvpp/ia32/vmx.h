@@ -13,6 +13,7 @@
 #include "vmx/exception_bitmap.h"
 #include "vmx/io_bitmap.h"
 #include "vmx/msr_bitmap.h"
+#include "vmx/msr_entry.h"
 
 #include <cstdint>
 
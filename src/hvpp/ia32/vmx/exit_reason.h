@@ -69,7 +69,7 @@ enum class exit_reason : uint16_t
   execute_xrstors                              = 0x00000040,
 };
 
-inline constexpr char* exit_reason_to_string(exit_reason value) noexcept
+inline constexpr const char* exit_reason_to_string(exit_reason value) noexcept
 {
   switch (value)
   {
@@ -0,0 +1,20 @@
+#pragma once
+#include <cstdint>
+
+namespace ia32::vmx {
+
+//
+// Entry of the VM-exit MSR-store, VM-exit MSR-load and VM-entry MSR-load
+// lists (Vol3C[24.7.2(VM-Exit Controls for MSRs)]). The lists must be
+// 16-byte aligned.
+//
+struct msr_entry_t
+{
+  uint32_t msr_id;
+  uint32_t reserved;
+  uint64_t value;
+};
+
+static_assert(sizeof(msr_entry_t) == 16);
+
+}
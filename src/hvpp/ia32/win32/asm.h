@@ -106,6 +106,7 @@ void                ia32_asm_inv_vpid           (_In_ unsigned long type, _In_ v
 #define             ia32_asm_popcnt             __popcnt64
 #define             ia32_asm_clear_ts           __clts
 #define             ia32_asm_wb_invd            __wbinvd
+#define             ia32_asm_inv_page           __invlpg
 
 #define             ia32_asm_vmx_on             __vmx_on
 #define             ia32_asm_vmx_off            __vmx_off
@@ -145,6 +146,16 @@ unsigned char      ia32_asm_bts(_In_ void* base, _In_ unsigned long offset) noex
   return _bittestandset((long*)base, offset);
 }
 
+//
+// Atomic operations.
+//
+
+inline
+unsigned long long ia32_asm_cmpxchg64(_Inout_ volatile unsigned long long* destination, _In_ unsigned long long exchange, _In_ unsigned long long comparand) noexcept
+{
+  return (unsigned long long)_InterlockedCompareExchange64((volatile long long*)destination, (long long)exchange, (long long)comparand);
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -19,6 +19,19 @@ namespace ia32 {
 
       return MmGetVirtualForPhysical(win_pa);
     }
+
+    void* map_io_space(uint64_t pa, size_t size) noexcept
+    {
+      PHYSICAL_ADDRESS win_pa;
+      win_pa.QuadPart = pa;
+
+      return MmMapIoSpace(win_pa, size, MmNonCached);
+    }
+
+    void unmap_io_space(void* va, size_t size) noexcept
+    {
+      MmUnmapIoSpace(va, size);
+    }
   }
 
 void physical_memory_descriptor::check_physical_memory() noexcept
@@ -0,0 +1,337 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+
+//
+// Open-addressing hash map with fixed capacity.
+//
+// The slot array is allocated once by the constructor (or by reset())
+// from the memory manager - the map never grows, so insert() can't
+// allocate memory and is safe to call in VM-exit. Collisions are resolved
+// by linear probing and erase() uses backward-shift deletion (no
+// tombstones), therefore the length of every probe sequence stays
+// bounded by the load factor.
+//
+// The capacity is rounded up to the power of 2 and insert() fails when
+// the map is filled to the maximum load factor - i.e. lookups never
+// degrade to a scan of the whole table.
+//
+// Note: KEY and VALUE must be default-constructible. The map isn't
+//       thread-safe - use per-CPU maps or protect them by a lock.
+//
+
+template <typename T>
+struct hash_map_hash
+{
+  static_assert(std::is_integral_v<T> || std::is_enum_v<T> || std::is_pointer_v<T>,
+                "hash_map_hash<> supports only integral, enum and pointer keys");
+
+  size_t operator()(T value) const noexcept
+  {
+    //
+    // Fibonacci hashing - spreads aligned values (such as CR3s or
+    // addresses) over all buckets.
+    //
+    uint64_t result;
+
+    if constexpr (std::is_pointer_v<T>)
+    {
+      result = reinterpret_cast<uint64_t>(value);
+    }
+    else
+    {
+      result = static_cast<uint64_t>(value);
+    }
+
+    result *= 0x9e3779b97f4a7c15;
+    return static_cast<size_t>(result ^ (result >> 32));
+  }
+};
+
+template <
+  typename KEY,
+  typename VALUE,
+  typename HASH = hash_map_hash<KEY>
+>
+class hash_map
+{
+  public:
+    //
+    // Maximum load factor is 7/8.
+    //
+    static constexpr size_t max_load_numerator   = 7;
+    static constexpr size_t max_load_denominator = 8;
+
+    struct slot_t
+    {
+      KEY   key;
+      VALUE value;
+      bool  used;
+    };
+
+    hash_map() noexcept
+      : slot_(nullptr)
+      , mask_(0)
+      , size_(0)
+      , max_size_(0)
+    {
+
+    }
+
+    hash_map(size_t capacity) noexcept
+      : hash_map()
+    {
+      reset(capacity);
+    }
+
+    hash_map(const hash_map& other) noexcept = delete;
+    hash_map(hash_map&& other) noexcept = delete;
+    hash_map& operator=(const hash_map& other) noexcept = delete;
+    hash_map& operator=(hash_map&& other) noexcept = delete;
+
+    ~hash_map() noexcept
+    {
+      delete[] slot_;
+    }
+
+    //
+    // (Re)allocates the table so it can hold at least "capacity" entries.
+    // All entries are removed. Returns false if the allocation failed.
+    // Don't call this method in VM-exit handler unless it is acceptable
+    // to take the memory manager lock.
+    //
+    bool reset(size_t capacity) noexcept
+    {
+      delete[] slot_;
+
+      size_t slot_count = 8;
+      while (slot_count * max_load_numerator / max_load_denominator < capacity)
+      {
+        slot_count *= 2;
+      }
+
+      slot_ = new slot_t[slot_count];
+
+      if (!slot_)
+      {
+        mask_ = 0;
+        size_ = 0;
+        max_size_ = 0;
+        return false;
+      }
+
+      mask_ = slot_count - 1;
+      max_size_ = slot_count * max_load_numerator / max_load_denominator;
+      clear();
+
+      return true;
+    }
+
+    void clear() noexcept
+    {
+      for (size_t i = 0; i < slot_count(); ++i)
+      {
+        slot_[i].used = false;
+      }
+
+      size_ = 0;
+    }
+
+    size_t size() const noexcept { return size_; }
+    size_t capacity() const noexcept { return max_size_; }
+    bool   empty() const noexcept { return size_ == 0; }
+    bool   full() const noexcept { return size_ >= max_size_; }
+
+    //
+    // Returns pointer to the value or nullptr if the key isn't present.
+    //
+    const VALUE* find(const KEY& key) const noexcept
+    {
+      auto index = find_index(key);
+      return index != npos ? &slot_[index].value : nullptr;
+    }
+
+    VALUE* find(const KEY& key) noexcept
+    {
+      auto index = find_index(key);
+      return index != npos ? &slot_[index].value : nullptr;
+    }
+
+    bool contains(const KEY& key) const noexcept
+    {
+      return find_index(key) != npos;
+    }
+
+    //
+    // Returns pointer to the value of the key - if the key isn't present,
+    // it is inserted with default-constructed value. Returns nullptr if
+    // the map is full.
+    //
+    VALUE* find_or_insert(const KEY& key) noexcept
+    {
+      bool inserted;
+      return find_or_insert(key, inserted);
+    }
+
+    VALUE* find_or_insert(const KEY& key, bool& inserted) noexcept
+    {
+      inserted = false;
+
+      if (!slot_)
+      {
+        return nullptr;
+      }
+
+      auto index = bucket(key);
+
+      for (;;)
+      {
+        auto& slot = slot_[index];
+
+        if (!slot.used)
+        {
+          if (full())
+          {
+            return nullptr;
+          }
+
+          slot.key = key;
+          slot.value = VALUE();
+          slot.used = true;
+          size_ += 1;
+
+          inserted = true;
+          return &slot.value;
+        }
+
+        if (slot.key == key)
+        {
+          return &slot.value;
+        }
+
+        index = (index + 1) & mask_;
+      }
+    }
+
+    //
+    // Inserts or overwrites the value of the key. Returns false if the map
+    // is full.
+    //
+    bool insert(const KEY& key, VALUE value) noexcept
+    {
+      auto result = find_or_insert(key);
+
+      if (!result)
+      {
+        return false;
+      }
+
+      *result = std::move(value);
+      return true;
+    }
+
+    bool erase(const KEY& key) noexcept
+    {
+      auto index = find_index(key);
+
+      if (index == npos)
+      {
+        return false;
+      }
+
+      //
+      // Backward-shift deletion - move following entries of the probe
+      // sequence into the hole, so no tombstone is needed.
+      //
+      auto hole = index;
+      auto next = (hole + 1) & mask_;
+
+      while (slot_[next].used)
+      {
+        auto home = bucket(slot_[next].key);
+
+        //
+        // Entry can be moved into the hole only if its home bucket isn't
+        // in the (cyclic) range (hole, next].
+        //
+        if (((next - home) & mask_) >= ((next - hole) & mask_))
+        {
+          slot_[hole].key = std::move(slot_[next].key);
+          slot_[hole].value = std::move(slot_[next].value);
+          hole = next;
+        }
+
+        next = (next + 1) & mask_;
+      }
+
+      slot_[hole].used = false;
+      size_ -= 1;
+      return true;
+    }
+
+    //
+    // Calls fn(key, value) for each entry.
+    //
+    template <typename FN>
+    void for_each(FN fn) const noexcept
+    {
+      for (size_t i = 0; i < slot_count(); ++i)
+      {
+        if (slot_[i].used)
+        {
+          fn(slot_[i].key, slot_[i].value);
+        }
+      }
+    }
+
+    template <typename FN>
+    void for_each(FN fn) noexcept
+    {
+      for (size_t i = 0; i < slot_count(); ++i)
+      {
+        if (slot_[i].used)
+        {
+          fn(slot_[i].key, slot_[i].value);
+        }
+      }
+    }
+
+  private:
+    static constexpr size_t npos = ~size_t(0);
+
+    size_t slot_count() const noexcept { return slot_ ? mask_ + 1 : 0; }
+    size_t bucket(const KEY& key) const noexcept { return HASH()(key) & mask_; }
+
+    size_t find_index(const KEY& key) const noexcept
+    {
+      if (!slot_)
+      {
+        return npos;
+      }
+
+      //
+      // The table always has at least one unused slot (see max_load_numerator),
+      // so the loop terminates.
+      //
+      auto index = bucket(key);
+
+      while (slot_[index].used)
+      {
+        if (slot_[index].key == key)
+        {
+          return index;
+        }
+
+        index = (index + 1) & mask_;
+      }
+
+      return npos;
+    }
+
+    slot_t* slot_;
+    size_t  mask_;
+    size_t  size_;
+    size_t  max_size_;
+};
@@ -0,0 +1,414 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+
+//
+// Augmented interval tree of guest-physical ranges.
+//
+// Each node holds a half-open range [begin, end), an access mask (e.g.
+// read/write/execute bits of the subscription) and a VALUE. The tree is
+// an AVL tree ordered by "begin" and each node is augmented by the
+// maximum "end" within its subtree. This allows a query to skip whole
+// subtrees which can't contain an overlapping range, therefore a
+// stabbing query ("which ranges contain this address") costs O(log n + k),
+// where k is the number of ranges which overlap the query - regardless of
+// how many pages the ranges span or how much they overlap each other.
+// Insertion and removal are O(log n) and keep the tree balanced.
+//
+// All nodes are preallocated by the constructor (or by reset()) from the
+// memory manager and kept in a free-list - insert() and remove() never
+// allocate memory, so they can be called in VM-exit handler.
+//
+// Usage:
+//   interval_tree<watchpoint_t*> tree(1024);
+//   auto node = tree.insert(gpa, gpa + size, access_write, watchpoint);
+//
+//   tree.for_each_containing(guest_pa, access_write, [&](auto& node) {
+//     node.value->notify(guest_pa);
+//   });
+//
+//   tree.remove(node);
+//
+// Note: VALUE must be default-constructible. The tree isn't thread-safe -
+//       use per-CPU trees or protect them by a lock. The callback of
+//       queries must not modify the tree.
+//
+
+template <typename VALUE>
+class interval_tree
+{
+  public:
+    struct node_t
+    {
+      uint64_t begin;
+      uint64_t end;
+      uint32_t access;
+      VALUE    value;
+
+      private:
+        friend class interval_tree;
+
+        node_t*  left;
+        node_t*  right;
+        uint64_t max_end;
+        int      height;
+    };
+
+    interval_tree() noexcept
+      : node_(nullptr)
+      , root_(nullptr)
+      , free_(nullptr)
+      , size_(0)
+      , capacity_(0)
+    {
+
+    }
+
+    interval_tree(size_t capacity) noexcept
+      : interval_tree()
+    {
+      reset(capacity);
+    }
+
+    interval_tree(const interval_tree& other) noexcept = delete;
+    interval_tree(interval_tree&& other) noexcept = delete;
+    interval_tree& operator=(const interval_tree& other) noexcept = delete;
+    interval_tree& operator=(interval_tree&& other) noexcept = delete;
+
+    ~interval_tree() noexcept
+    {
+      delete[] node_;
+    }
+
+    //
+    // (Re)allocates the node pool for "capacity" ranges. All ranges are
+    // removed. Returns false if the allocation failed.
+    // Don't call this method in VM-exit handler unless it is acceptable
+    // to take the memory manager lock.
+    //
+    bool reset(size_t capacity) noexcept
+    {
+      delete[] node_;
+
+      node_ = capacity ? new node_t[capacity] : nullptr;
+      capacity_ = node_ ? capacity : 0;
+      clear();
+
+      return node_ != nullptr;
+    }
+
+    void clear() noexcept
+    {
+      root_ = nullptr;
+      free_ = nullptr;
+      size_ = 0;
+
+      for (size_t i = capacity_; i > 0; --i)
+      {
+        node_[i - 1].left = free_;
+        free_ = &node_[i - 1];
+      }
+    }
+
+    size_t size() const noexcept { return size_; }
+    size_t capacity() const noexcept { return capacity_; }
+    bool   empty() const noexcept { return size_ == 0; }
+    bool   full() const noexcept { return free_ == nullptr; }
+
+    //
+    // Inserts range [begin, end). Ranges may overlap and duplicates are
+    // allowed. Returns the node (which identifies the range for remove())
+    // or nullptr if the range is empty or the tree is full.
+    //
+    node_t* insert(uint64_t begin, uint64_t end, uint32_t access, const VALUE& value) noexcept
+    {
+      if (begin >= end || !free_)
+      {
+        return nullptr;
+      }
+
+      auto node = free_;
+      free_ = free_->left;
+
+      node->begin   = begin;
+      node->end     = end;
+      node->access  = access;
+      node->value   = value;
+      node->left    = nullptr;
+      node->right   = nullptr;
+      node->max_end = end;
+      node->height  = 1;
+
+      root_ = insert(root_, node);
+      size_ += 1;
+
+      return node;
+    }
+
+    //
+    // Removes the range previously returned by insert().
+    //
+    void remove(node_t* node) noexcept
+    {
+      root_ = remove(root_, node);
+      size_ -= 1;
+
+      node->left = free_;
+      free_ = node;
+    }
+
+    //
+    // Calls fn(node) for each range which overlaps [begin, end) and whose
+    // access mask has any bit of "access" set. Returns number of such
+    // ranges.
+    //
+    template <typename FN>
+    size_t for_each_overlap(uint64_t begin, uint64_t end, uint32_t access, FN fn) noexcept
+    {
+      return begin < end
+        ? for_each_overlap(root_, begin, end, access, fn)
+        : 0;
+    }
+
+    //
+    // Stabbing query - calls fn(node) for each range which contains
+    // "address".
+    //
+    template <typename FN>
+    size_t for_each_containing(uint64_t address, uint32_t access, FN fn) noexcept
+    {
+      return address != ~uint64_t(0)
+        ? for_each_overlap(root_, address, address + 1, access, fn)
+        : 0;
+    }
+
+    bool any_overlap(uint64_t begin, uint64_t end, uint32_t access) const noexcept
+    {
+      return begin < end && any_overlap(root_, begin, end, access);
+    }
+
+    bool contains(uint64_t address, uint32_t access) const noexcept
+    {
+      return address != ~uint64_t(0) && any_overlap(root_, address, address + 1, access);
+    }
+
+  private:
+    static int height(const node_t* node) noexcept
+    {
+      return node ? node->height : 0;
+    }
+
+    static int balance(const node_t* node) noexcept
+    {
+      return height(node->left) - height(node->right);
+    }
+
+    static void update(node_t* node) noexcept
+    {
+      auto left_height = height(node->left);
+      auto right_height = height(node->right);
+
+      node->height = 1 + (left_height > right_height ? left_height : right_height);
+      node->max_end = node->end;
+
+      if (node->left && node->left->max_end > node->max_end)
+      {
+        node->max_end = node->left->max_end;
+      }
+
+      if (node->right && node->right->max_end > node->max_end)
+      {
+        node->max_end = node->right->max_end;
+      }
+    }
+
+    //
+    // Nodes are ordered by "begin" - nodes with the same "begin" by their
+    // address, so that each node has an unique position and remove() can
+    // find it.
+    //
+    static bool less(const node_t* lhs, const node_t* rhs) noexcept
+    {
+      return lhs->begin != rhs->begin
+        ? lhs->begin < rhs->begin
+        : lhs < rhs;
+    }
+
+    static node_t* rotate_left(node_t* node) noexcept
+    {
+      auto pivot = node->right;
+      node->right = pivot->left;
+      pivot->left = node;
+
+      update(node);
+      update(pivot);
+      return pivot;
+    }
+
+    static node_t* rotate_right(node_t* node) noexcept
+    {
+      auto pivot = node->left;
+      node->left = pivot->right;
+      pivot->right = node;
+
+      update(node);
+      update(pivot);
+      return pivot;
+    }
+
+    static node_t* rebalance(node_t* node) noexcept
+    {
+      update(node);
+
+      auto node_balance = balance(node);
+
+      if (node_balance > 1)
+      {
+        if (balance(node->left) < 0)
+        {
+          node->left = rotate_left(node->left);
+        }
+
+        return rotate_right(node);
+      }
+
+      if (node_balance < -1)
+      {
+        if (balance(node->right) > 0)
+        {
+          node->right = rotate_right(node->right);
+        }
+
+        return rotate_left(node);
+      }
+
+      return node;
+    }
+
+    //
+    // Recursion depth is bounded by the height of the AVL tree, which is
+    // below 1.44 * log2(n) - e.g. 20 levels for 10'000 ranges.
+    //
+    static node_t* insert(node_t* root, node_t* node) noexcept
+    {
+      if (!root)
+      {
+        return node;
+      }
+
+      if (less(node, root))
+      {
+        root->left = insert(root->left, node);
+      }
+      else
+      {
+        root->right = insert(root->right, node);
+      }
+
+      return rebalance(root);
+    }
+
+    static node_t* remove_min(node_t* root, node_t*& min) noexcept
+    {
+      if (!root->left)
+      {
+        min = root;
+        return root->right;
+      }
+
+      root->left = remove_min(root->left, min);
+      return rebalance(root);
+    }
+
+    static node_t* remove(node_t* root, node_t* node) noexcept
+    {
+      if (root == node)
+      {
+        if (!node->left || !node->right)
+        {
+          return node->left ? node->left : node->right;
+        }
+
+        //
+        // Replace the node by its successor.
+        //
+        node_t* successor;
+        auto right = remove_min(node->right, successor);
+
+        successor->left = node->left;
+        successor->right = right;
+        return rebalance(successor);
+      }
+
+      if (less(node, root))
+      {
+        root->left = remove(root->left, node);
+      }
+      else
+      {
+        root->right = remove(root->right, node);
+      }
+
+      return rebalance(root);
+    }
+
+    template <typename FN>
+    static size_t for_each_overlap(node_t* node, uint64_t begin, uint64_t end, uint32_t access, FN& fn) noexcept
+    {
+      size_t result = 0;
+
+      while (node && node->max_end > begin)
+      {
+        result += for_each_overlap(node->left, begin, end, access, fn);
+
+        //
+        // All ranges in the right subtree begin after this one.
+        //
+        if (node->begin >= end)
+        {
+          break;
+        }
+
+        if (node->end > begin && (node->access & access))
+        {
+          fn(*node);
+          result += 1;
+        }
+
+        node = node->right;
+      }
+
+      return result;
+    }
+
+    static bool any_overlap(const node_t* node, uint64_t begin, uint64_t end, uint32_t access) noexcept
+    {
+      while (node && node->max_end > begin)
+      {
+        if (any_overlap(node->left, begin, end, access))
+        {
+          return true;
+        }
+
+        if (node->begin >= end)
+        {
+          break;
+        }
+
+        if (node->end > begin && (node->access & access))
+        {
+          return true;
+        }
+
+        node = node->right;
+      }
+
+      return false;
+    }
+
+    node_t* node_;
+    node_t* root_;
+    node_t* free_;
+    size_t  size_;
+    size_t  capacity_;
+};
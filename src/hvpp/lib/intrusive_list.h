@@ -0,0 +1,148 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+//
+// Intrusive doubly-linked list.
+//
+// The list doesn't own nor allocate anything - the link (list_entry_t)
+// is a member of the linked object, so insertion and removal are O(1)
+// and can't fail. This makes it suitable for bookkeeping in VM-exit
+// handlers (e.g. free-lists or LRU lists of preallocated objects).
+//
+// Usage:
+//   struct item_t
+//   {
+//     int          value;
+//     list_entry_t link;
+//   };
+//
+//   intrusive_list<item_t, &item_t::link> list;
+//   list.push_back(item);
+//
+// Note: the object must not be destroyed while it is linked.
+//
+
+struct list_entry_t
+{
+  list_entry_t* next = nullptr;
+  list_entry_t* prev = nullptr;
+
+  bool linked() const noexcept { return next != nullptr; }
+};
+
+template <typename T, list_entry_t T::*LINK>
+class intrusive_list
+{
+  public:
+    class iterator
+    {
+      public:
+        iterator(list_entry_t* entry) noexcept : entry_(entry) { }
+
+        T& operator*()  const noexcept { return *container_of(entry_); }
+        T* operator->() const noexcept { return  container_of(entry_); }
+
+        iterator& operator++() noexcept { entry_ = entry_->next; return *this; }
+
+        bool operator==(const iterator& other) const noexcept { return entry_ == other.entry_; }
+        bool operator!=(const iterator& other) const noexcept { return entry_ != other.entry_; }
+
+      private:
+        list_entry_t* entry_;
+    };
+
+    intrusive_list() noexcept
+      : size_(0)
+    {
+      head_.next = &head_;
+      head_.prev = &head_;
+    }
+
+    intrusive_list(const intrusive_list& other) noexcept = delete;
+    intrusive_list(intrusive_list&& other) noexcept = delete;
+    intrusive_list& operator=(const intrusive_list& other) noexcept = delete;
+    intrusive_list& operator=(intrusive_list&& other) noexcept = delete;
+
+    size_t size() const noexcept { return size_; }
+    bool   empty() const noexcept { return size_ == 0; }
+
+    T* front() const noexcept { return empty() ? nullptr : container_of(head_.next); }
+    T* back()  const noexcept { return empty() ? nullptr : container_of(head_.prev); }
+
+    iterator begin() noexcept { return iterator(head_.next); }
+    iterator end()   noexcept { return iterator(&head_); }
+
+    void push_front(T& object) noexcept { insert_after(&head_, &(object.*LINK)); }
+    void push_back(T& object)  noexcept { insert_after(head_.prev, &(object.*LINK)); }
+
+    T* pop_front() noexcept
+    {
+      auto result = front();
+
+      if (result)
+      {
+        remove(*result);
+      }
+
+      return result;
+    }
+
+    T* pop_back() noexcept
+    {
+      auto result = back();
+
+      if (result)
+      {
+        remove(*result);
+      }
+
+      return result;
+    }
+
+    void remove(T& object) noexcept
+    {
+      auto entry = &(object.*LINK);
+
+      entry->prev->next = entry->next;
+      entry->next->prev = entry->prev;
+      entry->next = nullptr;
+      entry->prev = nullptr;
+
+      size_ -= 1;
+    }
+
+    //
+    // Moves the (linked) object to the front of the list - typical
+    // operation on LRU lists.
+    //
+    void move_to_front(T& object) noexcept
+    {
+      remove(object);
+      push_front(object);
+    }
+
+  private:
+    static T* container_of(const list_entry_t* entry) noexcept
+    {
+      //
+      // Offset of the link within T (the "pointer to member" can't be
+      // used in offsetof()).
+      //
+      auto offset = reinterpret_cast<size_t>(&(static_cast<T*>(nullptr)->*LINK));
+      return reinterpret_cast<T*>(reinterpret_cast<uintptr_t>(entry) - offset);
+    }
+
+    void insert_after(list_entry_t* position, list_entry_t* entry) noexcept
+    {
+      entry->prev = position;
+      entry->next = position->next;
+      position->next->prev = entry;
+      position->next = entry;
+
+      size_ += 1;
+    }
+
+    list_entry_t head_;
+    size_t       size_;
+};
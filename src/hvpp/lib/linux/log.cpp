@@ -0,0 +1,83 @@
+#include "log.h"
+#include "tracelog.h"
+
+#include "lib/mp.h"
+
+#include <cstdio>
+#include <ctime>
+
+namespace logger::detail {
+
+void vprint(level_t level, const char* function, const char* format, va_list args) noexcept
+{
+  if (!test_level(level))
+  {
+    return;
+  }
+
+  const char* level_string =
+    level == level_t::trace ? "TRC" :
+    level == level_t::debug ? "DBG" :
+    level == level_t::info  ? "INF" :
+    level == level_t::warn  ? "WRN" :
+    level == level_t::error ? "ERR" :
+                              "###";
+
+  char time_buffer[32] = { 0 };
+  if (test_options(options_t::print_time))
+  {
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    tm local_time;
+    localtime_r(&ts.tv_sec, &local_time);
+
+    snprintf(time_buffer, sizeof(time_buffer), "%02d:%02d:%02d.%03ld\t",
+             local_time.tm_hour, local_time.tm_min, local_time.tm_sec,
+             ts.tv_nsec / 1'000'000);
+  }
+
+  char processor_number_buffer[16] = { 0 };
+  if (test_options(options_t::print_processor_number))
+  {
+    snprintf(processor_number_buffer, sizeof(processor_number_buffer), "#%u\t", mp::cpu_index());
+  }
+
+  char function_name_buffer[64] = { 0 };
+  if (test_options(options_t::print_function_name))
+  {
+    snprintf(function_name_buffer, sizeof(function_name_buffer), "%-40s\t", function);
+  }
+
+  char message_buffer[512];
+  vsnprintf(message_buffer, sizeof(message_buffer), format, args);
+
+  fprintf(stderr, "%s%s%s\t%s%s\n",
+          time_buffer, processor_number_buffer, level_string,
+          function_name_buffer, message_buffer);
+}
+
+}
+
+namespace logger::tracelog {
+
+namespace detail {
+
+void vprint(level_t level, const char* function, const char* format, va_list args) noexcept
+{
+  logger::detail::vprint(level, function, format, args);
+}
+
+}
+
+void initialize() noexcept
+{
+
+}
+
+void destroy() noexcept
+{
+
+}
+
+}
@@ -0,0 +1,14 @@
+#pragma once
+#include "../log.h"
+
+#include <cstdarg>
+
+//
+// Standard error output.
+//
+
+namespace logger::detail {
+
+  void vprint(level_t level, const char* function, const char* format, va_list args) noexcept;
+
+}
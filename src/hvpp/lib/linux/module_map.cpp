@@ -0,0 +1,19 @@
+#include "module_map.h"
+
+//
+// User-mode implementation - there are no kernel image load notifications,
+// the map stays empty.
+//
+
+namespace module_map::detail {
+
+bool initialize() noexcept
+{
+  return false;
+}
+
+void destroy() noexcept
+{
+}
+
+}
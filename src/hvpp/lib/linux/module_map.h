@@ -0,0 +1,14 @@
+#pragma once
+
+namespace module_map::detail {
+
+  //
+  // Inserts all currently loaded kernel modules into the map and registers
+  // image load notification routine. Returns false if the routine couldn't
+  // be registered.
+  //
+  bool initialize() noexcept;
+
+  void destroy() noexcept;
+
+}
@@ -0,0 +1,53 @@
+#include "mp.h"
+
+#include <cstdint>
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+namespace mp::detail {
+
+uint32_t cpu_count() noexcept
+{
+  return static_cast<uint32_t>(sysconf(_SC_NPROCESSORS_ONLN));
+}
+
+uint32_t cpu_index() noexcept
+{
+  int result = sched_getcpu();
+  return result < 0 ? 0 : static_cast<uint32_t>(result);
+}
+
+void sleep(uint32_t milliseconds) noexcept
+{
+  usleep(milliseconds * 1000);
+}
+
+void ipi_call(void(*callback)(void*), void* context) noexcept
+{
+  //
+  // There are no IPIs in user-mode. Emulate them by running the callback
+  // on each CPU in turn - by pinning the current thread to it.
+  //
+  pthread_t thread = pthread_self();
+
+  cpu_set_t original_affinity;
+  pthread_getaffinity_np(thread, sizeof(original_affinity), &original_affinity);
+
+  for (uint32_t index = 0; index < cpu_count(); ++index)
+  {
+    cpu_set_t affinity;
+    CPU_ZERO(&affinity);
+    CPU_SET(index, &affinity);
+
+    if (pthread_setaffinity_np(thread, sizeof(affinity), &affinity) == 0)
+    {
+      callback(context);
+    }
+  }
+
+  pthread_setaffinity_np(thread, sizeof(original_affinity), &original_affinity);
+}
+
+}
@@ -0,0 +1,20 @@
+#pragma once
+#include "../log.h"
+
+#include <cstdarg>
+
+//
+// There is no TraceLogging on Linux - traces are written to the standard
+// error output as well.
+//
+
+namespace logger::tracelog {
+
+  namespace detail {
+    void vprint(level_t level, const char* function, const char* format, va_list args) noexcept;
+  }
+
+  void initialize() noexcept;
+  void destroy() noexcept;
+
+}
@@ -0,0 +1,48 @@
+#include "tsc.h"
+
+#include "ia32/asm.h"
+
+#include <cstdint>
+
+#include <time.h>
+
+namespace tsc::detail {
+
+static uint64_t tsc_frequency;
+
+static uint64_t monotonic_ns() noexcept
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1'000'000'000 + ts.tv_nsec;
+}
+
+void initialize() noexcept
+{
+  //
+  // Calibrate TSC against the monotonic clock (busy-wait for 10ms).
+  //
+  uint64_t ns_begin  = monotonic_ns();
+  uint64_t tsc_begin = ia32_asm_read_tsc();
+
+  uint64_t ns_end;
+  do
+  {
+    ns_end = monotonic_ns();
+  } while (ns_end - ns_begin < 10'000'000);
+
+  uint64_t tsc_end = ia32_asm_read_tsc();
+
+  uint64_t ns_delta  = ns_end - ns_begin;
+  uint64_t tsc_delta = tsc_end - tsc_begin;
+
+  tsc_frequency = static_cast<uint64_t>(
+    static_cast<double>(tsc_delta) * 1'000'000'000 / ns_delta);
+}
+
+uint64_t frequency() noexcept
+{
+  return tsc_frequency;
+}
+
+}
@@ -0,0 +1,10 @@
+#pragma once
+#include <cstdint>
+
+namespace tsc::detail {
+
+  void initialize() noexcept;
+
+  uint64_t frequency() noexcept;
+
+}
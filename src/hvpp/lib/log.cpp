@@ -1,7 +1,15 @@
 #include "log.h"
 
-#include "win32/log.h"
-#include "win32/tracelog.h"
+#ifdef _WIN32
+# include "win32/log.h"
+# include "win32/tracelog.h"
+#else
+# include "linux/log.h"
+# include "linux/tracelog.h"
+#endif
+
+#include "ia32/asm.h"
+#include "lib/tsc.h"
 
 #include <cstdarg>
 #include <cstdio>
@@ -85,4 +93,107 @@ namespace logger
 
     va_end(args);
   }
+
+  std::atomic<rate_limit_t*> rate_limit_t::head_{ nullptr };
+
+  bool rate_limit_t::acquire(const char* function, int line) noexcept
+  {
+    //
+    // Don't waste tokens on messages which wouldn't be printed anyway.
+    //
+    if (!test_level(level_t::trace))
+    {
+      return false;
+    }
+
+    //
+    // TSC frequency isn't known yet - don't limit anything.
+    //
+    auto window_ticks = tsc::ticks_per_ms() * window_ms;
+    if (!window_ticks)
+    {
+      return true;
+    }
+
+    auto now = ia32_asm_read_tsc();
+    auto window_begin = window_begin_.load(std::memory_order_acquire);
+
+    if (window_begin != window_closing &&
+        now - window_begin >= window_ticks &&
+        window_begin_.compare_exchange_strong(window_begin, window_closing, std::memory_order_relaxed))
+    {
+      //
+      // New window is being opened (only one CPU can succeed with the
+      // exchange above). Refill tokens before the window is published -
+      // otherwise other CPUs could spend the tokens of the old window in
+      // the new one - and report what has been dropped in the previous
+      // window.
+      //
+      used_.store(0, std::memory_order_relaxed);
+      window_begin_.store(now, std::memory_order_release);
+
+      report(function, line);
+    }
+
+    if (used_.fetch_add(1, std::memory_order_relaxed) < burst)
+    {
+      return true;
+    }
+
+    suppressed_.fetch_add(1, std::memory_order_relaxed);
+
+    //
+    // Link the bucket into the list for flush() when it suppresses its
+    // first message.
+    //
+    if (!registered_.exchange(true, std::memory_order_relaxed))
+    {
+      function_ = function;
+      line_ = line;
+
+      auto head = head_.load(std::memory_order_relaxed);
+      do
+      {
+        next_ = head;
+      } while (!head_.compare_exchange_weak(head, this, std::memory_order_release,
+                                                          std::memory_order_relaxed));
+    }
+
+    return false;
+  }
+
+  void rate_limit_t::flush() noexcept
+  {
+    auto window_ticks = tsc::ticks_per_ms() * window_ms;
+    if (!window_ticks || !test_level(level_t::trace))
+    {
+      return;
+    }
+
+    auto now = ia32_asm_read_tsc();
+
+    for (auto limiter = head_.load(std::memory_order_acquire);
+         limiter;
+         limiter = limiter->next_)
+    {
+      //
+      // Messages of the current window are reported when it expires.
+      //
+      auto window_begin = limiter->window_begin_.load(std::memory_order_relaxed);
+
+      if (window_begin != window_closing && now - window_begin >= window_ticks)
+      {
+        limiter->report(limiter->function_, limiter->line_);
+      }
+    }
+  }
+
+  void rate_limit_t::report(const char* function, int line) noexcept
+  {
+    auto suppressed = suppressed_.exchange(0, std::memory_order_relaxed);
+    if (suppressed)
+    {
+      print(level_t::trace, function, "suppressed %u messages from %s:%i", suppressed, function, line);
+    }
+  }
 }
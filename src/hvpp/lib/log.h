@@ -1,5 +1,6 @@
 #pragma once
 #include <cstdint>
+#include <atomic>
 
 #define hvpp_trace(format, ...)  ::logger::print(::logger::level_t::trace, __FUNCTION__, format, __VA_ARGS__)
 #define hvpp_debug(format, ...)  ::logger::print(::logger::level_t::debug, __FUNCTION__, format, __VA_ARGS__)
@@ -7,6 +8,21 @@
 #define hvpp_warn(format, ...)   ::logger::print(::logger::level_t::warn,  __FUNCTION__, format, __VA_ARGS__)
 #define hvpp_error(format, ...)  ::logger::print(::logger::level_t::error, __FUNCTION__, format, __VA_ARGS__)
 
+//
+// Rate-limited variant of hvpp_trace(). Each expansion of this macro has its
+// own token bucket (see logger::rate_limit_t), which is checked before any
+// formatting takes place.
+//
+#define hvpp_trace_rl(format, ...)                                      \
+  do                                                                    \
+  {                                                                     \
+    static ::logger::rate_limit_t hvpp_rate_limit_;                     \
+    if (hvpp_rate_limit_.acquire(__FUNCTION__, __LINE__))               \
+    {                                                                   \
+      hvpp_trace(format, __VA_ARGS__);                                  \
+    }                                                                   \
+  } while (0)
+
 namespace logger
 {
   enum class level_t : uint32_t
@@ -69,4 +85,62 @@ namespace logger
   bool test_level(level_t level) noexcept;
 
   void print(level_t level, const char* function, const char* format, ...) noexcept;
+
+  //
+  // Token bucket for rate limiting of single log call-site.
+  // The bucket is refilled with "burst" tokens every "window_ms"
+  // milliseconds. When the call-site runs out of tokens, its messages are
+  // only counted - and the count is printed as soon as the next window
+  // opens, either by the call-site itself or by flush().
+  //
+  // Buckets which have suppressed anything are linked into a global list,
+  // so that flush() can report them even if their call-site never fires
+  // again.
+  //
+  // The constructor is constexpr, therefore static instances are
+  // constant-initialized (no dynamic initializers, no guards).
+  //
+  class rate_limit_t
+  {
+    public:
+      static constexpr uint32_t burst     = 32;
+      static constexpr uint32_t window_ms = 1000;
+
+      constexpr rate_limit_t() noexcept
+        : window_begin_(0)
+        , used_(0)
+        , suppressed_(0)
+        , registered_(false)
+        , next_(nullptr)
+        , function_(nullptr)
+        , line_(0)
+      { }
+
+      bool acquire(const char* function, int line) noexcept;
+
+      //
+      // Prints suppressed counts of all buckets whose window has expired.
+      // Meant to be called periodically (e.g. from VM-exit handler).
+      //
+      static void flush() noexcept;
+
+    private:
+      //
+      // Value of window_begin_ while the window is being reopened.
+      //
+      static constexpr uint64_t window_closing = ~0ull;
+
+      void report(const char* function, int line) noexcept;
+
+      static std::atomic<rate_limit_t*> head_;
+
+      std::atomic<uint64_t> window_begin_;
+      std::atomic<uint32_t> used_;
+      std::atomic<uint32_t> suppressed_;
+      std::atomic<bool>     registered_;
+
+      rate_limit_t*         next_;
+      const char*           function_;
+      int                   line_;
+  };
 }
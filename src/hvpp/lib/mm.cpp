@@ -1,4 +1,3 @@
-#pragma once
 #include "mm.h"
 
 #include "ia32/memory.h"
@@ -310,7 +309,12 @@ namespace memory_manager
 
     int offset = static_cast<int>(ia32::bytes_to_pages(reinterpret_cast<uint8_t*>(address) - base_address));
 
-    if (offset * ia32::page_size > available_size)
+    //
+    // Note that the offset is relative to the base address - i.e. it covers
+    // also the pages reserved for page_bitmap and page_allocation_map - so it
+    // has to be checked against the whole bitmap, not just available_size.
+    //
+    if (offset < 0 || offset >= page_bitmap->size_in_bits())
     {
       //
       // We don't own this memory.
@@ -0,0 +1,314 @@
+#include "module_map.h"
+
+#include "ia32/asm.h"
+
+#include "lib/object.h"
+#include "lib/spinlock.h"
+
+#ifdef _WIN32
+# include "win32/module_map.h"
+#else
+# include "linux/module_map.h"
+#endif
+
+#include <cstring>
+#include <atomic>
+#include <mutex>
+
+//
+// Modules are stored in the "modules" table in order of insertion (their
+// index is their id). The "sorted_index" array holds ids of the modules
+// which are currently mapped, sorted by their base address - lookup()
+// performs binary search over it. Unloaded modules (see retain()) are
+// removed from it.
+//
+// Writers (initialize(), image load notifications and retain()) are
+// serialized by the lock. Readers are lock-free - they retry the search
+// if the sequence number changed (or was odd - write in progress) during
+// the search.
+//
+// Readers run in VM-exit handler, which can't wait for a writer that has
+// been preempted (or interrupted by VM-exit on the same CPU). Writers
+// therefore keep interrupts disabled while the sequence number is odd, and
+// readers give up after max_retry_count attempts.
+//
+
+namespace module_map
+{
+  module_t* modules = nullptr;
+  uint16_t* sorted_index = nullptr;
+
+  std::atomic<uint32_t> modules_count{ 0 };
+  std::atomic<uint32_t> sorted_count{ 0 };
+  std::atomic<uint32_t> sequence{ 0 };
+
+  object_t<spinlock> lock;
+
+  static constexpr uint32_t max_retry_count = 64;
+
+  bool initialize() noexcept
+  {
+    lock.initialize();
+
+    modules = new module_t[max_module_count];
+    sorted_index = new uint16_t[max_module_count];
+
+    memset(modules, 0, sizeof(module_t) * max_module_count);
+    memset(sorted_index, 0, sizeof(uint16_t) * max_module_count);
+
+    modules_count = 0;
+    sorted_count = 0;
+    sequence = 0;
+
+    //
+    // Take snapshot of loaded modules and register for notifications.
+    //
+    return detail::initialize();
+  }
+
+  void destroy() noexcept
+  {
+    //
+    // Unregister notifications first - no writer can run after this.
+    //
+    detail::destroy();
+
+    delete[] sorted_index;
+    delete[] modules;
+
+    sorted_index = nullptr;
+    modules = nullptr;
+
+    modules_count = 0;
+    sorted_count = 0;
+
+    lock.destroy();
+  }
+
+  uint32_t insert(uint64_t base, uint64_t size, const char* name, uint64_t load_tsc) noexcept
+  {
+    if (!modules)
+    {
+      return invalid_module_id;
+    }
+
+    std::lock_guard _(*lock);
+
+    uint32_t module_id = modules_count.load(std::memory_order_relaxed);
+    if (module_id >= max_module_count)
+    {
+      return invalid_module_id;
+    }
+
+    auto& module = modules[module_id];
+    module.base = base;
+    module.size = size;
+    module.load_tsc = load_tsc;
+    strncpy(module.name, name, max_name_length - 1);
+    module.name[max_name_length - 1] = '\0';
+
+    //
+    // Make the entry visible before its id is published.
+    //
+    modules_count.store(module_id + 1, std::memory_order_release);
+
+    //
+    // Begin write. The section below is short and doesn't touch pageable
+    // memory - disable interrupts, so that readers never see the odd
+    // sequence number for longer than that.
+    //
+    auto eflags = ia32_asm_read_eflags();
+    ia32_asm_disable_interrupts();
+
+    auto seq = sequence.load(std::memory_order_relaxed);
+    sequence.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    //
+    // Remove modules which overlap with the new one - they must have been
+    // unloaded.
+    //
+    uint32_t count = sorted_count.load(std::memory_order_relaxed);
+    uint32_t new_count = 0;
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+      auto& other = modules[sorted_index[i]];
+      if (other.base < base + size && base < other.base + other.size)
+      {
+        continue;
+      }
+
+      sorted_index[new_count++] = sorted_index[i];
+    }
+
+    //
+    // Insert the new module while keeping the array sorted.
+    //
+    uint32_t position = new_count;
+    while (position > 0 && modules[sorted_index[position - 1]].base > base)
+    {
+      sorted_index[position] = sorted_index[position - 1];
+      position -= 1;
+    }
+
+    sorted_index[position] = static_cast<uint16_t>(module_id);
+    sorted_count.store(new_count + 1, std::memory_order_relaxed);
+
+    //
+    // End write.
+    //
+    sequence.store(seq + 2, std::memory_order_release);
+
+    ia32_asm_write_eflags(eflags);
+
+    return module_id;
+  }
+
+  void retain(const uint64_t* bases, uint32_t count, uint64_t snapshot_tsc) noexcept
+  {
+    if (!modules)
+    {
+      return;
+    }
+
+    auto loaded_index = new uint16_t[max_module_count];
+
+    if (!loaded_index)
+    {
+      return;
+    }
+
+    std::lock_guard _(*lock);
+
+    //
+    // Writers are serialized - the sorted index can be filtered before
+    // the write section, which then just publishes the result.
+    //
+    uint32_t sorted = sorted_count.load(std::memory_order_relaxed);
+    uint32_t loaded = 0;
+
+    for (uint32_t i = 0; i < sorted; ++i)
+    {
+      auto& module = modules[sorted_index[i]];
+      auto found = module.load_tsc > snapshot_tsc;
+
+      for (uint32_t j = 0; j < count && !found; ++j)
+      {
+        found = bases[j] == module.base;
+      }
+
+      if (found)
+      {
+        loaded_index[loaded++] = sorted_index[i];
+      }
+    }
+
+    if (loaded != sorted)
+    {
+      auto eflags = ia32_asm_read_eflags();
+      ia32_asm_disable_interrupts();
+
+      auto seq = sequence.load(std::memory_order_relaxed);
+      sequence.store(seq + 1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+
+      memcpy(sorted_index, loaded_index, sizeof(uint16_t) * loaded);
+      sorted_count.store(loaded, std::memory_order_relaxed);
+
+      sequence.store(seq + 2, std::memory_order_release);
+
+      ia32_asm_write_eflags(eflags);
+    }
+
+    delete[] loaded_index;
+  }
+
+  bool lookup(uint64_t address, uint32_t& module_id, uint64_t& offset) noexcept
+  {
+    if (!modules)
+    {
+      return false;
+    }
+
+    uint32_t result;
+
+    for (uint32_t retry_count = 0; ; ++retry_count)
+    {
+      //
+      // The writer might be stuck behind this very CPU (e.g. this is
+      // VM-exit which interrupted it) - don't wait for it forever.
+      //
+      if (retry_count == max_retry_count)
+      {
+        return false;
+      }
+
+      auto seq = sequence.load(std::memory_order_acquire);
+
+      if (seq & 1)
+      {
+        ia32_asm_pause();
+        continue;
+      }
+
+      //
+      // Find the last module with base <= address.
+      //
+      uint32_t low = 0;
+      uint32_t high = sorted_count.load(std::memory_order_relaxed);
+
+      if (high > max_module_count)
+      {
+        high = max_module_count;
+      }
+
+      while (low < high)
+      {
+        uint32_t middle = low + (high - low) / 2;
+
+        if (modules[sorted_index[middle]].base <= address)
+        {
+          low = middle + 1;
+        }
+        else
+        {
+          high = middle;
+        }
+      }
+
+      result = low > 0
+        ? sorted_index[low - 1]
+        : invalid_module_id;
+
+      std::atomic_thread_fence(std::memory_order_acquire);
+
+      if (seq == sequence.load(std::memory_order_relaxed))
+      {
+        break;
+      }
+    }
+
+    if (result == invalid_module_id ||
+        address - modules[result].base >= modules[result].size)
+    {
+      return false;
+    }
+
+    module_id = result;
+    offset = address - modules[result].base;
+    return true;
+  }
+
+  const module_t* module(uint32_t module_id) noexcept
+  {
+    return module_id < modules_count.load(std::memory_order_acquire)
+      ? &modules[module_id]
+      : nullptr;
+  }
+
+  uint32_t module_count() noexcept
+  {
+    return modules_count.load(std::memory_order_acquire);
+  }
+}
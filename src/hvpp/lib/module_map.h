@@ -0,0 +1,77 @@
+#pragma once
+#include <cstdint>
+
+//
+// Map of loaded kernel modules.
+//
+// The map is snapshotted from the list of loaded modules in initialize()
+// and then updated on each kernel image load. Unloaded modules are found
+// by periodic comparison with the list of loaded modules (there's no
+// notification of kernel image unload). It is append-only - each module
+// gets its own id (index into the table) which is never reused, even if
+// the module is unloaded. This allows records (traces, samples,
+// ...) to carry (module id, offset) pair instead of raw address and to be
+// resolved later, after the module is gone.
+//
+// lookup() is lock-free and can be called from any context, including
+// VM-exit handler.
+//
+
+namespace module_map
+{
+  static constexpr uint32_t max_module_count  = 1024;
+  static constexpr uint32_t max_name_length   = 32;
+  static constexpr uint32_t invalid_module_id = ~0u;
+
+  struct module_t
+  {
+    uint64_t base;
+    uint64_t size;
+
+    //
+    // TSC at the time of the image load notification. Modules which were
+    // already loaded when the snapshot was taken have load_tsc == 0.
+    //
+    uint64_t load_tsc;
+
+    char     name[max_name_length];
+  };
+
+  //
+  // Returns false if the map couldn't register for image load
+  // notifications - it then holds just the initial snapshot.
+  //
+  bool initialize() noexcept;
+  void destroy() noexcept;
+
+  //
+  // Adds new module to the map. Modules which overlap with the new module
+  // (i.e. modules which have been unloaded in the meantime) are no longer
+  // found by lookup(), but their entries are kept.
+  // Returns id of the new module or invalid_module_id if the map is full.
+  //
+  uint32_t insert(uint64_t base, uint64_t size, const char* name, uint64_t load_tsc) noexcept;
+
+  //
+  // Marks modules which aren't in the list of loaded modules (given by
+  // their bases) as unloaded - they're no longer found by lookup(), but
+  // their entries are kept. Modules inserted after "snapshot_tsc" (i.e.
+  // after the list has been taken) are kept as well.
+  //
+  void retain(const uint64_t* bases, uint32_t count, uint64_t snapshot_tsc) noexcept;
+
+  //
+  // Finds module which contains "address" - O(log n).
+  // Returns false if no such module exists (or if the map is being
+  // updated for too long - lookup() never waits for the writer).
+  //
+  bool lookup(uint64_t address, uint32_t& module_id, uint64_t& offset) noexcept;
+
+  //
+  // Returns module with specified id or nullptr. Entries are immutable
+  // once inserted.
+  //
+  const module_t* module(uint32_t module_id) noexcept;
+
+  uint32_t module_count() noexcept;
+}
@@ -1,7 +1,11 @@
 #pragma once
 #include <cstdint>
 
-#include "win32/mp.h"
+#ifdef _WIN32
+# include "win32/mp.h"
+#else
+# include "linux/mp.h"
+#endif
 
 //
 // Multi-Processor functions.
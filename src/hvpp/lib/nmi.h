@@ -0,0 +1,36 @@
+#pragma once
+#include <cstdint>
+
+#include "win32/nmi.h"
+
+//
+// NMI notifications.
+//
+// Note that the host IDT of hvpp is the IDT of the OS, therefore the
+// handler is called on NMIs in both VMX root and VMX non-root operation.
+// It is called with RIP of the interrupted code and it must return true
+// if the NMI was caused by the caller - otherwise the NMI is passed to the
+// other handlers of the OS.
+//
+// The handler runs in NMI context - it must not take any locks and it
+// must not call any function of the OS.
+//
+
+namespace nmi {
+
+using handler_fn = bool(*)(uint64_t rip) noexcept;
+
+//
+// Must be called at PASSIVE_LEVEL. Only one handler can be registered.
+//
+inline bool initialize(handler_fn handler) noexcept
+{
+  return detail::initialize(handler);
+}
+
+inline void destroy() noexcept
+{
+  detail::destroy();
+}
+
+}
@@ -1,6 +1,8 @@
 #pragma once
 #include <type_traits>
+#include <utility>
 #include <cstdint>
+#include <new>
 
 //
 // Object class to create type-erasure'd static objects.
@@ -0,0 +1,47 @@
+#pragma once
+#include <cstdint>
+
+#include "win32/physical_window.h"
+
+//
+// Per-CPU window for reading arbitrary physical memory.
+//
+// Each logical CPU owns one page of reserved kernel address space. map()
+// rewrites the PTE of that page so that it points to the requested physical
+// page and invalidates its TLB entry - there are no calls into the OS, so
+// it can be used in VM-exit handlers (unlike pa_t::va(), which covers only
+// pages which are already mapped somewhere in the kernel address space).
+//
+// The window is read-only. The caller must not read physical pages which
+// aren't backed by RAM (see physical_memory_descriptor) - reads of MMIO
+// might have side effects.
+//
+
+namespace physical_window {
+
+//
+// Must be called at PASSIVE_LEVEL.
+//
+inline bool initialize() noexcept
+{
+  return detail::initialize();
+}
+
+inline void destroy() noexcept
+{
+  detail::destroy();
+}
+
+//
+// Maps the physical page which contains "pa" into the window of the current
+// CPU and returns its (page-aligned) virtual address, or nullptr if the
+// window isn't initialized. The mapping is valid until the next map() on
+// the same CPU - therefore the caller must not be preempted (e.g. it runs
+// in VM-exit handler).
+//
+inline const void* map(uint64_t pa) noexcept
+{
+  return detail::map(pa);
+}
+
+}
@@ -0,0 +1,195 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <type_traits>
+
+//
+// Bounded lock-free ring buffers with inline storage.
+//
+// Neither push() nor pop() allocate memory or wait for the other side -
+// when the ring is full, push() fails and when it's empty, pop() fails.
+// Therefore they're safe to call in VM-exit handlers and in NMI handlers
+// (as long as the NMI can't interrupt the same side of the ring).
+//
+// Large rings should be allocated by "new" (i.e. from the memory manager)
+// rather than placed on the stack.
+//
+
+//
+// Single-producer, single-consumer ring buffer.
+//
+// Head and tail indices never wrap (64-bit), the slot is selected by the
+// low bits. Producer and consumer indices live in separate cache lines.
+//
+
+template <typename T, size_t N>
+class spsc_ring_buffer
+{
+  static_assert(N > 0 && (N & (N - 1)) == 0, "capacity must be power of 2");
+  static_assert(std::is_trivially_copyable_v<T>, "T must be trivially copyable");
+
+  public:
+    static constexpr size_t capacity = N;
+
+    spsc_ring_buffer() noexcept : head_(0), tail_(0) { }
+    spsc_ring_buffer(const spsc_ring_buffer& other) noexcept = delete;
+    spsc_ring_buffer(spsc_ring_buffer&& other) noexcept = delete;
+    spsc_ring_buffer& operator=(const spsc_ring_buffer& other) noexcept = delete;
+    spsc_ring_buffer& operator=(spsc_ring_buffer&& other) noexcept = delete;
+
+    bool push(const T& value) noexcept
+    {
+      auto tail = tail_.load(std::memory_order_relaxed);
+
+      if (tail - head_.load(std::memory_order_acquire) == N)
+      {
+        return false;
+      }
+
+      data_[tail & (N - 1)] = value;
+      tail_.store(tail + 1, std::memory_order_release);
+      return true;
+    }
+
+    bool pop(T& value) noexcept
+    {
+      auto head = head_.load(std::memory_order_relaxed);
+
+      if (head == tail_.load(std::memory_order_acquire))
+      {
+        return false;
+      }
+
+      value = data_[head & (N - 1)];
+      head_.store(head + 1, std::memory_order_release);
+      return true;
+    }
+
+    //
+    // Approximate when called concurrently with push()/pop().
+    //
+    size_t size() const noexcept
+    {
+      return static_cast<size_t>(tail_.load(std::memory_order_acquire) -
+                                 head_.load(std::memory_order_acquire));
+    }
+
+    bool empty() const noexcept { return size() == 0; }
+
+  private:
+    alignas(64) std::atomic<uint64_t> head_;
+    alignas(64) std::atomic<uint64_t> tail_;
+    alignas(64) T                     data_[N];
+};
+
+//
+// Multiple-producer, single-consumer ring buffer.
+//
+// Each slot carries a sequence number (D. Vyukov's bounded queue):
+// producers reserve slots by CAS on the tail index and publish them by
+// storing the sequence number. A producer never waits for another
+// producer - if it loses the CAS, it simply retries with the new tail.
+// If a producer is interrupted between reserving and publishing the slot,
+// the consumer sees the ring as empty at that slot until it's published.
+//
+
+template <typename T, size_t N>
+class mpsc_ring_buffer
+{
+  static_assert(N > 0 && (N & (N - 1)) == 0, "capacity must be power of 2");
+  static_assert(std::is_trivially_copyable_v<T>, "T must be trivially copyable");
+
+  public:
+    static constexpr size_t capacity = N;
+
+    mpsc_ring_buffer() noexcept
+      : head_(0)
+      , tail_(0)
+    {
+      for (size_t i = 0; i < N; ++i)
+      {
+        slot_[i].sequence.store(i, std::memory_order_relaxed);
+      }
+    }
+
+    mpsc_ring_buffer(const mpsc_ring_buffer& other) noexcept = delete;
+    mpsc_ring_buffer(mpsc_ring_buffer&& other) noexcept = delete;
+    mpsc_ring_buffer& operator=(const mpsc_ring_buffer& other) noexcept = delete;
+    mpsc_ring_buffer& operator=(mpsc_ring_buffer&& other) noexcept = delete;
+
+    bool push(const T& value) noexcept
+    {
+      auto tail = tail_.load(std::memory_order_relaxed);
+
+      for (;;)
+      {
+        auto& slot = slot_[tail & (N - 1)];
+        auto sequence = slot.sequence.load(std::memory_order_acquire);
+        auto difference = static_cast<int64_t>(sequence - tail);
+
+        if (difference == 0)
+        {
+          //
+          // Slot is free - try to reserve it. On failure, "tail" is
+          // refreshed by compare_exchange_weak().
+          //
+          if (tail_.compare_exchange_weak(tail, tail + 1, std::memory_order_relaxed))
+          {
+            slot.value = value;
+            slot.sequence.store(tail + 1, std::memory_order_release);
+            return true;
+          }
+        }
+        else if (difference < 0)
+        {
+          //
+          // Slot still holds value from the previous lap - the ring is full.
+          //
+          return false;
+        }
+        else
+        {
+          tail = tail_.load(std::memory_order_relaxed);
+        }
+      }
+    }
+
+    bool pop(T& value) noexcept
+    {
+      auto head = head_.load(std::memory_order_relaxed);
+      auto& slot = slot_[head & (N - 1)];
+
+      if (slot.sequence.load(std::memory_order_acquire) != head + 1)
+      {
+        return false;
+      }
+
+      value = slot.value;
+      slot.sequence.store(head + N, std::memory_order_release);
+      head_.store(head + 1, std::memory_order_relaxed);
+      return true;
+    }
+
+    //
+    // Approximate when called concurrently with push()/pop().
+    //
+    size_t size() const noexcept
+    {
+      return static_cast<size_t>(tail_.load(std::memory_order_acquire) -
+                                 head_.load(std::memory_order_acquire));
+    }
+
+    bool empty() const noexcept { return size() == 0; }
+
+  private:
+    struct slot_t
+    {
+      std::atomic<uint64_t> sequence;
+      T                     value;
+    };
+
+    alignas(64) std::atomic<uint64_t> head_;
+    alignas(64) std::atomic<uint64_t> tail_;
+    alignas(64) slot_t                slot_[N];
+};
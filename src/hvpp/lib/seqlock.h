@@ -0,0 +1,103 @@
+#pragma once
+#include "ia32/asm.h"
+#include "spinlock.h"
+
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <mutex>
+#include <type_traits>
+
+//
+// Sequence lock - publishes value of type T to many readers and (rare)
+// writers.
+//
+// Readers never take any lock and never write to shared memory - they
+// just copy the value and check whether the sequence number has changed
+// in the meantime. If it has (or if a write is in progress), the copy is
+// retried. Therefore readers never block writers (nor each other) and in
+// the absence of writers, read() costs one copy of T and two loads.
+//
+// Writers are serialized by a spinlock. Sequence number is odd while the
+// write is in progress.
+//
+// Keep T small - it's copied on each read().
+//
+
+template <typename T>
+class seqlock
+{
+  static_assert(std::is_trivially_copyable_v<T>, "T must be trivially copyable");
+
+  public:
+    seqlock() noexcept
+      : sequence_(0)
+      , value_()
+    { }
+
+    seqlock(const T& value) noexcept
+      : sequence_(0)
+      , value_(value)
+    { }
+
+    seqlock(const seqlock& other) noexcept = delete;
+    seqlock(seqlock&& other) noexcept = delete;
+    seqlock& operator=(const seqlock& other) noexcept = delete;
+    seqlock& operator=(seqlock&& other) noexcept = delete;
+
+    T read() const noexcept
+    {
+      T result;
+      uint32_t sequence;
+
+      do
+      {
+        sequence = sequence_.load(std::memory_order_acquire);
+
+        //
+        // Write in progress - wait until it's done.
+        //
+        while (sequence & 1)
+        {
+          ia32_asm_pause();
+          sequence = sequence_.load(std::memory_order_acquire);
+        }
+
+        memcpy(&result, &value_, sizeof(T));
+        std::atomic_thread_fence(std::memory_order_acquire);
+      } while (sequence != sequence_.load(std::memory_order_relaxed));
+
+      return result;
+    }
+
+    void write(const T& value) noexcept
+    {
+      update([&](T& current) noexcept { current = value; });
+    }
+
+    //
+    // Read-modify-write - "fn" is called with reference to the current value
+    // while holding the writer lock.
+    //
+    template <typename TFunction>
+    void update(TFunction fn) noexcept
+    {
+      std::lock_guard _(lock_);
+
+      T value = value_;
+      fn(value);
+
+      auto sequence = sequence_.load(std::memory_order_relaxed);
+      sequence_.store(sequence + 1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+
+      memcpy(&value_, &value, sizeof(T));
+
+      sequence_.store(sequence + 2, std::memory_order_release);
+    }
+
+  private:
+    std::atomic<uint32_t> sequence_;
+    T                     value_;
+    spinlock              lock_;
+};
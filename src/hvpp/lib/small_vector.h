@@ -0,0 +1,166 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+//
+// Vector with inline storage for the first N elements.
+//
+// As long as the vector holds at most N elements, no memory is allocated
+// - which is the common case the N should be chosen for. When the inline
+// storage is exhausted, elements are moved into a buffer allocated from
+// the memory manager (the buffer doubles on each growth). Memory manager
+// never calls the OS, but it takes a lock - so in VM-exit handlers it's
+// preferable to reserve() the expected capacity up-front.
+//
+// Allocation failures are reported by push_back()/emplace_back()/reserve()
+// returning false - the vector stays unchanged in that case.
+//
+
+template <typename T, size_t N>
+class small_vector
+{
+  static_assert(N > 0, "small_vector<> requires non-zero inline capacity");
+
+  public:
+    using value_type = T;
+    using iterator = T*;
+    using const_iterator = const T*;
+
+    small_vector() noexcept
+      : data_(inline_data())
+      , size_(0)
+      , capacity_(N)
+    {
+
+    }
+
+    small_vector(const small_vector& other) noexcept = delete;
+    small_vector(small_vector&& other) noexcept = delete;
+    small_vector& operator=(const small_vector& other) noexcept = delete;
+    small_vector& operator=(small_vector&& other) noexcept = delete;
+
+    ~small_vector() noexcept
+    {
+      clear();
+
+      if (!is_inline())
+      {
+        delete[] reinterpret_cast<storage_t*>(data_);
+      }
+    }
+
+    size_t size() const noexcept { return size_; }
+    size_t capacity() const noexcept { return capacity_; }
+    bool   empty() const noexcept { return size_ == 0; }
+    bool   is_inline() const noexcept { return data_ == inline_data(); }
+
+    const T* data() const noexcept { return data_; }
+          T* data()       noexcept { return data_; }
+
+    const T& operator[](size_t index) const noexcept { return data_[index]; }
+          T& operator[](size_t index)       noexcept { return data_[index]; }
+
+    const T& front() const noexcept { return data_[0]; }
+          T& front()       noexcept { return data_[0]; }
+
+    const T& back()  const noexcept { return data_[size_ - 1]; }
+          T& back()        noexcept { return data_[size_ - 1]; }
+
+    const_iterator begin() const noexcept { return data_; }
+    const_iterator end()   const noexcept { return data_ + size_; }
+          iterator begin()       noexcept { return data_; }
+          iterator end()         noexcept { return data_ + size_; }
+
+    bool reserve(size_t capacity) noexcept
+    {
+      if (capacity <= capacity_)
+      {
+        return true;
+      }
+
+      auto buffer = reinterpret_cast<T*>(new storage_t[capacity]);
+
+      if (!buffer)
+      {
+        return false;
+      }
+
+      for (size_t i = 0; i < size_; ++i)
+      {
+        new (&buffer[i]) T(std::move(data_[i]));
+        data_[i].~T();
+      }
+
+      if (!is_inline())
+      {
+        delete[] reinterpret_cast<storage_t*>(data_);
+      }
+
+      data_ = buffer;
+      capacity_ = capacity;
+      return true;
+    }
+
+    template <typename ...ARGS>
+    bool emplace_back(ARGS&&... args) noexcept
+    {
+      if (size_ == capacity_ && !reserve(capacity_ * 2))
+      {
+        return false;
+      }
+
+      new (&data_[size_]) T(std::forward<ARGS>(args)...);
+      size_ += 1;
+      return true;
+    }
+
+    bool push_back(const T& value) noexcept { return emplace_back(value); }
+    bool push_back(T&& value) noexcept { return emplace_back(std::move(value)); }
+
+    void pop_back() noexcept
+    {
+      size_ -= 1;
+      data_[size_].~T();
+    }
+
+    //
+    // Removes the element by moving the last element in its place -
+    // O(1), but the order of elements isn't preserved.
+    //
+    void erase_unordered(size_t index) noexcept
+    {
+      if (index != size_ - 1)
+      {
+        data_[index] = std::move(data_[size_ - 1]);
+      }
+
+      pop_back();
+    }
+
+    void clear() noexcept
+    {
+      if constexpr (!std::is_trivially_destructible_v<T>)
+      {
+        for (size_t i = 0; i < size_; ++i)
+        {
+          data_[i].~T();
+        }
+      }
+
+      size_ = 0;
+    }
+
+  private:
+    using storage_t = std::aligned_storage_t<sizeof(T), alignof(T)>;
+
+    const T* inline_data() const noexcept { return reinterpret_cast<const T*>(inline_storage_); }
+          T* inline_data()       noexcept { return reinterpret_cast<T*>(inline_storage_); }
+
+    T*        data_;
+    size_t    size_;
+    size_t    capacity_;
+    storage_t inline_storage_[N];
+};
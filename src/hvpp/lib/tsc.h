@@ -0,0 +1,38 @@
+#pragma once
+#include <cstdint>
+
+#ifdef _WIN32
+# include "win32/tsc.h"
+#else
+# include "linux/tsc.h"
+#endif
+
+//
+// Time-Stamp Counter functions.
+//
+
+namespace tsc {
+
+//
+// Measures TSC frequency. Must be called (at PASSIVE_LEVEL) before
+// frequency() is used.
+//
+inline void initialize() noexcept
+{
+  detail::initialize();
+}
+
+//
+// Returns TSC frequency in Hz (ticks per second).
+//
+inline uint64_t frequency() noexcept
+{
+  return detail::frequency();
+}
+
+inline uint64_t ticks_per_ms() noexcept
+{
+  return detail::frequency() / 1000;
+}
+
+}
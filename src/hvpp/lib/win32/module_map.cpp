@@ -0,0 +1,275 @@
+#include "module_map.h"
+
+#include "ia32/asm.h"
+#include "lib/module_map.h"
+
+#include <cstdint>
+
+#include <ntddk.h>
+
+//
+// Undocumented structures and functions.
+//
+
+#define SystemModuleInformation 11
+
+typedef struct _RTL_PROCESS_MODULE_INFORMATION
+{
+  HANDLE Section;
+  PVOID MappedBase;
+  PVOID ImageBase;
+  ULONG ImageSize;
+  ULONG Flags;
+  USHORT LoadOrderIndex;
+  USHORT InitOrderIndex;
+  USHORT LoadCount;
+  USHORT OffsetToFileName;
+  UCHAR FullPathName[256];
+} RTL_PROCESS_MODULE_INFORMATION, *PRTL_PROCESS_MODULE_INFORMATION;
+
+typedef struct _RTL_PROCESS_MODULES
+{
+  ULONG NumberOfModules;
+  RTL_PROCESS_MODULE_INFORMATION Modules[1];
+} RTL_PROCESS_MODULES, *PRTL_PROCESS_MODULES;
+
+EXTERN_C
+NTSTATUS
+NTAPI
+ZwQuerySystemInformation(
+  _In_ ULONG SystemInformationClass,
+  _Out_writes_bytes_opt_(SystemInformationLength) PVOID SystemInformation,
+  _In_ ULONG SystemInformationLength,
+  _Out_opt_ PULONG ReturnLength
+  );
+
+#define HVPP_MODULE_MAP_TAG 'mmvh'
+
+namespace module_map::detail {
+
+//
+// Kernel images have no unload notification - the list of loaded modules
+// is compared with the map by the refresh thread in this interval.
+//
+static constexpr LONGLONG refresh_interval_ms = 1000;
+
+static bool notify_routine_registered = false;
+static HANDLE refresh_thread = nullptr;
+static KEVENT refresh_stop_event;
+
+static PRTL_PROCESS_MODULES query_module_list() noexcept
+{
+  //
+  // Get size of the module list first. The list might grow between the
+  // two calls, so add some space for few more entries.
+  //
+  ULONG ReturnLength = 0;
+  ZwQuerySystemInformation(SystemModuleInformation, nullptr, 0, &ReturnLength);
+
+  if (!ReturnLength)
+  {
+    return nullptr;
+  }
+
+  ULONG BufferSize = ReturnLength + 16 * sizeof(RTL_PROCESS_MODULE_INFORMATION);
+  auto ModuleList = reinterpret_cast<PRTL_PROCESS_MODULES>(
+    ExAllocatePoolWithTag(PagedPool, BufferSize, HVPP_MODULE_MAP_TAG));
+
+  if (!ModuleList)
+  {
+    return nullptr;
+  }
+
+  NTSTATUS Status = ZwQuerySystemInformation(SystemModuleInformation,
+                                             ModuleList,
+                                             BufferSize,
+                                             &ReturnLength);
+
+  if (!NT_SUCCESS(Status))
+  {
+    ExFreePoolWithTag(ModuleList, HVPP_MODULE_MAP_TAG);
+    return nullptr;
+  }
+
+  return ModuleList;
+}
+
+static void refresh() noexcept
+{
+  //
+  // TSC is read before the list is taken - modules loaded after that
+  // aren't in the list, but they're not unloaded (see retain()).
+  //
+  auto snapshot_tsc = ia32_asm_read_tsc();
+  auto ModuleList = query_module_list();
+
+  if (!ModuleList)
+  {
+    return;
+  }
+
+  auto Bases = reinterpret_cast<uint64_t*>(
+    ExAllocatePoolWithTag(PagedPool,
+                          ModuleList->NumberOfModules * sizeof(uint64_t),
+                          HVPP_MODULE_MAP_TAG));
+
+  if (Bases)
+  {
+    for (ULONG i = 0; i < ModuleList->NumberOfModules; ++i)
+    {
+      Bases[i] = reinterpret_cast<uint64_t>(ModuleList->Modules[i].ImageBase);
+    }
+
+    retain(Bases, ModuleList->NumberOfModules, snapshot_tsc);
+
+    ExFreePoolWithTag(Bases, HVPP_MODULE_MAP_TAG);
+  }
+
+  ExFreePoolWithTag(ModuleList, HVPP_MODULE_MAP_TAG);
+}
+
+static void refresh_thread_routine(
+  _In_ PVOID Context
+  ) noexcept
+{
+  UNREFERENCED_PARAMETER(Context);
+
+  LARGE_INTEGER Interval;
+  Interval.QuadPart = -refresh_interval_ms * 10'000;
+
+  while (KeWaitForSingleObject(&refresh_stop_event,
+                               Executive,
+                               KernelMode,
+                               FALSE,
+                               &Interval) == STATUS_TIMEOUT)
+  {
+    refresh();
+  }
+
+  PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+static void load_image_notify_routine(
+  _In_opt_ PUNICODE_STRING FullImageName,
+  _In_ HANDLE ProcessId,
+  _In_ PIMAGE_INFO ImageInfo
+  ) noexcept
+{
+  UNREFERENCED_PARAMETER(ProcessId);
+
+  //
+  // We're interested only in kernel modules.
+  //
+  if (!ImageInfo->SystemModeImage)
+  {
+    return;
+  }
+
+  //
+  // Take just the file name (without path) and convert it to ANSI. Module
+  // names are plain ASCII - anything else is replaced by '?'.
+  //
+  char name[max_name_length] = { 0 };
+
+  if (FullImageName && FullImageName->Buffer)
+  {
+    USHORT length = FullImageName->Length / sizeof(WCHAR);
+    USHORT begin = length;
+
+    while (begin > 0 && FullImageName->Buffer[begin - 1] != L'\\')
+    {
+      begin -= 1;
+    }
+
+    for (USHORT i = 0; i + begin < length && i < max_name_length - 1; ++i)
+    {
+      WCHAR c = FullImageName->Buffer[begin + i];
+      name[i] = c < 0x80 ? static_cast<char>(c) : '?';
+    }
+  }
+
+  insert(reinterpret_cast<uint64_t>(ImageInfo->ImageBase),
+         ImageInfo->ImageSize,
+         name,
+         ia32_asm_read_tsc());
+}
+
+bool initialize() noexcept
+{
+  //
+  // Register the notification routine before the snapshot is taken, so
+  // that no module loaded in the meantime is missed. Module which is
+  // inserted twice just gets two ids - the older one is shadowed by the
+  // newer one. If the registration fails (e.g. the system limit of
+  // notification routines has been reached), the map still holds the
+  // snapshot.
+  //
+  notify_routine_registered =
+    NT_SUCCESS(PsSetLoadImageNotifyRoutine(&load_image_notify_routine));
+
+  if (auto ModuleList = query_module_list())
+  {
+    for (ULONG i = 0; i < ModuleList->NumberOfModules; ++i)
+    {
+      auto& Module = ModuleList->Modules[i];
+
+      insert(reinterpret_cast<uint64_t>(Module.ImageBase),
+             Module.ImageSize,
+             reinterpret_cast<const char*>(&Module.FullPathName[Module.OffsetToFileName]),
+             0);
+    }
+
+    ExFreePoolWithTag(ModuleList, HVPP_MODULE_MAP_TAG);
+  }
+
+  //
+  // Start the refresh thread, which finds unloaded modules. Without it,
+  // unloaded modules stay in the map until another module is loaded at
+  // the same address - not fatal, the map just reports stale names.
+  //
+  if (notify_routine_registered)
+  {
+    KeInitializeEvent(&refresh_stop_event, NotificationEvent, FALSE);
+
+    OBJECT_ATTRIBUTES ObjectAttributes;
+    InitializeObjectAttributes(&ObjectAttributes,
+                               nullptr,
+                               OBJ_KERNEL_HANDLE,
+                               nullptr,
+                               nullptr);
+
+    NTSTATUS Status = PsCreateSystemThread(&refresh_thread,
+                                           THREAD_ALL_ACCESS,
+                                           &ObjectAttributes,
+                                           nullptr,
+                                           nullptr,
+                                           &refresh_thread_routine,
+                                           nullptr);
+
+    if (!NT_SUCCESS(Status))
+    {
+      refresh_thread = nullptr;
+    }
+  }
+
+  return notify_routine_registered;
+}
+
+void destroy() noexcept
+{
+  if (refresh_thread)
+  {
+    KeSetEvent(&refresh_stop_event, IO_NO_INCREMENT, FALSE);
+    ZwWaitForSingleObject(refresh_thread, FALSE, nullptr);
+    ZwClose(refresh_thread);
+    refresh_thread = nullptr;
+  }
+
+  if (notify_routine_registered)
+  {
+    PsRemoveLoadImageNotifyRoutine(&load_image_notify_routine);
+    notify_routine_registered = false;
+  }
+}
+
+}
@@ -0,0 +1,106 @@
+#include "nmi.h"
+
+#include "ia32/arch.h"
+
+#include <cstddef>
+#include <cstdint>
+
+#include <ntddk.h>
+
+//
+// Windows doesn't pass the interrupted context to the NMI callbacks.
+// However, NMI is always delivered on its own stack (IST) - the CPU pushes
+// the interrupt frame right below the top of that stack, and that's where
+// we take RIP of the interrupted code from.
+//
+// Note that both in VMX root and VMX non-root operation the IDT, GDT and TR
+// are the same (see vcpu_t::setup_host()).
+//
+
+namespace nmi::detail {
+
+using namespace ia32;
+
+#pragma pack(push, 4)
+struct tss64_t
+{
+  uint32_t reserved_1;
+  uint64_t rsp[3];
+  uint64_t ist[8];     // ist[0] is reserved
+  uint64_t reserved_2;
+  uint16_t reserved_3;
+  uint16_t io_map_base;
+};
+#pragma pack(pop)
+
+struct machine_frame_t
+{
+  uint64_t rip;
+  uint64_t cs;
+  uint64_t rflags;
+  uint64_t rsp;
+  uint64_t ss;
+};
+
+static_assert(offsetof(tss64_t, ist) == 0x1c);
+static_assert(sizeof(tss64_t) == 0x68);
+
+static PVOID callback_handle;
+static bool(*nmi_handler)(uint64_t rip) noexcept;
+
+static uint64_t interrupted_rip() noexcept
+{
+  //
+  // IST index of the NMI gate (vector 2) is in bits 2:0 of its 5th byte.
+  //
+  auto idtr = read<idtr_t>();
+  auto nmi_gate = reinterpret_cast<const uint8_t*>(idtr.base_address) + 2 * 16;
+  auto ist_index = nmi_gate[4] & 7;
+
+  if (!ist_index)
+  {
+    return 0;
+  }
+
+  auto gdtr = read<gdtr_t>();
+  auto tss = reinterpret_cast<const tss64_t*>(gdtr[read<tr_t>()].base_address());
+
+  //
+  // IST pointers are 16-byte aligned, so there's no alignment padding above
+  // the frame.
+  //
+  auto frame = reinterpret_cast<const machine_frame_t*>(tss->ist[ist_index]) - 1;
+  return frame->rip;
+}
+
+static BOOLEAN nmi_callback(_In_opt_ PVOID Context, _In_ BOOLEAN Handled) noexcept
+{
+  UNREFERENCED_PARAMETER(Context);
+  UNREFERENCED_PARAMETER(Handled);
+
+  return nmi_handler(interrupted_rip()) ? TRUE : FALSE;
+}
+
+bool initialize(bool(*handler)(uint64_t rip) noexcept) noexcept
+{
+  if (callback_handle)
+  {
+    return false;
+  }
+
+  nmi_handler = handler;
+  callback_handle = KeRegisterNmiCallback(&nmi_callback, nullptr);
+
+  return callback_handle != nullptr;
+}
+
+void destroy() noexcept
+{
+  if (callback_handle)
+  {
+    KeDeregisterNmiCallback(callback_handle);
+    callback_handle = nullptr;
+  }
+}
+
+}
@@ -0,0 +1,10 @@
+#pragma once
+#include <cstdint>
+
+namespace nmi::detail {
+
+  bool initialize(bool(*handler)(uint64_t rip) noexcept) noexcept;
+
+  void destroy() noexcept;
+
+}
@@ -0,0 +1,169 @@
+#include "physical_window.h"
+
+#include "ia32/arch.h"
+#include "ia32/asm.h"
+#include "ia32/memory.h"
+#include "lib/mp.h"
+
+#include <cstdint>
+
+#include <ntddk.h>
+
+#define HVPP_PHYSICAL_WINDOW_TAG 'wpvh'
+
+//
+// The window is reserved by MmAllocateMappingAddress - the OS guarantees
+// that page tables for the reserved range exist and it never touches its
+// PTEs on its own. The PTEs are found by walking the paging structures of
+// the current (kernel) CR3. Kernel half of the address space is shared by
+// all processes (and the host uses the kernel CR3 too), so the PTEs - and
+// their self-map virtual addresses returned by pa_t::va() - are the same
+// everywhere.
+//
+
+namespace physical_window::detail {
+
+using namespace ia32;
+
+static constexpr uint64_t pte_present   = 1ull << 0;
+static constexpr uint64_t pte_accessed  = 1ull << 5;
+static constexpr uint64_t pte_dirty     = 1ull << 6;
+static constexpr uint64_t pte_large     = 1ull << 7;
+static constexpr uint64_t pte_nx        = 1ull << 63;
+static constexpr uint64_t pte_pfn_mask  = 0x000ffffffffff000;
+
+static uint8_t*            window_base;
+static volatile uint64_t** window_pte;
+static uint32_t            window_count;
+
+static volatile uint64_t* find_pte(void* va) noexcept
+{
+  auto table_pa = pa_t::from_pfn(read<cr3_t>().page_frame_number);
+
+  for (auto level = page_table_level::pml4; ; --level)
+  {
+    auto table = static_cast<volatile uint64_t*>(table_pa.va());
+
+    if (!table || pa_t::from_va(const_cast<uint64_t*>(table)) != table_pa)
+    {
+      return nullptr;
+    }
+
+    auto entry = &table[pa_t(reinterpret_cast<uint64_t>(va)).index(level)];
+
+    if (level == page_table_level::pt)
+    {
+      return entry;
+    }
+
+    if (!(*entry & pte_present) || (*entry & pte_large))
+    {
+      return nullptr;
+    }
+
+    table_pa = pa_t(*entry & pte_pfn_mask);
+  }
+}
+
+static ULONG_PTR flush_ipi_callback(_In_ ULONG_PTR Argument) noexcept
+{
+  UNREFERENCED_PARAMETER(Argument);
+
+  for (uint32_t i = 0; i < window_count; ++i)
+  {
+    ia32_asm_inv_page(window_base + i * page_size);
+  }
+
+  return 0;
+}
+
+bool initialize() noexcept
+{
+  if (window_base)
+  {
+    return false;
+  }
+
+  auto count = mp::cpu_count();
+  auto base = static_cast<uint8_t*>(MmAllocateMappingAddress(count * page_size,
+                                                             HVPP_PHYSICAL_WINDOW_TAG));
+
+  if (!base)
+  {
+    return false;
+  }
+
+  auto pte = new volatile uint64_t*[count];
+
+  if (!pte)
+  {
+    MmFreeMappingAddress(base, HVPP_PHYSICAL_WINDOW_TAG);
+    return false;
+  }
+
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    pte[i] = find_pte(base + i * page_size);
+
+    if (!pte[i])
+    {
+      delete[] pte;
+      MmFreeMappingAddress(base, HVPP_PHYSICAL_WINDOW_TAG);
+      return false;
+    }
+  }
+
+  window_pte = pte;
+  window_count = count;
+  window_base = base;
+
+  return true;
+}
+
+void destroy() noexcept
+{
+  if (!window_base)
+  {
+    return;
+  }
+
+  //
+  // The PTEs have been written behind the back of the memory manager, so
+  // it must get them back clean - including the TLBs of all CPUs.
+  //
+  for (uint32_t i = 0; i < window_count; ++i)
+  {
+    *window_pte[i] = 0;
+  }
+
+  KeIpiGenericCall(&flush_ipi_callback, 0);
+
+  MmFreeMappingAddress(window_base, HVPP_PHYSICAL_WINDOW_TAG);
+  delete[] window_pte;
+
+  window_base = nullptr;
+  window_pte = nullptr;
+  window_count = 0;
+}
+
+const void* map(uint64_t pa) noexcept
+{
+  if (!window_base)
+  {
+    return nullptr;
+  }
+
+  auto index = mp::cpu_index();
+  auto va = window_base + index * page_size;
+  auto pte = (pa & pte_pfn_mask) | pte_present | pte_accessed | pte_dirty | pte_nx;
+
+  if (*window_pte[index] != pte)
+  {
+    *window_pte[index] = pte;
+    ia32_asm_inv_page(va);
+  }
+
+  return va;
+}
+
+}
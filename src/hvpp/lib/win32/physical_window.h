@@ -0,0 +1,12 @@
+#pragma once
+#include <cstdint>
+
+namespace physical_window::detail {
+
+  bool initialize() noexcept;
+
+  void destroy() noexcept;
+
+  const void* map(uint64_t pa) noexcept;
+
+}
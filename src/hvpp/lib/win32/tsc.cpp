@@ -0,0 +1,51 @@
+#include "tsc.h"
+
+#include "ia32/asm.h"
+
+#include <cstdint>
+
+#include <ntddk.h>
+
+namespace tsc::detail {
+
+static uint64_t tsc_frequency;
+
+void initialize() noexcept
+{
+  //
+  // Calibrate TSC against the performance counter. Stay on the same CPU
+  // during the measurement - TSC is expected to be invariant and synchronized
+  // across CPUs, but there's no need to rely on that here.
+  //
+  KIRQL OldIrql;
+  KeRaiseIrql(DISPATCH_LEVEL, &OldIrql);
+
+  LARGE_INTEGER QpcFrequency;
+  LARGE_INTEGER QpcBegin = KeQueryPerformanceCounter(&QpcFrequency);
+  uint64_t      TscBegin = ia32_asm_read_tsc();
+
+  //
+  // 10ms is enough to get precision well below 0.1%.
+  //
+  KeStallExecutionProcessor(10 * 1000);
+
+  LARGE_INTEGER QpcEnd   = KeQueryPerformanceCounter(nullptr);
+  uint64_t      TscEnd   = ia32_asm_read_tsc();
+
+  KeLowerIrql(OldIrql);
+
+  uint64_t QpcDelta = QpcEnd.QuadPart - QpcBegin.QuadPart;
+  uint64_t TscDelta = TscEnd - TscBegin;
+
+  tsc_frequency = QpcDelta
+    ? (TscDelta / QpcDelta) * QpcFrequency.QuadPart +
+      (TscDelta % QpcDelta) * QpcFrequency.QuadPart / QpcDelta
+    : 0;
+}
+
+uint64_t frequency() noexcept
+{
+  return tsc_frequency;
+}
+
+}
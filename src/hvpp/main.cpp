@@ -1,6 +1,8 @@
 #include "lib/mm.h"
 #include "lib/assert.h"
 #include "lib/log.h"
+#include "lib/module_map.h"
+#include "lib/tsc.h"
 
 #include "hvpp/hypervisor.h"
 
@@ -71,6 +73,12 @@ GlobalInitialize(
   logger::initialize();
   memory_manager::initialize();
 
+  //
+  // Measure TSC frequency (used by VM-exit history).
+  //
+  tsc::initialize();
+  hvpp_info("TscFrequency:        %8" PRIu64 " kHz", tsc::frequency() / 1000);
+
   //
   // Print physical memory descriptor to the debugger.
   //
@@ -125,6 +133,16 @@ GlobalInitialize(
   //
   memory_manager::assign(AllocatedMemory, RequiredMemorySize);
 
+  //
+  // Build map of loaded kernel modules (requires memory manager).
+  //
+  if (!module_map::initialize())
+  {
+    hvpp_warn("Image load notifications unavailable - module map won't be updated");
+  }
+
+  hvpp_info("ModuleCount:         %u", module_map::module_count());
+
   *Memory     = AllocatedMemory;
   *MemorySize = RequiredMemorySize;
 
@@ -139,6 +157,7 @@ GlobalDestroy(
 {
   UNREFERENCED_PARAMETER(MemorySize);
 
+  module_map::destroy();
   memory_manager::destroy();
   logger::destroy();
 
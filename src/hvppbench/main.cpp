@@ -0,0 +1,640 @@
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+
+#include <atomic>
+#include <mutex>
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "ia32/asm.h"
+#include "lib/mm.h"
+#include "lib/mp.h"
+#include "lib/tsc.h"
+#include "lib/seqlock.h"
+#include "lib/spinlock.h"
+#include "hvpp/vmexit_stats.h"
+
+//
+// Multi-core scaling benchmark of the shared hypervisor primitives.
+//
+// Runs the real memory_manager (lib/mm.cpp), spinlock (lib/spinlock.h),
+// seqlock (lib/seqlock.h) and vmexit_stats_handler::stats_t layout in
+// user-mode, with N threads pinned to CPUs (thread i runs on CPU i % ncpu).
+// Each thread executes a random mix of operations for a fixed time and
+// measures latency of every single operation with RDTSC.
+//
+// For each thread count, following is reported:
+//   - throughput (operations per second, total and per operation type)
+//   - latency percentiles (p50/p99/p99.9) per operation type
+//   - fairness - Jain's index of per-thread operation counts and the
+//     min/max ratio (1.0 means every thread made the same progress)
+//
+// Note that latency includes the RDTSC overhead (~20-40 cycles) and that
+// the global operator new/delete are backed by the memory_manager - exactly
+// as in the driver - so the harness itself doesn't allocate while measuring.
+//
+
+namespace bench {
+
+using hvpp::vmexit_stats_handler;
+
+enum class op_t
+{
+  alloc,          // memory_manager::allocate() or free() from per-thread ring
+  lock,           // lock/unlock of the shared spinlock around a counter increment
+  stats_shared,   // atomic increment in a single stats_t shared by all threads
+  stats_percpu,   // plain increment in stats_t[thread] (layout of vmexit_stats)
+  config_read,    // seqlock<config_t>::read() + trace_enabled()
+  config_write,   // seqlock<config_t>::update()
+
+  max
+};
+
+static const char* op_to_string(op_t value) noexcept
+{
+  switch (value)
+  {
+    case op_t::alloc:        return "alloc";
+    case op_t::lock:         return "lock";
+    case op_t::stats_shared: return "stats_shared";
+    case op_t::stats_percpu: return "stats_percpu";
+    case op_t::config_read:  return "config_read";
+    case op_t::config_write: return "config_write";
+    default:                 return "";
+  }
+}
+
+static constexpr int op_count = static_cast<int>(op_t::max);
+
+static constexpr int max_threads = 256;
+static constexpr int ring_size = 16;
+
+//
+// Latency histogram - 4 sub-buckets per power of 2 (~19% resolution).
+//
+static constexpr int histogram_size = 64 * 4;
+
+static int histogram_index(uint64_t ticks) noexcept
+{
+  if (ticks < 4)
+  {
+    return static_cast<int>(ticks);
+  }
+
+  int msb = 63 - __builtin_clzll(ticks);
+  int sub = static_cast<int>((ticks >> (msb - 2)) & 3);
+  return msb * 4 + sub;
+}
+
+static uint64_t histogram_upper_bound(int index) noexcept
+{
+  if (index < 4)
+  {
+    return static_cast<uint64_t>(index);
+  }
+
+  int msb = index / 4;
+  int sub = index % 4;
+  return ((4ull + sub + 1) << (msb - 2)) - 1;
+}
+
+struct options_t
+{
+  int      thread_counts[32];
+  int      thread_count_count;
+  uint32_t weight[op_count];
+  uint32_t duration_ms;
+  uint32_t alloc_size;
+  size_t   pool_size;
+};
+
+struct alignas(64) thread_result_t
+{
+  uint64_t ops[op_count];
+  uint64_t failed_allocations;
+  uint32_t histogram[op_count][histogram_size];
+};
+
+struct alignas(64) shared_t
+{
+  //
+  // Each member on its own cache line - we want to measure contention
+  // on the member itself, not false sharing between members.
+  //
+  alignas(64) spinlock                                   lock;
+  alignas(64) uint64_t                                   lock_counter;
+  alignas(64) vmexit_stats_handler::stats_t              stats;
+  alignas(64) seqlock<vmexit_stats_handler::config_t>    config;
+  alignas(64) std::atomic<int>                           ready;
+  alignas(64) std::atomic<bool>                          start;
+  alignas(64) std::atomic<bool>                          stop;
+};
+
+struct thread_context_t
+{
+  int                             thread_index;
+  int                             cpu_index;
+  const options_t*                options;
+  const uint8_t*                  op_table;
+  shared_t*                       shared;
+  vmexit_stats_handler::stats_t*  percpu_stats;
+  thread_result_t*                result;
+};
+
+//
+// Table of 256 operations distributed according to the weights - the
+// operation is then picked by one random byte.
+//
+static void build_op_table(const options_t& options, uint8_t* op_table) noexcept
+{
+  uint64_t total = 0;
+  for (int i = 0; i < op_count; ++i)
+  {
+    total += options.weight[i];
+  }
+
+  int index = 0;
+  uint64_t cumulative = 0;
+  for (int i = 0; i < op_count; ++i)
+  {
+    cumulative += options.weight[i];
+    int end = static_cast<int>(cumulative * 256 / total);
+
+    for (; index < end; ++index)
+    {
+      op_table[index] = static_cast<uint8_t>(i);
+    }
+  }
+}
+
+static uint64_t xorshift64(uint64_t& state) noexcept
+{
+  state ^= state << 13;
+  state ^= state >> 7;
+  state ^= state << 17;
+  return state;
+}
+
+static void* thread_routine(void* context) noexcept
+{
+  auto ctx = reinterpret_cast<thread_context_t*>(context);
+  auto& options = *ctx->options;
+  auto& shared = *ctx->shared;
+  auto& result = *ctx->result;
+  auto& stats = ctx->percpu_stats[ctx->thread_index];
+
+  cpu_set_t affinity;
+  CPU_ZERO(&affinity);
+  CPU_SET(ctx->cpu_index, &affinity);
+  pthread_setaffinity_np(pthread_self(), sizeof(affinity), &affinity);
+
+  void* ring[ring_size] = {};
+  int ring_index = 0;
+
+  uint64_t random_state = 0x9e3779b97f4a7c15ull * (ctx->thread_index + 1);
+
+  shared.ready.fetch_add(1);
+  while (!shared.start.load(std::memory_order_acquire))
+  {
+    ia32_asm_pause();
+  }
+
+  while (!shared.stop.load(std::memory_order_relaxed))
+  {
+    //
+    // Check the stop flag only every 64 operations.
+    //
+    for (int iteration = 0; iteration < 64; ++iteration)
+    {
+      uint64_t random = xorshift64(random_state);
+      auto op = static_cast<op_t>(ctx->op_table[random & 0xff]);
+      uint32_t reason = static_cast<uint32_t>((random >> 8) % 65);
+
+      uint64_t tsc_begin = ia32_asm_read_tsc();
+
+      switch (op)
+      {
+        case op_t::alloc:
+          if (ring[ring_index])
+          {
+            memory_manager::free(ring[ring_index]);
+            ring[ring_index] = nullptr;
+          }
+          else
+          {
+            ring[ring_index] = memory_manager::allocate(options.alloc_size);
+            result.failed_allocations += !ring[ring_index];
+          }
+
+          ring_index = (ring_index + 1) % ring_size;
+          break;
+
+        case op_t::lock:
+          {
+            std::lock_guard _(shared.lock);
+            shared.lock_counter += 1;
+          }
+          break;
+
+        case op_t::stats_shared:
+          __atomic_fetch_add(&shared.stats.vmexit[reason], 1, __ATOMIC_RELAXED);
+          break;
+
+        case op_t::stats_percpu:
+          stats.vmexit[reason] += 1;
+          break;
+
+        case op_t::config_read:
+          if (shared.config.read().trace_enabled(static_cast<ia32::vmx::exit_reason>(reason)))
+          {
+            stats.expt_vector[0] += 1;
+          }
+          break;
+
+        case op_t::config_write:
+          shared.config.update([reason](vmexit_stats_handler::config_t& config) noexcept {
+            config.trace_bitmap[reason / 8] ^= 1 << (reason % 8);
+          });
+          break;
+
+        default:
+          break;
+      }
+
+      uint64_t tsc_end = ia32_asm_read_tsc();
+
+      result.ops[static_cast<int>(op)] += 1;
+      result.histogram[static_cast<int>(op)][histogram_index(tsc_end - tsc_begin)] += 1;
+    }
+  }
+
+  for (auto& address : ring)
+  {
+    if (address)
+    {
+      memory_manager::free(address);
+    }
+  }
+
+  return nullptr;
+}
+
+static uint64_t percentile(const uint32_t* histogram, uint64_t total, double fraction) noexcept
+{
+  uint64_t threshold = static_cast<uint64_t>(std::ceil(total * fraction));
+  uint64_t cumulative = 0;
+
+  for (int i = 0; i < histogram_size; ++i)
+  {
+    cumulative += histogram[i];
+
+    if (cumulative >= threshold && cumulative > 0)
+    {
+      return histogram_upper_bound(i);
+    }
+  }
+
+  return 0;
+}
+
+static double ticks_to_ns(uint64_t ticks) noexcept
+{
+  return static_cast<double>(ticks) * 1e9 / static_cast<double>(tsc::frequency());
+}
+
+static void report(const options_t& options, int thread_count, const thread_result_t* results, uint64_t elapsed_ticks) noexcept
+{
+  double seconds = static_cast<double>(elapsed_ticks) / static_cast<double>(tsc::frequency());
+
+  //
+  // Merge per-thread histograms.
+  //
+  static uint32_t histogram[op_count][histogram_size];
+  uint64_t ops[op_count] = {};
+  uint64_t failed_allocations = 0;
+
+  memset(histogram, 0, sizeof(histogram));
+
+  for (int t = 0; t < thread_count; ++t)
+  {
+    for (int op = 0; op < op_count; ++op)
+    {
+      ops[op] += results[t].ops[op];
+
+      for (int i = 0; i < histogram_size; ++i)
+      {
+        histogram[op][i] += results[t].histogram[op][i];
+      }
+    }
+
+    failed_allocations += results[t].failed_allocations;
+  }
+
+  //
+  // Fairness - Jain's index: (sum x)^2 / (n * sum x^2).
+  //
+  double sum = 0.0;
+  double sum_squared = 0.0;
+  uint64_t min_ops = UINT64_MAX;
+  uint64_t max_ops = 0;
+
+  for (int t = 0; t < thread_count; ++t)
+  {
+    uint64_t thread_ops = 0;
+    for (int op = 0; op < op_count; ++op)
+    {
+      thread_ops += results[t].ops[op];
+    }
+
+    sum += static_cast<double>(thread_ops);
+    sum_squared += static_cast<double>(thread_ops) * static_cast<double>(thread_ops);
+    min_ops = thread_ops < min_ops ? thread_ops : min_ops;
+    max_ops = thread_ops > max_ops ? thread_ops : max_ops;
+  }
+
+  double jain_index = sum_squared > 0.0 ? (sum * sum) / (thread_count * sum_squared) : 0.0;
+
+  printf("threads: %d  time: %.3f s  total: %.3f Mops/s  fairness: jain %.3f  min/max %.3f (%llu / %llu)\n",
+         thread_count,
+         seconds,
+         sum / seconds / 1e6,
+         jain_index,
+         max_ops ? static_cast<double>(min_ops) / static_cast<double>(max_ops) : 0.0,
+         static_cast<unsigned long long>(min_ops),
+         static_cast<unsigned long long>(max_ops));
+
+  printf("  %-14s %12s %12s %12s %12s\n", "op", "Mops/s", "p50 ns", "p99 ns", "p99.9 ns");
+
+  for (int op = 0; op < op_count; ++op)
+  {
+    if (!options.weight[op])
+    {
+      continue;
+    }
+
+    printf("  %-14s %12.3f %12.1f %12.1f %12.1f\n",
+           op_to_string(static_cast<op_t>(op)),
+           static_cast<double>(ops[op]) / seconds / 1e6,
+           ticks_to_ns(percentile(histogram[op], ops[op], 0.50)),
+           ticks_to_ns(percentile(histogram[op], ops[op], 0.99)),
+           ticks_to_ns(percentile(histogram[op], ops[op], 0.999)));
+  }
+
+  if (failed_allocations)
+  {
+    printf("  failed allocations: %llu (increase -p)\n",
+           static_cast<unsigned long long>(failed_allocations));
+  }
+
+  printf("\n");
+}
+
+static void run(const options_t& options, int thread_count) noexcept
+{
+  //
+  // All of these are allocated by the memory_manager, before the
+  // measurement starts.
+  //
+  auto shared       = new shared_t();
+  auto percpu_stats = new vmexit_stats_handler::stats_t[thread_count];
+  auto results      = new thread_result_t[thread_count];
+  auto contexts     = new thread_context_t[thread_count];
+  auto threads      = new pthread_t[thread_count];
+
+  memset(percpu_stats, 0, sizeof(vmexit_stats_handler::stats_t) * thread_count);
+  memset(results, 0, sizeof(thread_result_t) * thread_count);
+  memset(&shared->stats, 0, sizeof(shared->stats));
+  shared->lock_counter = 0;
+  shared->ready = 0;
+  shared->start = false;
+  shared->stop = false;
+
+  uint8_t op_table[256];
+  build_op_table(options, op_table);
+
+  uint32_t cpu_count = mp::cpu_count();
+
+  for (int t = 0; t < thread_count; ++t)
+  {
+    contexts[t] = thread_context_t{
+      t,
+      static_cast<int>(t % cpu_count),
+      &options,
+      op_table,
+      shared,
+      percpu_stats,
+      &results[t]
+    };
+
+    pthread_create(&threads[t], nullptr, &thread_routine, &contexts[t]);
+  }
+
+  while (shared->ready.load() != thread_count)
+  {
+    mp::sleep(1);
+  }
+
+  uint64_t tsc_begin = ia32_asm_read_tsc();
+  shared->start.store(true, std::memory_order_release);
+
+  mp::sleep(options.duration_ms);
+
+  shared->stop.store(true, std::memory_order_relaxed);
+
+  for (int t = 0; t < thread_count; ++t)
+  {
+    pthread_join(threads[t], nullptr);
+  }
+
+  uint64_t tsc_end = ia32_asm_read_tsc();
+
+  report(options, thread_count, results, tsc_end - tsc_begin);
+
+  delete[] threads;
+  delete[] contexts;
+  delete[] results;
+  delete[] percpu_stats;
+  delete shared;
+}
+
+static void usage(const char* program) noexcept
+{
+  printf("usage: %s [-t THREADS] [-m MIX] [-d MS] [-s BYTES] [-p MB]\n", program);
+  printf("  -t  comma-separated thread counts, 1-%d (default: 1,2,4,... up to CPU count)\n", max_threads);
+  printf("  -m  operation mix as op=weight pairs (default: alloc=30,lock=30,stats_shared=15,\n");
+  printf("      stats_percpu=15,config_read=10,config_write=0)\n");
+  printf("  -d  duration of each run in milliseconds (default: 1000)\n");
+  printf("  -s  allocation size in bytes (default: 4096)\n");
+  printf("  -p  memory_manager pool size in MB (default: 128)\n");
+}
+
+static bool parse_thread_counts(const char* value, options_t& options) noexcept
+{
+  options.thread_count_count = 0;
+
+  while (*value)
+  {
+    char* end;
+    long count = strtol(value, &end, 10);
+
+    if (end == value || count < 1 || count > max_threads ||
+        options.thread_count_count == static_cast<int>(std::size(options.thread_counts)))
+    {
+      return false;
+    }
+
+    options.thread_counts[options.thread_count_count++] = static_cast<int>(count);
+    value = *end == ',' ? end + 1 : end;
+
+    if (*end && *end != ',')
+    {
+      return false;
+    }
+  }
+
+  return options.thread_count_count > 0;
+}
+
+static bool parse_mix(const char* value, options_t& options) noexcept
+{
+  memset(options.weight, 0, sizeof(options.weight));
+
+  while (*value)
+  {
+    const char* equals = strchr(value, '=');
+    if (!equals)
+    {
+      return false;
+    }
+
+    int op = 0;
+    for (; op < op_count; ++op)
+    {
+      const char* name = op_to_string(static_cast<op_t>(op));
+      if (strlen(name) == static_cast<size_t>(equals - value) && !strncmp(name, value, equals - value))
+      {
+        break;
+      }
+    }
+
+    if (op == op_count)
+    {
+      return false;
+    }
+
+    char* end;
+    options.weight[op] = static_cast<uint32_t>(strtoul(equals + 1, &end, 10));
+    value = *end == ',' ? end + 1 : end;
+
+    if (*end && *end != ',')
+    {
+      return false;
+    }
+  }
+
+  for (auto weight : options.weight)
+  {
+    if (weight)
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+  using namespace bench;
+
+  static options_t options;
+  options.weight[static_cast<int>(op_t::alloc)]        = 30;
+  options.weight[static_cast<int>(op_t::lock)]         = 30;
+  options.weight[static_cast<int>(op_t::stats_shared)] = 15;
+  options.weight[static_cast<int>(op_t::stats_percpu)] = 15;
+  options.weight[static_cast<int>(op_t::config_read)]  = 10;
+  options.duration_ms = 1000;
+  options.alloc_size = 4096;
+  options.pool_size = 128 * 1024 * 1024;
+
+  uint32_t cpu_count = mp::cpu_count();
+  for (int count = 1; ; count *= 2)
+  {
+    int capped = count < static_cast<int>(cpu_count) ? count : static_cast<int>(cpu_count);
+    capped = capped < max_threads ? capped : max_threads;
+    options.thread_counts[options.thread_count_count++] = capped;
+
+    if (capped != count || capped == static_cast<int>(cpu_count) || capped == max_threads)
+    {
+      break;
+    }
+  }
+
+  int opt;
+  while ((opt = getopt(argc, argv, "t:m:d:s:p:h")) != -1)
+  {
+    bool valid = true;
+
+    switch (opt)
+    {
+      case 't': valid = parse_thread_counts(optarg, options); break;
+      case 'm': valid = parse_mix(optarg, options); break;
+      case 'd': options.duration_ms = static_cast<uint32_t>(strtoul(optarg, nullptr, 10)); break;
+      case 's': options.alloc_size = static_cast<uint32_t>(strtoul(optarg, nullptr, 10)); break;
+      case 'p': options.pool_size = static_cast<size_t>(strtoull(optarg, nullptr, 10)) * 1024 * 1024; break;
+      default:  valid = false; break;
+    }
+
+    if (!valid)
+    {
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  if (!options.duration_ms || !options.alloc_size)
+  {
+    usage(argv[0]);
+    return 1;
+  }
+
+  //
+  // Same initialization order as in the driver - memory_manager must be
+  // ready before the first "new".
+  //
+  memory_manager::initialize();
+
+  void* pool = aligned_alloc(4096, options.pool_size);
+  if (!pool)
+  {
+    fprintf(stderr, "cannot allocate pool of %zu bytes\n", options.pool_size);
+    return 1;
+  }
+
+  memory_manager::assign(pool, options.pool_size);
+
+  tsc::initialize();
+
+  printf("cpus: %u  tsc: %.3f GHz  spinlock::max_wait: %u  alloc size: %u\n\n",
+         cpu_count,
+         static_cast<double>(tsc::frequency()) / 1e9,
+         spinlock::max_wait,
+         options.alloc_size);
+
+  for (int i = 0; i < options.thread_count_count; ++i)
+  {
+    run(options, options.thread_counts[i]);
+  }
+
+  memory_manager::destroy();
+  free(pool);
+
+  return 0;
+}
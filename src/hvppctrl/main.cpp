@@ -1,7 +1,14 @@
 #include <cstdio>
 #include <cstdint>
 
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
 #include <windows.h>
+#include <dbghelp.h>
+#include <psapi.h>
 
 #include "ia32/asm.h"
 #include "lib/mp.h"
@@ -209,10 +216,1901 @@ void TestHook()
   free(OriginalFunctionBackup);
 }
 
-int main()
+#define PING_EVENT_NAME "Local\\HvppPing"
+#define PONG_EVENT_NAME "Local\\HvppPong"
+#define PING_PONG_COUNT 100000
+
+void ContextSwitchPong()
+{
+  //
+  // Child process of TestContextSwitch() - answer each "ping" with "pong".
+  //
+  HANDLE PingEvent = OpenEventA(SYNCHRONIZE, FALSE, PING_EVENT_NAME);
+  HANDLE PongEvent = OpenEventA(EVENT_MODIFY_STATE, FALSE, PONG_EVENT_NAME);
+
+  for (int i = 0; i < PING_PONG_COUNT; ++i)
+  {
+    WaitForSingleObject(PingEvent, INFINITE);
+    SetEvent(PongEvent);
+  }
+
+  CloseHandle(PongEvent);
+  CloseHandle(PingEvent);
+}
+
+void TestContextSwitch()
+{
+  //
+  // Benchmark of context-switch-heavy workload. Two processes pinned to the
+  // same logical core are playing ping-pong with events - therefore each
+  // round-trip consists of 2 context switches (and 2 MOV to CR3).
+  //
+  // The benchmark is run twice - with CR3-load exiting turned off and on
+  // (see hvpp/vmcall.h).
+  //
+  HANDLE PingEvent = CreateEventA(NULL, FALSE, FALSE, PING_EVENT_NAME);
+  HANDLE PongEvent = CreateEventA(NULL, FALSE, FALSE, PONG_EVENT_NAME);
+
+  CHAR ModulePath[MAX_PATH];
+  GetModuleFileNameA(NULL, ModulePath, MAX_PATH);
+
+  CHAR CommandLine[MAX_PATH + 16];
+  sprintf_s(CommandLine, "\"%s\" pong", ModulePath);
+
+  SetProcessAffinityMask(GetCurrentProcess(), 1);
+
+  auto SetCr3Exiting = [](BOOL Enable)
+  {
+    ForEachLogicalCore([](void* Context) {
+      ia32_asm_vmx_vmcall(0xc3, (uint64_t)Context, 0, 0);
+    }, (void*)(uintptr_t)Enable);
+  };
+
+  const BOOL Cr3ExitingModes[] = { FALSE, TRUE };
+
+  for (BOOL Cr3Exiting : Cr3ExitingModes)
+  {
+    SetCr3Exiting(Cr3Exiting);
+
+    STARTUPINFOA StartupInfo = { sizeof(StartupInfo) };
+    PROCESS_INFORMATION ProcessInformation;
+    if (!CreateProcessA(NULL, CommandLine, NULL, NULL, FALSE,
+                        CREATE_SUSPENDED, NULL, NULL,
+                        &StartupInfo, &ProcessInformation))
+    {
+      printf("CreateProcess failed (%u)\n", GetLastError());
+      break;
+    }
+
+    SetProcessAffinityMask(ProcessInformation.hProcess, 1);
+    ResumeThread(ProcessInformation.hThread);
+
+    LARGE_INTEGER Frequency, Start, End;
+    QueryPerformanceFrequency(&Frequency);
+    QueryPerformanceCounter(&Start);
+
+    for (int i = 0; i < PING_PONG_COUNT; ++i)
+    {
+      SignalObjectAndWait(PingEvent, PongEvent, INFINITE, FALSE);
+    }
+
+    QueryPerformanceCounter(&End);
+
+    WaitForSingleObject(ProcessInformation.hProcess, INFINITE);
+    CloseHandle(ProcessInformation.hThread);
+    CloseHandle(ProcessInformation.hProcess);
+
+    double Elapsed = (double)(End.QuadPart - Start.QuadPart) / Frequency.QuadPart;
+    printf("ContextSwitch (cr3_load_exiting: %i): %8.1f ns per switch\n",
+           Cr3Exiting, Elapsed * 1e9 / (PING_PONG_COUNT * 2));
+  }
+
+  SetCr3Exiting(FALSE);
+
+  CloseHandle(PongEvent);
+  CloseHandle(PingEvent);
+  printf("\n");
+}
+
+//
+// Layout of the VM-exit history - must match
+// hvpp::vmexit_stats_handler::history_t.
+//
+
+#define HISTORY_FINE_BUCKET_MS    100
+#define HISTORY_FINE_COUNT        200
+#define HISTORY_COARSE_BUCKET_MS  1000
+#define HISTORY_COARSE_COUNT      300
+
+struct HISTORY_BUCKET
+{
+  uint64_t Epoch;
+  uint32_t VmExit[80];
+  uint32_t ExceptionVector[20];
+  uint32_t Cpuid0[16];
+  uint32_t Cpuid8[16];
+  uint32_t CpuidOther;
+  uint32_t MovFromCr[8];
+  uint32_t MovToCr[8];
+  uint32_t Clts;
+  uint32_t Lmsw;
+  uint32_t Rdmsr[3];
+  uint32_t Wrmsr[3];
+  uint32_t IoIn;
+  uint32_t IoOut;
+};
+
+struct HISTORY
+{
+  uint32_t       CpuIndex;
+  uint32_t       Reserved;
+  uint64_t       TscFrequency;
+  HISTORY_BUCKET Fine[HISTORY_FINE_COUNT];
+  HISTORY_BUCKET Coarse[HISTORY_COARSE_COUNT];
+};
+
+void PrintHistorySpikes(
+  const char* Name,
+  const HISTORY_BUCKET* Buckets,
+  int BucketCount,
+  uint64_t BucketTicks,
+  uint64_t BucketMs
+  )
+{
+  //
+  // Sort buckets by epoch - oldest first. Stale buckets (older than the
+  // length of the ring) are dropped.
+  //
+  uint64_t CurrentEpoch = ia32_asm_read_tsc() / BucketTicks;
+
+  std::vector<const HISTORY_BUCKET*> Timeline;
+  for (int i = 0; i < BucketCount; ++i)
+  {
+    if (Buckets[i].Epoch && CurrentEpoch - Buckets[i].Epoch < (uint64_t)BucketCount)
+    {
+      Timeline.push_back(&Buckets[i]);
+    }
+  }
+
+  if (Timeline.empty())
+  {
+    return;
+  }
+
+  std::sort(Timeline.begin(), Timeline.end(), [](auto Lhs, auto Rhs) {
+    return Lhs->Epoch < Rhs->Epoch;
+  });
+
+  auto BucketTotal = [](const HISTORY_BUCKET* Bucket) {
+    uint64_t Total = 0;
+    for (auto Count : Bucket->VmExit)
+    {
+      Total += Count;
+    }
+    return Total;
+  };
+
+  //
+  // Median of VM-exits per bucket is used as the baseline. Time slots without
+  // any VM-exit don't have a bucket, therefore they're not taken into account.
+  //
+  std::vector<uint64_t> Totals;
+  for (auto Bucket : Timeline)
+  {
+    Totals.push_back(BucketTotal(Bucket));
+  }
+
+  std::nth_element(Totals.begin(), Totals.begin() + Totals.size() / 2, Totals.end());
+  uint64_t Median = Totals[Totals.size() / 2];
+
+  //
+  // Print buckets with at least 4x more VM-exits than the median together
+  // with their wall-clock time, so they can be correlated with other events.
+  //
+  FILETIME NowFileTime;
+  GetSystemTimeAsFileTime(&NowFileTime);
+
+  for (auto Bucket : Timeline)
+  {
+    uint64_t Total = BucketTotal(Bucket);
+    if (Total < Median * 4 || Total == 0)
+    {
+      continue;
+    }
+
+    int TopReason = 0;
+    for (int i = 0; i < 80; ++i)
+    {
+      if (Bucket->VmExit[i] > Bucket->VmExit[TopReason])
+      {
+        TopReason = i;
+      }
+    }
+
+    uint64_t AgeMs = (CurrentEpoch - Bucket->Epoch) * BucketMs;
+
+    ULARGE_INTEGER Time;
+    Time.LowPart  = NowFileTime.dwLowDateTime;
+    Time.HighPart = NowFileTime.dwHighDateTime;
+    Time.QuadPart -= AgeMs * 10000;
+
+    FILETIME SpikeFileTime = { Time.LowPart, Time.HighPart };
+    SYSTEMTIME SpikeTime;
+    FileTimeToSystemTime(&SpikeFileTime, &SpikeTime);
+
+    printf("  %s %02u:%02u:%02u.%03u UTC (-%6.1fs): %8llu exits (median %llu), top exit_reason %i (%u)\n",
+           Name,
+           SpikeTime.wHour, SpikeTime.wMinute, SpikeTime.wSecond, SpikeTime.wMilliseconds,
+           AgeMs / 1000.0, Total, Median, TopReason, Bucket->VmExit[TopReason]);
+  }
+}
+
+void TestHistory()
+{
+  //
+  // Fetch VM-exit history from each logical core and print spikes.
+  // See hvpp/vmcall.h.
+  //
+  // The buffer is written by the hypervisor in VM-exit handler, therefore
+  // it must be locked in memory - page-fault in VM-exit is fatal.
+  //
+  DWORD ProcessorCount = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+  SIZE_T HistorySize = sizeof(HISTORY) * ProcessorCount;
+
+  HISTORY* History = (HISTORY*)VirtualAlloc(NULL, HistorySize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+  if (!History)
+  {
+    printf("VirtualAlloc failed (%u)\n", GetLastError());
+    return;
+  }
+
+  SetProcessWorkingSetSize(GetCurrentProcess(), HistorySize * 2, HistorySize * 4);
+  memset(History, 0, HistorySize);
+
+  if (!VirtualLock(History, HistorySize))
+  {
+    printf("VirtualLock failed (%u)\n", GetLastError());
+    VirtualFree(History, 0, MEM_RELEASE);
+    return;
+  }
+
+  struct FETCH_CONTEXT
+  {
+    HISTORY* History;
+    DWORD    Index;
+    DWORD    Count;
+  } FetchContext = { History, 0, ProcessorCount };
+
+  ForEachLogicalCore([](void* Context) {
+    auto FetchContext = (FETCH_CONTEXT*)Context;
+    if (FetchContext->Index < FetchContext->Count)
+    {
+      ia32_asm_vmx_vmcall(0xc4, (uint64_t)&FetchContext->History[FetchContext->Index], sizeof(HISTORY), 0);
+      FetchContext->Index += 1;
+    }
+  }, &FetchContext);
+
+  for (DWORD i = 0; i < FetchContext.Index; ++i)
+  {
+    if (!History[i].TscFrequency)
+    {
+      printf("History of CPU %u not available\n", i);
+      continue;
+    }
+
+    uint64_t TicksPerMs = History[i].TscFrequency / 1000;
+
+    printf("History of CPU %u (TSC frequency: %llu kHz)\n", History[i].CpuIndex, TicksPerMs);
+    PrintHistorySpikes("100ms", History[i].Fine, HISTORY_FINE_COUNT,
+                       TicksPerMs * HISTORY_FINE_BUCKET_MS, HISTORY_FINE_BUCKET_MS);
+    PrintHistorySpikes("1s   ", History[i].Coarse, HISTORY_COARSE_COUNT,
+                       TicksPerMs * HISTORY_COARSE_BUCKET_MS, HISTORY_COARSE_BUCKET_MS);
+  }
+
+  VirtualUnlock(History, HistorySize);
+  VirtualFree(History, 0, MEM_RELEASE);
+  printf("\n");
+}
+
+//
+// Layout of the runtime configuration - must match
+// hvpp::vmexit_stats_handler::config_t.
+//
+
+#define CONFIG_COLLECT_CR3_STATS         0x01
+#define CONFIG_COLLECT_TRANSITION_STATS  0x02
+#define CONFIG_COLLECT_HISTORY           0x04
+#define CONFIG_COLLECT_LBR               0x08
+#define CONFIG_COLLECT_TRACE             0x10
+
+struct CONFIG
+{
+  uint8_t  TraceBitmap[16];
+  uint32_t Flags;
+  uint8_t  LbrBitmap[16];
+  uint32_t LbrCount;
+};
+
+void TestConfig()
+{
+  //
+  // Read current configuration, turn off tracing of CPUID VM-exits
+  // (exit reason 10), run a burst of CPUIDs and restore the original
+  // configuration.
+  // See hvpp/vmcall.h.
+  //
+  // The configuration is global - there's no need to call VMCALL on
+  // each logical core.
+  //
+  CONFIG* Config = (CONFIG*)VirtualAlloc(NULL, sizeof(CONFIG) * 2, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+  if (!Config)
+  {
+    printf("VirtualAlloc failed (%u)\n", GetLastError());
+    return;
+  }
+
+  memset(Config, 0, sizeof(CONFIG) * 2);
+  VirtualLock(Config, sizeof(CONFIG) * 2);
+
+  CONFIG* OriginalConfig = &Config[0];
+  CONFIG* NewConfig      = &Config[1];
+
+  if (!ia32_asm_vmx_vmcall(0xc5, (uint64_t)OriginalConfig, 0, 0))
+  {
+    printf("Config: get failed\n\n");
+    goto exit;
+  }
+
+  printf("Config: flags 0x%x, trace cpuid: %i\n",
+         OriginalConfig->Flags, !!(OriginalConfig->TraceBitmap[10 / 8] & (1 << (10 % 8))));
+
+  *NewConfig = *OriginalConfig;
+  NewConfig->TraceBitmap[10 / 8] &= ~(1 << (10 % 8));
+  ia32_asm_vmx_vmcall(0xc6, (uint64_t)NewConfig, 0, 0);
+
+  for (int i = 0; i < 10000; ++i)
+  {
+    int CpuInfo[4];
+    ia32_asm_cpuid(CpuInfo, 0);
+  }
+
+  ia32_asm_vmx_vmcall(0xc6, (uint64_t)OriginalConfig, 0, 0);
+  printf("Config: 10000 CPUIDs executed with cpuid tracing off\n\n");
+
+exit:
+  VirtualUnlock(Config, sizeof(CONFIG) * 2);
+  VirtualFree(Config, 0, MEM_RELEASE);
+}
+
+//
+// Indexes of the nested VMX counters - must match
+// hvpp::nested_vmx_t::stats_t.
+//
+
+enum NESTED_STAT
+{
+  NestedL2Exits,
+  NestedRoundTripCycles,
+  NestedRoundTripVmxExits,
+  NestedReflectCycles,
+  NestedEntryCycles,
+  NestedVmreadExits,
+  NestedVmwriteExits,
+
+  NestedStatCount
+};
+
+void TestNested(int Shadowing)
+{
+  //
+  // Usage:
+  //   hvppctrl nested on|off - enable/disable VMCS shadowing and reset
+  //                            the counters
+  //   hvppctrl nested        - print the counters
+  //
+  // Run the same workload in the nested guest (L2) with shadowing on and
+  // off and compare the round-trip (VM-exit of L2 -> VM-entry of L2) time.
+  // See hvpp/vmcall.h.
+  //
+  struct NESTED_CONTEXT
+  {
+    int      Shadowing;
+    DWORD    Index;
+    uint64_t Previous;
+    uint64_t Stats[NestedStatCount];
+  } Context = { Shadowing };
+
+  ForEachLogicalCore([](void* ContextPtr) {
+    auto Context = (NESTED_CONTEXT*)ContextPtr;
+
+    if (Context->Shadowing >= 0)
+    {
+      Context->Previous = ia32_asm_vmx_vmcall(0xc7, Context->Shadowing, 0, 0);
+      return;
+    }
+
+    uint64_t Stats[NestedStatCount];
+    for (int i = 0; i < NestedStatCount; ++i)
+    {
+      Stats[i] = ia32_asm_vmx_vmcall(0xc8, i, 0, 0);
+      Context->Stats[i] += Stats[i];
+    }
+
+    if (Stats[NestedL2Exits])
+    {
+      printf("  CPU %2u: %10llu L2 exits, round-trip %6llu cycles (%4.1f VMX exits), reflect %5llu, entry %5llu, vmread/vmwrite exits %llu/%llu\n",
+             Context->Index,
+             Stats[NestedL2Exits],
+             Stats[NestedRoundTripCycles] / Stats[NestedL2Exits],
+             (double)Stats[NestedRoundTripVmxExits] / Stats[NestedL2Exits],
+             Stats[NestedReflectCycles] / Stats[NestedL2Exits],
+             Stats[NestedEntryCycles] / Stats[NestedL2Exits],
+             Stats[NestedVmreadExits],
+             Stats[NestedVmwriteExits]);
+    }
+
+    Context->Index += 1;
+  }, &Context);
+
+  if (Shadowing >= 0)
+  {
+    printf("Nested: VMCS shadowing %s (was %s), counters reset\n",
+           Shadowing ? "on" : "off", Context.Previous ? "on" : "off");
+    return;
+  }
+
+  if (!Context.Stats[NestedL2Exits])
+  {
+    printf("Nested: no L2 exits\n");
+    return;
+  }
+
+  printf("Nested: %llu L2 exits, average round-trip %llu cycles, %.1f VMX exits per round-trip\n",
+         Context.Stats[NestedL2Exits],
+         Context.Stats[NestedRoundTripCycles] / Context.Stats[NestedL2Exits],
+         (double)Context.Stats[NestedRoundTripVmxExits] / Context.Stats[NestedL2Exits]);
+}
+
+//
+// Layout of the steal-time page - must match hvpp::steal_time_page_t.
+//
+
+struct STEAL_TIME_PAGE
+{
+  volatile uint32_t Version;
+  volatile uint32_t CpuIndex;
+  volatile uint64_t ExitCount;
+  volatile uint64_t RootCycles;
+  volatile uint64_t LastExitTsc;
+  uint8_t           Reserved[PAGE_SIZE - 32];
+};
+
+static_assert(sizeof(STEAL_TIME_PAGE) == PAGE_SIZE, "STEAL_TIME_PAGE");
+
+struct STEAL_TIME
+{
+  uint64_t ExitCount;
+  uint64_t RootCycles;
+};
+
+static void ReadStealTime(const STEAL_TIME_PAGE* Page, STEAL_TIME* StealTime)
+{
+  uint32_t Version;
+
+  do
+  {
+    Version = Page->Version;
+    _ReadWriteBarrier();
+    StealTime->ExitCount  = Page->ExitCount;
+    StealTime->RootCycles = Page->RootCycles;
+    _ReadWriteBarrier();
+  } while ((Version & 1) || Version != Page->Version);
+}
+
+void TestStealTime()
+{
+  //
+  // Register the steal-time pages on each logical core, sample them for
+  // a few seconds (without any VMCALL) and print how much of the time
+  // each CPU spent in the hypervisor.
+  // See hvpp/vmcall.h.
+  //
+  // The hypervisor maps the pages onto its own pages in EPT and it unmaps
+  // them only on unregistration - therefore it accepts the registration
+  // only from kernel mode (see hvpp::steal_time_t). From this program the
+  // VMCALL is expected to be refused.
+  //
+  DWORD ProcessorCount = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+  SIZE_T PagesSize = sizeof(STEAL_TIME_PAGE) * ProcessorCount;
+
+  STEAL_TIME_PAGE* Pages = (STEAL_TIME_PAGE*)VirtualAlloc(NULL, PagesSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+  if (!Pages)
+  {
+    printf("VirtualAlloc failed (%u)\n", GetLastError());
+    return;
+  }
+
+  SetProcessWorkingSetSize(GetCurrentProcess(), PagesSize * 2, PagesSize * 4);
+  memset(Pages, 0, PagesSize);
+
+  if (!VirtualLock(Pages, PagesSize))
+  {
+    printf("VirtualLock failed (%u)\n", GetLastError());
+    VirtualFree(Pages, 0, MEM_RELEASE);
+    return;
+  }
+
+  struct REGISTER_CONTEXT
+  {
+    STEAL_TIME_PAGE* Pages;
+    DWORD            Count;
+    DWORD            Registered;
+  } RegisterContext = { Pages, ProcessorCount, 0 };
+
+  ForEachLogicalCore([](void* Context) {
+    auto RegisterContext = (REGISTER_CONTEXT*)Context;
+    if (ia32_asm_vmx_vmcall(0xc9, (uint64_t)RegisterContext->Pages, RegisterContext->Count, 0))
+    {
+      RegisterContext->Registered += 1;
+    }
+  }, &RegisterContext);
+
+  if (!RegisterContext.Registered)
+  {
+    printf("StealTime: registration refused (kernel-mode registrant required)\n");
+  }
+  else if (RegisterContext.Registered != ProcessorCount)
+  {
+    printf("StealTime: registered on %u of %u CPUs\n", RegisterContext.Registered, ProcessorCount);
+  }
+
+  if (RegisterContext.Registered)
+  {
+    std::vector<STEAL_TIME> Before(ProcessorCount);
+    std::vector<STEAL_TIME> After(ProcessorCount);
+
+    for (DWORD i = 0; i < ProcessorCount; ++i)
+    {
+      ReadStealTime(&Pages[i], &Before[i]);
+    }
+
+    uint64_t TscBegin = ia32_asm_read_tsc();
+    Sleep(3000);
+    uint64_t TscEnd = ia32_asm_read_tsc();
+
+    for (DWORD i = 0; i < ProcessorCount; ++i)
+    {
+      ReadStealTime(&Pages[i], &After[i]);
+    }
+
+    for (DWORD i = 0; i < ProcessorCount; ++i)
+    {
+      uint64_t ExitCount  = After[i].ExitCount  - Before[i].ExitCount;
+      uint64_t RootCycles = After[i].RootCycles - Before[i].RootCycles;
+
+      printf("  CPU %2u: %10llu exits, %12llu cycles in hypervisor (%6.3f%%)\n",
+             i, ExitCount, RootCycles,
+             100.0 * RootCycles / (TscEnd - TscBegin));
+    }
+  }
+
+  ForEachLogicalCore([](void*) { ia32_asm_vmx_vmcall(0xc9, 0, 0, 0); }, nullptr);
+
+  VirtualUnlock(Pages, PagesSize);
+  VirtualFree(Pages, 0, MEM_RELEASE);
+  printf("\n");
+}
+
+//
+// Layout of the memory scan structures - must match hvpp::memscan_*_t.
+//
+
+#define MEMSCAN_MAX_PATTERN_LENGTH  48
+#define MEMSCAN_MAX_PATTERN_COUNT   16
+
+#define MEMSCAN_STATE_IDLE          0
+#define MEMSCAN_STATE_SETUP         1
+#define MEMSCAN_STATE_RUNNING       2
+#define MEMSCAN_STATE_DONE          3
+
+struct MEMSCAN_PATTERN
+{
+  uint32_t Length;
+  uint32_t Reserved;
+  uint8_t  Data[MEMSCAN_MAX_PATTERN_LENGTH];
+};
+
+struct MEMSCAN_REQUEST
+{
+  uint32_t        PatternCount;
+  uint32_t        BudgetUs;
+  MEMSCAN_PATTERN Pattern[MEMSCAN_MAX_PATTERN_COUNT];
+};
+
+struct MEMSCAN_MATCH
+{
+  uint64_t Pa;
+  uint32_t PatternIndex;
+  uint32_t Sequence;
+};
+
+struct MEMSCAN_STATUS
+{
+  uint32_t State;
+  uint32_t PatternCount;
+  uint64_t TotalBytes;
+  uint64_t ScannedBytes;
+  uint64_t SkippedBytes;
+  uint64_t ElapsedCycles;
+  uint64_t BusyCycles;
+  uint64_t TscFrequency;
+  uint64_t MatchCount;
+  uint64_t StealCount;
+  uint64_t Cursor;
+};
+
+#define MEMSCAN_MATCHES_PER_POLL    256
+#define MEMSCAN_PRINT_MATCHES       32
+
+static bool ParsePattern(const char* Hex, MEMSCAN_PATTERN* Pattern)
+{
+  size_t Length = strlen(Hex);
+  if (Length == 0 || Length % 2 || Length / 2 > MEMSCAN_MAX_PATTERN_LENGTH)
+  {
+    return false;
+  }
+
+  for (size_t i = 0; i < Length / 2; ++i)
+  {
+    unsigned int Byte;
+    if (sscanf_s(&Hex[i * 2], "%2x", &Byte) != 1)
+    {
+      return false;
+    }
+
+    Pattern->Data[i] = (uint8_t)Byte;
+  }
+
+  Pattern->Length = (uint32_t)(Length / 2);
+  return true;
+}
+
+void TestMemoryScan(int PatternCount, char* Patterns[])
+{
+  //
+  // Usage:
+  //   hvppctrl scan <hex> [<hex> ...] - scan physical memory for patterns
+  //                                     (e.g. "hvppctrl scan 4d5a9000")
+  //
+  // The scan is performed by the hypervisor on VM-exits of all logical
+  // cores - VMCALLs below just collect the results (and cause VM-exits).
+  // See hvpp/vmcall.h and memory_scanner_t.
+  //
+  if (PatternCount < 1 || PatternCount > MEMSCAN_MAX_PATTERN_COUNT)
+  {
+    printf("MemoryScan: 1 - %u patterns expected\n", MEMSCAN_MAX_PATTERN_COUNT);
+    return;
+  }
+
+  SIZE_T BufferSize = sizeof(MEMSCAN_REQUEST)
+                    + sizeof(MEMSCAN_STATUS) + sizeof(MEMSCAN_MATCH) * MEMSCAN_MATCHES_PER_POLL;
+
+  uint8_t* Buffer = (uint8_t*)VirtualAlloc(NULL, BufferSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+  if (!Buffer)
+  {
+    printf("VirtualAlloc failed (%u)\n", GetLastError());
+    return;
+  }
+
+  memset(Buffer, 0, BufferSize);
+  VirtualLock(Buffer, BufferSize);
+
+  MEMSCAN_REQUEST* Request = (MEMSCAN_REQUEST*)Buffer;
+
+  struct POLL_CONTEXT
+  {
+    MEMSCAN_STATUS* Status;
+    uint64_t        Cursor;
+    uint64_t        Received;
+    uint64_t        Lost;
+  } PollContext = { (MEMSCAN_STATUS*)(Request + 1), 0, 0, 0 };
+
+  for (int i = 0; i < PatternCount; ++i)
+  {
+    if (!ParsePattern(Patterns[i], &Request->Pattern[i]))
+    {
+      printf("MemoryScan: invalid pattern '%s'\n", Patterns[i]);
+      goto exit;
+    }
+  }
+
+  Request->PatternCount = PatternCount;
+
+  if (!ia32_asm_vmx_vmcall(0xca, (uint64_t)Request, 0, 0))
+  {
+    printf("MemoryScan: start failed\n");
+    goto exit;
+  }
+
+  do
+  {
+    ForEachLogicalCore([](void* Context) {
+      auto PollContext = (POLL_CONTEXT*)Context;
+      auto Status = PollContext->Status;
+      auto Match = (MEMSCAN_MATCH*)(Status + 1);
+
+      auto Count = ia32_asm_vmx_vmcall(0xcb, (uint64_t)Status,
+                                       sizeof(MEMSCAN_STATUS) + sizeof(MEMSCAN_MATCH) * MEMSCAN_MATCHES_PER_POLL,
+                                       PollContext->Cursor);
+
+      PollContext->Lost += Status->Cursor - PollContext->Cursor;
+
+      for (uint64_t i = 0; i < Count; ++i)
+      {
+        if (PollContext->Received + i < MEMSCAN_PRINT_MATCHES)
+        {
+          printf("  pattern %u at PA 0x%llx\n", Match[i].PatternIndex, Match[i].Pa);
+        }
+      }
+
+      PollContext->Received += Count;
+      PollContext->Cursor = Status->Cursor + Count;
+    }, &PollContext);
+  } while (PollContext.Status->State == MEMSCAN_STATE_RUNNING ||
+           PollContext.Cursor < PollContext.Status->MatchCount);
+
+  {
+    auto Status = PollContext.Status;
+    double Seconds     = (double)Status->ElapsedCycles / Status->TscFrequency;
+    double BusySeconds = (double)Status->BusyCycles / Status->TscFrequency;
+    double Gb          = (double)Status->ScannedBytes / (1024 * 1024 * 1024);
+
+    printf("MemoryScan: %llu MB scanned (%llu MB skipped) in %.0f ms - %.2f GB/s, %.2f GB/s per busy CPU, %llu steals\n",
+           Status->ScannedBytes >> 20, Status->SkippedBytes >> 20, Seconds * 1000,
+           Seconds ? Gb / Seconds : 0,
+           BusySeconds ? Gb / BusySeconds : 0,
+           Status->StealCount);
+    printf("MemoryScan: %llu matches (%llu lost)\n\n", Status->MatchCount, PollContext.Lost);
+  }
+
+exit:
+  VirtualUnlock(Buffer, BufferSize);
+  VirtualFree(Buffer, 0, MEM_RELEASE);
+}
+
+//
+// Layout of the LBR trace - must match
+// hvpp::vmexit_stats_handler::lbr_trace_t and hvpp::trace_file.
+//
+
+#define LBR_MAX_COUNT       8
+#define LBR_TRACE_CAPACITY  256
+#define LBR_PRINT_PATHS     16
+
+#define TRACE_MAGIC         0x72747668 // "hvtr"
+#define TRACE_VERSION       2
+#define TRACE_FLAG_LBR      0x0001
+
+struct LBR_ENTRY
 {
+  uint64_t From;
+  uint64_t To;
+};
+
+struct TRACE_RECORD
+{
+  uint64_t  Tsc;
+  uint64_t  Cr3;
+  uint64_t  Rip;
+  uint32_t  ModuleId;
+  uint32_t  ModuleOffset;
+  uint32_t  HandlerTicks;
+  uint16_t  ExitReason;
+  uint16_t  CpuIndex;
+  uint16_t  Type;
+  uint16_t  Flags;
+  uint32_t  Reserved;
+  uint32_t  LbrCount;
+  uint32_t  Reserved2;
+  LBR_ENTRY Lbr[LBR_MAX_COUNT];
+};
+
+struct TRACE_HEADER
+{
+  uint32_t Magic;
+  uint16_t Version;
+  uint16_t HeaderSize;
+  uint32_t RecordSize;
+  uint32_t ModuleCount;
+  uint64_t ModuleOffset;
+  uint64_t RecordOffset;
+  uint64_t RecordCount;
+  uint64_t TscFrequency;
+  uint32_t CpuCount;
+  uint32_t Reserved1;
+  uint64_t Reserved2;
+};
+
+struct LBR_TRACE
+{
+  uint64_t     Count;
+  TRACE_RECORD Record[LBR_TRACE_CAPACITY];
+};
+
+static_assert(sizeof(TRACE_RECORD) == 184, "TRACE_RECORD");
+static_assert(sizeof(TRACE_HEADER) == 64, "TRACE_HEADER");
+
+void TestLbr(int ExitReason, const char* FileName)
+{
+  //
+  // Usage:
+  //   hvppctrl lbr <exit reason> [file] - collect LBR snapshots of given
+  //                                       exit reason for 1 second
+  //                                       (e.g. "hvppctrl lbr 10")
+  //
+  // Prints the most frequent call paths which led to the VM-exit and
+  // optionally writes the records into the trace file (see hvpptrace).
+  // See hvpp/vmcall.h.
+  //
+  if (ExitReason < 0 || ExitReason >= 16 * 8)
+  {
+    printf("Lbr: invalid exit reason\n");
+    return;
+  }
+
+  DWORD ProcessorCount = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+  SIZE_T BufferSize = sizeof(CONFIG) * 2 + sizeof(LBR_TRACE) * ProcessorCount;
+
+  uint8_t* Buffer = (uint8_t*)VirtualAlloc(NULL, BufferSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+  if (!Buffer)
+  {
+    printf("VirtualAlloc failed (%u)\n", GetLastError());
+    return;
+  }
+
+  SetProcessWorkingSetSize(GetCurrentProcess(), BufferSize * 2, BufferSize * 4);
+  memset(Buffer, 0, BufferSize);
+
+  if (!VirtualLock(Buffer, BufferSize))
+  {
+    printf("VirtualLock failed (%u)\n", GetLastError());
+    VirtualFree(Buffer, 0, MEM_RELEASE);
+    return;
+  }
+
+  CONFIG* OriginalConfig = (CONFIG*)Buffer;
+  CONFIG* NewConfig      = OriginalConfig + 1;
+  LBR_TRACE* Trace       = (LBR_TRACE*)(NewConfig + 1);
+
+  struct FETCH_CONTEXT
+  {
+    LBR_TRACE* Trace;
+    DWORD      Index;
+    DWORD      Count;
+  } FetchContext = { Trace, 0, ProcessorCount };
+
+  std::vector<TRACE_RECORD> Records;
+
+  if (!ia32_asm_vmx_vmcall(0xc5, (uint64_t)OriginalConfig, 0, 0))
+  {
+    printf("Lbr: config get failed\n\n");
+    goto exit;
+  }
+
+  *NewConfig = *OriginalConfig;
+  NewConfig->Flags |= CONFIG_COLLECT_LBR;
+  NewConfig->LbrBitmap[ExitReason / 8] |= 1 << (ExitReason % 8);
+  NewConfig->LbrCount = LBR_MAX_COUNT;
+  ia32_asm_vmx_vmcall(0xc6, (uint64_t)NewConfig, 0, 0);
+
+  Sleep(1000);
+
+  //
+  // Fetch LBR traces before the original configuration is restored (LBRs
+  // are disabled by that) - records are kept, but we don't want to miss
+  // the last ones.
+  //
+  ForEachLogicalCore([](void* Context) {
+    auto FetchContext = (FETCH_CONTEXT*)Context;
+    if (FetchContext->Index < FetchContext->Count)
+    {
+      ia32_asm_vmx_vmcall(0xcc, (uint64_t)&FetchContext->Trace[FetchContext->Index], sizeof(LBR_TRACE), 0);
+      FetchContext->Index += 1;
+    }
+  }, &FetchContext);
+
+  ia32_asm_vmx_vmcall(0xc6, (uint64_t)OriginalConfig, 0, 0);
+
+  for (DWORD i = 0; i < FetchContext.Index; ++i)
+  {
+    uint64_t Count = min(Trace[i].Count, (uint64_t)LBR_TRACE_CAPACITY);
+    for (uint64_t j = 0; j < Count; ++j)
+    {
+      if ((Trace[i].Record[j].Flags & TRACE_FLAG_LBR) && Trace[i].Record[j].ExitReason == ExitReason)
+      {
+        Records.push_back(Trace[i].Record[j]);
+      }
+    }
+  }
+
+  if (Records.empty())
+  {
+    printf("Lbr: no records (LBRs not supported?)\n\n");
+    goto exit;
+  }
+
+  {
+    //
+    // Group records by call path - RIP and sources of the LBR entries.
+    //
+    std::sort(Records.begin(), Records.end(), [](const TRACE_RECORD& Lhs, const TRACE_RECORD& Rhs) {
+      if (Lhs.Rip != Rhs.Rip) return Lhs.Rip < Rhs.Rip;
+      if (Lhs.LbrCount != Rhs.LbrCount) return Lhs.LbrCount < Rhs.LbrCount;
+      for (uint32_t i = 0; i < Lhs.LbrCount; ++i)
+      {
+        if (Lhs.Lbr[i].From != Rhs.Lbr[i].From) return Lhs.Lbr[i].From < Rhs.Lbr[i].From;
+      }
+      return false;
+    });
+
+    auto SamePath = [](const TRACE_RECORD& Lhs, const TRACE_RECORD& Rhs) {
+      if (Lhs.Rip != Rhs.Rip || Lhs.LbrCount != Rhs.LbrCount) return false;
+      for (uint32_t i = 0; i < Lhs.LbrCount; ++i)
+      {
+        if (Lhs.Lbr[i].From != Rhs.Lbr[i].From) return false;
+      }
+      return true;
+    };
+
+    std::vector<std::pair<size_t, size_t>> Paths; // (count, index of the first record)
+    for (size_t i = 0; i < Records.size(); )
+    {
+      size_t j = i + 1;
+      while (j < Records.size() && SamePath(Records[i], Records[j]))
+      {
+        ++j;
+      }
+
+      Paths.emplace_back(j - i, i);
+      i = j;
+    }
+
+    std::sort(Paths.begin(), Paths.end(), [](auto& Lhs, auto& Rhs) { return Lhs.first > Rhs.first; });
+
+    printf("Lbr: %zu records of exit reason %i, %zu distinct paths\n", Records.size(), ExitReason, Paths.size());
+
+    for (size_t i = 0; i < min(Paths.size(), (size_t)LBR_PRINT_PATHS); ++i)
+    {
+      auto& Record = Records[Paths[i].second];
+
+      printf("  %6zu  0x%llx", Paths[i].first, Record.Rip);
+      for (uint32_t j = 0; j < Record.LbrCount; ++j)
+      {
+        printf(" <- 0x%llx", Record.Lbr[j].From);
+      }
+      printf("\n");
+    }
+    printf("\n");
+  }
+
+  if (FileName)
+  {
+    FILE* File = nullptr;
+    if (fopen_s(&File, FileName, "wb") || !File)
+    {
+      printf("Lbr: cannot create '%s'\n\n", FileName);
+      goto exit;
+    }
+
+    //
+    // Guest addresses are not resolved - the module table is empty. TSC
+    // frequency isn't known here either.
+    //
+    TRACE_HEADER Header = {};
+    Header.Magic        = TRACE_MAGIC;
+    Header.Version      = TRACE_VERSION;
+    Header.HeaderSize   = sizeof(TRACE_HEADER);
+    Header.RecordSize   = sizeof(TRACE_RECORD);
+    Header.ModuleOffset = sizeof(TRACE_HEADER);
+    Header.RecordOffset = sizeof(TRACE_HEADER);
+    Header.RecordCount  = Records.size();
+    Header.CpuCount     = ProcessorCount;
+
+    fwrite(&Header, sizeof(Header), 1, File);
+    fwrite(Records.data(), sizeof(TRACE_RECORD), Records.size(), File);
+    fclose(File);
+
+    printf("Lbr: %zu records written to '%s'\n\n", Records.size(), FileName);
+  }
+
+exit:
+  VirtualUnlock(Buffer, BufferSize);
+  VirtualFree(Buffer, 0, MEM_RELEASE);
+}
+
+//
+// Layout of the compact trace - must match
+// hvpp::vmexit_stats_handler::compact_trace_t and hvpp::trace_file.
+//
+
+#define COMPACT_TRACE_CAPACITY  64
+#define TRACE_CHUNK_SIZE        4096
+
+#define TRACE_COMPACT_MAGIC     0x63747668 // "hvtc"
+#define TRACE_COMPACT_VERSION   1
+
+struct TRACE_CHUNK_HEADER
+{
+  uint64_t Sequence;
+  uint64_t Tsc;
+  uint64_t Rip;
+  uint16_t CpuIndex;
+  uint16_t RecordCount;
+  uint16_t DataSize;
+  uint16_t Reserved;
+};
+
+struct COMPACT_TRACE
+{
+  uint64_t ChunkCount;
+  uint64_t RecordCount;
+  uint64_t EncodeTicks;
+  uint64_t Reserved;
+  uint8_t  Chunk[COMPACT_TRACE_CAPACITY][TRACE_CHUNK_SIZE];
+};
+
+static_assert(sizeof(TRACE_CHUNK_HEADER) == 32, "TRACE_CHUNK_HEADER");
+
+void TestTrace(int Seconds, const char* FileName)
+{
+  //
+  // Usage:
+  //   hvppctrl trace [seconds] [file] - encode all VM-exits into the per-CPU
+  //                                     rings of delta-encoded records
+  //                                     (default: 1 second)
+  //
+  // Prints number of records, their encoded size and the cost of the
+  // encoder and optionally writes the chunks into the compact trace file
+  // (see hvpptrace). See hvpp/vmcall.h.
+  //
+  DWORD ProcessorCount = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+  SIZE_T BufferSize = sizeof(CONFIG) * 2 + sizeof(COMPACT_TRACE) * ProcessorCount;
+
+  uint8_t* Buffer = (uint8_t*)VirtualAlloc(NULL, BufferSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+  if (!Buffer)
+  {
+    printf("VirtualAlloc failed (%u)\n", GetLastError());
+    return;
+  }
+
+  SetProcessWorkingSetSize(GetCurrentProcess(), BufferSize * 2, BufferSize * 4);
+  memset(Buffer, 0, BufferSize);
+
+  if (!VirtualLock(Buffer, BufferSize))
+  {
+    printf("VirtualLock failed (%u)\n", GetLastError());
+    VirtualFree(Buffer, 0, MEM_RELEASE);
+    return;
+  }
+
+  CONFIG* OriginalConfig = (CONFIG*)Buffer;
+  CONFIG* NewConfig      = OriginalConfig + 1;
+  COMPACT_TRACE* Trace   = (COMPACT_TRACE*)(NewConfig + 1);
+
+  struct FETCH_CONTEXT
+  {
+    COMPACT_TRACE* Trace;
+    DWORD          Index;
+    DWORD          Count;
+  } FetchContext = { Trace, 0, ProcessorCount };
+
+  uint64_t TotalRecords = 0;
+  uint64_t TotalTicks   = 0;
+  uint64_t RingRecords  = 0;
+  uint64_t RingBytes    = 0;
+  uint64_t ChunkCount   = 0;
+
+  if (!ia32_asm_vmx_vmcall(0xc5, (uint64_t)OriginalConfig, 0, 0))
+  {
+    printf("Trace: config get failed\n\n");
+    goto exit;
+  }
+
+  *NewConfig = *OriginalConfig;
+  NewConfig->Flags |= CONFIG_COLLECT_TRACE;
+  ia32_asm_vmx_vmcall(0xc6, (uint64_t)NewConfig, 0, 0);
+
+  Sleep(Seconds * 1000);
+
+  ForEachLogicalCore([](void* Context) {
+    auto FetchContext = (FETCH_CONTEXT*)Context;
+    if (FetchContext->Index < FetchContext->Count)
+    {
+      ia32_asm_vmx_vmcall(0xd6, (uint64_t)&FetchContext->Trace[FetchContext->Index], sizeof(COMPACT_TRACE), 0);
+      FetchContext->Index += 1;
+    }
+  }, &FetchContext);
+
+  ia32_asm_vmx_vmcall(0xc6, (uint64_t)OriginalConfig, 0, 0);
+
+  printf("Trace: %u CPUs\n", FetchContext.Index);
+
+  for (DWORD i = 0; i < FetchContext.Index; ++i)
+  {
+    //
+    // Only the last COMPACT_TRACE_CAPACITY chunks are kept in the ring.
+    //
+    uint64_t Count = min(Trace[i].ChunkCount, (uint64_t)COMPACT_TRACE_CAPACITY);
+    uint64_t Records = 0;
+    uint64_t Bytes = 0;
+
+    for (uint64_t j = Trace[i].ChunkCount - Count; j < Trace[i].ChunkCount; ++j)
+    {
+      auto Chunk = (TRACE_CHUNK_HEADER*)Trace[i].Chunk[j % COMPACT_TRACE_CAPACITY];
+      Records += Chunk->RecordCount;
+      Bytes += sizeof(TRACE_CHUNK_HEADER) + Chunk->DataSize;
+    }
+
+    printf("  CPU %2u: %10llu records, %8llu in ring, %6.2f bytes/record, %6.1f ticks/record\n",
+           i,
+           Trace[i].RecordCount,
+           Records,
+           Records ? (double)Bytes / Records : 0.0,
+           Trace[i].RecordCount ? (double)Trace[i].EncodeTicks / Trace[i].RecordCount : 0.0);
+
+    TotalRecords += Trace[i].RecordCount;
+    TotalTicks += Trace[i].EncodeTicks;
+    RingRecords += Records;
+    RingBytes += Bytes;
+    ChunkCount += Count;
+  }
+
+  printf("  total:  %10llu records, %8llu in ring, %6.2f bytes/record (%u with fixed-size records), %6.1f ticks/record\n\n",
+         TotalRecords,
+         RingRecords,
+         RingRecords ? (double)RingBytes / RingRecords : 0.0,
+         (unsigned)sizeof(TRACE_RECORD),
+         TotalRecords ? (double)TotalTicks / TotalRecords : 0.0);
+
+  if (FileName && ChunkCount)
+  {
+    FILE* File = nullptr;
+    if (fopen_s(&File, FileName, "wb") || !File)
+    {
+      printf("Trace: cannot create '%s'\n\n", FileName);
+      goto exit;
+    }
+
+    //
+    // Same as in TestLbr() - the module table is empty and TSC frequency
+    // isn't known.
+    //
+    TRACE_HEADER Header = {};
+    Header.Magic        = TRACE_COMPACT_MAGIC;
+    Header.Version      = TRACE_COMPACT_VERSION;
+    Header.HeaderSize   = sizeof(TRACE_HEADER);
+    Header.RecordSize   = TRACE_CHUNK_SIZE;
+    Header.ModuleOffset = sizeof(TRACE_HEADER);
+    Header.RecordOffset = sizeof(TRACE_HEADER);
+    Header.RecordCount  = ChunkCount;
+    Header.CpuCount     = ProcessorCount;
+
+    fwrite(&Header, sizeof(Header), 1, File);
+
+    for (DWORD i = 0; i < FetchContext.Index; ++i)
+    {
+      uint64_t Count = min(Trace[i].ChunkCount, (uint64_t)COMPACT_TRACE_CAPACITY);
+
+      for (uint64_t j = Trace[i].ChunkCount - Count; j < Trace[i].ChunkCount; ++j)
+      {
+        fwrite(Trace[i].Chunk[j % COMPACT_TRACE_CAPACITY], TRACE_CHUNK_SIZE, 1, File);
+      }
+    }
+
+    fclose(File);
+
+    printf("Trace: %llu chunks written to '%s'\n\n", ChunkCount, FileName);
+  }
+
+exit:
+  VirtualUnlock(Buffer, BufferSize);
+  VirtualFree(Buffer, 0, MEM_RELEASE);
+}
+
+//
+// Layout of the profiler status - must match hvpp::profiler_status_t.
+//
+
+#define PROFILER_DEFAULT_PERIOD     1000000
+#define PROFILER_SAMPLES_PER_READ   8192
+#define PROFILER_PRINT_FUNCTIONS    40
+
+struct PROFILER_STATUS
+{
+  uint32_t CpuIndex;
+  uint32_t Period;
+  uint64_t SampleCount;
+  uint64_t Cursor;
+};
+
+static bool FindDriver(const char* Name, uint64_t* ImageBase)
+{
+  LPVOID Drivers[1024];
+  DWORD  Needed;
+
+  if (!EnumDeviceDrivers(Drivers, sizeof(Drivers), &Needed))
+  {
+    return false;
+  }
+
+  for (DWORD i = 0; i < min(Needed / sizeof(LPVOID), (DWORD)ARRAYSIZE(Drivers)); ++i)
+  {
+    char BaseName[MAX_PATH];
+    if (GetDeviceDriverBaseNameA(Drivers[i], BaseName, sizeof(BaseName)) && !_stricmp(BaseName, Name))
+    {
+      *ImageBase = (uint64_t)Drivers[i];
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void TestProfiler(int Seconds, uint32_t Period, const char* ImagePath)
+{
+  //
+  // Usage:
+  //   hvppctrl profile [seconds] [period] [image]
+  //     - sample the hypervisor for given number of seconds (default: 5)
+  //       every "period" cycles spent in VMX root (default: 1000000)
+  //     - "image" is path to hvpp.sys (default: hvpp.sys, searched next to
+  //       the PDB in the symbol path and the current directory)
+  //
+  // Samples (host RIPs) are symbolized by DbgHelp against the PDB of the
+  // driver and printed as flat profile of hvpp functions.
+  // See hvpp/vmcall.h and profiler_t.
+  //
+  uint64_t ImageBase;
+  if (!FindDriver("hvpp.sys", &ImageBase))
+  {
+    printf("Profiler: hvpp.sys not loaded\n");
+    return;
+  }
+
+  SIZE_T BufferSize = sizeof(PROFILER_STATUS) + sizeof(uint64_t) * PROFILER_SAMPLES_PER_READ;
+
+  uint8_t* Buffer = (uint8_t*)VirtualAlloc(NULL, BufferSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+  if (!Buffer)
+  {
+    printf("VirtualAlloc failed (%u)\n", GetLastError());
+    return;
+  }
+
+  SetProcessWorkingSetSize(GetCurrentProcess(), BufferSize * 2, BufferSize * 4);
+  memset(Buffer, 0, BufferSize);
+
+  if (!VirtualLock(Buffer, BufferSize))
+  {
+    printf("VirtualLock failed (%u)\n", GetLastError());
+    VirtualFree(Buffer, 0, MEM_RELEASE);
+    return;
+  }
+
+  struct READ_CONTEXT
+  {
+    PROFILER_STATUS*      Status;
+    std::vector<uint64_t> Cursor;
+    std::vector<uint64_t> Samples;
+    uint64_t              Lost;
+    DWORD                 Index;
+  } ReadContext = { (PROFILER_STATUS*)Buffer };
+
+  ReadContext.Cursor.resize(GetActiveProcessorCount(ALL_PROCESSOR_GROUPS));
+  ReadContext.Lost = 0;
+
+  auto ReadSamples = [](void* Context) {
+    auto ReadContext = (READ_CONTEXT*)Context;
+    auto Status = ReadContext->Status;
+    auto Samples = (uint64_t*)(Status + 1);
+
+    if (ReadContext->Index >= ReadContext->Cursor.size())
+    {
+      return;
+    }
+
+    auto& Cursor = ReadContext->Cursor[ReadContext->Index++];
+    uint64_t Count;
+
+    do
+    {
+      Count = ia32_asm_vmx_vmcall(0xce, (uint64_t)Status,
+                                  sizeof(PROFILER_STATUS) + sizeof(uint64_t) * PROFILER_SAMPLES_PER_READ,
+                                  Cursor);
+
+      ReadContext->Lost += Status->Cursor - Cursor;
+      ReadContext->Samples.insert(ReadContext->Samples.end(), Samples, Samples + Count);
+      Cursor = Status->Cursor + Count;
+    } while (Count == PROFILER_SAMPLES_PER_READ);
+  };
+
+  //
+  // Skip samples collected before this run.
+  //
+  ReadContext.Index = 0;
+  ForEachLogicalCore(ReadSamples, &ReadContext);
+  ReadContext.Samples.clear();
+  ReadContext.Lost = 0;
+
+  Period = (uint32_t)ia32_asm_vmx_vmcall(0xcd, Period, 0, 0);
+  if (!Period)
+  {
+    printf("Profiler: not supported\n\n");
+    goto exit;
+  }
+
+  printf("Profiler: sampling every %u cycles in VMX root for %i s\n", Period, Seconds);
+
+  //
+  // Drain the rings every 100ms - they hold just a few thousand samples.
+  //
+  for (int i = 0; i < Seconds * 10; ++i)
+  {
+    Sleep(100);
+
+    ReadContext.Index = 0;
+    ForEachLogicalCore(ReadSamples, &ReadContext);
+  }
+
+  ia32_asm_vmx_vmcall(0xcd, 0, 0, 0);
+
+  printf("Profiler: %zu samples (%llu lost)\n", ReadContext.Samples.size(), ReadContext.Lost);
+
+  {
+    HANDLE Process = GetCurrentProcess();
+
+    SymSetOptions(SymGetOptions() | SYMOPT_UNDNAME | SYMOPT_DEFERRED_LOADS);
+    if (!SymInitialize(Process, NULL, FALSE))
+    {
+      printf("Profiler: SymInitialize failed (%u)\n\n", GetLastError());
+      goto exit;
+    }
+
+    if (!SymLoadModuleEx(Process, NULL, ImagePath, NULL, ImageBase, 0, NULL, 0))
+    {
+      printf("Profiler: cannot load symbols of '%s' (%u)\n", ImagePath, GetLastError());
+    }
+
+    //
+    // Samples are aggregated per function. Samples which don't belong to
+    // the driver (e.g. NMI delivered after VM-entry) are put into one bucket.
+    //
+    std::unordered_map<std::string, uint64_t> Functions;
+
+    alignas(SYMBOL_INFO) char SymbolBuffer[sizeof(SYMBOL_INFO) + MAX_SYM_NAME];
+    auto Symbol = (PSYMBOL_INFO)SymbolBuffer;
+
+    for (auto Rip : ReadContext.Samples)
+    {
+      Symbol->SizeOfStruct = sizeof(SYMBOL_INFO);
+      Symbol->MaxNameLen   = MAX_SYM_NAME;
+
+      DWORD64 Displacement;
+      if (SymFromAddr(Process, Rip, &Displacement, Symbol))
+      {
+        Functions[Symbol->Name] += 1;
+      }
+      else
+      {
+        Functions[SymGetModuleBase64(Process, Rip) ? "<unknown>" : "<outside hvpp>"] += 1;
+      }
+    }
+
+    SymCleanup(Process);
+
+    std::vector<std::pair<std::string, uint64_t>> Profile(Functions.begin(), Functions.end());
+    std::sort(Profile.begin(), Profile.end(), [](auto& Lhs, auto& Rhs) { return Lhs.second > Rhs.second; });
+
+    uint64_t Total = ReadContext.Samples.size();
+
+    printf("%10s %7s  %s\n", "samples", "%", "function");
+
+    for (size_t i = 0; i < min(Profile.size(), (size_t)PROFILER_PRINT_FUNCTIONS); ++i)
+    {
+      printf("%10llu %6.2f%%  %s\n",
+             Profile[i].second,
+             Total ? (double)Profile[i].second * 100.0 / Total : 0.0,
+             Profile[i].first.c_str());
+    }
+
+    printf("\n");
+  }
+
+exit:
+  VirtualUnlock(Buffer, BufferSize);
+  VirtualFree(Buffer, 0, MEM_RELEASE);
+}
+
+//
+// Layout of the idle time status - must match hvpp::idle_status_t.
+//
+
+struct IDLE_STATUS
+{
+  uint32_t CpuIndex;
+  uint32_t Enabled;
+  uint64_t TotalCycles;
+  uint64_t HaltedCycles;
+  uint64_t HaltCount;
+  uint64_t ExitCount;
+  uint64_t RootCycles;
+};
+
+static_assert(sizeof(IDLE_STATUS) == 48, "IDLE_STATUS");
+
+void TestIdleTime(int Seconds)
+{
+  //
+  // Enable HLT exiting on each logical core, let the system run for a few
+  // seconds and print how busy each core really was - and how much of the
+  // busy time has been spent in the hypervisor.
+  // See hvpp/vmcall.h.
+  //
+  DWORD ProcessorCount = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+  SIZE_T BufferSize = sizeof(IDLE_STATUS) * ProcessorCount;
+
+  IDLE_STATUS* Status = (IDLE_STATUS*)VirtualAlloc(NULL, BufferSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+  if (!Status)
+  {
+    printf("VirtualAlloc failed (%u)\n", GetLastError());
+    return;
+  }
+
+  SetProcessWorkingSetSize(GetCurrentProcess(), BufferSize * 2 + PAGE_SIZE * 4, BufferSize * 4 + PAGE_SIZE * 8);
+  memset(Status, 0, BufferSize);
+
+  if (!VirtualLock(Status, BufferSize))
+  {
+    printf("VirtualLock failed (%u)\n", GetLastError());
+    VirtualFree(Status, 0, MEM_RELEASE);
+    return;
+  }
+
+  struct IDLE_CONTEXT
+  {
+    IDLE_STATUS*  Status;
+    volatile LONG Count;
+  } Context = { Status, 0 };
+
+  ForEachLogicalCore([](void* Context) {
+    auto IdleContext = (IDLE_CONTEXT*)Context;
+    if (ia32_asm_vmx_vmcall(0xcf, 1, 0, 0))
+    {
+      InterlockedIncrement(&IdleContext->Count);
+    }
+  }, &Context);
+
+  if ((DWORD)Context.Count != ProcessorCount)
+  {
+    printf("IdleTime: enabled on %u of %u CPUs\n", Context.Count, ProcessorCount);
+  }
+
+  if (Context.Count)
+  {
+    Sleep(Seconds * 1000);
+
+    Context.Count = 0;
+    ForEachLogicalCore([](void* Context) {
+      auto IdleContext = (IDLE_CONTEXT*)Context;
+      auto Index = InterlockedIncrement(&IdleContext->Count) - 1;
+      ia32_asm_vmx_vmcall(0xd0, (uint64_t)&IdleContext->Status[Index], 0, 0);
+    }, &Context);
+
+    std::sort(Status, Status + ProcessorCount,
+              [](auto& Lhs, auto& Rhs) { return Lhs.CpuIndex < Rhs.CpuIndex; });
+
+    uint64_t TotalBusy = 0;
+    uint64_t TotalRoot = 0;
+
+    for (DWORD i = 0; i < ProcessorCount; ++i)
+    {
+      if (!Status[i].Enabled || !Status[i].TotalCycles)
+      {
+        continue;
+      }
+
+      uint64_t BusyCycles = Status[i].TotalCycles - min(Status[i].HaltedCycles, Status[i].TotalCycles);
+
+      printf("  CPU %2u: %6.2f%% idle (%8llu halts), %6.2f%% busy, hypervisor %6.3f%% of busy time (%llu exits)\n",
+             Status[i].CpuIndex,
+             100.0 * Status[i].HaltedCycles / Status[i].TotalCycles,
+             Status[i].HaltCount,
+             100.0 * BusyCycles / Status[i].TotalCycles,
+             BusyCycles ? 100.0 * Status[i].RootCycles / BusyCycles : 0.0,
+             Status[i].ExitCount);
+
+      TotalBusy += BusyCycles;
+      TotalRoot += Status[i].RootCycles;
+    }
+
+    if (TotalBusy)
+    {
+      printf("IdleTime: hypervisor overhead %.3f%% of busy time\n", 100.0 * TotalRoot / TotalBusy);
+    }
+  }
+
+  ForEachLogicalCore([](void*) { ia32_asm_vmx_vmcall(0xcf, 0, 0, 0); }, nullptr);
+
+  VirtualUnlock(Status, BufferSize);
+  VirtualFree(Status, 0, MEM_RELEASE);
+  printf("\n");
+}
+
+//
+// Layout of the bulk read descriptor - must match hvpp::bulk_read_descriptor_t.
+//
+
+struct BULK_READ_DESCRIPTOR
+{
+  uint64_t Cr3;
+  uint64_t Va;
+  uint32_t Length;
+  uint32_t Status;
+  uint32_t BytesRead;
+  uint32_t Reserved;
+};
+
+static_assert(sizeof(BULK_READ_DESCRIPTOR) == 32, "BULK_READ_DESCRIPTOR");
+
+#define BULK_READ_ITERATIONS 1000
+
+void TestBulkRead()
+{
+  //
+  // Read parts of our own address space (CR3 = 0) in a single VMCALL and
+  // compare them with the local memory. The request includes a range which
+  // ends in a reserved (not present) page and a non-canonical address, so
+  // that all descriptor statuses are exercised.
+  // See hvpp/vmcall.h.
+  //
+  static const char* StatusName[] = { "success", "partial", "not present", "invalid" };
+
+  const SIZE_T SourceSize = PAGE_SIZE * 4;
+  const SIZE_T BufferSize = SourceSize + PAGE_SIZE * 8;
+
+  uint8_t* Source = (uint8_t*)VirtualAlloc(NULL, BufferSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+  if (!Source)
+  {
+    printf("VirtualAlloc failed (%u)\n", GetLastError());
+    return;
+  }
+
+  //
+  // The page which follows the reserved one is never committed.
+  //
+  uint8_t* Reserved = (uint8_t*)VirtualAlloc(NULL, PAGE_SIZE * 2, MEM_RESERVE, PAGE_NOACCESS);
+  if (!Reserved || !VirtualAlloc(Reserved, PAGE_SIZE, MEM_COMMIT, PAGE_READWRITE))
+  {
+    printf("VirtualAlloc failed (%u)\n", GetLastError());
+    VirtualFree(Source, 0, MEM_RELEASE);
+    return;
+  }
+
+  SetProcessWorkingSetSize(GetCurrentProcess(), BufferSize * 2 + PAGE_SIZE * 8, BufferSize * 4 + PAGE_SIZE * 16);
+
+  for (SIZE_T i = 0; i < SourceSize; ++i)
+  {
+    Source[i] = (uint8_t)(i * 7 + (i >> 12));
+  }
+
+  memset(Reserved, 0xcc, PAGE_SIZE);
+
+  if (!VirtualLock(Source, BufferSize) || !VirtualLock(Reserved, PAGE_SIZE))
+  {
+    printf("VirtualLock failed (%u)\n", GetLastError());
+    VirtualFree(Reserved, 0, MEM_RELEASE);
+    VirtualFree(Source, 0, MEM_RELEASE);
+    return;
+  }
+
+  BULK_READ_DESCRIPTOR* Descriptors = (BULK_READ_DESCRIPTOR*)(Source + SourceSize);
+  uint8_t* Output = Source + SourceSize + PAGE_SIZE;
+
+  BULK_READ_DESCRIPTOR Request[] = {
+    { 0, (uint64_t)Source,                     (uint32_t)SourceSize },
+    { 0, (uint64_t)Source + 100,               PAGE_SIZE + 200      },
+    { 0, (uint64_t)Reserved + PAGE_SIZE - 64,  128                  },
+    { 0, 0x8000000000000000,                   16                   },
+  };
+
+  const uint32_t Count = ARRAYSIZE(Request);
+  const uint32_t ExpectedLength[] = { (uint32_t)SourceSize, PAGE_SIZE + 200, 64, 0 };
+
+  memcpy(Descriptors, Request, sizeof(Request));
+  uint64_t Result = ia32_asm_vmx_vmcall(0xd1, (uint64_t)Descriptors, Count, (uint64_t)Output);
+
+  printf("BulkRead: %llu of %u descriptors read completely\n", Result, Count);
+
+  uint8_t* Data = Output;
+  for (uint32_t i = 0; i < Count; ++i)
+  {
+    auto& Descriptor = Descriptors[i];
+    bool Match = Descriptor.BytesRead == ExpectedLength[i] &&
+                 !memcmp(Data, (const void*)Descriptor.Va, Descriptor.BytesRead);
+
+    printf("  %u) %p %6u bytes: %-11s %6u bytes read, %s\n",
+           i, (void*)Descriptor.Va, Descriptor.Length,
+           Descriptor.Status < ARRAYSIZE(StatusName) ? StatusName[Descriptor.Status] : "?",
+           Descriptor.BytesRead, Match ? "OK" : "MISMATCH");
+
+    Data += Descriptor.Length;
+  }
+
+  //
+  // Measure the cost of the whole request.
+  //
+  LARGE_INTEGER Frequency, Start, End;
+  QueryPerformanceFrequency(&Frequency);
+  QueryPerformanceCounter(&Start);
+
+  for (int i = 0; i < BULK_READ_ITERATIONS; ++i)
+  {
+    memcpy(Descriptors, Request, sizeof(Request));
+    ia32_asm_vmx_vmcall(0xd1, (uint64_t)Descriptors, Count, (uint64_t)Output);
+  }
+
+  QueryPerformanceCounter(&End);
+
+  double Elapsed = (double)(End.QuadPart - Start.QuadPart) / Frequency.QuadPart;
+  printf("BulkRead: %8.1f us per request\n", Elapsed * 1e6 / BULK_READ_ITERATIONS);
+
+  VirtualUnlock(Reserved, PAGE_SIZE);
+  VirtualUnlock(Source, BufferSize);
+  VirtualFree(Reserved, 0, MEM_RELEASE);
+  VirtualFree(Source, 0, MEM_RELEASE);
+  printf("\n");
+}
+
+//
+// Layout of the coverage structures - must match hvpp::coverage_*_t.
+//
+
+struct COVERAGE_RANGE
+{
+  uint64_t Va;
+  uint64_t Size;
+};
+
+struct COVERAGE_REQUEST
+{
+  uint32_t       RangeCount;
+  uint32_t       Reserved;
+  COVERAGE_RANGE Range[16];
+};
+
+struct COVERAGE_PAGE
+{
+  uint64_t Va;
+  uint64_t Pa;
+  uint64_t Rip;
+};
+
+struct COVERAGE_STATUS
+{
+  uint32_t PageCount;
+  uint32_t HitCount;
+  uint32_t SkippedCount;
+  uint32_t ArmedCpuCount;
+  uint64_t Generation;
+  uint64_t BitmapSize;
+  uint64_t RequiredSize;
+};
+
+static_assert(sizeof(COVERAGE_REQUEST) == 264, "COVERAGE_REQUEST");
+static_assert(sizeof(COVERAGE_PAGE) == 24, "COVERAGE_PAGE");
+static_assert(sizeof(COVERAGE_STATUS) == 40, "COVERAGE_STATUS");
+
+#define COVERAGE_MAX_PAGE_COUNT 32768
+
+static bool PrintCoverage(COVERAGE_STATUS* Status, SIZE_T BufferSize, uint64_t ImageBase)
+{
+  if (!ia32_asm_vmx_vmcall(0xd5, (uint64_t)Status, BufferSize, 0))
+  {
+    printf("Coverage: read failed\n");
+    return false;
+  }
+
+  auto Bitmap = (const uint64_t*)(Status + 1);
+  auto Pages = (const COVERAGE_PAGE*)((const uint8_t*)Bitmap + Status->BitmapSize);
+
+  printf("Coverage: generation %llu, %u of %u pages executed (%u pages not present, armed on %u CPUs)\n",
+         Status->Generation, Status->HitCount, Status->PageCount,
+         Status->SkippedCount, Status->ArmedCpuCount);
+
+  for (uint32_t i = 0; i < Status->PageCount; ++i)
+  {
+    if (Bitmap[i / 64] & (1ull << (i % 64)))
+    {
+      printf("  +0x%06llx first executed at +0x%06llx\n",
+             Pages[i].Va - ImageBase, Pages[i].Rip - ImageBase);
+    }
+  }
+
+  return true;
+}
+
+void TestCoverage(const char* DriverName, int Seconds)
+{
+  //
+  // Usage:
+  //   hvppctrl coverage <driver> [seconds]
+  //     - track execution of the pages of the loaded driver for given
+  //       number of seconds (default: 5), then reset the coverage and
+  //       track it once again
+  //
+  // See hvpp/vmcall.h and coverage_t.
+  //
+  uint64_t ImageBase;
+  if (!FindDriver(DriverName, &ImageBase))
+  {
+    printf("Coverage: %s not loaded\n", DriverName);
+    return;
+  }
+
+  //
+  // Take the size of the image from the file.
+  //
+  char ImagePath[MAX_PATH];
+  GetSystemDirectoryA(ImagePath, MAX_PATH);
+  strcat_s(ImagePath, "\\drivers\\");
+  strcat_s(ImagePath, DriverName);
+
+  HMODULE Image = LoadLibraryExA(ImagePath, NULL, LOAD_LIBRARY_AS_IMAGE_RESOURCE);
+  if (!Image)
+  {
+    printf("LoadLibraryEx(%s) failed (%u)\n", ImagePath, GetLastError());
+    return;
+  }
+
+  PIMAGE_NT_HEADERS NtHeaders = ImageNtHeader((PVOID)((ULONG_PTR)Image & ~(ULONG_PTR)3));
+  uint64_t ImageSize = NtHeaders ? NtHeaders->OptionalHeader.SizeOfImage : 0;
+  FreeLibrary(Image);
+
+  if (!ImageSize)
+  {
+    printf("Coverage: invalid image %s\n", ImagePath);
+    return;
+  }
+
+  SIZE_T BufferSize = sizeof(COVERAGE_REQUEST) + sizeof(COVERAGE_STATUS) +
+                      COVERAGE_MAX_PAGE_COUNT / 8 +
+                      COVERAGE_MAX_PAGE_COUNT * sizeof(COVERAGE_PAGE);
+
+  uint8_t* Buffer = (uint8_t*)VirtualAlloc(NULL, BufferSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+  if (!Buffer)
+  {
+    printf("VirtualAlloc failed (%u)\n", GetLastError());
+    return;
+  }
+
+  SetProcessWorkingSetSize(GetCurrentProcess(), BufferSize * 2, BufferSize * 4);
+  memset(Buffer, 0, BufferSize);
+
+  if (!VirtualLock(Buffer, BufferSize))
+  {
+    printf("VirtualLock failed (%u)\n", GetLastError());
+    VirtualFree(Buffer, 0, MEM_RELEASE);
+    return;
+  }
+
+  auto Request = (COVERAGE_REQUEST*)Buffer;
+  auto Status = (COVERAGE_STATUS*)(Request + 1);
+  SIZE_T StatusSize = BufferSize - sizeof(COVERAGE_REQUEST);
+
+  Request->RangeCount = 1;
+  Request->Range[0].Va = ImageBase;
+  Request->Range[0].Size = ImageSize;
+
+  auto PageCount = ia32_asm_vmx_vmcall(0xd2, (uint64_t)Request, 0, 0);
+  printf("Coverage: %s at %p (%llu bytes), %llu pages tracked\n",
+         DriverName, (void*)ImageBase, ImageSize, PageCount);
+
+  if (PageCount)
+  {
+    ForEachLogicalCore([](void*) { ia32_asm_vmx_vmcall(0xd3, 1, 0, 0); }, nullptr);
+    Sleep(Seconds * 1000);
+
+    if (PrintCoverage(Status, StatusSize, ImageBase))
+    {
+      //
+      // Reset the hits on all CPUs and collect the coverage once again.
+      //
+      uint64_t Generation = Status->Generation + 1;
+
+      ForEachLogicalCore([](void* Context) {
+        ia32_asm_vmx_vmcall(0xd4, *(uint64_t*)Context, 0, 0);
+      }, &Generation);
+
+      Sleep(Seconds * 1000);
+      PrintCoverage(Status, StatusSize, ImageBase);
+    }
+
+    ForEachLogicalCore([](void*) { ia32_asm_vmx_vmcall(0xd3, 0, 0, 0); }, nullptr);
+  }
+
+  VirtualUnlock(Buffer, BufferSize);
+  VirtualFree(Buffer, 0, MEM_RELEASE);
+  printf("\n");
+}
+
+int main(int argc, char* argv[])
+{
+  if (argc > 1 && !strcmp(argv[1], "pong"))
+  {
+    ContextSwitchPong();
+    return 0;
+  }
+
+  if (argc > 1 && !strcmp(argv[1], "nested"))
+  {
+    TestNested(argc > 2 ? !strcmp(argv[2], "on") : -1);
+    return 0;
+  }
+
+  if (argc > 1 && !strcmp(argv[1], "steal"))
+  {
+    TestStealTime();
+    return 0;
+  }
+
+  if (argc > 1 && !strcmp(argv[1], "scan"))
+  {
+    TestMemoryScan(argc - 2, &argv[2]);
+    return 0;
+  }
+
+  if (argc > 2 && !strcmp(argv[1], "lbr"))
+  {
+    TestLbr(atoi(argv[2]), argc > 3 ? argv[3] : nullptr);
+    return 0;
+  }
+
+  if (argc > 1 && !strcmp(argv[1], "trace"))
+  {
+    TestTrace(argc > 2 ? atoi(argv[2]) : 1, argc > 3 ? argv[3] : nullptr);
+    return 0;
+  }
+
+  if (argc > 1 && !strcmp(argv[1], "profile"))
+  {
+    TestProfiler(argc > 2 ? atoi(argv[2]) : 5,
+                 argc > 3 ? (uint32_t)strtoul(argv[3], nullptr, 0) : PROFILER_DEFAULT_PERIOD,
+                 argc > 4 ? argv[4] : "hvpp.sys");
+    return 0;
+  }
+
+  if (argc > 1 && !strcmp(argv[1], "idle"))
+  {
+    TestIdleTime(argc > 2 ? atoi(argv[2]) : 5);
+    return 0;
+  }
+
+  if (argc > 1 && !strcmp(argv[1], "read"))
+  {
+    TestBulkRead();
+    return 0;
+  }
+
+  if (argc > 2 && !strcmp(argv[1], "coverage"))
+  {
+    TestCoverage(argv[2], argc > 3 ? atoi(argv[3]) : 5);
+    return 0;
+  }
+
   TestCpuid();
   TestHook();
+  TestContextSwitch();
+  TestHistory();
+  TestConfig();
 
   return 0;
 }
@@ -0,0 +1,576 @@
+/* udis86 - libudis86/cfg.c
+ *
+ * Recursive-descent basic-block and call-graph builder, with on-disk cache.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright notice,
+ *       this list of conditions and the following disclaimer in the documentation
+ *       and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "udint.h"
+#include "extern.h"
+
+#if !defined(__UD_STANDALONE__)
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Per-byte state of the buffer during the build. Low 4 bits hold the
+ * length of the instruction starting at that byte (0 if no instruction
+ * has been decoded there), upper bits are flags.
+ */
+#define UD_CFG_LENGTH_MASK      0x0f
+#define UD_CFG_LEADER           0x10  /* instruction starts a block */
+#define UD_CFG_FUNCTION         0x20  /* instruction is a call target */
+#define UD_CFG_TERMINATOR       0x40  /* instruction ends a block */
+
+#define UD_CFG_MAGIC            0x66636475  /* "udcf" */
+#define UD_CFG_VERSION          1
+
+struct ud_cfg_file_header
+{
+  uint32_t magic;
+  uint32_t version;
+  uint64_t hash;
+  uint64_t pc;
+  uint32_t size;
+  uint32_t mode;
+  uint64_t block_count;
+  uint64_t succ_count;
+  uint64_t call_count;
+};
+
+struct ud_cfg_vector
+{
+  void*   data;
+  size_t  count;
+  size_t  capacity;
+  size_t  item_size;
+};
+
+static int
+ud_cfg_vector_push(struct ud_cfg_vector* v, const void* item)
+{
+  if (v->count == v->capacity) {
+    size_t new_capacity = v->capacity ? v->capacity * 2 : 256;
+    void* data = realloc(v->data, new_capacity * v->item_size);
+    if (data == NULL) {
+      return -1;
+    }
+    v->data = data;
+    v->capacity = new_capacity;
+  }
+
+  memcpy((uint8_t*) v->data + v->count * v->item_size, item, v->item_size);
+  v->count++;
+  return 0;
+}
+
+static int
+ud_cfg_is_jcc(enum ud_mnemonic_code m)
+{
+  return (m >= UD_Ijo && m <= UD_Ijrcxz) ||
+         (m >= UD_Iloopne && m <= UD_Iloop);
+}
+
+static int
+ud_cfg_is_return(enum ud_mnemonic_code m)
+{
+  return m == UD_Iret   || m == UD_Iretf  ||
+         m == UD_Iiretw || m == UD_Iiretd || m == UD_Iiretq ||
+         m == UD_Isysret;
+}
+
+static int
+ud_cfg_is_stop(enum ud_mnemonic_code m)
+{
+  return m == UD_Ihlt || m == UD_Iud2 || m == UD_Iint3 || m == UD_Iinvalid;
+}
+
+/*
+ * Returns 1 and fills "target" (offset from the start of the buffer) if the
+ * first operand of the decoded branch is a relative target inside the buffer.
+ */
+static int
+ud_cfg_branch_target(const struct ud* u, uint64_t pc, size_t size, size_t* target)
+{
+  const struct ud_operand* opr = &u->operand[0];
+  const uint64_t trunc_mask = 0xffffffffffffffffull >> (64 - u->opr_mode);
+  uint64_t address;
+
+  if (opr->type != UD_OP_JIMM) {
+    return 0;
+  }
+
+  switch (opr->size) {
+  case 8 : address = (u->pc + opr->lval.sbyte)  & trunc_mask; break;
+  case 16: address = (u->pc + opr->lval.sword)  & trunc_mask; break;
+  case 32: address = (u->pc + opr->lval.sdword) & trunc_mask; break;
+  default: return 0;
+  }
+
+  if (address < pc || address - pc >= size) {
+    return 0;
+  }
+
+  *target = (size_t) (address - pc);
+  return 1;
+}
+
+static void
+ud_cfg_decoder_init(struct ud* u, const uint8_t* buffer, size_t size, uint8_t mode,
+                    uint64_t pc, unsigned vendor, size_t offset)
+{
+  ud_init(u);
+  ud_set_mode(u, mode);
+  ud_set_vendor(u, vendor);
+  ud_set_pc(u, pc + offset);
+  ud_set_input_buffer(u, buffer + offset, size - offset);
+}
+
+/* =============================================================================
+ * ud_cfg_hash
+ *    64-bit FNV-1a hash of the buffer (processed in 8-byte words), used as
+ *    the cache key.
+ * =============================================================================
+ */
+extern uint64_t
+ud_cfg_hash(const uint8_t* buffer, size_t size)
+{
+  uint64_t hash = 0xcbf29ce484222325ull ^ size;
+  size_t i = 0;
+
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    memcpy(&word, buffer + i, sizeof(word));
+    hash = (hash ^ word) * 0x100000001b3ull;
+  }
+
+  for (; i < size; ++i) {
+    hash = (hash ^ buffer[i]) * 0x100000001b3ull;
+  }
+
+  return hash;
+}
+
+/* =============================================================================
+ * ud_cfg_explore
+ *    First pass - follows the control flow from all entry points and marks
+ *    instruction starts, block leaders and terminators. Calls are recorded.
+ * =============================================================================
+ */
+static int
+ud_cfg_explore(uint8_t* state, const uint8_t* buffer, size_t size, uint8_t mode,
+               uint64_t pc, unsigned vendor, struct ud_cfg_vector* work,
+               struct ud_cfg_vector* call)
+{
+  struct ud u;
+
+  while (work->count) {
+    size_t offset = ((uint32_t*) work->data)[--work->count];
+    int first = 1;
+
+    while (offset < size) {
+      enum ud_mnemonic_code m;
+      unsigned int len;
+      size_t target;
+      uint32_t item;
+
+      if (state[offset] & UD_CFG_LENGTH_MASK) {
+        /* Already decoded - we've merged into known code. */
+        state[offset] |= UD_CFG_LEADER;
+        break;
+      }
+
+      if (first) {
+        state[offset] |= UD_CFG_LEADER;
+        ud_cfg_decoder_init(&u, buffer, size, mode, pc, vendor, offset);
+        first = 0;
+      }
+
+      len = ud_decode(&u);
+      if (len == 0 || len > UD_CFG_LENGTH_MASK) {
+        state[offset] |= UD_CFG_TERMINATOR;
+        break;
+      }
+
+      state[offset] |= (uint8_t) len;
+      m = u.mnemonic;
+
+      if (ud_cfg_is_jcc(m)) {
+        state[offset] |= UD_CFG_TERMINATOR;
+        if (ud_cfg_branch_target(&u, pc, size, &target)) {
+          item = (uint32_t) target;
+          if (ud_cfg_vector_push(work, &item) != 0) {
+            return -1;
+          }
+        }
+        item = (uint32_t) (offset + len);
+        if (ud_cfg_vector_push(work, &item) != 0) {
+          return -1;
+        }
+        break;
+      }
+
+      if (m == UD_Ijmp) {
+        state[offset] |= UD_CFG_TERMINATOR;
+        if (ud_cfg_branch_target(&u, pc, size, &target)) {
+          item = (uint32_t) target;
+          if (ud_cfg_vector_push(work, &item) != 0) {
+            return -1;
+          }
+        }
+        break;
+      }
+
+      if (ud_cfg_is_return(m) || ud_cfg_is_stop(m) || u.error || u.inp_end) {
+        state[offset] |= UD_CFG_TERMINATOR;
+        break;
+      }
+
+      if (m == UD_Icall && ud_cfg_branch_target(&u, pc, size, &target)) {
+        struct ud_cfg_call c;
+        c.site   = (uint32_t) offset;
+        c.target = (uint32_t) target;
+        if (ud_cfg_vector_push(call, &c) != 0) {
+          return -1;
+        }
+
+        state[target] |= UD_CFG_FUNCTION;
+        item = (uint32_t) target;
+        if (ud_cfg_vector_push(work, &item) != 0) {
+          return -1;
+        }
+      }
+
+      offset += len;
+    }
+  }
+
+  return 0;
+}
+
+static int
+ud_cfg_compare_call(const void* lhs, const void* rhs)
+{
+  const struct ud_cfg_call* a = (const struct ud_cfg_call*) lhs;
+  const struct ud_cfg_call* b = (const struct ud_cfg_call*) rhs;
+  return a->site < b->site ? -1 : a->site > b->site;
+}
+
+static size_t
+ud_cfg_find_block(const struct ud_cfg* cfg, uint32_t offset)
+{
+  size_t lo = 0;
+  size_t hi = cfg->block_count;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (cfg->block[mid].begin < offset) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+/* =============================================================================
+ * ud_cfg_build
+ *    Builds basic blocks and call graph of the buffer by recursive descent
+ *    from the "entry" offsets (or from offset 0, if there are none).
+ *    Returns 0 on success, -1 if memory couldn't be allocated. The result
+ *    must be freed by ud_cfg_free().
+ * =============================================================================
+ */
+extern int
+ud_cfg_build(struct ud_cfg* cfg, const uint8_t* buffer, size_t size, uint8_t mode,
+             uint64_t pc, unsigned vendor, const uint32_t* entry, size_t entry_count)
+{
+  struct ud_cfg_vector work  = { NULL, 0, 0, sizeof(uint32_t) };
+  struct ud_cfg_vector call  = { NULL, 0, 0, sizeof(struct ud_cfg_call) };
+  struct ud_cfg_vector block = { NULL, 0, 0, sizeof(struct ud_cfg_block) };
+  struct ud_cfg_vector succ  = { NULL, 0, 0, sizeof(uint32_t) };
+  uint8_t* state;
+  size_t offset;
+  size_t i;
+  struct ud u;
+
+  memset(cfg, 0, sizeof(*cfg));
+  cfg->hash = ud_cfg_hash(buffer, size);
+  cfg->pc   = pc;
+  cfg->size = (uint32_t) size;
+  cfg->mode = mode;
+
+  state = (uint8_t*) calloc(size ? size : 1, 1);
+  if (state == NULL) {
+    return -1;
+  }
+
+  for (i = 0; i < entry_count; ++i) {
+    if (entry[i] < size) {
+      state[entry[i]] |= UD_CFG_FUNCTION;
+      if (ud_cfg_vector_push(&work, &entry[i]) != 0) {
+        goto error;
+      }
+    }
+  }
+
+  if (entry_count == 0 && size != 0) {
+    uint32_t zero = 0;
+    state[0] |= UD_CFG_FUNCTION;
+    if (ud_cfg_vector_push(&work, &zero) != 0) {
+      goto error;
+    }
+  }
+
+  if (ud_cfg_explore(state, buffer, size, mode, pc, vendor, &work, &call) != 0) {
+    goto error;
+  }
+
+  /*
+   * Second pass - form blocks from leaders. Successors are first collected
+   * as offsets and converted to block indices once all blocks are known.
+   */
+  for (offset = 0; offset < size; ++offset) {
+    struct ud_cfg_block b;
+    size_t insn;
+    size_t next;
+
+    if (!(state[offset] & UD_CFG_LEADER) || !(state[offset] & UD_CFG_LENGTH_MASK)) {
+      continue;
+    }
+
+    b.begin      = (uint32_t) offset;
+    b.succ_begin = (uint32_t) succ.count;
+    b.succ_count = 0;
+    b.flags      = (state[offset] & UD_CFG_FUNCTION) ? UD_CFG_BLOCK_FUNCTION : 0;
+
+    insn = offset;
+    for (;;) {
+      next = insn + (state[insn] & UD_CFG_LENGTH_MASK);
+
+      if ((state[insn] & UD_CFG_TERMINATOR) ||
+          next >= size ||
+          !(state[next] & UD_CFG_LENGTH_MASK) ||
+          (state[next] & UD_CFG_LEADER)) {
+        break;
+      }
+
+      insn = next;
+    }
+
+    b.end = (uint32_t) next;
+
+    if (state[insn] & UD_CFG_TERMINATOR) {
+      /*
+       * Decode the terminator again to get its kind and branch target.
+       */
+      enum ud_mnemonic_code m;
+      size_t target;
+
+      ud_cfg_decoder_init(&u, buffer, size, mode, pc, vendor, insn);
+      ud_decode(&u);
+      m = u.mnemonic;
+
+      if (ud_cfg_is_jcc(m) || m == UD_Ijmp) {
+        if (ud_cfg_branch_target(&u, pc, size, &target)) {
+          uint32_t item = (uint32_t) target;
+          if (ud_cfg_vector_push(&succ, &item) != 0) {
+            goto error;
+          }
+          b.succ_count++;
+        } else if (m == UD_Ijmp) {
+          b.flags |= UD_CFG_BLOCK_INDIRECT;
+        }
+
+        if (ud_cfg_is_jcc(m) && next < size) {
+          uint32_t item = (uint32_t) next;
+          if (ud_cfg_vector_push(&succ, &item) != 0) {
+            goto error;
+          }
+          b.succ_count++;
+        }
+      } else if (ud_cfg_is_return(m)) {
+        b.flags |= UD_CFG_BLOCK_RETURN;
+      } else if (m == UD_Iinvalid || u.error) {
+        b.flags |= UD_CFG_BLOCK_INVALID;
+      }
+    } else if (next < size && (state[next] & UD_CFG_LEADER)) {
+      /* Falls through into the next block. */
+      uint32_t item = (uint32_t) next;
+      if (ud_cfg_vector_push(&succ, &item) != 0) {
+        goto error;
+      }
+      b.succ_count++;
+    }
+
+    if (ud_cfg_vector_push(&block, &b) != 0) {
+      goto error;
+    }
+  }
+
+  cfg->block       = (struct ud_cfg_block*) block.data;
+  cfg->block_count = block.count;
+  cfg->succ        = (uint32_t*) succ.data;
+  cfg->succ_count  = succ.count;
+  cfg->call        = (struct ud_cfg_call*) call.data;
+  cfg->call_count  = call.count;
+
+  for (i = 0; i < cfg->succ_count; ++i) {
+    cfg->succ[i] = (uint32_t) ud_cfg_find_block(cfg, cfg->succ[i]);
+  }
+
+  if (cfg->call_count) {
+    qsort(cfg->call, cfg->call_count, sizeof(*cfg->call), &ud_cfg_compare_call);
+  }
+
+  free(work.data);
+  free(state);
+  return 0;
+
+error:
+  free(work.data);
+  free(call.data);
+  free(block.data);
+  free(succ.data);
+  free(state);
+  memset(cfg, 0, sizeof(*cfg));
+  return -1;
+}
+
+/* =============================================================================
+ * ud_cfg_save
+ *    Writes the index into the cache file. Returns 0 on success.
+ * =============================================================================
+ */
+extern int
+ud_cfg_save(const struct ud_cfg* cfg, const char* path)
+{
+  struct ud_cfg_file_header header;
+  FILE* file;
+  int result = 0;
+
+  header.magic       = UD_CFG_MAGIC;
+  header.version     = UD_CFG_VERSION;
+  header.hash        = cfg->hash;
+  header.pc          = cfg->pc;
+  header.size        = cfg->size;
+  header.mode        = cfg->mode;
+  header.block_count = cfg->block_count;
+  header.succ_count  = cfg->succ_count;
+  header.call_count  = cfg->call_count;
+
+  file = fopen(path, "wb");
+  if (file == NULL) {
+    return -1;
+  }
+
+  if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+      fwrite(cfg->block, sizeof(*cfg->block), cfg->block_count, file) != cfg->block_count ||
+      fwrite(cfg->succ,  sizeof(*cfg->succ),  cfg->succ_count,  file) != cfg->succ_count ||
+      fwrite(cfg->call,  sizeof(*cfg->call),  cfg->call_count,  file) != cfg->call_count) {
+    result = -1;
+  }
+
+  if (fclose(file) != 0) {
+    result = -1;
+  }
+
+  if (result != 0) {
+    remove(path);
+  }
+
+  return result;
+}
+
+/* =============================================================================
+ * ud_cfg_load
+ *    Loads the index from the cache file. Fails (returns -1) if the file
+ *    doesn't exist, is corrupted or was built from different buffer than
+ *    the one with the given hash.
+ * =============================================================================
+ */
+extern int
+ud_cfg_load(struct ud_cfg* cfg, const char* path, uint64_t hash)
+{
+  struct ud_cfg_file_header header;
+  FILE* file;
+
+  memset(cfg, 0, sizeof(*cfg));
+
+  file = fopen(path, "rb");
+  if (file == NULL) {
+    return -1;
+  }
+
+  if (fread(&header, sizeof(header), 1, file) != 1 ||
+      header.magic != UD_CFG_MAGIC ||
+      header.version != UD_CFG_VERSION ||
+      header.hash != hash) {
+    fclose(file);
+    return -1;
+  }
+
+  cfg->hash        = header.hash;
+  cfg->pc          = header.pc;
+  cfg->size        = header.size;
+  cfg->mode        = (uint8_t) header.mode;
+  cfg->block_count = (size_t) header.block_count;
+  cfg->succ_count  = (size_t) header.succ_count;
+  cfg->call_count  = (size_t) header.call_count;
+
+  cfg->block = (struct ud_cfg_block*) malloc(cfg->block_count * sizeof(*cfg->block) + 1);
+  cfg->succ  = (uint32_t*) malloc(cfg->succ_count * sizeof(*cfg->succ) + 1);
+  cfg->call  = (struct ud_cfg_call*) malloc(cfg->call_count * sizeof(*cfg->call) + 1);
+
+  if (cfg->block == NULL || cfg->succ == NULL || cfg->call == NULL ||
+      fread(cfg->block, sizeof(*cfg->block), cfg->block_count, file) != cfg->block_count ||
+      fread(cfg->succ,  sizeof(*cfg->succ),  cfg->succ_count,  file) != cfg->succ_count ||
+      fread(cfg->call,  sizeof(*cfg->call),  cfg->call_count,  file) != cfg->call_count) {
+    fclose(file);
+    ud_cfg_free(cfg);
+    return -1;
+  }
+
+  fclose(file);
+  return 0;
+}
+
+/* =============================================================================
+ * ud_cfg_free
+ *    Frees index created by ud_cfg_build() or ud_cfg_load().
+ * =============================================================================
+ */
+extern void
+ud_cfg_free(struct ud_cfg* cfg)
+{
+  free(cfg->block);
+  free(cfg->succ);
+  free(cfg->call);
+  memset(cfg, 0, sizeof(*cfg));
+}
+
+#endif /* !__UD_STANDALONE__ */
+
+/*
+vim: set ts=2 sw=2 expandtab
+*/
@@ -97,6 +97,32 @@ extern void ud_set_sym_resolver(struct ud *u,
                                                         uint64_t addr,
                                                         int64_t *offset));
 
+extern int ud_sweep(struct ud_index*, const uint8_t*, size_t, uint8_t mode,
+                    uint64_t pc, unsigned vendor, unsigned thread_count);
+
+extern void ud_index_free(struct ud_index*);
+
+extern uint64_t ud_cfg_hash(const uint8_t*, size_t);
+
+extern int ud_cfg_build(struct ud_cfg*, const uint8_t*, size_t, uint8_t mode,
+                        uint64_t pc, unsigned vendor,
+                        const uint32_t* entry, size_t entry_count);
+
+extern int ud_cfg_save(const struct ud_cfg*, const char* path);
+
+extern int ud_cfg_load(struct ud_cfg*, const char* path, uint64_t hash);
+
+extern void ud_cfg_free(struct ud_cfg*);
+
+extern int ud_symtab_init(struct ud_symtab*, const struct ud_symbol*, size_t);
+
+extern void ud_symtab_free(struct ud_symtab*);
+
+extern const char* ud_symtab_lookup(const struct ud_symtab*, uint64_t addr,
+                                    int64_t *offset, size_t *hint);
+
+extern void ud_set_symtab(struct ud*, const struct ud_symtab*);
+
 /* ========================================================================== */
 
 #ifdef __cplusplus
@@ -0,0 +1,379 @@
+/* udis86 - libudis86/sweep.c
+ *
+ * Parallel linear-sweep disassembly.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright notice,
+ *       this list of conditions and the following disclaimer in the documentation
+ *       and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "udint.h"
+#include "extern.h"
+
+#if !defined(__UD_STANDALONE__)
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <pthread.h>
+#endif
+
+/*
+ * The buffer is split into chunks, each of which is decoded by its own
+ * ud_t on its own thread. A chunk (except the first one) starts at an
+ * arbitrary byte, so its first few instructions may be misaligned. Each
+ * thread therefore decodes only the instructions *starting* in its chunk,
+ * but always with the whole rest of the buffer as input - so the decoding
+ * of any given offset is exactly the same as in sequential sweep.
+ *
+ * When the chunks are merged, the end of the last (correct) instruction
+ * of the previous chunk gives the first true instruction boundary in the
+ * next chunk. If the chunk decoded an instruction at that offset, the
+ * streams are synchronized - decoding is deterministic, so everything from
+ * that offset on is identical to the sequential sweep. Otherwise the
+ * instructions in the overlap are decoded again sequentially, until the
+ * stream hits an offset which the chunk has already decoded (x86 code
+ * usually resynchronizes within a few instructions).
+ */
+
+#define UD_SWEEP_MIN_CHUNK_SIZE   4096
+
+struct ud_sweep_chunk
+{
+  const uint8_t*  buffer;
+  size_t          size;
+  size_t          begin;
+  size_t          end;
+  uint8_t         mode;
+  unsigned        vendor;
+  uint64_t        pc;
+
+  struct ud_index_entry* entry;
+  size_t          count;
+  size_t          capacity;
+  int             error;
+};
+
+static int
+ud_sweep_append(struct ud_index_entry** entry, size_t* count, size_t* capacity,
+                const struct ud* u, size_t offset)
+{
+  struct ud_index_entry* e;
+
+  if (*count == *capacity) {
+    size_t new_capacity = *capacity ? *capacity * 2 : 256;
+    e = (struct ud_index_entry*) realloc(*entry, new_capacity * sizeof(**entry));
+    if (e == NULL) {
+      return -1;
+    }
+    *entry = e;
+    *capacity = new_capacity;
+  }
+
+  e = &(*entry)[(*count)++];
+  e->offset   = (uint32_t) offset;
+  e->mnemonic = (uint16_t) u->mnemonic;
+  e->length   = (uint8_t) u->inp_ctr;
+  e->reserved = 0;
+  return 0;
+}
+
+static void
+ud_sweep_init(struct ud* u, const struct ud_sweep_chunk* chunk, size_t offset)
+{
+  ud_init(u);
+  ud_set_mode(u, chunk->mode);
+  ud_set_vendor(u, chunk->vendor);
+  ud_set_pc(u, chunk->pc + offset);
+  ud_set_input_buffer(u, chunk->buffer + offset, chunk->size - offset);
+}
+
+/* =============================================================================
+ * ud_sweep_decode_chunk
+ *    Decodes all instructions starting in [begin, end) of the chunk.
+ * =============================================================================
+ */
+static void
+ud_sweep_decode_chunk(struct ud_sweep_chunk* chunk)
+{
+  struct ud u;
+  size_t offset = chunk->begin;
+
+  ud_sweep_init(&u, chunk, offset);
+
+  chunk->capacity = (chunk->end - chunk->begin) / 3 + 16;
+  chunk->entry = (struct ud_index_entry*) malloc(chunk->capacity * sizeof(*chunk->entry));
+  if (chunk->entry == NULL) {
+    chunk->error = 1;
+    return;
+  }
+
+  while (offset < chunk->end && !u.inp_end) {
+    unsigned int len = ud_decode(&u);
+    if (len == 0) {
+      break;
+    }
+    if (ud_sweep_append(&chunk->entry, &chunk->count, &chunk->capacity, &u, offset) != 0) {
+      chunk->error = 1;
+      return;
+    }
+    offset += len;
+  }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI
+ud_sweep_thread(LPVOID context)
+{
+  ud_sweep_decode_chunk((struct ud_sweep_chunk*) context);
+  return 0;
+}
+#else
+static void*
+ud_sweep_thread(void* context)
+{
+  ud_sweep_decode_chunk((struct ud_sweep_chunk*) context);
+  return NULL;
+}
+#endif
+
+/* =============================================================================
+ * ud_sweep_merge
+ *    Concatenates the chunks into the index, re-decoding misaligned
+ *    instructions at the chunk seams.
+ * =============================================================================
+ */
+static int
+ud_sweep_merge(struct ud_index* index, struct ud_sweep_chunk* chunk, unsigned chunk_count)
+{
+  size_t capacity = 0;
+  size_t offset = 0;
+  unsigned i;
+
+  for (i = 0; i < chunk_count; ++i) {
+    capacity += chunk[i].count;
+  }
+
+  index->entry = (struct ud_index_entry*) malloc((capacity + 16) * sizeof(*index->entry));
+  index->count = 0;
+  capacity += 16;
+
+  if (index->entry == NULL) {
+    return -1;
+  }
+
+  for (i = 0; i < chunk_count; ++i) {
+    struct ud_sweep_chunk* c = &chunk[i];
+    size_t j = 0;
+
+    if (offset >= c->end) {
+      /* An instruction from the previous chunk spans this whole chunk. */
+      continue;
+    }
+
+    /*
+     * Find the first instruction of the chunk which is not before the
+     * "offset" - it's the candidate for the synchronization point.
+     */
+    while (j < c->count && c->entry[j].offset < offset) {
+      ++j;
+    }
+
+    if (j == c->count || c->entry[j].offset != offset) {
+      struct ud u;
+      ud_sweep_init(&u, c, offset);
+
+      while (offset < c->end && !u.inp_end) {
+        unsigned int len = ud_decode(&u);
+        if (len == 0) {
+          break;
+        }
+        if (ud_sweep_append(&index->entry, &index->count, &capacity, &u, offset) != 0) {
+          return -1;
+        }
+        offset += len;
+
+        while (j < c->count && c->entry[j].offset < offset) {
+          ++j;
+        }
+        if (j < c->count && c->entry[j].offset == offset) {
+          break;
+        }
+      }
+
+      if (offset >= c->end || j == c->count || c->entry[j].offset != offset) {
+        /* Didn't synchronize within the chunk (or the input has ended). */
+        continue;
+      }
+    }
+
+    /*
+     * Synchronized - the rest of the chunk is valid.
+     */
+    if (index->count + (c->count - j) > capacity) {
+      struct ud_index_entry* e;
+      capacity = index->count + (c->count - j) + 16;
+      e = (struct ud_index_entry*) realloc(index->entry, capacity * sizeof(*e));
+      if (e == NULL) {
+        return -1;
+      }
+      index->entry = e;
+    }
+
+    memcpy(&index->entry[index->count], &c->entry[j], (c->count - j) * sizeof(*c->entry));
+    index->count += c->count - j;
+
+    offset = c->entry[c->count - 1].offset + c->entry[c->count - 1].length;
+  }
+
+  return 0;
+}
+
+/* =============================================================================
+ * ud_sweep
+ *    Linear-sweep disassembly of the whole buffer using "thread_count"
+ *    threads. The resulting index is identical to the one produced by
+ *    calling ud_decode() in a loop. Returns 0 on success, -1 if memory
+ *    couldn't be allocated. The index must be freed by ud_index_free().
+ * =============================================================================
+ */
+extern int
+ud_sweep(struct ud_index* index, const uint8_t* buffer, size_t size, uint8_t mode,
+         uint64_t pc, unsigned vendor, unsigned thread_count)
+{
+  struct ud_sweep_chunk* chunk;
+  unsigned chunk_count;
+  unsigned i;
+  int result = 0;
+
+  index->entry = NULL;
+  index->count = 0;
+
+  chunk_count = thread_count ? thread_count : 1;
+  if (size / UD_SWEEP_MIN_CHUNK_SIZE < chunk_count) {
+    chunk_count = (unsigned) (size / UD_SWEEP_MIN_CHUNK_SIZE);
+  }
+  if (chunk_count == 0) {
+    chunk_count = 1;
+  }
+
+  chunk = (struct ud_sweep_chunk*) calloc(chunk_count, sizeof(*chunk));
+  if (chunk == NULL) {
+    return -1;
+  }
+
+  for (i = 0; i < chunk_count; ++i) {
+    chunk[i].buffer = buffer;
+    chunk[i].size   = size;
+    chunk[i].begin  = size / chunk_count * i;
+    chunk[i].end    = i + 1 == chunk_count ? size : size / chunk_count * (i + 1);
+    chunk[i].mode   = mode;
+    chunk[i].vendor = vendor;
+    chunk[i].pc     = pc;
+  }
+
+  /*
+   * The first chunk is decoded by the calling thread.
+   */
+  {
+#ifdef _WIN32
+    HANDLE* thread = (HANDLE*) calloc(chunk_count, sizeof(HANDLE));
+#else
+    pthread_t* thread = (pthread_t*) calloc(chunk_count, sizeof(pthread_t));
+    int* started = (int*) calloc(chunk_count, sizeof(int));
+#endif
+
+    for (i = 1; i < chunk_count; ++i) {
+#ifdef _WIN32
+      thread[i] = thread ? CreateThread(NULL, 0, &ud_sweep_thread, &chunk[i], 0, NULL) : NULL;
+      if (thread[i] == NULL) {
+        ud_sweep_decode_chunk(&chunk[i]);
+      }
+#else
+      if (thread == NULL || started == NULL ||
+          !(started[i] = pthread_create(&thread[i], NULL, &ud_sweep_thread, &chunk[i]) == 0)) {
+        ud_sweep_decode_chunk(&chunk[i]);
+      }
+#endif
+    }
+
+    ud_sweep_decode_chunk(&chunk[0]);
+
+    for (i = 1; i < chunk_count; ++i) {
+#ifdef _WIN32
+      if (thread && thread[i] != NULL) {
+        WaitForSingleObject(thread[i], INFINITE);
+        CloseHandle(thread[i]);
+      }
+#else
+      if (thread && started && started[i]) {
+        pthread_join(thread[i], NULL);
+      }
+#endif
+    }
+
+    free(thread);
+#ifndef _WIN32
+    free(started);
+#endif
+  }
+
+  for (i = 0; i < chunk_count; ++i) {
+    if (chunk[i].error) {
+      result = -1;
+    }
+  }
+
+  if (result == 0) {
+    result = ud_sweep_merge(index, chunk, chunk_count);
+  }
+
+  for (i = 0; i < chunk_count; ++i) {
+    free(chunk[i].entry);
+  }
+  free(chunk);
+
+  if (result != 0) {
+    ud_index_free(index);
+  }
+
+  return result;
+}
+
+/* =============================================================================
+ * ud_index_free
+ *    Frees index created by ud_sweep().
+ * =============================================================================
+ */
+extern void
+ud_index_free(struct ud_index* index)
+{
+  free(index->entry);
+  index->entry = NULL;
+  index->count = 0;
+}
+
+#endif /* !__UD_STANDALONE__ */
+
+/*
+vim: set ts=2 sw=2 expandtab
+*/
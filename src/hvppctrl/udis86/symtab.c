@@ -0,0 +1,216 @@
+/* udis86 - libudis86/symtab.c
+ *
+ * Built-in symbol resolver backed by a sorted symbol table.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright notice,
+ *       this list of conditions and the following disclaimer in the documentation
+ *       and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "udint.h"
+#include "extern.h"
+
+#if !defined(__UD_STANDALONE__)
+
+#include <stdlib.h>
+#include <string.h>
+
+static int
+ud_symtab_compare(const void* lhs, const void* rhs)
+{
+  const struct ud_symbol* a = *(const struct ud_symbol* const*) lhs;
+  const struct ud_symbol* b = *(const struct ud_symbol* const*) rhs;
+  if (a->address != b->address) {
+    return a->address < b->address ? -1 : 1;
+  }
+  /* qsort() isn't stable - keep the original order of duplicates. */
+  return a < b ? -1 : a > b;
+}
+
+/* =============================================================================
+ * ud_symtab_init
+ *    Builds the symbol table from (unsorted) array of symbols. Names are
+ *    copied. Of symbols with the same address, the first one is kept.
+ *    Returns 0 on success, -1 if memory couldn't be allocated. The table
+ *    must be freed by ud_symtab_free().
+ * =============================================================================
+ */
+extern int
+ud_symtab_init(struct ud_symtab* symtab, const struct ud_symbol* symbol, size_t count)
+{
+  const struct ud_symbol** sorted;
+  size_t strings_size = 0;
+  size_t i;
+  size_t n;
+  char* p;
+
+  memset(symtab, 0, sizeof(*symtab));
+
+  sorted = (const struct ud_symbol**) malloc((count ? count : 1) * sizeof(*sorted));
+  if (sorted == NULL) {
+    return -1;
+  }
+
+  for (i = 0; i < count; ++i) {
+    sorted[i] = &symbol[i];
+    strings_size += strlen(symbol[i].name ? symbol[i].name : "") + 1;
+  }
+
+  qsort(sorted, count, sizeof(*sorted), &ud_symtab_compare);
+
+  symtab->address = (uint64_t*) malloc((count ? count : 1) * sizeof(*symtab->address));
+  symtab->size    = (uint64_t*) malloc((count ? count : 1) * sizeof(*symtab->size));
+  symtab->name    = (const char**) malloc((count ? count : 1) * sizeof(*symtab->name));
+  symtab->strings = (char*) malloc(strings_size ? strings_size : 1);
+
+  if (symtab->address == NULL || symtab->size == NULL ||
+      symtab->name == NULL || symtab->strings == NULL) {
+    free(sorted);
+    ud_symtab_free(symtab);
+    return -1;
+  }
+
+  p = symtab->strings;
+  n = 0;
+
+  for (i = 0; i < count; ++i) {
+    const char* name = sorted[i]->name ? sorted[i]->name : "";
+    size_t length = strlen(name) + 1;
+
+    if (n > 0 && symtab->address[n - 1] == sorted[i]->address) {
+      continue;
+    }
+
+    memcpy(p, name, length);
+
+    symtab->address[n] = sorted[i]->address;
+    symtab->size[n]    = sorted[i]->size;
+    symtab->name[n]    = p;
+    p += length;
+    ++n;
+  }
+
+  symtab->count = n;
+  free(sorted);
+  return 0;
+}
+
+/* =============================================================================
+ * ud_symtab_free
+ *    Frees the symbol table.
+ * =============================================================================
+ */
+extern void
+ud_symtab_free(struct ud_symtab* symtab)
+{
+  free(symtab->address);
+  free(symtab->size);
+  free((void*) symtab->name);
+  free(symtab->strings);
+  memset(symtab, 0, sizeof(*symtab));
+}
+
+/* =============================================================================
+ * ud_symtab_lookup
+ *    Finds the symbol containing "addr". Returns its name and fills the
+ *    offset from its start, or returns NULL if there is no such symbol.
+ *
+ *    "hint" (may be NULL) is the index of the previously found symbol - it's
+ *    checked first, since consecutive lookups (branches within the same
+ *    function) mostly hit the same symbol. It's updated on success.
+ * =============================================================================
+ */
+extern const char*
+ud_symtab_lookup(const struct ud_symtab* symtab, uint64_t addr, int64_t *offset, size_t *hint)
+{
+  const uint64_t* address = symtab->address;
+  const uint64_t* base;
+  size_t count = symtab->count;
+  size_t index;
+
+  if (count == 0) {
+    return NULL;
+  }
+
+  if (hint != NULL && *hint < count &&
+      address[*hint] <= addr &&
+      (*hint + 1 == count || addr < address[*hint + 1])) {
+    index = *hint;
+  } else {
+    /*
+     * Branch-free binary search - the loop runs exactly log2(count) times
+     * and the comparison compiles to a conditional move.
+     */
+    base = address;
+    while (count > 1) {
+      size_t half = count / 2;
+      base = (base[half] <= addr) ? base + half : base;
+      count -= half;
+    }
+
+    if (*base > addr) {
+      return NULL;
+    }
+
+    index = (size_t) (base - address);
+  }
+
+  if (symtab->size[index] != 0 && addr - address[index] >= symtab->size[index]) {
+    return NULL;
+  }
+
+  if (hint != NULL) {
+    *hint = index;
+  }
+
+  *offset = (int64_t) (addr - address[index]);
+  return symtab->name[index];
+}
+
+static const char*
+ud_symtab_resolver(struct ud* u, uint64_t addr, int64_t *offset)
+{
+  if (u->symtab == NULL) {
+    return NULL;
+  }
+
+  return ud_symtab_lookup(u->symtab, addr, offset, &u->symtab_last_hit);
+}
+
+/* =============================================================================
+ * ud_set_symtab
+ *    Sets the built-in symbol resolver, which resolves relative targets
+ *    using the symbol table. The table must outlive the ud_t and may be
+ *    shared by more ud_t objects (e.g. on multiple threads). Passing NULL
+ *    resets symbol resolution.
+ * =============================================================================
+ */
+extern void
+ud_set_symtab(struct ud* u, const struct ud_symtab* symtab)
+{
+  u->symtab = symtab;
+  u->symtab_last_hit = 0;
+  ud_set_sym_resolver(u, symtab ? &ud_symtab_resolver : NULL);
+}
+
+#endif /* !__UD_STANDALONE__ */
+
+/*
+vim: set ts=2 sw=2 expandtab
+*/
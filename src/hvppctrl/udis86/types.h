@@ -160,6 +160,29 @@ struct ud_operand {
   uint8_t         _oprcode;
 };
 
+/* -----------------------------------------------------------------------------
+ * struct ud_symtab - Sorted symbol table (see ud_symtab_init()).
+ *
+ * Addresses, sizes and names are kept in separate arrays, so the binary
+ * search touches only the (densely packed) addresses.
+ * -----------------------------------------------------------------------------
+ */
+struct ud_symbol
+{
+  uint64_t    address;
+  uint64_t    size;     /* 0 if unknown - symbol then spans up to the next one */
+  const char* name;
+};
+
+struct ud_symtab
+{
+  uint64_t*     address;
+  uint64_t*     size;
+  const char**  name;
+  char*         strings;
+  size_t        count;
+};
+
 /* -----------------------------------------------------------------------------
  * struct ud - The udis86 object.
  * -----------------------------------------------------------------------------
@@ -198,6 +221,13 @@ struct ud
    */
   const char* (*sym_resolver)(struct ud*, uint64_t addr, int64_t *offset);
 
+  /*
+   * Symbol table used by the built-in resolver (see ud_set_symtab()) and
+   * index of the last symbol it has found.
+   */
+  const struct ud_symtab* symtab;
+  size_t    symtab_last_hit;
+
   uint8_t   dis_mode;
   uint64_t  pc;
   uint8_t   vendor;
@@ -225,6 +255,66 @@ struct ud
   struct ud_lookup_table_list_entry *le;
 };
 
+/* -----------------------------------------------------------------------------
+ * struct ud_index - Instruction index of a buffer (see ud_sweep()).
+ * -----------------------------------------------------------------------------
+ */
+struct ud_index_entry
+{
+  uint32_t  offset;     /* offset of the instruction from start of the buffer */
+  uint16_t  mnemonic;   /* enum ud_mnemonic_code (UD_Iinvalid for bad bytes) */
+  uint8_t   length;
+  uint8_t   reserved;
+};
+
+struct ud_index
+{
+  struct ud_index_entry* entry;
+  size_t    count;
+};
+
+/* -----------------------------------------------------------------------------
+ * struct ud_cfg - Basic blocks and call graph of a buffer (see ud_cfg_build()).
+ *
+ * Blocks are sorted by their start offset. Successors of the block are
+ * stored in succ[succ_begin .. succ_begin + succ_count) as block indices.
+ * -----------------------------------------------------------------------------
+ */
+#define UD_CFG_BLOCK_FUNCTION   0x0001  /* block is a function entry (call target) */
+#define UD_CFG_BLOCK_RETURN     0x0002  /* block ends with ret/iret */
+#define UD_CFG_BLOCK_INDIRECT   0x0004  /* block ends with indirect jmp */
+#define UD_CFG_BLOCK_INVALID    0x0008  /* block ends with invalid instruction */
+
+struct ud_cfg_block
+{
+  uint32_t  begin;      /* offset of the first instruction */
+  uint32_t  end;        /* offset past the last instruction */
+  uint32_t  succ_begin;
+  uint16_t  succ_count;
+  uint16_t  flags;
+};
+
+struct ud_cfg_call
+{
+  uint32_t  site;       /* offset of the call instruction */
+  uint32_t  target;     /* offset of the called function */
+};
+
+struct ud_cfg
+{
+  uint64_t  hash;       /* ud_cfg_hash() of the buffer */
+  uint64_t  pc;
+  uint32_t  size;
+  uint8_t   mode;
+
+  struct ud_cfg_block* block;
+  size_t    block_count;
+  uint32_t* succ;
+  size_t    succ_count;
+  struct ud_cfg_call* call;
+  size_t    call_count;
+};
+
 /* -----------------------------------------------------------------------------
  * Type-definitions
  * -----------------------------------------------------------------------------
@@ -234,6 +324,9 @@ typedef enum ud_mnemonic_code ud_mnemonic_code_t;
 
 typedef struct ud             ud_t;
 typedef struct ud_operand     ud_operand_t;
+typedef struct ud_index       ud_index_t;
+typedef struct ud_cfg         ud_cfg_t;
+typedef struct ud_symtab      ud_symtab_t;
 
 #define UD_SYN_INTEL          ud_translate_intel
 #define UD_SYN_ATT            ud_translate_att
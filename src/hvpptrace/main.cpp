@@ -0,0 +1,1248 @@
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <x86intrin.h> // __rdtsc()
+
+#include "hvpp/trace_codec.h"
+#include "ia32/vmx/exit_reason.h"
+
+//
+// Offline analyzer of binary VM-exit/sample traces (see hvpp/trace_file.h).
+//
+// The trace file is mapped into memory and the records are parsed in place.
+// The record range is split between worker threads, each of which builds
+// its own aggregate; these are merged at the end. Reported are:
+//   - per-exit-reason counts, rates and handler latency percentiles
+//   - top guest RIPs and modules
+//   - per-CR3 (address space) breakdown
+//   - top LBR call paths per exit reason (version 2 records with LBR)
+//
+// With --diff, two captures are analyzed and per-exit-reason rates and
+// latencies are compared.
+//
+// Compact (delta-encoded) traces are decoded on the fly - the chunks are
+// split between the threads, each chunk is decoded from its sync point.
+// With --codec, size of the encoded records and speed of the encoder and
+// the decoder are measured (fixed-size traces are encoded in memory
+// first); --compact converts fixed-size trace into the compact one.
+//
+
+using namespace hvpp;
+
+namespace analyzer {
+
+static constexpr int exit_reason_count = 80;
+
+//
+// Latency histogram - 4 sub-buckets per power of 2 (~19% resolution).
+//
+static constexpr int histogram_size = 64 * 4;
+
+static int histogram_index(uint64_t ticks) noexcept
+{
+  if (ticks < 4)
+  {
+    return static_cast<int>(ticks);
+  }
+
+  int msb = 63 - __builtin_clzll(ticks);
+  int sub = static_cast<int>((ticks >> (msb - 2)) & 3);
+  return msb * 4 + sub;
+}
+
+static uint64_t histogram_upper_bound(int index) noexcept
+{
+  if (index < 4)
+  {
+    return static_cast<uint64_t>(index);
+  }
+
+  int msb = index / 4;
+  int sub = index % 4;
+  return ((4ull + sub + 1) << (msb - 2)) - 1;
+}
+
+enum class format_t
+{
+  text,
+  csv,
+  json,
+};
+
+struct counter_t
+{
+  uint64_t vmexits;
+  uint64_t samples;
+  uint64_t handler_ticks;
+};
+
+struct reason_stats_t
+{
+  uint64_t count;
+  uint64_t handler_ticks;
+  uint64_t histogram[histogram_size];
+};
+
+struct cr3_stats_t
+{
+  counter_t counter;
+  uint64_t  reason_count[exit_reason_count];
+};
+
+//
+// VM-exits with the same exit reason, RIP and LBR sources.
+//
+struct lbr_path_t
+{
+  uint64_t count;
+  uint64_t rip;
+  uint32_t exit_reason;
+  uint32_t lbr_count;
+  uint64_t from[trace_file::max_lbr_count];
+};
+
+struct aggregate_t
+{
+  uint64_t                                  record_count = 0;
+  uint64_t                                  sample_count = 0;
+  uint64_t                                  min_tsc = UINT64_MAX;
+  uint64_t                                  max_tsc = 0;
+  std::vector<reason_stats_t>               reason = std::vector<reason_stats_t>(exit_reason_count);
+  std::unordered_map<uint64_t, counter_t>   rip;
+  std::unordered_map<uint32_t, counter_t>   module;
+  std::unordered_map<uint64_t, cr3_stats_t> cr3;
+  std::unordered_map<uint64_t, lbr_path_t>  lbr_path;
+
+  void merge(const aggregate_t& other) noexcept;
+};
+
+struct trace_t
+{
+  std::string                      path;
+  const uint8_t*                   base = nullptr;
+  size_t                           size = 0;
+  const trace_file::file_header_t* header = nullptr;
+  const module_map::module_t*      modules = nullptr;
+  uint32_t                         module_count = 0;
+  const uint8_t*                   records = nullptr;
+  uint64_t                         record_count = 0;
+  uint32_t                         record_size = 0;
+  bool                             has_lbr = false;
+
+  //
+  // Compact traces - records are chunks (record_size == chunk_size) and
+  // record_count is known only after the analysis.
+  //
+  bool                             compact = false;
+  uint64_t                         chunk_count = 0;
+  uint64_t                         corrupted_chunk_count = 0;
+
+  aggregate_t                      aggregate;
+
+  bool open(const char* file_path) noexcept;
+  void close() noexcept;
+  void analyze(unsigned thread_count) noexcept;
+
+  double seconds() const noexcept;
+  double ticks_to_ns(uint64_t ticks) const noexcept;
+  uint64_t percentile(int reason, double fraction) const noexcept;
+  const char* module_name(uint32_t module_id) const noexcept;
+  std::string location(uint64_t address) const noexcept;
+};
+
+struct options_t
+{
+  format_t    format = format_t::text;
+  unsigned    thread_count = 0;
+  int         top = 20;
+  const char* diff_path = nullptr;
+  const char* compact_path = nullptr;
+  bool        codec = false;
+};
+
+static const char* reason_to_string(int reason) noexcept
+{
+  const char* result = ia32::vmx::exit_reason_to_string(static_cast<ia32::vmx::exit_reason>(reason));
+  return result ? result : "unknown";
+}
+
+void aggregate_t::merge(const aggregate_t& other) noexcept
+{
+  record_count += other.record_count;
+  sample_count += other.sample_count;
+  min_tsc = std::min(min_tsc, other.min_tsc);
+  max_tsc = std::max(max_tsc, other.max_tsc);
+
+  for (int r = 0; r < exit_reason_count; ++r)
+  {
+    reason[r].count += other.reason[r].count;
+    reason[r].handler_ticks += other.reason[r].handler_ticks;
+
+    for (int i = 0; i < histogram_size; ++i)
+    {
+      reason[r].histogram[i] += other.reason[r].histogram[i];
+    }
+  }
+
+  auto merge_counter = [](counter_t& to, const counter_t& from) noexcept {
+    to.vmexits += from.vmexits;
+    to.samples += from.samples;
+    to.handler_ticks += from.handler_ticks;
+  };
+
+  for (auto& [key, value] : other.rip)
+  {
+    merge_counter(rip[key], value);
+  }
+
+  for (auto& [key, value] : other.module)
+  {
+    merge_counter(module[key], value);
+  }
+
+  for (auto& [key, value] : other.cr3)
+  {
+    auto& entry = cr3[key];
+    merge_counter(entry.counter, value.counter);
+
+    for (int r = 0; r < exit_reason_count; ++r)
+    {
+      entry.reason_count[r] += value.reason_count[r];
+    }
+  }
+
+  for (auto& [key, value] : other.lbr_path)
+  {
+    auto [it, inserted] = lbr_path.emplace(key, value);
+    if (!inserted)
+    {
+      it->second.count += value.count;
+    }
+  }
+}
+
+bool trace_t::open(const char* file_path) noexcept
+{
+  path = file_path;
+
+  int fd = ::open(file_path, O_RDONLY);
+  if (fd < 0)
+  {
+    fprintf(stderr, "%s: cannot open\n", file_path);
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(trace_file::file_header_t))
+  {
+    fprintf(stderr, "%s: file too small\n", file_path);
+    ::close(fd);
+    return false;
+  }
+
+  size = static_cast<size_t>(st.st_size);
+
+  void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+
+  if (mapping == MAP_FAILED)
+  {
+    fprintf(stderr, "%s: mmap failed\n", file_path);
+    return false;
+  }
+
+  //
+  // Records are read once, front to back (per thread).
+  //
+  madvise(mapping, size, MADV_SEQUENTIAL);
+
+  base = reinterpret_cast<const uint8_t*>(mapping);
+  header = reinterpret_cast<const trace_file::file_header_t*>(base);
+
+  compact = header->magic == trace_file::compact_magic;
+
+  if (header->magic != trace_file::magic && !compact)
+  {
+    fprintf(stderr, "%s: not a hvpp trace file\n", file_path);
+    return false;
+  }
+
+  if (compact)
+  {
+    //
+    // Unlike the records, the encoding can't be extended compatibly.
+    //
+    if (header->version != trace_file::compact_version ||
+        header->record_size != trace_file::chunk_size)
+    {
+      fprintf(stderr, "%s: unsupported compact trace version %u\n", file_path, header->version);
+      return false;
+    }
+  }
+  else if (header->version > trace_file::version)
+  {
+    //
+    // Newer versions only append fields to the record - we can still read
+    // the ones we know about.
+    //
+    fprintf(stderr, "%s: warning: trace version %u is newer than %u\n",
+            file_path, header->version, trace_file::version);
+  }
+
+  record_size = header->record_size;
+
+  //
+  // Version 1 records don't have LBR fields.
+  //
+  // The module table is checked without any multiplication or addition,
+  // which could wrap around.
+  //
+  if (record_size < trace_file::record_v1_size ||
+      header->record_offset > size ||
+      header->module_offset > size ||
+      header->module_count > (size - header->module_offset) / sizeof(module_map::module_t))
+  {
+    fprintf(stderr, "%s: corrupted header\n", file_path);
+    return false;
+  }
+
+  modules = reinterpret_cast<const module_map::module_t*>(base + header->module_offset);
+  module_count = header->module_count;
+  records = base + header->record_offset;
+  has_lbr = compact || record_size >= sizeof(trace_file::record_t);
+  record_count = (size - header->record_offset) / record_size;
+
+  if (header->record_count && header->record_count < record_count)
+  {
+    record_count = header->record_count;
+  }
+
+  if (compact)
+  {
+    chunk_count = record_count;
+    record_count = 0;
+  }
+
+  return true;
+}
+
+void trace_t::close() noexcept
+{
+  if (base)
+  {
+    munmap(const_cast<uint8_t*>(base), size);
+    base = nullptr;
+  }
+}
+
+//
+// Paths are keyed by FNV-1a hash of (exit reason, RIP, LBR sources) -
+// collisions are unlikely enough to be ignored.
+//
+static void add_lbr_path(aggregate_t& aggregate, const trace_file::record_t& record, int reason) noexcept
+{
+  uint32_t lbr_count = std::min<uint32_t>(record.lbr_count, trace_file::max_lbr_count);
+
+  uint64_t hash = 0xcbf29ce484222325;
+  auto mix = [&hash](uint64_t value) noexcept {
+    hash = (hash ^ value) * 0x100000001b3;
+  };
+
+  mix(static_cast<uint64_t>(reason));
+  mix(record.rip);
+  for (uint32_t i = 0; i < lbr_count; ++i)
+  {
+    mix(record.lbr[i].from);
+  }
+
+  auto& path = aggregate.lbr_path[hash];
+
+  if (!path.count)
+  {
+    path.rip = record.rip;
+    path.exit_reason = static_cast<uint32_t>(reason);
+    path.lbr_count = lbr_count;
+
+    for (uint32_t i = 0; i < lbr_count; ++i)
+    {
+      path.from[i] = record.lbr[i].from;
+    }
+  }
+
+  path.count += 1;
+}
+
+static void add_record(aggregate_t& result, const trace_file::record_t& record, bool has_lbr) noexcept
+{
+  result.min_tsc = std::min(result.min_tsc, record.tsc);
+  result.max_tsc = std::max(result.max_tsc, record.tsc);
+
+  bool is_vmexit = record.type == trace_file::record_type::vmexit;
+
+  counter_t increment = {
+    is_vmexit ? 1u : 0u,
+    is_vmexit ? 0u : 1u,
+    record.handler_ticks
+  };
+
+  auto add = [&increment](counter_t& counter) noexcept {
+    counter.vmexits += increment.vmexits;
+    counter.samples += increment.samples;
+    counter.handler_ticks += increment.handler_ticks;
+  };
+
+  add(result.rip[record.rip]);
+  add(result.module[record.module_id]);
+
+  auto& cr3 = result.cr3[record.cr3];
+  add(cr3.counter);
+
+  if (is_vmexit)
+  {
+    int reason = record.exit_reason < exit_reason_count ? record.exit_reason : exit_reason_count - 1;
+
+    result.record_count += 1;
+    result.reason[reason].count += 1;
+    result.reason[reason].handler_ticks += record.handler_ticks;
+    result.reason[reason].histogram[histogram_index(record.handler_ticks)] += 1;
+
+    cr3.reason_count[reason] += 1;
+
+    if (has_lbr && (record.flags & trace_file::flag_lbr))
+    {
+      add_lbr_path(result, record, reason);
+    }
+  }
+  else
+  {
+    result.sample_count += 1;
+  }
+}
+
+void trace_t::analyze(unsigned thread_count) noexcept
+{
+  //
+  // Single pass over the records - each thread takes contiguous range
+  // (of records or chunks) and aggregates into its own aggregate_t.
+  //
+  std::vector<aggregate_t> partial(thread_count);
+  std::vector<uint64_t> corrupted(thread_count);
+  std::vector<std::thread> threads;
+
+  uint64_t count = compact ? chunk_count : record_count;
+  uint64_t chunk = (count + thread_count - 1) / thread_count;
+
+  for (unsigned t = 0; t < thread_count; ++t)
+  {
+    threads.emplace_back([this, &partial, &corrupted, t, count, chunk]() noexcept {
+      auto& result = partial[t];
+
+      uint64_t begin = std::min<uint64_t>(t * chunk, count);
+      uint64_t end   = std::min<uint64_t>(begin + chunk, count);
+
+      if (compact)
+      {
+        trace_file::compact_decoder_t decoder(modules, module_count);
+
+        for (uint64_t i = begin; i < end; ++i)
+        {
+          auto header = reinterpret_cast<const trace_file::chunk_header_t*>(records + i * record_size);
+
+          auto decoded = decoder.decode(header, [&result](const trace_file::record_t& record) noexcept {
+            add_record(result, record, true);
+          });
+
+          if (decoded != header->record_count)
+          {
+            corrupted[t] += 1;
+          }
+        }
+
+        return;
+      }
+
+      //
+      // Version 1 records are shorter than record_t - copy them into a
+      // zeroed record instead of reading past them.
+      //
+      for (uint64_t i = begin; i < end; ++i)
+      {
+        trace_file::record_t record{};
+        memcpy(&record, records + i * record_size, std::min<size_t>(record_size, sizeof(record)));
+
+        add_record(result, record, has_lbr);
+      }
+    });
+  }
+
+  for (auto& thread : threads)
+  {
+    thread.join();
+  }
+
+  for (unsigned t = 0; t < thread_count; ++t)
+  {
+    aggregate.merge(partial[t]);
+    corrupted_chunk_count += corrupted[t];
+  }
+
+  if (compact)
+  {
+    record_count = aggregate.record_count + aggregate.sample_count;
+
+    if (corrupted_chunk_count)
+    {
+      fprintf(stderr, "%s: warning: %llu corrupted chunks (decoded partially)\n",
+              path.c_str(), static_cast<unsigned long long>(corrupted_chunk_count));
+    }
+  }
+}
+
+double trace_t::seconds() const noexcept
+{
+  if (!header->tsc_frequency || aggregate.max_tsc <= aggregate.min_tsc)
+  {
+    return 0.0;
+  }
+
+  return static_cast<double>(aggregate.max_tsc - aggregate.min_tsc) / static_cast<double>(header->tsc_frequency);
+}
+
+double trace_t::ticks_to_ns(uint64_t ticks) const noexcept
+{
+  return header->tsc_frequency
+    ? static_cast<double>(ticks) * 1e9 / static_cast<double>(header->tsc_frequency)
+    : static_cast<double>(ticks);
+}
+
+uint64_t trace_t::percentile(int reason, double fraction) const noexcept
+{
+  auto& stats = aggregate.reason[reason];
+  uint64_t threshold = static_cast<uint64_t>(static_cast<double>(stats.count) * fraction + 0.5);
+  uint64_t cumulative = 0;
+
+  for (int i = 0; i < histogram_size; ++i)
+  {
+    cumulative += stats.histogram[i];
+
+    if (cumulative >= threshold && cumulative > 0)
+    {
+      return histogram_upper_bound(i);
+    }
+  }
+
+  return 0;
+}
+
+const char* trace_t::module_name(uint32_t module_id) const noexcept
+{
+  static thread_local char buffer[module_map::max_name_length + 1];
+
+  if (module_id >= module_count)
+  {
+    return "<unknown>";
+  }
+
+  memcpy(buffer, modules[module_id].name, module_map::max_name_length);
+  buffer[module_map::max_name_length] = '\0';
+  return buffer;
+}
+
+std::string trace_t::location(uint64_t address) const noexcept
+{
+  //
+  // Any module which contains the address will do (unless the module has
+  // been unloaded and another one loaded at the same address - rare enough
+  // to ignore here).
+  //
+  const char* name = "<unknown>";
+  uint64_t offset = address;
+
+  for (uint32_t m = 0; m < module_count; ++m)
+  {
+    if (address - modules[m].base < modules[m].size)
+    {
+      name = module_name(m);
+      offset = address - modules[m].base;
+      break;
+    }
+  }
+
+  char buffer[64];
+  snprintf(buffer, sizeof(buffer), "%s+0x%llx", name, static_cast<unsigned long long>(offset));
+  return buffer;
+}
+
+//
+// Returns (at most) "count" entries of the map sorted by descending number
+// of records.
+//
+template <typename TKey, typename TValue, typename TCountFn>
+static std::vector<std::pair<TKey, TValue>> top(const std::unordered_map<TKey, TValue>& map, int count, TCountFn count_fn) noexcept
+{
+  std::vector<std::pair<TKey, TValue>> result(map.begin(), map.end());
+
+  auto middle = result.begin() + std::min<size_t>(count, result.size());
+  std::partial_sort(result.begin(), middle, result.end(), [&](auto& lhs, auto& rhs) {
+    return count_fn(lhs.second) > count_fn(rhs.second);
+  });
+
+  result.erase(middle, result.end());
+  return result;
+}
+
+static uint64_t counter_total(const counter_t& counter) noexcept
+{
+  return counter.vmexits + counter.samples;
+}
+
+static void print_text(const trace_t& trace, const options_t& options) noexcept
+{
+  auto& aggregate = trace.aggregate;
+  double seconds = trace.seconds();
+
+  printf("file: %s\n", trace.path.c_str());
+  printf("version: %u%s  cpus: %u  tsc: %.3f GHz  modules: %u\n",
+         trace.header->version,
+         trace.compact ? " (compact)" : "",
+         trace.header->cpu_count,
+         static_cast<double>(trace.header->tsc_frequency) / 1e9,
+         trace.module_count);
+  printf("records: %llu (vmexits: %llu, samples: %llu)  duration: %.3f s\n\n",
+         static_cast<unsigned long long>(trace.record_count),
+         static_cast<unsigned long long>(aggregate.record_count),
+         static_cast<unsigned long long>(aggregate.sample_count),
+         seconds);
+
+  printf("%-32s %12s %12s %10s %10s %10s %10s\n",
+         "exit reason", "count", "rate/s", "avg ns", "p50 ns", "p99 ns", "p99.9 ns");
+
+  for (int r = 0; r < exit_reason_count; ++r)
+  {
+    auto& stats = aggregate.reason[r];
+    if (!stats.count)
+    {
+      continue;
+    }
+
+    printf("%-32s %12llu %12.1f %10.1f %10.1f %10.1f %10.1f\n",
+           reason_to_string(r),
+           static_cast<unsigned long long>(stats.count),
+           seconds > 0.0 ? static_cast<double>(stats.count) / seconds : 0.0,
+           trace.ticks_to_ns(stats.handler_ticks / stats.count),
+           trace.ticks_to_ns(trace.percentile(r, 0.50)),
+           trace.ticks_to_ns(trace.percentile(r, 0.99)),
+           trace.ticks_to_ns(trace.percentile(r, 0.999)));
+  }
+
+  printf("\n%-18s %-32s %12s %12s %14s\n", "rip", "module", "vmexits", "samples", "handler ms");
+
+  for (auto& [rip, counter] : top(aggregate.rip, options.top, counter_total))
+  {
+    printf("0x%016llx %-32s %12llu %12llu %14.3f\n",
+           static_cast<unsigned long long>(rip),
+           trace.location(rip).c_str(),
+           static_cast<unsigned long long>(counter.vmexits),
+           static_cast<unsigned long long>(counter.samples),
+           trace.ticks_to_ns(counter.handler_ticks) / 1e6);
+  }
+
+  printf("\n%-32s %12s %12s %14s\n", "module", "vmexits", "samples", "handler ms");
+
+  for (auto& [module_id, counter] : top(aggregate.module, options.top, counter_total))
+  {
+    printf("%-32s %12llu %12llu %14.3f\n",
+           trace.module_name(module_id),
+           static_cast<unsigned long long>(counter.vmexits),
+           static_cast<unsigned long long>(counter.samples),
+           trace.ticks_to_ns(counter.handler_ticks) / 1e6);
+  }
+
+  printf("\n%-18s %12s %12s %14s  %s\n", "cr3", "vmexits", "samples", "handler ms", "top exit reasons");
+
+  for (auto& [cr3, stats] : top(aggregate.cr3, options.top, [](auto& value) { return counter_total(value.counter); }))
+  {
+    printf("0x%016llx %12llu %12llu %14.3f ",
+           static_cast<unsigned long long>(cr3),
+           static_cast<unsigned long long>(stats.counter.vmexits),
+           static_cast<unsigned long long>(stats.counter.samples),
+           trace.ticks_to_ns(stats.counter.handler_ticks) / 1e6);
+
+    //
+    // Three most frequent exit reasons of this address space.
+    //
+    int order[exit_reason_count];
+    for (int r = 0; r < exit_reason_count; ++r)
+    {
+      order[r] = r;
+    }
+
+    std::partial_sort(order, order + 3, order + exit_reason_count, [&stats](int lhs, int rhs) {
+      return stats.reason_count[lhs] > stats.reason_count[rhs];
+    });
+
+    for (int i = 0; i < 3 && stats.reason_count[order[i]]; ++i)
+    {
+      printf(" %s(%llu)", reason_to_string(order[i]), static_cast<unsigned long long>(stats.reason_count[order[i]]));
+    }
+
+    printf("\n");
+  }
+
+  if (aggregate.lbr_path.empty())
+  {
+    return;
+  }
+
+  //
+  // Call paths are printed from the VM-exit RIP back to the oldest branch
+  // source.
+  //
+  printf("\n%-32s %12s  %s\n", "exit reason", "count", "lbr call path");
+
+  for (auto& [hash, path] : top(aggregate.lbr_path, options.top, [](auto& value) { return value.count; }))
+  {
+    printf("%-32s %12llu  %s",
+           reason_to_string(path.exit_reason),
+           static_cast<unsigned long long>(path.count),
+           trace.location(path.rip).c_str());
+
+    for (uint32_t i = 0; i < path.lbr_count; ++i)
+    {
+      printf(" <- %s", trace.location(path.from[i]).c_str());
+    }
+
+    printf("\n");
+  }
+}
+
+static void print_csv(const trace_t& trace, const options_t& options) noexcept
+{
+  auto& aggregate = trace.aggregate;
+  double seconds = trace.seconds();
+
+  printf("section,key,name,vmexits,samples,rate,handler_ns,p50_ns,p99_ns,p999_ns\n");
+
+  for (int r = 0; r < exit_reason_count; ++r)
+  {
+    auto& stats = aggregate.reason[r];
+    if (!stats.count)
+    {
+      continue;
+    }
+
+    printf("reason,%d,%s,%llu,0,%.3f,%.1f,%.1f,%.1f,%.1f\n",
+           r,
+           reason_to_string(r),
+           static_cast<unsigned long long>(stats.count),
+           seconds > 0.0 ? static_cast<double>(stats.count) / seconds : 0.0,
+           trace.ticks_to_ns(stats.handler_ticks),
+           trace.ticks_to_ns(trace.percentile(r, 0.50)),
+           trace.ticks_to_ns(trace.percentile(r, 0.99)),
+           trace.ticks_to_ns(trace.percentile(r, 0.999)));
+  }
+
+  for (auto& [rip, counter] : top(aggregate.rip, options.top, counter_total))
+  {
+    printf("rip,0x%llx,,%llu,%llu,,%.1f,,,\n",
+           static_cast<unsigned long long>(rip),
+           static_cast<unsigned long long>(counter.vmexits),
+           static_cast<unsigned long long>(counter.samples),
+           trace.ticks_to_ns(counter.handler_ticks));
+  }
+
+  for (auto& [module_id, counter] : top(aggregate.module, options.top, counter_total))
+  {
+    printf("module,%u,%s,%llu,%llu,,%.1f,,,\n",
+           module_id,
+           trace.module_name(module_id),
+           static_cast<unsigned long long>(counter.vmexits),
+           static_cast<unsigned long long>(counter.samples),
+           trace.ticks_to_ns(counter.handler_ticks));
+  }
+
+  for (auto& [cr3, stats] : top(aggregate.cr3, options.top, [](auto& value) { return counter_total(value.counter); }))
+  {
+    printf("cr3,0x%llx,,%llu,%llu,,%.1f,,,\n",
+           static_cast<unsigned long long>(cr3),
+           static_cast<unsigned long long>(stats.counter.vmexits),
+           static_cast<unsigned long long>(stats.counter.samples),
+           trace.ticks_to_ns(stats.counter.handler_ticks));
+  }
+}
+
+static void print_json(const trace_t& trace, const options_t& options) noexcept
+{
+  auto& aggregate = trace.aggregate;
+  double seconds = trace.seconds();
+
+  printf("{\n");
+  printf("  \"file\": \"%s\",\n", trace.path.c_str());
+  printf("  \"version\": %u,\n", trace.header->version);
+  printf("  \"cpu_count\": %u,\n", trace.header->cpu_count);
+  printf("  \"tsc_frequency\": %llu,\n", static_cast<unsigned long long>(trace.header->tsc_frequency));
+  printf("  \"duration_s\": %.6f,\n", seconds);
+  printf("  \"vmexits\": %llu,\n", static_cast<unsigned long long>(aggregate.record_count));
+  printf("  \"samples\": %llu,\n", static_cast<unsigned long long>(aggregate.sample_count));
+
+  const char* separator = "";
+
+  printf("  \"reasons\": [");
+  for (int r = 0; r < exit_reason_count; ++r)
+  {
+    auto& stats = aggregate.reason[r];
+    if (!stats.count)
+    {
+      continue;
+    }
+
+    printf("%s\n    { \"reason\": %d, \"name\": \"%s\", \"count\": %llu, \"rate\": %.3f, "
+           "\"handler_ns\": %.1f, \"p50_ns\": %.1f, \"p99_ns\": %.1f, \"p999_ns\": %.1f }",
+           separator,
+           r,
+           reason_to_string(r),
+           static_cast<unsigned long long>(stats.count),
+           seconds > 0.0 ? static_cast<double>(stats.count) / seconds : 0.0,
+           trace.ticks_to_ns(stats.handler_ticks),
+           trace.ticks_to_ns(trace.percentile(r, 0.50)),
+           trace.ticks_to_ns(trace.percentile(r, 0.99)),
+           trace.ticks_to_ns(trace.percentile(r, 0.999)));
+    separator = ",";
+  }
+  printf("\n  ],\n");
+
+  separator = "";
+  printf("  \"rips\": [");
+  for (auto& [rip, counter] : top(aggregate.rip, options.top, counter_total))
+  {
+    printf("%s\n    { \"rip\": \"0x%llx\", \"vmexits\": %llu, \"samples\": %llu, \"handler_ns\": %.1f }",
+           separator,
+           static_cast<unsigned long long>(rip),
+           static_cast<unsigned long long>(counter.vmexits),
+           static_cast<unsigned long long>(counter.samples),
+           trace.ticks_to_ns(counter.handler_ticks));
+    separator = ",";
+  }
+  printf("\n  ],\n");
+
+  separator = "";
+  printf("  \"modules\": [");
+  for (auto& [module_id, counter] : top(aggregate.module, options.top, counter_total))
+  {
+    printf("%s\n    { \"module\": \"%s\", \"vmexits\": %llu, \"samples\": %llu, \"handler_ns\": %.1f }",
+           separator,
+           trace.module_name(module_id),
+           static_cast<unsigned long long>(counter.vmexits),
+           static_cast<unsigned long long>(counter.samples),
+           trace.ticks_to_ns(counter.handler_ticks));
+    separator = ",";
+  }
+  printf("\n  ],\n");
+
+  separator = "";
+  printf("  \"cr3\": [");
+  for (auto& [cr3, stats] : top(aggregate.cr3, options.top, [](auto& value) { return counter_total(value.counter); }))
+  {
+    printf("%s\n    { \"cr3\": \"0x%llx\", \"vmexits\": %llu, \"samples\": %llu, \"handler_ns\": %.1f }",
+           separator,
+           static_cast<unsigned long long>(cr3),
+           static_cast<unsigned long long>(stats.counter.vmexits),
+           static_cast<unsigned long long>(stats.counter.samples),
+           trace.ticks_to_ns(stats.counter.handler_ticks));
+    separator = ",";
+  }
+  printf("\n  ]\n");
+  printf("}\n");
+}
+
+//
+// Compares per-exit-reason rates and latencies of two captures.
+//
+static void print_diff(const trace_t& a, const trace_t& b, const options_t& options) noexcept
+{
+  double seconds_a = a.seconds();
+  double seconds_b = b.seconds();
+
+  auto rate = [](const trace_t& trace, double seconds, int r) noexcept {
+    return seconds > 0.0 ? static_cast<double>(trace.aggregate.reason[r].count) / seconds : 0.0;
+  };
+
+  auto delta = [](double before, double after) noexcept {
+    return before > 0.0 ? (after - before) / before * 100.0 : 0.0;
+  };
+
+  switch (options.format)
+  {
+    case format_t::text:
+      printf("a: %s (%.3f s)\nb: %s (%.3f s)\n\n", a.path.c_str(), seconds_a, b.path.c_str(), seconds_b);
+      printf("%-32s %12s %12s %9s %10s %10s %9s\n",
+             "exit reason", "rate/s a", "rate/s b", "delta %", "p99 ns a", "p99 ns b", "delta %");
+      break;
+
+    case format_t::csv:
+      printf("reason,name,rate_a,rate_b,rate_delta_pct,p99_ns_a,p99_ns_b,p99_delta_pct\n");
+      break;
+
+    case format_t::json:
+      printf("{\n  \"a\": \"%s\",\n  \"b\": \"%s\",\n  \"reasons\": [", a.path.c_str(), b.path.c_str());
+      break;
+  }
+
+  const char* separator = "";
+
+  for (int r = 0; r < exit_reason_count; ++r)
+  {
+    if (!a.aggregate.reason[r].count && !b.aggregate.reason[r].count)
+    {
+      continue;
+    }
+
+    double rate_a = rate(a, seconds_a, r);
+    double rate_b = rate(b, seconds_b, r);
+    double p99_a  = a.ticks_to_ns(a.percentile(r, 0.99));
+    double p99_b  = b.ticks_to_ns(b.percentile(r, 0.99));
+
+    switch (options.format)
+    {
+      case format_t::text:
+        printf("%-32s %12.1f %12.1f %+9.1f %10.1f %10.1f %+9.1f\n",
+               reason_to_string(r), rate_a, rate_b, delta(rate_a, rate_b), p99_a, p99_b, delta(p99_a, p99_b));
+        break;
+
+      case format_t::csv:
+        printf("%d,%s,%.3f,%.3f,%.2f,%.1f,%.1f,%.2f\n",
+               r, reason_to_string(r), rate_a, rate_b, delta(rate_a, rate_b), p99_a, p99_b, delta(p99_a, p99_b));
+        break;
+
+      case format_t::json:
+        printf("%s\n    { \"reason\": %d, \"name\": \"%s\", \"rate_a\": %.3f, \"rate_b\": %.3f, "
+               "\"rate_delta_pct\": %.2f, \"p99_ns_a\": %.1f, \"p99_ns_b\": %.1f, \"p99_delta_pct\": %.2f }",
+               separator, r, reason_to_string(r), rate_a, rate_b, delta(rate_a, rate_b), p99_a, p99_b, delta(p99_a, p99_b));
+        separator = ",";
+        break;
+    }
+  }
+
+  if (options.format == format_t::json)
+  {
+    printf("\n  ]\n}\n");
+  }
+}
+
+//
+// Chunks of the fixed-size trace encoded in memory. Each chunk is allocated
+// separately - the encoder keeps pointer to its current chunk.
+//
+struct encoded_trace_t
+{
+  std::vector<std::unique_ptr<uint8_t[]>> chunks;
+  uint64_t                                encode_ticks = 0;
+};
+
+static void encode(const trace_t& trace, encoded_trace_t& result) noexcept
+{
+  //
+  // Records of single chunk must belong to the same CPU - each CPU has its
+  // own encoder.
+  //
+  struct cpu_state_t
+  {
+    trace_file::compact_encoder_t encoder;
+    uint64_t                      sequence = 0;
+  };
+
+  std::unordered_map<uint16_t, cpu_state_t> cpu;
+
+  for (uint64_t i = 0; i < trace.record_count; ++i)
+  {
+    //
+    // Version 1 records are shorter than record_t.
+    //
+    trace_file::record_t record{};
+    memcpy(&record, trace.records + i * trace.record_size, std::min<size_t>(trace.record_size, sizeof(record)));
+
+    auto& state = cpu[record.cpu_index];
+
+    //
+    // Measured the same way as in vmexit_stats_handler::update_compact_trace().
+    //
+    auto tsc_begin = __rdtsc();
+
+    if (!state.encoder.encode(record))
+    {
+      result.chunks.emplace_back(new uint8_t[trace_file::chunk_size]());
+
+      state.encoder.begin(reinterpret_cast<trace_file::chunk_header_t*>(result.chunks.back().get()),
+                          state.sequence++, record);
+      state.encoder.encode(record);
+    }
+
+    result.encode_ticks += __rdtsc() - tsc_begin;
+  }
+}
+
+//
+// Prints size of the encoded records and throughput of the encoder (for
+// fixed-size traces) and of the decoder (single thread, without analysis).
+//
+static void print_codec(const trace_t& trace) noexcept
+{
+  encoded_trace_t encoded;
+  std::vector<const trace_file::chunk_header_t*> chunks;
+
+  if (trace.compact)
+  {
+    for (uint64_t i = 0; i < trace.chunk_count; ++i)
+    {
+      chunks.push_back(reinterpret_cast<const trace_file::chunk_header_t*>(trace.records + i * trace.record_size));
+    }
+  }
+  else
+  {
+    encode(trace, encoded);
+
+    for (auto& chunk : encoded.chunks)
+    {
+      chunks.push_back(reinterpret_cast<const trace_file::chunk_header_t*>(chunk.get()));
+    }
+  }
+
+  uint64_t encoded_size = 0;
+  uint64_t record_count = 0;
+  uint64_t checksum = 0;
+
+  trace_file::compact_decoder_t decoder(trace.modules, trace.module_count);
+
+  auto begin = std::chrono::steady_clock::now();
+
+  for (auto chunk : chunks)
+  {
+    encoded_size += sizeof(trace_file::chunk_header_t) + chunk->data_size;
+    record_count += decoder.decode(chunk, [&checksum](const trace_file::record_t& record) noexcept {
+      checksum += record.tsc ^ record.rip;
+    });
+  }
+
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+  auto per_record = [record_count](double value) noexcept {
+    return record_count ? value / static_cast<double>(record_count) : 0.0;
+  };
+
+  printf("file: %s\n", trace.path.c_str());
+  printf("records: %llu  chunks: %zu  checksum: %016llx\n",
+         static_cast<unsigned long long>(record_count),
+         chunks.size(),
+         static_cast<unsigned long long>(checksum));
+  printf("size: %.2f bytes/record (%.2f including chunk padding, record_t: %zu)\n",
+         per_record(static_cast<double>(encoded_size)),
+         per_record(static_cast<double>(chunks.size() * trace_file::chunk_size)),
+         sizeof(trace_file::record_t));
+
+  if (!trace.compact)
+  {
+    printf("encode: %.1f cycles/record\n", per_record(static_cast<double>(encoded.encode_ticks)));
+  }
+
+  printf("decode: %.2f M records/s, %.1f MB/s\n",
+         seconds > 0.0 ? static_cast<double>(record_count) / seconds / 1e6 : 0.0,
+         seconds > 0.0 ? static_cast<double>(chunks.size() * trace_file::chunk_size) / seconds / 1e6 : 0.0);
+}
+
+static bool write_compact(const trace_t& trace, const char* file_path) noexcept
+{
+  if (trace.compact)
+  {
+    fprintf(stderr, "%s: already compact\n", trace.path.c_str());
+    return false;
+  }
+
+  encoded_trace_t encoded;
+  encode(trace, encoded);
+
+  FILE* file = fopen(file_path, "wb");
+  if (!file)
+  {
+    fprintf(stderr, "%s: cannot create\n", file_path);
+    return false;
+  }
+
+  trace_file::file_header_t header = *trace.header;
+  header.magic         = trace_file::compact_magic;
+  header.version       = trace_file::compact_version;
+  header.header_size   = sizeof(header);
+  header.record_size   = trace_file::chunk_size;
+  header.module_offset = sizeof(header);
+  header.record_offset = sizeof(header) + trace.module_count * sizeof(module_map::module_t);
+  header.record_count  = encoded.chunks.size();
+
+  bool result = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                fwrite(trace.modules, sizeof(module_map::module_t), trace.module_count, file) == trace.module_count;
+
+  for (auto& chunk : encoded.chunks)
+  {
+    result = result && fwrite(chunk.get(), trace_file::chunk_size, 1, file) == 1;
+  }
+
+  if (fclose(file) != 0 || !result)
+  {
+    fprintf(stderr, "%s: write failed\n", file_path);
+    return false;
+  }
+
+  printf("%s: %llu records -> %zu chunks (%llu -> %llu bytes)\n",
+         file_path,
+         static_cast<unsigned long long>(trace.record_count),
+         encoded.chunks.size(),
+         static_cast<unsigned long long>(trace.record_count * trace.record_size),
+         static_cast<unsigned long long>(encoded.chunks.size() * trace_file::chunk_size));
+
+  return true;
+}
+
+static void usage(const char* program) noexcept
+{
+  printf("usage: %s [-f text|csv|json] [-j THREADS] [-n TOP] FILE [--diff FILE2]\n", program);
+  printf("       %s FILE --codec | --compact FILE2\n", program);
+  printf("  -f         output format (default: text)\n");
+  printf("  -j         number of worker threads (default: number of CPUs)\n");
+  printf("  -n         number of entries in the top RIP/module/CR3 tables (default: 20)\n");
+  printf("  --diff     compare per-exit-reason rates and latencies with FILE2\n");
+  printf("  --codec    measure size of the delta-encoded records and encoder/decoder speed\n");
+  printf("  --compact  convert fixed-size trace into compact (delta-encoded) FILE2\n");
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+  using namespace analyzer;
+
+  options_t options;
+  const char* path = nullptr;
+
+  for (int i = 1; i < argc; ++i)
+  {
+    const char* arg = argv[i];
+    const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+
+    if (!strcmp(arg, "-f") && value)
+    {
+      if      (!strcmp(value, "text")) options.format = format_t::text;
+      else if (!strcmp(value, "csv"))  options.format = format_t::csv;
+      else if (!strcmp(value, "json")) options.format = format_t::json;
+      else { usage(argv[0]); return 1; }
+      ++i;
+    }
+    else if (!strcmp(arg, "-j") && value)
+    {
+      options.thread_count = static_cast<unsigned>(strtoul(value, nullptr, 10));
+      ++i;
+    }
+    else if (!strcmp(arg, "-n") && value)
+    {
+      options.top = static_cast<int>(strtol(value, nullptr, 10));
+      ++i;
+    }
+    else if (!strcmp(arg, "--diff") && value)
+    {
+      options.diff_path = value;
+      ++i;
+    }
+    else if (!strcmp(arg, "--compact") && value)
+    {
+      options.compact_path = value;
+      ++i;
+    }
+    else if (!strcmp(arg, "--codec"))
+    {
+      options.codec = true;
+    }
+    else if (arg[0] != '-' && !path)
+    {
+      path = arg;
+    }
+    else
+    {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (!path || options.top < 0)
+  {
+    usage(argv[0]);
+    return 1;
+  }
+
+  if (!options.thread_count)
+  {
+    options.thread_count = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  trace_t trace;
+  if (!trace.open(path))
+  {
+    return 1;
+  }
+
+  if (options.codec || options.compact_path)
+  {
+    bool result = true;
+
+    if (options.compact_path)
+    {
+      result = write_compact(trace, options.compact_path);
+    }
+
+    if (result && options.codec)
+    {
+      print_codec(trace);
+    }
+
+    trace.close();
+    return result ? 0 : 1;
+  }
+
+  trace.analyze(options.thread_count);
+
+  if (options.diff_path)
+  {
+    trace_t other;
+    if (!other.open(options.diff_path))
+    {
+      return 1;
+    }
+
+    other.analyze(options.thread_count);
+    print_diff(trace, other, options);
+    other.close();
+  }
+  else
+  {
+    switch (options.format)
+    {
+      case format_t::text: print_text(trace, options); break;
+      case format_t::csv:  print_csv(trace, options); break;
+      case format_t::json: print_json(trace, options); break;
+    }
+  }
+
+  trace.close();
+
+  return 0;
+}
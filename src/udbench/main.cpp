@@ -0,0 +1,658 @@
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <elf.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "udis86/udis86.h"
+
+//
+// Benchmarks of the udis86 extensions on real binaries.
+//
+//   sweep  - parallel linear-sweep (ud_sweep()) vs. sequential ud_decode()
+//            loop, for increasing number of threads; verifies that the
+//            resulting instruction index is identical
+//   cfg    - basic-block/call-graph build (ud_cfg_build()) from the function
+//            symbols vs. load of the cached index (ud_cfg_load())
+//   sym    - symbolized disassembly with the built-in resolver
+//            (ud_set_symtab()) vs. naive linear resolver vs. no resolver
+//
+// The input is an ELF64 file (its largest executable section is used) or
+// any other file, which is then disassembled as a whole.
+//
+
+namespace bench {
+
+struct symbol_t
+{
+  uint64_t    address;
+  uint64_t    size;
+  std::string name;
+};
+
+struct image_t
+{
+  const uint8_t*        file_base;
+  size_t                file_size;
+
+  const uint8_t*        code;
+  size_t                code_size;
+  uint64_t              code_address;
+
+  //
+  // Function symbols (from .symtab and .dynsym) and the entry point
+  // inside of the code section, sorted by address.
+  //
+  std::vector<symbol_t> symbols;
+};
+
+static void load_symbols(image_t& image, const Elf64_Ehdr* ehdr, const Elf64_Shdr* shdr) noexcept
+{
+  for (int i = 0; i < ehdr->e_shnum; ++i)
+  {
+    if ((shdr[i].sh_type != SHT_SYMTAB && shdr[i].sh_type != SHT_DYNSYM) ||
+        shdr[i].sh_link >= ehdr->e_shnum ||
+        shdr[i].sh_offset + shdr[i].sh_size > image.file_size)
+    {
+      continue;
+    }
+
+    auto& strtab = shdr[shdr[i].sh_link];
+    if (strtab.sh_offset + strtab.sh_size > image.file_size)
+    {
+      continue;
+    }
+
+    auto symbol = reinterpret_cast<const Elf64_Sym*>(image.file_base + shdr[i].sh_offset);
+    auto names  = reinterpret_cast<const char*>(image.file_base + strtab.sh_offset);
+    size_t count = shdr[i].sh_size / sizeof(Elf64_Sym);
+
+    for (size_t s = 0; s < count; ++s)
+    {
+      if (ELF64_ST_TYPE(symbol[s].st_info) != STT_FUNC ||
+          symbol[s].st_value - image.code_address >= image.code_size ||
+          symbol[s].st_name >= strtab.sh_size)
+      {
+        continue;
+      }
+
+      image.symbols.push_back(symbol_t{ symbol[s].st_value, symbol[s].st_size, names + symbol[s].st_name });
+    }
+  }
+
+  if (ehdr->e_entry - image.code_address < image.code_size)
+  {
+    image.symbols.push_back(symbol_t{ ehdr->e_entry, 0, "_entry" });
+  }
+
+  std::sort(image.symbols.begin(), image.symbols.end(), [](auto& lhs, auto& rhs) {
+    return lhs.address < rhs.address;
+  });
+
+  image.symbols.erase(std::unique(image.symbols.begin(), image.symbols.end(), [](auto& lhs, auto& rhs) {
+    return lhs.address == rhs.address;
+  }), image.symbols.end());
+}
+
+static bool load_image(const char* path, image_t& image) noexcept
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+  {
+    fprintf(stderr, "%s: cannot open\n", path);
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size == 0)
+  {
+    fprintf(stderr, "%s: empty file\n", path);
+    close(fd);
+    return false;
+  }
+
+  void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (mapping == MAP_FAILED)
+  {
+    fprintf(stderr, "%s: mmap failed\n", path);
+    return false;
+  }
+
+  image.file_base    = reinterpret_cast<const uint8_t*>(mapping);
+  image.file_size    = static_cast<size_t>(st.st_size);
+  image.code         = image.file_base;
+  image.code_size    = image.file_size;
+  image.code_address = 0;
+
+  //
+  // If it's an ELF64 image, pick its largest executable section.
+  //
+  auto ehdr = reinterpret_cast<const Elf64_Ehdr*>(image.file_base);
+
+  if (image.file_size >= sizeof(Elf64_Ehdr) &&
+      !memcmp(ehdr->e_ident, ELFMAG, SELFMAG) &&
+      ehdr->e_ident[EI_CLASS] == ELFCLASS64 &&
+      ehdr->e_shoff + ehdr->e_shnum * sizeof(Elf64_Shdr) <= image.file_size)
+  {
+    auto shdr = reinterpret_cast<const Elf64_Shdr*>(image.file_base + ehdr->e_shoff);
+
+    for (int i = 0; i < ehdr->e_shnum; ++i)
+    {
+      if ((shdr[i].sh_flags & SHF_EXECINSTR) &&
+          shdr[i].sh_type == SHT_PROGBITS &&
+          shdr[i].sh_offset + shdr[i].sh_size <= image.file_size &&
+          (image.code == image.file_base || shdr[i].sh_size > image.code_size))
+      {
+        image.code         = image.file_base + shdr[i].sh_offset;
+        image.code_size    = shdr[i].sh_size;
+        image.code_address = shdr[i].sh_addr;
+      }
+    }
+
+    load_symbols(image, ehdr, shdr);
+  }
+
+  return true;
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point begin) noexcept
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+}
+
+//
+// Reference - plain sequential sweep.
+//
+static std::vector<ud_index_entry> sequential_sweep(const image_t& image) noexcept
+{
+  std::vector<ud_index_entry> result;
+  result.reserve(image.code_size / 3);
+
+  ud_t u;
+  ud_init(&u);
+  ud_set_mode(&u, 64);
+  ud_set_vendor(&u, UD_VENDOR_ANY);
+  ud_set_pc(&u, image.code_address);
+  ud_set_input_buffer(&u, image.code, image.code_size);
+
+  size_t offset = 0;
+  unsigned int length;
+
+  while (!ud_input_end(&u) && (length = ud_decode(&u)) > 0)
+  {
+    result.push_back(ud_index_entry{
+      static_cast<uint32_t>(offset),
+      static_cast<uint16_t>(ud_insn_mnemonic(&u)),
+      static_cast<uint8_t>(length),
+      0
+    });
+
+    offset += length;
+  }
+
+  return result;
+}
+
+static int bench_sweep(const image_t& image, const std::vector<unsigned>& thread_counts, int iterations) noexcept
+{
+  auto begin = std::chrono::steady_clock::now();
+  std::vector<ud_index_entry> reference;
+  for (int i = 0; i < iterations; ++i)
+  {
+    reference = sequential_sweep(image);
+  }
+  double sequential_seconds = seconds_since(begin) / iterations;
+
+  printf("code: %zu bytes, %zu instructions\n\n", image.code_size, reference.size());
+  printf("%-10s %12s %12s %10s %s\n", "threads", "time ms", "MB/s", "speedup", "index");
+  printf("%-10s %12.3f %12.1f %10.2f %s\n",
+         "seq",
+         sequential_seconds * 1e3,
+         image.code_size / sequential_seconds / 1e6,
+         1.0,
+         "reference");
+
+  int result = 0;
+
+  for (unsigned thread_count : thread_counts)
+  {
+    ud_index index = {};
+    double seconds = 0.0;
+
+    for (int i = 0; i < iterations; ++i)
+    {
+      ud_index_free(&index);
+
+      begin = std::chrono::steady_clock::now();
+      if (ud_sweep(&index, image.code, image.code_size, 64, image.code_address, UD_VENDOR_ANY, thread_count) != 0)
+      {
+        fprintf(stderr, "ud_sweep failed\n");
+        return 1;
+      }
+      seconds += seconds_since(begin);
+    }
+
+    seconds /= iterations;
+
+    bool identical =
+      index.count == reference.size() &&
+      !memcmp(index.entry, reference.data(), index.count * sizeof(ud_index_entry));
+
+    printf("%-10u %12.3f %12.1f %10.2f %s\n",
+           thread_count,
+           seconds * 1e3,
+           image.code_size / seconds / 1e6,
+           sequential_seconds / seconds,
+           identical ? "identical" : "MISMATCH");
+
+    result |= !identical;
+    ud_index_free(&index);
+  }
+
+  return result;
+}
+
+static bool cfg_equal(const ud_cfg& lhs, const ud_cfg& rhs) noexcept
+{
+  return lhs.hash == rhs.hash &&
+         lhs.block_count == rhs.block_count &&
+         lhs.succ_count == rhs.succ_count &&
+         lhs.call_count == rhs.call_count &&
+         !memcmp(lhs.block, rhs.block, lhs.block_count * sizeof(ud_cfg_block)) &&
+         !memcmp(lhs.succ, rhs.succ, lhs.succ_count * sizeof(uint32_t)) &&
+         !memcmp(lhs.call, rhs.call, lhs.call_count * sizeof(ud_cfg_call));
+}
+
+static int bench_cfg(const image_t& image, const char* cache_directory, int iterations) noexcept
+{
+  std::vector<uint32_t> entries;
+  for (auto& symbol : image.symbols)
+  {
+    entries.push_back(static_cast<uint32_t>(symbol.address - image.code_address));
+  }
+
+  //
+  // Cold - hash the module, build the index and store it into the cache.
+  //
+  ud_cfg cfg = {};
+  double build_seconds = 0.0;
+
+  for (int i = 0; i < iterations; ++i)
+  {
+    ud_cfg_free(&cfg);
+
+    auto begin = std::chrono::steady_clock::now();
+    if (ud_cfg_build(&cfg, image.code, image.code_size, 64, image.code_address, UD_VENDOR_ANY,
+                     entries.data(), entries.size()) != 0)
+    {
+      fprintf(stderr, "ud_cfg_build failed\n");
+      return 1;
+    }
+    build_seconds += seconds_since(begin);
+  }
+
+  build_seconds /= iterations;
+
+  char cache_path[4096];
+  snprintf(cache_path, sizeof(cache_path), "%s/%016llx.udcfg",
+           cache_directory, static_cast<unsigned long long>(cfg.hash));
+
+  auto begin = std::chrono::steady_clock::now();
+  if (ud_cfg_save(&cfg, cache_path) != 0)
+  {
+    fprintf(stderr, "%s: cannot write cache\n", cache_path);
+    ud_cfg_free(&cfg);
+    return 1;
+  }
+  double save_seconds = seconds_since(begin);
+
+  //
+  // Warm - hash the module and load the index from the cache.
+  //
+  ud_cfg cached = {};
+  double load_seconds = 0.0;
+
+  for (int i = 0; i < iterations; ++i)
+  {
+    ud_cfg_free(&cached);
+
+    begin = std::chrono::steady_clock::now();
+    uint64_t hash = ud_cfg_hash(image.code, image.code_size);
+    if (ud_cfg_load(&cached, cache_path, hash) != 0)
+    {
+      fprintf(stderr, "%s: cannot load cache\n", cache_path);
+      ud_cfg_free(&cfg);
+      return 1;
+    }
+    load_seconds += seconds_since(begin);
+  }
+
+  load_seconds /= iterations;
+
+  size_t function_count = 0;
+  size_t code_bytes = 0;
+  for (size_t i = 0; i < cfg.block_count; ++i)
+  {
+    function_count += !!(cfg.block[i].flags & UD_CFG_BLOCK_FUNCTION);
+    code_bytes += cfg.block[i].end - cfg.block[i].begin;
+  }
+
+  bool identical = cfg_equal(cfg, cached);
+
+  printf("code: %zu bytes, entry points: %zu\n", image.code_size, entries.size());
+  printf("blocks: %zu (%zu bytes of code), edges: %zu, calls: %zu, functions: %zu\n",
+         cfg.block_count, code_bytes, cfg.succ_count, cfg.call_count, function_count);
+  printf("cache: %s\n\n", cache_path);
+  printf("build:  %10.3f ms\n", build_seconds * 1e3);
+  printf("save:   %10.3f ms\n", save_seconds * 1e3);
+  printf("load:   %10.3f ms (incl. hash)  speedup: %.1fx  index: %s\n",
+         load_seconds * 1e3,
+         build_seconds / load_seconds,
+         identical ? "identical" : "MISMATCH");
+
+  ud_cfg_free(&cached);
+  ud_cfg_free(&cfg);
+
+  return !identical;
+}
+
+//
+// Baseline resolver - linear scan over all symbols for each lookup.
+//
+static const std::vector<symbol_t>* naive_symbols;
+
+static const char* naive_resolver(ud_t*, uint64_t address, int64_t* offset) noexcept
+{
+  const symbol_t* best = nullptr;
+
+  for (auto& symbol : *naive_symbols)
+  {
+    if (symbol.address <= address && (!best || symbol.address > best->address))
+    {
+      best = &symbol;
+    }
+  }
+
+  if (!best || (best->size && address - best->address >= best->size))
+  {
+    return nullptr;
+  }
+
+  *offset = static_cast<int64_t>(address - best->address);
+  return best->name.c_str();
+}
+
+enum class resolver_t
+{
+  none,
+  naive,
+  symtab,
+};
+
+//
+// Disassembles the whole code and returns hash of the produced text
+// (to check that both resolvers produce the same output).
+//
+static uint64_t disassemble(const image_t& image, resolver_t resolver, const ud_symtab* symtab, size_t& instruction_count) noexcept
+{
+  ud_t u;
+  ud_init(&u);
+  ud_set_mode(&u, 64);
+  ud_set_vendor(&u, UD_VENDOR_ANY);
+  ud_set_syntax(&u, UD_SYN_INTEL);
+  ud_set_pc(&u, image.code_address);
+  ud_set_input_buffer(&u, image.code, image.code_size);
+
+  switch (resolver)
+  {
+    case resolver_t::none:   break;
+    case resolver_t::naive:  ud_set_sym_resolver(&u, &naive_resolver); break;
+    case resolver_t::symtab: ud_set_symtab(&u, symtab); break;
+  }
+
+  uint64_t hash = 0xcbf29ce484222325ull;
+  instruction_count = 0;
+
+  while (ud_disassemble(&u))
+  {
+    for (const char* p = ud_insn_asm(&u); *p; ++p)
+    {
+      hash = (hash ^ static_cast<uint8_t>(*p)) * 0x100000001b3ull;
+    }
+
+    instruction_count += 1;
+  }
+
+  return hash;
+}
+
+static int bench_sym(const image_t& image, bool with_naive) noexcept
+{
+  std::vector<ud_symbol> input;
+  for (auto& symbol : image.symbols)
+  {
+    input.push_back(ud_symbol{ symbol.address, symbol.size, symbol.name.c_str() });
+  }
+
+  auto begin = std::chrono::steady_clock::now();
+  ud_symtab symtab;
+  if (ud_symtab_init(&symtab, input.data(), input.size()) != 0)
+  {
+    fprintf(stderr, "ud_symtab_init failed\n");
+    return 1;
+  }
+  double init_seconds = seconds_since(begin);
+
+  naive_symbols = &image.symbols;
+
+  printf("code: %zu bytes, symbols: %zu (table built in %.3f ms)\n\n",
+         image.code_size, symtab.count, init_seconds * 1e3);
+  printf("%-10s %12s %12s %14s %s\n", "resolver", "time ms", "MB/s", "Minsn/s", "output");
+
+  uint64_t reference_hash = 0;
+  int result = 0;
+
+  for (auto resolver : { resolver_t::none, resolver_t::naive, resolver_t::symtab })
+  {
+    if (resolver == resolver_t::naive && !with_naive)
+    {
+      continue;
+    }
+
+    size_t instruction_count;
+    begin = std::chrono::steady_clock::now();
+    uint64_t hash = disassemble(image, resolver, &symtab, instruction_count);
+    double seconds = seconds_since(begin);
+
+    const char* output = "";
+    if (resolver == resolver_t::naive || (resolver == resolver_t::symtab && !with_naive))
+    {
+      reference_hash = hash;
+      output = "reference";
+    }
+    else if (resolver == resolver_t::symtab)
+    {
+      output = hash == reference_hash ? "identical" : "MISMATCH";
+      result |= hash != reference_hash;
+    }
+
+    printf("%-10s %12.3f %12.1f %14.3f %s\n",
+           resolver == resolver_t::none  ? "none" :
+           resolver == resolver_t::naive ? "naive" : "symtab",
+           seconds * 1e3,
+           image.code_size / seconds / 1e6,
+           instruction_count / seconds / 1e6,
+           output);
+  }
+
+  //
+  // Raw lookup cost - random addresses (no memoization benefit) and
+  // sequential addresses (mostly hits of the last symbol).
+  //
+  if (symtab.count)
+  {
+    constexpr int lookup_count = 10'000'000;
+    uint64_t random_state = 0x9e3779b97f4a7c15ull;
+    uint64_t checksum = 0;
+    int64_t offset;
+    size_t hint = 0;
+
+    begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < lookup_count; ++i)
+    {
+      random_state ^= random_state << 13;
+      random_state ^= random_state >> 7;
+      random_state ^= random_state << 17;
+
+      uint64_t address = image.code_address + random_state % image.code_size;
+      checksum += reinterpret_cast<uintptr_t>(ud_symtab_lookup(&symtab, address, &offset, nullptr));
+    }
+    double random_seconds = seconds_since(begin);
+
+    begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < lookup_count; ++i)
+    {
+      uint64_t address = image.code_address + (static_cast<uint64_t>(i) * 16) % image.code_size;
+      checksum += reinterpret_cast<uintptr_t>(ud_symtab_lookup(&symtab, address, &offset, &hint));
+    }
+    double sequential_seconds = seconds_since(begin);
+
+    printf("\nlookup: random %.1f ns, sequential (with hint) %.1f ns  [%llx]\n",
+           random_seconds / lookup_count * 1e9,
+           sequential_seconds / lookup_count * 1e9,
+           static_cast<unsigned long long>(checksum & 0xf));
+  }
+
+  ud_symtab_free(&symtab);
+  return result;
+}
+
+static void usage(const char* program) noexcept
+{
+  printf("usage: %s sweep [-t THREADS] [-i ITERATIONS] FILE\n", program);
+  printf("       %s cfg [-c CACHE_DIRECTORY] [-i ITERATIONS] FILE\n", program);
+  printf("       %s sym [-n] FILE\n", program);
+  printf("  -t  comma-separated thread counts (default: 1,2,4,... up to CPU count)\n");
+  printf("  -c  directory of the cached indexes (default: /tmp)\n");
+  printf("  -i  number of iterations (default: 3)\n");
+  printf("  -n  skip the naive resolver (O(n*m) - slow on big images)\n");
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+  using namespace bench;
+
+  if (argc < 2)
+  {
+    usage(argv[0]);
+    return 1;
+  }
+
+  const char* command = argv[1];
+  const char* path = nullptr;
+  const char* cache_directory = "/tmp";
+  int iterations = 3;
+  bool with_naive = true;
+  std::vector<unsigned> thread_counts;
+
+  for (int i = 2; i < argc; ++i)
+  {
+    const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+
+    if (!strcmp(argv[i], "-t") && value)
+    {
+      for (const char* p = value; *p; )
+      {
+        char* end;
+        unsigned long count = strtoul(p, &end, 10);
+        if (end == p || !count)
+        {
+          usage(argv[0]);
+          return 1;
+        }
+
+        thread_counts.push_back(static_cast<unsigned>(count));
+        p = *end == ',' ? end + 1 : end;
+      }
+      ++i;
+    }
+    else if (!strcmp(argv[i], "-n"))
+    {
+      with_naive = false;
+    }
+    else if (!strcmp(argv[i], "-c") && value)
+    {
+      cache_directory = value;
+      ++i;
+    }
+    else if (!strcmp(argv[i], "-i") && value)
+    {
+      iterations = atoi(value);
+      ++i;
+    }
+    else if (argv[i][0] != '-' && !path)
+    {
+      path = argv[i];
+    }
+    else
+    {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (!path || iterations <= 0)
+  {
+    usage(argv[0]);
+    return 1;
+  }
+
+  if (thread_counts.empty())
+  {
+    unsigned cpu_count = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned count = 1; count < cpu_count; count *= 2)
+    {
+      thread_counts.push_back(count);
+    }
+    thread_counts.push_back(cpu_count);
+  }
+
+  image_t image;
+  if (!load_image(path, image))
+  {
+    return 1;
+  }
+
+  if (!strcmp(command, "sweep"))
+  {
+    return bench_sweep(image, thread_counts, iterations);
+  }
+
+  if (!strcmp(command, "cfg"))
+  {
+    return bench_cfg(image, cache_directory, iterations);
+  }
+
+  if (!strcmp(command, "sym"))
+  {
+    return bench_sym(image, with_naive);
+  }
+
+  usage(argv[0]);
+  return 1;
+}